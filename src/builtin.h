@@ -0,0 +1,13 @@
+#ifndef _BUILTIN_H
+#define _BUILTIN_H 1
+
+/* 
+ * Utilities that sh(1) links in as builtins. When built with SH_BUILTIN
+ * these provide no main(), and report errors through their return value
+ * instead of exiting.
+ */
+
+extern int echo_main(int, char *[]);
+extern int test_main(int, char *[]);
+
+#endif /* _BUILTIN_H */
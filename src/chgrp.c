@@ -8,15 +8,17 @@
 #include <pwd.h>
 #include <err.h>
 #include <sys/stat.h>
-#include <dirent.h>
+#include <fcntl.h>
 #include <string.h>
-#include <errno.h>
+
+#include "walk.h"
 
 static int opt_recurse = 0;
 static int opt_deref = 0;
 static int opt_traverse_cmd = 0;
 static int opt_traverse_all = 0;
 static int opt_traverse_none = 0;
+static int opt_jobs = 1;
 static int mode_chgrp = 0;
 
 static void show_usage()
@@ -24,72 +26,31 @@ static void show_usage()
 	if (mode_chgrp)
 		fprintf(stderr,
 				"Usage: chgrp [-h] group file...\n"
-				"       chgrp -R [-H|-L|-P]\n");
+				"       chgrp -R [-H|-L|-P] [-j jobs] group file...\n");
 	else
 		fprintf(stderr,
 				"Usage: chown [-h] owner[:group] file...\n"
-				"       chown -R [-H|-L|-P]\n");
+				"       chown -R [-H|-L|-P] [-j jobs] owner[:group] file...\n");
 	exit(EXIT_FAILURE);
 }
 
-static int do_chgrp(const uid_t uid, const gid_t gid, const char *file, const int cmdline)
-{
-	int rc = EXIT_SUCCESS, err;
-	struct stat sb, lsb;
-	
-	if (lstat(file, &lsb) == -1 || stat(file, &sb) == -1) {
-		warn("%s", file);
-		return EXIT_FAILURE;
-	}
-
-	/* we only recurse if recurse is on & this file is a directory
-	 * however, if it is a link to a directory, we have to check
-	 * the opt_traverse_* options
-	 */
-	if (opt_recurse && S_ISDIR(sb.st_mode) && 
-			(!S_ISLNK(lsb.st_mode) || 
-			 (((opt_traverse_cmd && cmdline) || 
-			   (opt_traverse_all)) &&
-			  !opt_traverse_none)))
-	{
-		DIR *dir = opendir(file);
-		if (dir == NULL) {
-			warn("%s", file);
-			return EXIT_FAILURE;
-		}
-
-		char buf[BUFSIZ];
-		struct dirent *ent;
-		while ((ent = readdir(dir)) != NULL)
-		{
-			if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
-				continue;
-
-			snprintf(buf, BUFSIZ, "%s/%s", file, ent->d_name);
-			rc += do_chgrp(uid, gid, buf, 0);
-			errno = 0;
-		}
-
-		/* this should catch errors on readdir() */
-		if (errno) {
-			warnx("%s", file);
-			rc++;
-		}
+static uid_t opt_uid = -1;
+static gid_t opt_gid = -1;
 
-		closedir(dir);
-		/* pass through so we then chgrp the directory itsself */
+static int do_chgrp(const int dfd, const char *name, const char *path, const struct stat *sb)
+{
+	/* nothing to do, so don't touch the ctime */
+	if ((opt_uid == (uid_t)-1 || opt_uid == sb->st_uid) &&
+			(opt_gid == (gid_t)-1 || opt_gid == sb->st_gid))
+		return 0;
+
+	/* a link that was not followed is changed itself */
+	if (fchownat(dfd, name, opt_uid, opt_gid, S_ISLNK(sb->st_mode) ? AT_SYMLINK_NOFOLLOW : 0) == -1) {
+		warn("%s", path);
+		return 1;
 	}
-	
-
-	if (opt_deref)
-		err = lchown(file, uid, gid);
-	else
-		err = chown(file, uid, gid);
-
-	if (err == -1 && ++rc)
-		warn("%s", file);
 
-	return rc;
+	return 0;
 }
 
 int main(int argc, char *argv[])
@@ -99,7 +60,7 @@ int main(int argc, char *argv[])
 
 	{
 		int opt;
-		while ((opt = getopt(argc, argv, "hRHLP")) != -1)
+		while ((opt = getopt(argc, argv, "hRHLPj:")) != -1)
 		{
 			switch (opt)
 			{
@@ -118,27 +79,31 @@ int main(int argc, char *argv[])
 				case 'P':
 					opt_traverse_none = 1;
 					break;
+				case 'j':
+					if ((opt_jobs = atoi(optarg)) < 1) {
+						warnx("invalid number of jobs: %s", optarg);
+						show_usage();
+					}
+					break;
 				default:
 					show_usage();
 			}
+		}
 
-			if (opt_recurse && 
-					(opt_traverse_cmd + 
-					 opt_traverse_none + 
-					 opt_traverse_all == 0))
-				opt_traverse_none = 1;
-
-			if (argc - optind < 2)
-				show_usage();
+		if (argc - optind < 2)
+			show_usage();
 
-			if (opt_recurse + opt_deref > 1)
-				show_usage();
-		}
+		if (opt_recurse + opt_deref > 1)
+			show_usage();
 	}
 
-	/* the next arg is either the group name (chgrp) or user[:group] (chown) */
-	const char *grpnam = mode_chgrp ? argv[optind] : strchr(argv[optind], ':');
-	const struct group *grp = grpnam ? getgrnam(argv[optind]) : NULL;
+	/*
+	 * the next arg is either the group name (chgrp) or user[:group] (chown);
+	 * chown leaves alone the part that is empty in user: or :group
+	 */
+	const char *colon = mode_chgrp ? NULL : strchr(argv[optind], ':');
+	const char *grpnam = mode_chgrp ? argv[optind] : colon && colon[1] ? colon + 1 : NULL;
+	const struct group *grp = grpnam ? getgrnam(grpnam) : NULL;
 
 	gid_t gid = -1;
 	uid_t uid = -1;
@@ -146,10 +111,10 @@ int main(int argc, char *argv[])
 	/* if we were passed a group name but couldn't find it in the db */
 	if (grp == NULL && grpnam) {
 		char *err = NULL;
-		gid = strtol(argv[optind], &err, 10);
+		gid = strtol(grpnam, &err, 10);
 
-		if (err != NULL && *err)
-			errx(EXIT_FAILURE, "%s: invalid name/gid", argv[optind]);
+		if (!*grpnam || (err != NULL && *err))
+			errx(EXIT_FAILURE, "%s: invalid name/gid", grpnam);
 	} else if (grp) {
 		gid = grp->gr_gid;
 	}
@@ -159,26 +124,46 @@ int main(int argc, char *argv[])
 		/* user */
 		char *tmp = argv[optind];
 		/* user:group */
-		if (grpnam)
-			tmp = strndup(argv[optind], grpnam - argv[optind] - 1);
+		if (colon)
+			tmp = strndup(argv[optind], colon - argv[optind]);
 
 		const struct passwd *usr = getpwnam(tmp);
-		if (usr == NULL) {
+		if (usr) {
+			uid = usr->pw_uid;
+		} else if (*tmp || !colon) {
 			char *err = NULL;
 			uid = strtol(tmp, &err, 10);
 
-			if (err != NULL && *err)
+			if (!*tmp || (err != NULL && *err))
 				errx(EXIT_FAILURE, "%s: invalid name/uid", tmp);
-		} else {
-			uid = usr->pw_uid;
 		}
 	}
 
+	/*
+	 * -h changes links themselves; without -R anything else follows
+	 * them, and -R follows them as -H, -L or -P (the default) say.
+	 */
+	walk_t w = {
+		.visit = do_chgrp,
+		.follow = WALK_CMDLINE,
+		.recurse = opt_recurse,
+		.jobs = opt_jobs,
+	};
+
+	if (opt_deref || (opt_recurse &&
+				(opt_traverse_none || !(opt_traverse_cmd || opt_traverse_all))))
+		w.follow = WALK_PHYSICAL;
+	else if (opt_recurse && opt_traverse_all)
+		w.follow = WALK_LOGICAL;
+
+	opt_uid = uid;
+	opt_gid = gid;
+
 	/* process each remaining argument as a target */
 	int rc = 0;
 	for (int i = ++optind; i < argc; i++)
 	{
-		rc += do_chgrp(uid, gid, argv[i], 1);
+		rc += walk(&w, argv[i]);
 	}
 
 	exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
@@ -7,17 +7,17 @@
 #include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <dirent.h>
+#include <fcntl.h>
 #include <string.h>
 
+#include "walk.h"
+
 static void show_usage()
 {
-	fprintf(stderr, "chmod: [-R] mode file...\n");
+	fprintf(stderr, "chmod: [-R] [-j jobs] mode file...\n");
 	exit(EXIT_FAILURE);
 }
 
-static int opt_recurse = 0;
-
 struct who {
 	unsigned usr:1;
 	unsigned grp:1;
@@ -176,7 +176,7 @@ static struct clause **parse_mode(char arg[])
 	return ret;
 }
 
-static int apply_change(mode_t change, const struct stat *sb, const struct who who, const struct perm p)
+static mode_t apply_change(mode_t change, const mode_t mode, const struct who who, const struct perm p)
 {
 	if (who.usr && p.r) change |= S_IRUSR;
 	if (who.usr && p.w) change |= S_IWUSR;
@@ -190,153 +190,105 @@ static int apply_change(mode_t change, const struct stat *sb, const struct who w
 	if (who.oth && p.w) change |= S_IWOTH;
 	if (who.oth && p.x) change |= S_IXOTH;
 
-	if (p.X && (S_ISDIR(sb->st_mode) ||
-				(sb->st_mode & (S_IXUSR|S_IXGRP|S_IXOTH)))) {
+	if (p.X && (S_ISDIR(mode) ||
+				(mode & (S_IXUSR|S_IXGRP|S_IXOTH)))) {
 		if (who.usr) change |= S_IXUSR;
 		if (who.grp) change |= S_IXGRP;
 		if (who.oth) change |= S_IXOTH;
 	}
-	return change;
-}
-
-static int do_chmod(mode_t mode, struct clause *list[], const char *file)
-{
-	struct clause *cur = NULL;
-	int rc = 0;
-	struct stat sb;
-
-	if (stat(file, &sb) == -1) {
-		warn("%s", file);
-		return EXIT_FAILURE;
-	}
-
-	/* if recurising and a directory, recurse */
-	if (opt_recurse && S_ISDIR(sb.st_mode)) 
-	{
-		DIR *dir = opendir(file);
-		if (dir == NULL) {
-			warn("%s", file);
-			return EXIT_FAILURE;
-		}
 
-		struct dirent *ent;
-		char buf[BUFSIZ];
+	if (p.t) change |= S_ISVTX;
 
-		while ((ent = readdir(dir)) != NULL)
-		{
-			if (!strcmp(".", ent->d_name) || !strcmp("..", ent->d_name))
-				continue;
-
-			snprintf(buf, BUFSIZ, "%s/%s", file, ent->d_name);
-			rc += do_chmod(mode, list, buf);
-		}
+	return change;
+}
 
-		closedir(dir);
-	}
-	/* we need to do the directory itsself */
+static mode_t opt_octal = 0;
+static struct clause **opt_clauses = NULL;
 
-	/* handle simple case of a octal mode argument */
-	if (mode) {
-		if (chmod(file, mode) == -1) {
-			warn("%s", file);
-			rc++;
-		}
-		return rc;
-	}
+/*
+ * The mode the symbolic clauses leave behind, worked out in one go: each
+ * clause sees what the ones before it did, as if chmod had been run once
+ * per clause.
+ */
+static mode_t symbolic_mode(mode_t mode)
+{
+	const struct clause *cur;
 
-	/* handle the more complex list of symbolic modes */
-	for (int i = 0; (cur = list[i]); i++)
+	for (int i = 0; (cur = opt_clauses[i]); i++)
 	{
-		/* as a union this checks perm & permcopy */
-		if (!cur->action.permcopy) continue;
-
-
-		if (stat(file, &sb) == -1) {
-			warn("%s", file);
-			rc++;
-			break;
-		}
+		struct who who = cur->who;
 
-		mode_t base;
-		if (cur->op == '=') {
-			base = 0;
-		} else {
-			base = sb.st_mode;
-		}
-
-		if (cur->who.usr + cur->who.grp + cur->who.oth == 0) {
-			cur->who.usr = 1;
-			cur->who.grp = 1;
-			cur->who.oth = 1;
+		if (who.usr + who.grp + who.oth == 0) {
+			who.usr = 1;
+			who.grp = 1;
+			who.oth = 1;
 		}
 
+		const mode_t mask = (who.usr ? S_IRWXU : 0) | (who.grp ? S_IRWXG : 0) |
+			(who.oth ? S_IRWXO : 0);
 		mode_t change = 0;
 
-		if (cur->act_flag == NONE)
-		{
-			; // FIXME ???
-		}
-		else if (cur->act_flag == PERMLIST)
+		if (cur->act_flag == PERMLIST)
 		{
-			change = apply_change(change, &sb, cur->who, cur->action.perm);
-
-			// TODO t and s?
-			
-			if (cur->op == '-')
-				base &= ~change;
-			else
-				base |= change;
-
-			if (chmod(file, base) == -1) {
-				warn("%s", file);
-				rc++;
-			}
+			change = apply_change(change, mode, who, cur->action.perm);
 		}
-		else // PERMCOPY
+		else if (cur->act_flag == PERMCOPY)
 		{
 			struct perm p;
-			mode_t save = 0;
 
+			memset(&p, 0, sizeof(p));
 			switch (cur->action.permcopy)
 			{
 				case 'u':
-					p.r = (sb.st_mode & S_IRUSR) ? 1 : 0;
-					p.w = (sb.st_mode & S_IWUSR) ? 1 : 0;
-					p.x = (sb.st_mode & S_IXUSR) ? 1 : 0;
-					save = S_IRWXU;
+					p.r = (mode & S_IRUSR) ? 1 : 0;
+					p.w = (mode & S_IWUSR) ? 1 : 0;
+					p.x = (mode & S_IXUSR) ? 1 : 0;
 					break;
 				case 'g':
-					p.r = (sb.st_mode & S_IRGRP) ? 1 : 0;
-					p.w = (sb.st_mode & S_IWGRP) ? 1 : 0;
-					p.x = (sb.st_mode & S_IXGRP) ? 1 : 0;
-					save = S_IRWXG;
+					p.r = (mode & S_IRGRP) ? 1 : 0;
+					p.w = (mode & S_IWGRP) ? 1 : 0;
+					p.x = (mode & S_IXGRP) ? 1 : 0;
 					break;
 				case 'o':
-					p.r = (sb.st_mode & S_IROTH) ? 1 : 0;
-					p.w = (sb.st_mode & S_IWOTH) ? 1 : 0;
-					p.x = (sb.st_mode & S_IXOTH) ? 1 : 0;
-					save = S_IRWXO;
+					p.r = (mode & S_IROTH) ? 1 : 0;
+					p.w = (mode & S_IWOTH) ? 1 : 0;
+					p.x = (mode & S_IXOTH) ? 1 : 0;
 					break;
 			}
 
-			change = apply_change(change, &sb, cur->who, p);
-			
-			if (cur->op == '-')
-				base &= ~change;
-			else
-				base |= change;
+			change = apply_change(change, mode, who, p);
+		}
 
-			base |= (save & sb.st_mode);
+		// TODO s?
 
-			if (chmod(file, base) == -1) {
-				warn("%s", file);
-				rc++;
-			}
-		}
-		
+		if (cur->op == '-')
+			mode &= ~change;
+		else if (cur->op == '=')
+			mode = (mode & ~mask) | change;
+		else
+			mode |= change;
 	}
 
-	return rc;
+	return mode;
+}
+
+static int do_chmod(const int dfd, const char *name, const char *path, const struct stat *sb)
+{
+	/* links met on the way down have no mode of their own to change */
+	if (S_ISLNK(sb->st_mode))
+		return 0;
+
+	const mode_t mode = (opt_clauses ? symbolic_mode(sb->st_mode) : opt_octal) & 07777;
+
+	if (mode == (sb->st_mode & 07777))
+		return 0;
+
+	if (fchmodat(dfd, name, mode, 0) == -1) {
+		warn("%s", path);
+		return 1;
+	}
+
+	return 0;
 }
 
 static int isnumber(const char str[])
@@ -349,14 +301,26 @@ static int isnumber(const char str[])
 
 int main(int argc, char *argv[])
 {
+	walk_t w = {
+		.visit = do_chmod,
+		.follow = WALK_CMDLINE,
+		.jobs = 1,
+	};
+
 	{
 		int opt;
-		while ((opt = getopt(argc, argv, "R")) != -1)
+		while ((opt = getopt(argc, argv, "Rj:")) != -1)
 		{
 			switch (opt)
 			{
 				case 'R':
-					opt_recurse = 1;
+					w.recurse = true;
+					break;
+				case 'j':
+					if ((w.jobs = atoi(optarg)) < 1) {
+						warnx("invalid number of jobs: %s", optarg);
+						show_usage();
+					}
 					break;
 				default:
 					show_usage();
@@ -370,28 +334,22 @@ int main(int argc, char *argv[])
 	char *modestr = argv[optind++];
 	char *modestrerr;
 
-	struct clause **mode;
-	
-	mode_t oct_mode = 0;
-
 	if (isnumber(modestr)) 
 	{
-		oct_mode = strtol(modestr, &modestrerr, 8);
-		if (oct_mode == 0 && modestrerr != NULL)
+		opt_octal = strtol(modestr, &modestrerr, 8);
+		if (*modestrerr)
 			errx(EXIT_FAILURE, "'%s' is not a valid octal number: %s", 
 					modestr, modestrerr);
-
-		mode = NULL;
 	} 
 	else 
 	{
-		mode = parse_mode(modestr);
+		opt_clauses = parse_mode(modestr);
 	}
 
 	int rc = 0;
 	for (int i = optind; i < argc; i++)
 	{
-		rc += do_chmod(oct_mode, mode, argv[i]);
+		rc += walk(&w, argv[i]);
 	}
 
 	exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
@@ -7,6 +7,13 @@
 #include <stdio.h>
 #include <limits.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 struct range {
 	int from;
@@ -18,17 +25,12 @@ static void show_usage(const char *message)
 	if (message)
 		warnx("%s", message);
 	fprintf(stderr,
-			"Usage: cut -b list [-n] [file...]\n"
-			"       cut -c list [file...]\n"
-			"       cut -f list [-d delim] [-s] [file...]\n");
+			"Usage: cut -b list [-n] [-j jobs] [file...]\n"
+			"       cut -c list [-j jobs] [file...]\n"
+			"       cut -f list [-d delim] [-s] [-j jobs] [file...]\n");
 	exit(EXIT_FAILURE);
 }
 
-inline static int min(const int a, const int b)
-{
-	return a < b ? a : b;
-}
-
 static int opt_bytes = 0;
 static int opt_chars = 0;
 static int opt_fields = 0;
@@ -38,130 +40,386 @@ static int opt_delim_not_default = 0;
 
 static char delim = '\t';
 
-static void cut_one_file_lines(FILE *fp, struct range **ranges, const char *filename)
+/*
+ * The list is merged once into sorted, disjoint ranges, so each line is
+ * a single pass: delimiters and newlines are found with memchr(), and
+ * the selected spans are copied into a large output buffer.
+ */
+static struct range *sel = NULL;
+static int sel_cnt = 0;
+
+/* output goes to fd when the buffer fills, or into a growing buffer if fd is -1 */
+typedef struct {
+	char	*buf;
+	size_t	 len;
+	size_t	 size;
+	int		 fd;
+} out_t;
+
+#define	CUT_BLOCK	(256 * 1024)
+
+static void write_all(const int fd, const char *p, size_t len)
 {
-	char buf[BUFSIZ];
-	char printed[BUFSIZ];
-	char *line;
-	int lines_read = 0;
+	ssize_t wr;
 
-	while ((line = fgets(buf, BUFSIZ, fp)) != NULL)
+	while (len)
 	{
-		int op = 0;
-		int len = strlen(line);
-		if (buf[len-1] != '\n')
-			errx(EXIT_FAILURE, "buffer overflow: %s: line %d", filename, lines_read);
-		/* skip back from newline and erase it */
-		buf[--len] = '\0';
-		lines_read++;
-		char *end = buf + len;
-
-		memset(printed, 0, len);
-		struct range *rg;
-
-		/* iterate over each range in the list */
-		for (int i = 0; (rg = ranges[i]); i++)
+		if ((wr = write(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "write");
+		}
+		p += wr;
+		len -= wr;
+	}
+}
+
+static void out_flush(out_t *out)
+{
+	write_all(out->fd, out->buf, out->len);
+	out->len = 0;
+}
+
+static void out_put(out_t *out, const char *p, const size_t len)
+{
+	if (out->len + len > out->size) {
+		if (out->fd != -1) {
+			out_flush(out);
+			if (len > out->size) {
+				write_all(out->fd, p, len);
+				return;
+			}
+		} else {
+			size_t size = out->size ? out->size : CUT_BLOCK;
+			while (size < out->len + len)
+				size *= 2;
+			char *tmp = realloc(out->buf, size);
+			if (tmp == NULL)
+				err(EXIT_FAILURE, "realloc");
+			out->buf = tmp;
+			out->size = size;
+		}
+	}
+
+	memcpy(out->buf + out->len, p, len);
+	out->len += len;
+}
+
+static void out_putc(out_t *out, const char c)
+{
+	if (out->len == out->size)
+		out_put(out, &c, 1);
+	else
+		out->buf[out->len++] = c;
+}
+
+/* line is len bytes, without its newline */
+static void cut_line(out_t *out, const char *line, const size_t len)
+{
+	const char *const end = line + len;
+	const struct range *r = sel, *const sel_end = sel + sel_cnt;
+
+	if (!opt_fields) {
+		for (; r < sel_end && (size_t)r->from <= len; r++)
 		{
+			const size_t to = (size_t)r->to < len ? (size_t)r->to : len;
+			out_put(out, line + r->from - 1, to - r->from + 1);
+		}
+		out_putc(out, '\n');
+		return;
+	}
 
-			/* for bytes and chars */
-			if (opt_bytes || opt_chars ) 
-			{
-				int end = min(ranges[i]->to, len);
-				for (int pos = ranges[i]->from-1; pos < end; pos++) 
-				{
-					if(printed[pos]) continue;
-					printed[pos] = 1;
-					putchar(buf[pos]);
-					op++;
-				}
-			} 
-			/* for delimiter based */
-			else if (opt_fields) 
-			{
-				/* short circuit if no delim on the line */
-				if (!strchr(line, delim))
-					break;
+	const char *start = line, *d = memchr(line, delim, len);
 
-				int skip = -1;
-				int found = 0;
-
-				/* scan for unprinted ranges */
-				for (int i = rg->from-1; i<rg->to; i++)
-					if(!printed[i]) { skip = i; break; }
-
-				/* entire line already printed, don't bother */
-				if (skip == -1)
-					continue;
-
-				/* start at the beginning of the line */
-				char *first = line;
-
-				/* scan over each elemtent of the range x-y */
-				for (int j = 0; j<rg->to; j++)
-				{
-					/* have we ran out of line or trokens? */
-					if (!first || first+1 >= end)
-					{
-						break;
-					/* skip tokens before x in range:x-y */
-					} 
-					else if (j < rg->from-1) 
-					{
-						first = strchr(first+1, delim);
-						continue;
-					}
-					/* skip over the token itself */
-					else if (*first == ':') 
-					{
-						first++;
-					}
-
-					/* bump the number of found, needed, tokens and 
-					 * calculate the byte offset */
-					int first_off = first-line;
-					found++;
-
-					/* find the next token (x-y) or skip to the end (x-) */
-					char *next;
-					if (rg->to == INT_MAX)
-						next = end;
-					else
-						next = strchr(first+1, delim);
-
-					/* calculate the offset, if there is one */
-					int next_off = next ? next-line : len;
-
-					/* save the string length between first and next offsets */
-					int plen = next_off - first_off;
-
-					/* set the bytes as already printed */
-					memset(&printed[first_off], 1, plen);
-					
-					/* and print them */
-					fwrite(first, 1, plen, stdout);
+	/* a line with no delimiter is passed whole, or dropped with -s */
+	if (d == NULL) {
+		if (!opt_hide_unmatched) {
+			out_put(out, line, len);
+			out_putc(out, '\n');
+		}
+		return;
+	}
 
-					/* record the fact we printed something for \n */
-					op++;
+	bool first = true;
 
-					/* shuffle along */
-					first = next;
-				}
+	for (int field = 1; ; field++)
+	{
+		while (field > r->to)
+			if (++r == sel_end)
+				goto done;
+
+		if (field >= r->from) {
+			if (!first)
+				out_putc(out, delim);
+			first = false;
+
+			/* field- takes the rest of the line as it is */
+			if (r->to == INT_MAX) {
+				out_put(out, start, end - start);
+				break;
 			}
+			out_put(out, start, (d ? d : end) - start);
 		}
 
-		if (op) { 
-			putchar('\n');
+		if (d == NULL)
+			break;
+		start = d + 1;
+		d = memchr(start, delim, end - start);
+	}
+
+done:
+	out_putc(out, '\n');
+}
+
+/* cuts each complete line in buf, returning how many bytes that used */
+static size_t cut_lines(out_t *out, const char *buf, const size_t len, size_t scanned)
+{
+	const char *p = buf, *nl;
+	const char *const end = buf + len;
+
+	/* scanned: the start of buf is already known to hold no newline */
+	while ((nl = memchr(p + scanned, '\n', end - p - scanned)) != NULL)
+	{
+		cut_line(out, p, nl - p);
+		p = nl + 1;
+		scanned = 0;
+	}
+
+	return p - buf;
+}
+
+static void cut_fd(out_t *out, const int fd, const char *filename)
+{
+	static char *buf = NULL;
+	static size_t size = 0;
+	size_t have = 0;
+	ssize_t rd;
+
+	while (1)
+	{
+		/* a line longer than the buffer makes it grow */
+		if (have == size) {
+			size = size ? size * 2 : CUT_BLOCK;
+			if ((buf = realloc(buf, size)) == NULL)
+				err(EXIT_FAILURE, "realloc");
 		}
-		else if (opt_fields && !opt_hide_unmatched)
-		{
-			puts(line);
+
+		if ((rd = read(fd, buf + have, size - have)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "%s", filename);
 		}
+
+		/* a last line without a newline still counts */
+		if (rd == 0) {
+			if (have)
+				cut_line(out, buf, have);
+			return;
+		}
+
+		const size_t used = cut_lines(out, buf, have + rd, have);
+
+		have += rd - used;
+		memmove(buf, buf + used, have);
 	}
+}
 
-	if (feof(fp))
-		return;
+/*
+ * cut -j jobs on a regular file: the file is mapped and split into
+ * chunks of whole lines, which worker threads cut into buffers of their
+ * own. Only a window of chunks is in flight, and they are written out in
+ * file order as they complete.
+ */
+#define	CHUNK_SIZE	(8 * 1024 * 1024)
+
+static int opt_jobs = 1;
+
+typedef struct {
+	out_t	out;
+	bool	done;
+} slot_t;
+
+typedef struct {
+	const char		*base;
+	const size_t	*bounds;		/* nchunks + 1 offsets */
+	size_t			 nchunks;
+	size_t			 next;			/* next chunk to hand out */
+	size_t			 written;		/* chunks written so far */
+	slot_t			*slots;
+	size_t			 nslots;
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 cond;
+} chunks_t;
+
+static void *cut_worker(void *arg)
+{
+	chunks_t *c = arg;
+
+	pthread_mutex_lock(&c->lock);
+	while (c->next < c->nchunks)
+	{
+		/* don't run further ahead of the writer than there are slots */
+		if (c->next - c->written >= c->nslots) {
+			pthread_cond_wait(&c->cond, &c->lock);
+			continue;
+		}
+
+		const size_t k = c->next++;
+		slot_t *slot = &c->slots[k % c->nslots];
+		pthread_mutex_unlock(&c->lock);
+
+		const char *start = c->base + c->bounds[k];
+		const size_t len = c->bounds[k + 1] - c->bounds[k];
+		const size_t used = cut_lines(&slot->out, start, len, 0);
+
+		/* only the last chunk can end without a newline */
+		if (used < len)
+			cut_line(&slot->out, start + used, len - used);
 
-	err(EXIT_FAILURE, "%s", filename);
+		pthread_mutex_lock(&c->lock);
+		slot->done = true;
+		pthread_cond_broadcast(&c->cond);
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return NULL;
+}
+
+/* returns false, having done nothing, if fd is not worth doing this way */
+static bool cut_parallel(out_t *out, const int fd)
+{
+	struct stat sb;
+	char *base;
+
+	if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_size < 2 * CHUNK_SIZE ||
+			(uintmax_t)sb.st_size > SIZE_MAX || lseek(fd, 0, SEEK_CUR) != 0)
+		return false;
+
+	const size_t size = sb.st_size;
+
+	if ((base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		return false;
+	posix_madvise(base, size, POSIX_MADV_SEQUENTIAL);
+
+	/*
+	 * A chunk starts after the first newline at or past its nominal
+	 * start. Found in one pass here, so a huge line is only scanned once.
+	 */
+	const size_t nominal = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	size_t *bounds, nchunks = 0;
+
+	if ((bounds = malloc(sizeof(size_t) * (nominal + 1))) == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	bounds[0] = 0;
+	for (size_t k = 1; k < nominal; k++)
+	{
+		size_t from = k * CHUNK_SIZE - 1;
+		const char *nl;
+
+		if (from < bounds[nchunks])
+			continue;
+		if ((nl = memchr(base + from, '\n', size - from)) == NULL || (size_t)(nl + 1 - base) == size)
+			break;
+		bounds[++nchunks] = nl + 1 - base;
+	}
+	bounds[++nchunks] = size;
+
+	chunks_t c = {
+		.base = base,
+		.bounds = bounds,
+		.nchunks = nchunks,
+		.nslots = opt_jobs * 2,
+	};
+	pthread_t *threads;
+	int nthreads = 0;
+
+	if ((c.slots = calloc(c.nslots, sizeof(slot_t))) == NULL ||
+			(threads = calloc(opt_jobs, sizeof(pthread_t))) == NULL)
+		err(EXIT_FAILURE, "calloc");
+	for (size_t i = 0; i < c.nslots; i++)
+		c.slots[i].out.fd = -1;
+	pthread_mutex_init(&c.lock, NULL);
+	pthread_cond_init(&c.cond, NULL);
+
+	/* what is already buffered comes first */
+	out_flush(out);
+
+	for (int i = 0; i < opt_jobs; i++)
+	{
+		if ((errno = pthread_create(&threads[i], NULL, cut_worker, &c))) {
+			warn("pthread_create");
+			break;
+		}
+		nthreads++;
+	}
+
+	if (nthreads == 0)
+		cut_worker(&c);
+
+	for (size_t k = 0; k < nchunks; k++)
+	{
+		slot_t *slot = &c.slots[k % c.nslots];
+
+		pthread_mutex_lock(&c.lock);
+		while (!slot->done)
+			pthread_cond_wait(&c.cond, &c.lock);
+		pthread_mutex_unlock(&c.lock);
+
+		write_all(STDOUT_FILENO, slot->out.buf, slot->out.len);
+		slot->out.len = 0;
+
+		pthread_mutex_lock(&c.lock);
+		slot->done = false;
+		c.written++;
+		pthread_cond_broadcast(&c.cond);
+		pthread_mutex_unlock(&c.lock);
+	}
+
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (size_t i = 0; i < c.nslots; i++)
+		free(c.slots[i].out.buf);
+	free(c.slots);
+	free(threads);
+	free(bounds);
+	pthread_mutex_destroy(&c.lock);
+	pthread_cond_destroy(&c.cond);
+	munmap(base, size);
+
+	return true;
+}
+
+/* merges the sorted list into sel */
+static void select_ranges(struct range **list)
+{
+	for (int i = 0; list[i]; i++)
+	{
+		struct range r = *list[i];
+
+		if (r.from < 1)
+			r.from = 1;
+		if (r.to < r.from)
+			errx(EXIT_FAILURE, "invalid range %d-%d", list[i]->from, list[i]->to);
+
+		if (sel_cnt) {
+			struct range *last = &sel[sel_cnt - 1];
+
+			/* sorted by from, so x- covers everything after it */
+			if (last->to == INT_MAX)
+				continue;
+			if (r.from <= last->to + 1) {
+				if (r.to > last->to)
+					last->to = r.to;
+				continue;
+			}
+		}
+
+		if ((sel = realloc(sel, sizeof(struct range) * (sel_cnt + 1))) == NULL)
+			err(EXIT_FAILURE, NULL);
+		sel[sel_cnt++] = r;
+	}
 }
 
 static int count_range(struct range **lst)
@@ -286,7 +544,7 @@ int main(int argc, char *argv[])
 
 	{
 		int opt;
-		while ((opt = getopt(argc, argv, "b:nc:f:d:s")) != -1)
+		while ((opt = getopt(argc, argv, "b:nc:f:d:sj:")) != -1)
 		{
 			switch (opt)
 			{
@@ -322,6 +580,11 @@ int main(int argc, char *argv[])
 				case 's':
 					opt_hide_unmatched = 1;
 					break;
+
+				case 'j':
+					if ((opt_jobs = atoi(optarg)) < 1)
+						show_usage("invalid number of jobs");
+					break;
 			}
 		}
 
@@ -346,28 +609,40 @@ int main(int argc, char *argv[])
 		range_list = parse_list(list_str);
 	}
 
+	static char out_buf[CUT_BLOCK];
+	out_t out = { out_buf, 0, sizeof(out_buf), STDOUT_FILENO };
+
+	select_ranges(range_list);
+	for (int i = 0; range_list[i]; i++)
+		free(range_list[i]);
+	free(range_list);
+
 	if (optind >= argc) 
 	{
-		cut_one_file_lines(stdin, range_list, "<stdin>");
+		if (opt_jobs < 2 || !cut_parallel(&out, STDIN_FILENO))
+			cut_fd(&out, STDIN_FILENO, "<stdin>");
 	} else 
 	{
 		for (int i = optind; i < argc; i++)
 		{
 			if (strcmp(argv[i], "-"))
 			{
-				FILE *file = NULL;
-				if ((file = fopen(argv[i], "r")) == NULL)
+				int fd;
+				if ((fd = open(argv[i], O_RDONLY)) == -1)
 					err(EXIT_FAILURE, "%s", argv[i]);
-				cut_one_file_lines(file, range_list, argv[i]);
-				fclose(file);
+				if (opt_jobs < 2 || !cut_parallel(&out, fd))
+					cut_fd(&out, fd, argv[i]);
+				close(fd);
 			} 
 			else 
 			{
-				cut_one_file_lines(stdin, range_list, "<stdin>");
+				if (opt_jobs < 2 || !cut_parallel(&out, STDIN_FILENO))
+					cut_fd(&out, STDIN_FILENO, "<stdin>");
 			}
 					
 		}
 	}
 
+	out_flush(&out);
 	exit(EXIT_SUCCESS);
 }
@@ -3,12 +3,22 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <string.h>
-#include <libgen.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "walk.h"
 
 static int opt_all_size = 0;
 static int opt_total_size = 0;
@@ -17,13 +27,15 @@ static int opt_units = 512;
 static int opt_deref_all = 0;
 static int opt_same_dev = 0;
 static int opt_apparent_size = 0;
+static int opt_jobs = 1;
+static const char *opt_cache_file = NULL;
 
-static int error_count = 0;
+static atomic_int error_count = 0;
 
 static void show_usage()
 {
-	fprintf(stderr, 
-			"Usage: du [-a|-s] [-kx] [-H|-L] [file...]\n");
+	fprintf(stderr,
+			"Usage: du [-a|-s] [-kx] [-H|-L] [-j jobs] [-K cachefile] [file...]\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -32,73 +44,1039 @@ inline static ssize_t roundup(ssize_t value, ssize_t div)
 	return (value + (div/2))/div;
 }
 
-static ssize_t perform_du(const char *restrict path, const int top, dev_t dev)
+/*
+ * Files with more than one link are counted once, the first time any of
+ * their names is seen. With -L directories go in too, so a symlink back
+ * up the tree cannot loop. The set is split into stripes, each with its
+ * own lock, for the parallel walk.
+ */
+#define	SEEN_STRIPES	64
+
+typedef struct {
+	dev_t	dev;
+	ino_t	ino;
+	bool	used;
+} inode_t;
+
+static struct {
+	pthread_mutex_t	 lock;
+	inode_t			*slots;
+	size_t			 cnt;
+	size_t			 size;			/* a power of two */
+} seen[SEEN_STRIPES];
+
+static size_t inode_hash(const dev_t dev, const ino_t ino)
+{
+	unsigned long long h = (unsigned long long)ino * 0x9e3779b97f4a7c15ULL;
+
+	return (size_t)(h ^ (h >> 29) ^ (unsigned long long)dev);
+}
+
+static void seen_init(void)
+{
+	for (int i = 0; i < SEEN_STRIPES; i++)
+		pthread_mutex_init(&seen[i].lock, NULL);
+}
+
+/* called with the stripe locked */
+static bool seen_grow(const int stripe)
+{
+	const size_t size = seen[stripe].size ? seen[stripe].size * 2 : 64;
+	inode_t *slots = calloc(size, sizeof(inode_t));
+
+	if (slots == NULL)
+		return false;
+
+	for (size_t i = 0; i < seen[stripe].size; i++)
+	{
+		const inode_t *old = &seen[stripe].slots[i];
+
+		if (!old->used)
+			continue;
+		for (size_t h = inode_hash(old->dev, old->ino) / SEEN_STRIPES; ; h++)
+			if (!slots[h & (size - 1)].used) {
+				slots[h & (size - 1)] = *old;
+				break;
+			}
+	}
+
+	free(seen[stripe].slots);
+	seen[stripe].slots = slots;
+	seen[stripe].size = size;
+
+	return true;
+}
+
+/* true the first time dev/ino is asked about */
+static bool seen_first(const dev_t dev, const ino_t ino)
+{
+	const size_t hash = inode_hash(dev, ino);
+	const int stripe = hash % SEEN_STRIPES;
+	bool ret = true;
+
+	pthread_mutex_lock(&seen[stripe].lock);
+
+	if ((seen[stripe].cnt + 1) * 4 > seen[stripe].size * 3 && !seen_grow(stripe)) {
+		/* better to count a link twice than to give up */
+		pthread_mutex_unlock(&seen[stripe].lock);
+		return true;
+	}
+
+	for (size_t h = hash / SEEN_STRIPES; ; h++)
+	{
+		inode_t *slot = &seen[stripe].slots[h & (seen[stripe].size - 1)];
+
+		if (!slot->used) {
+			slot->dev = dev;
+			slot->ino = ino;
+			slot->used = true;
+			seen[stripe].cnt++;
+			break;
+		}
+		if (slot->dev == dev && slot->ino == ino) {
+			ret = false;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&seen[stripe].lock);
+	return ret;
+}
+
+/*
+ * fstatat() name in dfd and decide whether it counts. Returns the size to
+ * add, -1 when the entry is to be skipped (on another device with -x, or
+ * already counted), or -2 when it could not be stat'd.
+ */
+static ssize_t du_stat(const int dfd, const char *name, const char *path,
+		const int top, const dev_t dev, struct stat *sb)
+{
+	const bool deref = opt_deref_all || (top && opt_deref_cmdline);
+
+	if (fstatat(dfd, name, sb, deref ? 0 : AT_SYMLINK_NOFOLLOW) == -1) {
+		/* a dangling link is counted as the link */
+		if (!deref || errno != ENOENT || fstatat(dfd, name, sb, AT_SYMLINK_NOFOLLOW) == -1) {
+			warn("%s", path);
+			error_count++;
+			return -2;
+		}
+	}
+
+	if (!top && opt_same_dev && sb->st_dev != dev)
+		return -1;
+
+	if ((S_ISDIR(sb->st_mode) ? opt_deref_all : sb->st_nlink > 1) &&
+			!seen_first(sb->st_dev, sb->st_ino))
+		return -1;
+
+	return opt_apparent_size ? sb->st_size : sb->st_blocks * 512;
+}
+
+static void du_print(const ssize_t size, const char *path)
+{
+	printf("%-7ld %s\n", roundup(size, opt_units), path);
+}
+
+static int du_open_dir(const int dfd, const char *name, const bool follow)
+{
+	return openat(dfd, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC|(follow ? 0 : O_NOFOLLOW));
+}
+
+/*
+ * du -K cachefile remembers, for every directory, its own size (itself
+ * and the non-directories in it) and the names of its subdirectories,
+ * keyed by dev and inode and checked against mtime and ctime. A directory
+ * whose entries have not changed since is neither read nor are its files
+ * stat'd again; only its subdirectories are visited, each checked the
+ * same way. A file that grows in place does not touch its directory, so
+ * that is not seen until the directory itself changes. A directory that
+ * holds a file with more than one link is never cached: which of its
+ * names counts the file depends on what else is read in the same run.
+ *
+ * The file is a header, the records sorted by dev and inode, then the
+ * subdirectory names, NUL separated. It is mapped and binary searched,
+ * and written out again whole, through a rename, at exit; the records of
+ * directories the run did not reach are carried over, so one cache file
+ * serves any number of trees.
+ */
+#define	CACHE_MAGIC		"DUK1"
+#define	CACHE_VERSION	1
+
+typedef struct {
+	char		magic[4];
+	uint32_t	version;
+	uint32_t	flags;				/* options that change what own means */
+	uint32_t	pad;
+	uint64_t	cnt;
+	uint64_t	names_size;
+} cache_hdr_t;
+
+typedef struct {
+	uint64_t	dev;
+	uint64_t	ino;
+	int64_t		mtime_sec;
+	int64_t		ctime_sec;
+	int32_t		mtime_nsec;
+	int32_t		ctime_nsec;
+	int64_t		own;
+	uint64_t	names;				/* offset into the name area */
+	uint64_t	nnames;
+} cache_rec_t;
+
+typedef struct {
+	char	*buf;
+	size_t	 len;
+	size_t	 size;
+	size_t	 cnt;
+} names_t;
+
+static struct {
+	void				*map;
+	size_t				 map_size;
+	const cache_rec_t	*recs;
+	size_t				 cnt;
+	const char			*names;
+	size_t				 names_size;
+
+	pthread_mutex_t		 lock;		/* for what follows, filled as directories are done */
+	cache_rec_t			*out;
+	size_t				 out_cnt;
+	size_t				 out_size;
+	names_t				 out_names;
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint32_t cache_flags(void)
+{
+	return (opt_apparent_size ? 1 : 0) | (opt_deref_all ? 2 : 0) | (opt_same_dev ? 4 : 0);
+}
+
+static bool names_grow(names_t *n, const size_t need)
+{
+	if (n->len + need > n->size) {
+		size_t size = n->size ? n->size : 256;
+		while (size < n->len + need)
+			size *= 2;
+		char *tmp = realloc(n->buf, size);
+		if (tmp == NULL)
+			return false;
+		n->buf = tmp;
+		n->size = size;
+	}
+
+	return true;
+}
+
+static bool names_add(names_t *n, const char *name, const size_t len)
+{
+	if (!names_grow(n, len + 1))
+		return false;
+
+	memcpy(n->buf + n->len, name, len);
+	n->buf[n->len + len] = '\0';
+	n->len += len + 1;
+	n->cnt++;
+
+	return true;
+}
+
+/* cnt names, already NUL terminated, len bytes in all */
+static bool names_block(names_t *n, const char *names, const size_t len, const size_t cnt)
+{
+	if (len == 0)
+		return true;
+	if (!names_grow(n, len))
+		return false;
+
+	memcpy(n->buf + n->len, names, len);
+	n->len += len;
+	n->cnt += cnt;
+
+	return true;
+}
+
+static void cache_load(const char *file)
 {
+	const cache_hdr_t *hdr;
 	struct stat sb;
-	char *restrict tmp = NULL;
+	int fd;
+
+	if ((fd = open(file, O_RDONLY|O_CLOEXEC)) == -1) {
+		if (errno != ENOENT)
+			warn("%s", file);
+		return;
+	}
+
+	if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(cache_hdr_t) ||
+			(cache.map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		cache.map = NULL;
+		close(fd);
+		return;
+	}
+	close(fd);
 
-	/* we always want to know the size of the link, even if we are
-	 * not dereferencing them */
-	if (lstat(path, &sb) == -1) goto fail;
+	cache.map_size = sb.st_size;
+	hdr = cache.map;
 
-	/* deref is selected */
-	if ((opt_deref_all || (top && opt_deref_cmdline)) && S_ISLNK(sb.st_mode))
+	/* a cache from other options is rebuilt, one that does not add up ignored */
+	if (hdr->flags != cache_flags() && !memcmp(hdr->magic, CACHE_MAGIC, 4)) {
+		munmap(cache.map, cache.map_size);
+		cache.map = NULL;
+		return;
+	}
+
+	if (memcmp(hdr->magic, CACHE_MAGIC, 4) || hdr->version != CACHE_VERSION ||
+			hdr->cnt > (cache.map_size - sizeof(cache_hdr_t)) / sizeof(cache_rec_t) ||
+			hdr->names_size != cache.map_size - sizeof(cache_hdr_t) - hdr->cnt * sizeof(cache_rec_t) ||
+			(hdr->names_size && ((const char *)cache.map)[cache.map_size - 1] != '\0')) {
+		warnx("%s: not a usable cache, ignored", file);
+		munmap(cache.map, cache.map_size);
+		cache.map = NULL;
+		return;
+	}
+
+	cache.recs = (const cache_rec_t *)(hdr + 1);
+	cache.cnt = hdr->cnt;
+	cache.names = (const char *)(cache.recs + cache.cnt);
+	cache.names_size = hdr->names_size;
+}
+
+static int rec_cmp(const uint64_t dev, const uint64_t ino, const cache_rec_t *r)
+{
+	if (dev != r->dev)
+		return dev < r->dev ? -1 : 1;
+	if (ino != r->ino)
+		return ino < r->ino ? -1 : 1;
+	return 0;
+}
+
+/* the record for sb, if the directory is unchanged since */
+static const cache_rec_t *cache_find(const struct stat *sb)
+{
+	size_t lo = 0, hi = cache.cnt;
+
+	while (lo < hi)
 	{
-		tmp = malloc(sb.st_size + 1);
-		if (tmp == NULL) goto fail;
-		if (readlink(path, tmp, sb.st_size) == -1) goto fail;
-		if (stat(tmp, &sb) == -1) goto fail;
-	} 
-
-	/* check for dev cross-over, or lookup the dev if we're
-	 * looking at a command line path */
-	if (dev == (dev_t)-1 && top) dev = sb.st_dev;
-	else if (opt_same_dev && sb.st_dev != dev) return 0;
-
-	const char *restrict fn = tmp ? tmp : path;
-	ssize_t rc = 0;
-	int is_dir = 0;
-
-	/* handle recursion */
+		const size_t mid = lo + (hi - lo) / 2;
+		const cache_rec_t *r = &cache.recs[mid];
+		const int cmp = rec_cmp(sb->st_dev, sb->st_ino, r);
+
+		if (cmp < 0) {
+			hi = mid;
+		} else if (cmp > 0) {
+			lo = mid + 1;
+		} else {
+			if (r->mtime_sec != sb->st_mtim.tv_sec || r->mtime_nsec != sb->st_mtim.tv_nsec ||
+					r->ctime_sec != sb->st_ctim.tv_sec || r->ctime_nsec != sb->st_ctim.tv_nsec ||
+					r->names > cache.names_size || (r->nnames && r->names == cache.names_size))
+				return NULL;
+			return r;
+		}
+	}
+
+	return NULL;
+}
+
+/* the next subdirectory name of a cached directory, or NULL */
+static const char *rec_next(const cache_rec_t *r, size_t *off, size_t *left)
+{
+	const char *name;
+
+	if (*left == 0 || *off >= cache.names_size)
+		return NULL;
+
+	name = cache.names + *off;
+	*off += strlen(name) + 1;		/* the area ends in a NUL, checked at load */
+	(*left)--;
+
+	return name;
+}
+
+static void cache_add(const struct stat *sb, const ssize_t own, const char *names,
+		const size_t names_len, const size_t nnames)
+{
+	cache_rec_t *r;
+
+	pthread_mutex_lock(&cache.lock);
+
+	if (cache.out_cnt == cache.out_size) {
+		cache_rec_t *tmp = realloc(cache.out,
+				sizeof(cache_rec_t) * (cache.out_size = cache.out_size ? cache.out_size * 2 : 256));
+		if (tmp == NULL)
+			goto fail;
+		cache.out = tmp;
+	}
+
+	r = &cache.out[cache.out_cnt];
+	memset(r, 0, sizeof(cache_rec_t));
+	r->dev = sb->st_dev;
+	r->ino = sb->st_ino;
+	r->mtime_sec = sb->st_mtim.tv_sec;
+	r->mtime_nsec = sb->st_mtim.tv_nsec;
+	r->ctime_sec = sb->st_ctim.tv_sec;
+	r->ctime_nsec = sb->st_ctim.tv_nsec;
+	r->own = own;
+	r->names = cache.out_names.len;
+	r->nnames = nnames;
+
+	if (!names_block(&cache.out_names, names, names_len, nnames))
+		goto fail;
+
+	cache.out_cnt++;
+	pthread_mutex_unlock(&cache.lock);
+	return;
+
+fail:
+	warn("%s", opt_cache_file);
+	pthread_mutex_unlock(&cache.lock);
+}
+
+static int out_cmp(const void *a, const void *b)
+{
+	const cache_rec_t *rb = b;
+
+	return rec_cmp(((const cache_rec_t *)a)->dev, ((const cache_rec_t *)a)->ino, rb);
+}
+
+/* the records not replaced by one of this run's first cnt, which are sorted */
+static size_t cache_carry(size_t cnt)
+{
+	const size_t visited = cnt;
+	size_t j = 0;
+
+	for (size_t i = 0; i < cache.cnt; i++)
+	{
+		const cache_rec_t *r = &cache.recs[i];
+		size_t off = r->names, left = r->nnames;
+		int cmp = 1;
+
+		while (j < visited && (cmp = rec_cmp(r->dev, r->ino, &cache.out[j])) > 0)
+			j++;
+		if (j < visited && cmp == 0)
+			continue;
+
+		/* one whose names do not add up is dropped */
+		while (rec_next(r, &off, &left) != NULL)
+			;
+		if (left || r->names > cache.names_size)
+			continue;
+
+		if (cnt == cache.out_size) {
+			const size_t size = cache.out_size ? cache.out_size * 2 : 256;
+			cache_rec_t *tmp = realloc(cache.out, sizeof(cache_rec_t) * size);
+			if (tmp == NULL) {
+				warn("%s", opt_cache_file);
+				break;
+			}
+			cache.out = tmp;
+			cache.out_size = size;
+		}
+
+		cache.out[cnt] = *r;
+		cache.out[cnt].names = cache.out_names.len;
+		if (!names_block(&cache.out_names, cache.names + r->names, off - r->names, r->nnames)) {
+			warn("%s", opt_cache_file);
+			break;
+		}
+		cnt++;
+	}
+
+	qsort(cache.out, cnt, sizeof(cache_rec_t), out_cmp);
+
+	return cnt;
+}
+
+static void cache_save(const char *file)
+{
+	cache_hdr_t hdr;
+	char *tmp;
+	size_t cnt = 0;
+	FILE *fp;
+
+	qsort(cache.out, cache.out_cnt, sizeof(cache_rec_t), out_cmp);
+
+	/* a directory reached twice keeps one record */
+	for (size_t i = 0; i < cache.out_cnt; i++)
+		if (cnt == 0 || rec_cmp(cache.out[i].dev, cache.out[i].ino, &cache.out[cnt - 1]))
+			cache.out[cnt++] = cache.out[i];
+
+	cnt = cache_carry(cnt);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_MAGIC, 4);
+	hdr.version = CACHE_VERSION;
+	hdr.flags = cache_flags();
+	hdr.cnt = cnt;
+	hdr.names_size = cache.out_names.len;
+
+	if ((tmp = malloc(strlen(file) + 32)) == NULL) {
+		warn("%s", file);
+		return;
+	}
+	sprintf(tmp, "%s.%ld", file, (long)getpid());
+
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		warn("%s", tmp);
+		free(tmp);
+		return;
+	}
+
+	const bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+		(cnt == 0 || fwrite(cache.out, sizeof(cache_rec_t), cnt, fp) == cnt) &&
+		(hdr.names_size == 0 || fwrite(cache.out_names.buf, hdr.names_size, 1, fp) == 1);
+
+	if (fclose(fp) == EOF || !ok || rename(tmp, file) == -1) {
+		warn("%s", file);
+		unlink(tmp);
+	}
+
+	free(tmp);
+	free(cache.out);
+	free(cache.out_names.buf);
+	if (cache.map)
+		munmap(cache.map, cache.map_size);
+}
+
+static bool use_cache(void)
+{
+	/* -a prints every file, so every directory has to be read */
+	return opt_cache_file && !opt_all_size;
+}
+
+/*
+ * The serial walk: directories are opened relative to their parent's fd
+ * and entries stat'd relative to theirs, so the kernel never resolves a
+ * full path, and read through wdir_t, so a deep tree does not hold an fd
+ * per level. The path is kept in one buffer, only for printing.
+ */
+/* for du_walk() */
+#define	DU_FILE		0
+#define	DU_DIR		1
+#define	DU_FAILED	2
+#define	DU_LINKED	3		/* a file with more than one link, counted or not */
+
+static ssize_t du_walk(wdir_t *up, const char *name, path_t *path, const int top, dev_t dev,
+		int *what)
+{
+	struct stat sb;
+	ssize_t rc;
+
+	if ((rc = du_stat(up->fd, name, path->buf, top, dev, &sb)) == -2) {
+		*what = DU_FAILED;
+		return 0;
+	}
+
+	*what = !S_ISDIR(sb.st_mode) && sb.st_nlink > 1 ? DU_LINKED : DU_FILE;
+
+	if (rc == -1)
+		return 0;
+
+	if (top)
+		dev = sb.st_dev;
+
 	if (S_ISDIR(sb.st_mode)) {
-		is_dir = 1;
-		struct dirent *restrict ent;
-		DIR *restrict dir = opendir(fn);
+		const cache_rec_t *rec = use_cache() ? cache_find(&sb) : NULL;
+		const char *sname;
+		unsigned char type;
+		wdir_t dir;
+		names_t subdirs;
+		ssize_t subtotal = 0;
+		bool complete = true;
+		int sub;
+
+		*what = DU_DIR;
+		memset(&subdirs, 0, sizeof(subdirs));
+
+		if (!wdir_open(&dir, up->fd, name, opt_deref_all || (top && opt_deref_cmdline))) {
+			warn("%s", path->buf);
+			error_count++;
+		} else {
+			wdir_leave(up, dir.fd);
+
+			if (rec) {
+				size_t off = rec->names, left = rec->nnames;
+
+				rc = rec->own;
+				while ((sname = rec_next(rec, &off, &left)) != NULL)
+				{
+					const size_t mark = path_push(path, sname);
+					const ssize_t size = du_walk(&dir, sname, path, 0, dev, &sub);
+					path_pop(path, mark);
+
+					if (sub == DU_DIR) subtotal += size; else rc += size;
+					/* lost on the way back up */
+					if (dir.fd == -1)
+						break;
+				}
+				if (dir.fd != -1)
+					cache_add(&sb, rec->own, cache.names + rec->names, off - rec->names, rec->nnames);
+			} else {
+				while ((sname = wdir_read(&dir, &type)) != NULL)
+				{
+					const size_t mark = path_push(path, sname);
+					const ssize_t size = du_walk(&dir, sname, path, 0, dev, &sub);
+					path_pop(path, mark);
+
+					if (sub == DU_DIR) {
+						subtotal += size;
+						if (use_cache() && !names_add(&subdirs, sname, strlen(sname)))
+							complete = false;
+					} else {
+						rc += size;
+						if (sub == DU_FAILED || sub == DU_LINKED)
+							complete = false;
+					}
+					if (dir.fd == -1)
+						break;
+				}
+				if (dir.fd == -1) {
+					complete = false;
+				} else if (errno) {
+					warn("%s", path->buf);
+					error_count++;
+					complete = false;
+				}
+
+				if (use_cache() && complete)
+					cache_add(&sb, rc, subdirs.buf, subdirs.len, subdirs.cnt);
+				free(subdirs.buf);
+			}
+
+			if (!wdir_back(up, dir.fd)) {
+				warn("%s/..", path->buf);
+				error_count++;
+			}
+			wdir_close(&dir);
+		}
+
+		rc += subtotal;
+		if (top || !opt_total_size)
+			du_print(rc, path->buf);
+	} else if (top || opt_all_size)
+		du_print(rc, path->buf);
+
+	return rc;
+}
+
+/*
+ * du -j jobs: directories are tasks on a work-stealing pool. Each worker
+ * pushes the subdirectories it finds onto its own deque and takes work
+ * back from the same end; an idle worker steals from the other end of
+ * someone else's. Sizes are collected into a tree, and printed once the
+ * walk is done, in the order the serial walk would have printed them.
+ *
+ * A task carries its directory already opened relative to the parent's
+ * fd, so nothing is looked up from the top. Once too many fds are queued,
+ * subdirectories are scanned in place instead of becoming tasks.
+ */
+typedef struct du_node du_node_t;
+
+typedef struct {
+	du_node_t	*child;			/* a subdirectory, or */
+	char		*path;			/* a file, for -a */
+	ssize_t		 size;
+} du_item_t;
+
+struct du_node {
+	char		*path;
+	struct stat	 sb;			/* of the directory itself, for the cache */
+	dev_t		 dev;
+	int			 fd;			/* open on the directory until it is scanned */
+	ssize_t		 own;			/* the directory and the files directly in it */
+	du_item_t	*items;
+	size_t		 nitems;
+	size_t		 size;
+};
+
+typedef struct {
+	pthread_mutex_t	  lock;
+	du_node_t		**tasks;
+	size_t			  top;			/* thieves take from here */
+	size_t			  bottom;		/* the owner pushes and pops here */
+	size_t			  size;
+} deque_t;
+
+static deque_t *deques;
+static atomic_size_t pending;			/* tasks pushed and not yet finished */
+static atomic_uint generation;			/* bumped by every push */
+static atomic_int idle;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static atomic_int fds_held;
+static int fds_budget = 512;
+
+static void deque_push(const int self, du_node_t *n)
+{
+	deque_t *d = &deques[self];
+
+	pending++;
+	pthread_mutex_lock(&d->lock);
+	if (d->bottom == d->size) {
+		if (d->top) {
+			memmove(d->tasks, d->tasks + d->top, sizeof(du_node_t *) * (d->bottom - d->top));
+			d->bottom -= d->top;
+			d->top = 0;
+		}
+		if (d->bottom == d->size) {
+			du_node_t **tmp = realloc(d->tasks,
+					sizeof(du_node_t *) * (d->size = d->size ? d->size * 2 : 256));
+			if (tmp == NULL)
+				err(EXIT_FAILURE, "realloc");
+			d->tasks = tmp;
+		}
+	}
+	d->tasks[d->bottom++] = n;
+	pthread_mutex_unlock(&d->lock);
+
+	generation++;
+	if (idle) {
+		pthread_mutex_lock(&idle_lock);
+		pthread_cond_broadcast(&idle_cond);
+		pthread_mutex_unlock(&idle_lock);
+	}
+}
+
+static du_node_t *deque_pop(const int self)
+{
+	deque_t *d = &deques[self];
+	du_node_t *n = NULL;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->bottom > d->top)
+		n = d->tasks[--d->bottom];
+	if (d->bottom == d->top)
+		d->top = d->bottom = 0;
+	pthread_mutex_unlock(&d->lock);
+
+	return n;
+}
+
+static du_node_t *deque_steal(const int self)
+{
+	for (int i = 1; i < opt_jobs; i++)
+	{
+		deque_t *d = &deques[(self + i) % opt_jobs];
+		du_node_t *n = NULL;
+
+		pthread_mutex_lock(&d->lock);
+		if (d->bottom > d->top)
+			n = d->tasks[d->top++];
+		if (d->bottom == d->top)
+			d->top = d->bottom = 0;
+		pthread_mutex_unlock(&d->lock);
+
+		if (n)
+			return n;
+	}
+
+	return NULL;
+}
+
+static du_item_t *node_item(du_node_t *n)
+{
+	if (n->nitems == n->size) {
+		du_item_t *tmp = realloc(n->items, sizeof(du_item_t) * (n->size = n->size ? n->size * 2 : 16));
+		if (tmp == NULL)
+			err(EXIT_FAILURE, "realloc");
+		n->items = tmp;
+	}
+
+	du_item_t *item = &n->items[n->nitems++];
+
+	memset(item, 0, sizeof(du_item_t));
+	return item;
+}
+
+static char *node_path(const char *dir, const char *name)
+{
+	const size_t dlen = strlen(dir), nlen = strlen(name);
+	const bool slash = dlen && dir[dlen - 1] != '/';
+	char *ret;
+
+	if ((ret = malloc(dlen + slash + nlen + 1)) == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	memcpy(ret, dir, dlen);
+	if (slash)
+		ret[dlen] = '/';
+	memcpy(ret + dlen + slash, name, nlen + 1);
+
+	return ret;
+}
+
+static void node_scan(const int, du_node_t *, wdir_t *);
+
+/* subdirectory name of up found at sb, to be walked as its own task */
+static void node_child(const int self, du_node_t *n, wdir_t *up, const char *name,
+		char *path, const struct stat *sb, const ssize_t size)
+{
+	wdir_t dir;
+	du_node_t *c;
+
+	if ((c = calloc(1, sizeof(du_node_t))) == NULL)
+		err(EXIT_FAILURE, "calloc");
+	c->path = path;
+	c->sb = *sb;
+	c->dev = n->dev;
+	c->own = size;
+	node_item(n)->child = c;
+
+	if ((c->fd = du_open_dir(up->fd, name, opt_deref_all)) == -1) {
+		warn("%s", path);
+		error_count++;
+		return;
+	}
+
+	if (fds_held < fds_budget) {
+		fds_held++;
+		deque_push(self, c);
+		return;
+	}
+
+	if (!wdir_fdopen(&dir, c->fd)) {
+		warn("%s", path);
+		error_count++;
+		return;
+	}
+
+	wdir_leave(up, dir.fd);
+	node_scan(self, c, &dir);
+	if (!wdir_back(up, dir.fd)) {
+		warn("%s/..", path);
+		error_count++;
+	}
+	wdir_close(&dir);
+}
 
-		if (dir == NULL) goto fail;
+/* read one directory, open in dir: files are summed, subdirectories become tasks */
+static void node_scan(const int self, du_node_t *n, wdir_t *dir)
+{
+	const cache_rec_t *rec = use_cache() ? cache_find(&n->sb) : NULL;
+	const char *name;
+	unsigned char type;
+	struct stat sb;
+	names_t subdirs;
+	bool complete = true;
 
-		// TODO handle ent==NULL && errno
-		while ((ent = readdir(dir)) != NULL)
+	if (rec) {
+		size_t off = rec->names, left = rec->nnames;
+
+		n->own = rec->own;
+		while ((name = rec_next(rec, &off, &left)) != NULL)
 		{
-			if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+			char *path = node_path(n->path, name);
+			ssize_t size;
 
-			char *name = calloc(1, strlen(fn) + strlen(ent->d_name) + 2);
-			if (name == NULL) { warn("%s", fn); continue; }
+			if ((size = du_stat(dir->fd, name, path, 0, n->dev, &sb)) < 0) {
+				free(path);
+			} else if (S_ISDIR(sb.st_mode)) {
+				node_child(self, n, dir, name, path, &sb, size);
+			} else {
+				n->own += size;
+				free(path);
+			}
+			/* lost on the way back up */
+			if (dir->fd == -1)
+				return;
+		}
+		cache_add(&n->sb, rec->own, cache.names + rec->names, off - rec->names, rec->nnames);
+		return;
+	}
+
+	memset(&subdirs, 0, sizeof(subdirs));
+
+	while ((name = wdir_read(dir, &type)) != NULL)
+	{
+		char *path = node_path(n->path, name);
+		ssize_t size;
 
-			strcpy(name, fn);
-			strcat(name, "/");
-			strcat(name, ent->d_name);
-			rc += perform_du(name, 0, dev);
-			free(name); name = NULL;
+		size = du_stat(dir->fd, name, path, 0, n->dev, &sb);
+		if (size == -2 || (!S_ISDIR(sb.st_mode) && sb.st_nlink > 1))
+			complete = false;
+
+		if (size < 0) {
+			free(path);
+		} else if (S_ISDIR(sb.st_mode)) {
+			node_child(self, n, dir, name, path, &sb, size);
+			if (use_cache() && !names_add(&subdirs, name, strlen(name)))
+				complete = false;
+		} else if (opt_all_size) {
+			du_item_t *item = node_item(n);
+
+			item->path = path;
+			item->size = size;
+		} else {
+			n->own += size;
+			free(path);
 		}
-		closedir(dir);
-	} 
+		if (dir->fd == -1)
+			break;
+	}
+	if (dir->fd == -1) {
+		complete = false;
+	} else if (errno) {
+		warn("%s", n->path);
+		error_count++;
+		complete = false;
+	}
 
-	/* add this file/directory */
-	rc += opt_apparent_size ? sb.st_size : sb.st_blocks * 512;
+	if (use_cache() && complete)
+		cache_add(&n->sb, n->own, subdirs.buf, subdirs.len, subdirs.cnt);
+	free(subdirs.buf);
+}
+
+static void *du_worker(void *arg)
+{
+	const int self = *(int *)arg;
+	du_node_t *n;
+
+	while (pending)
+	{
+		const unsigned gen = generation;
+
+		if ((n = deque_pop(self)) != NULL || (n = deque_steal(self)) != NULL) {
+			wdir_t dir;
+
+			if (wdir_fdopen(&dir, n->fd)) {
+				node_scan(self, n, &dir);
+				wdir_close(&dir);
+			} else {
+				warn("%s", n->path);
+				error_count++;
+			}
+			fds_held--;
+			if (--pending == 0) {
+				pthread_mutex_lock(&idle_lock);
+				pthread_cond_broadcast(&idle_cond);
+				pthread_mutex_unlock(&idle_lock);
+			}
+			continue;
+		}
 
-	if (top || (is_dir && !opt_total_size) || (!is_dir && opt_all_size))
-		printf("%-7ld %s\n", roundup(rc, opt_units), path);
+		/* nothing to steal: sleep until something is pushed, or all is done */
+		pthread_mutex_lock(&idle_lock);
+		idle++;
+		while (pending && gen == generation)
+			pthread_cond_wait(&idle_cond, &idle_lock);
+		idle--;
+		pthread_mutex_unlock(&idle_lock);
+	}
+
+	return NULL;
+}
+
+/* print the subtree in the serial order, freeing it as it goes */
+static ssize_t node_report(du_node_t *n, const int top)
+{
+	ssize_t rc = n->own;
+
+	for (size_t i = 0; i < n->nitems; i++)
+	{
+		du_item_t *item = &n->items[i];
+
+		if (item->child) {
+			rc += node_report(item->child, 0);
+		} else {
+			rc += item->size;
+			du_print(item->size, item->path);
+			free(item->path);
+		}
+	}
+
+	if (top || !opt_total_size)
+		du_print(rc, n->path);
+
+	free(n->items);
+	free(n->path);
+	if (!top)
+		free(n);
 
-ok:
-	if (tmp) { free(tmp); tmp = NULL; }
 	return rc;
+}
 
-fail:
-	warn("%s", path);
-	error_count++;
-	rc = 0;
-	goto ok;
+static ssize_t du_parallel(const char *path)
+{
+	du_node_t root;
+	struct stat sb;
+	struct rlimit rl;
+	pthread_t *threads;
+	int *selves;
+	ssize_t size;
+
+	if ((size = du_stat(AT_FDCWD, path, path, 1, 0, &sb)) < 0)
+		return 0;
+
+	if (!S_ISDIR(sb.st_mode)) {
+		du_print(size, path);
+		return size;
+	}
+
+	memset(&root, 0, sizeof(root));
+	if ((root.path = strdup(path)) == NULL)
+		err(EXIT_FAILURE, "strdup");
+	root.sb = sb;
+	root.dev = sb.st_dev;
+	root.own = size;
+
+	if ((root.fd = du_open_dir(AT_FDCWD, path, opt_deref_all || opt_deref_cmdline)) == -1) {
+		warn("%s", path);
+		error_count++;
+		return node_report(&root, 1);
+	}
+
+	/* keep half the fds free for the directories scanned in place */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+		fds_budget = rl.rlim_cur < INT_MAX ? rl.rlim_cur / 2 : INT_MAX / 2;
+
+	if ((deques = calloc(opt_jobs, sizeof(deque_t))) == NULL ||
+			(threads = calloc(opt_jobs, sizeof(pthread_t))) == NULL ||
+			(selves = calloc(opt_jobs, sizeof(int))) == NULL)
+		err(EXIT_FAILURE, "calloc");
+
+	for (int i = 0; i < opt_jobs; i++)
+		pthread_mutex_init(&deques[i].lock, NULL);
+
+	/* the root goes in first, a worker that sees nothing pending quits */
+	pending = 0;
+	fds_held = 1;
+	deque_push(0, &root);
+
+	for (int i = 0; i < opt_jobs; i++)
+	{
+		selves[i] = i;
+		if ((errno = pthread_create(&threads[i], NULL, du_worker, &selves[i])))
+			err(EXIT_FAILURE, "pthread_create");
+	}
+
+	for (int i = 0; i < opt_jobs; i++)
+		pthread_join(threads[i], NULL);
+
+	for (int i = 0; i < opt_jobs; i++) {
+		pthread_mutex_destroy(&deques[i].lock);
+		free(deques[i].tasks);
+	}
+	free(deques);
+	free(threads);
+	free(selves);
+
+	return node_report(&root, 1);
+}
+
+static ssize_t perform_du(const char *restrict path)
+{
+	wdir_t top = { .fd = AT_FDCWD, .keep = true };
+	path_t buf;
+	ssize_t rc;
+	int what;
+
+	if (opt_jobs > 1)
+		return du_parallel(path);
+
+	memset(&buf, 0, sizeof(buf));
+	path_push(&buf, path);
+	rc = du_walk(&top, path, &buf, 1, 0, &what);
+	free(buf.buf);
+
+	return rc;
 }
 
 int main(const int argc, char *argv[])
@@ -106,7 +1084,7 @@ int main(const int argc, char *argv[])
 	{
 		int opt;
 
-		while ((opt = getopt(argc, argv, "askxHLmb")) != -1)
+		while ((opt = getopt(argc, argv, "askxHLmbj:K:")) != -1)
 		{
 			switch (opt)
 			{
@@ -135,6 +1113,15 @@ int main(const int argc, char *argv[])
 				case 'm':
 					opt_units = 1024*1024;
 					break;
+				case 'j':
+					if ((opt_jobs = atoi(optarg)) < 1) {
+						warnx("invalid number of jobs: %s", optarg);
+						show_usage();
+					}
+					break;
+				case 'K':
+					opt_cache_file = optarg;
+					break;
 				default:
 					show_usage();
 			}
@@ -144,13 +1131,19 @@ int main(const int argc, char *argv[])
 			show_usage();
 	}
 
-	ssize_t total = 0;
+	seen_init();
+
+	if (use_cache())
+		cache_load(opt_cache_file);
 
 	if (optind >= argc)
-		total = perform_du(".", 1, -1);
+		perform_du(".");
 	else
 		for (int i = optind; i < argc; i++)
-			total += perform_du(argv[i], 1, -1);
+			perform_du(argv[i]);
+
+	if (use_cache())
+		cache_save(opt_cache_file);
 
 	exit(error_count ? EXIT_FAILURE : EXIT_SUCCESS);
 }
@@ -6,11 +6,15 @@
 #include <err.h>
 #include <ctype.h>
 
-static void show_usage()
+#ifdef SH_BUILTIN
+# include "builtin.h"
+#endif
+
+static int show_usage()
 {
 	fprintf(stderr,
 			"Usage: echo [-n] [string...]\n");
-	exit(EXIT_FAILURE);
+	return EXIT_FAILURE;
 }
 
 static int print_process(char *arg)
@@ -39,8 +43,10 @@ static int print_process(char *arg)
 							  {
 								  cnt *= 8;
 								  cnt += *c - 0x30;
-								  if (cnt > 0777)
-									  errx(EXIT_FAILURE, "invalid octal number");
+								  if (cnt > 0777) {
+									  warnx("invalid octal number");
+									  return -1;
+								  }
 								  c++;
 							  }
 							  continue;
@@ -59,8 +65,11 @@ static int print_process(char *arg)
 
 static int opt_process = 0;
 
-int main(int argc, char *argv[])
+/* returns the exit status rather than exiting, see builtin.h */
+int echo_main(int argc, char *argv[])
 {
+	opt_process = 0;
+
 	{
 		int opt;
 
@@ -72,17 +81,19 @@ int main(int argc, char *argv[])
 					opt_process = 1;
 					break;
 				default:
-					show_usage();
+					return show_usage();
 			}
 		}
 	}
 
 	for (int i = optind; i < argc; i++)
 	{
-		if (opt_process && print_process(argv[i]))
-			break;
+		int rc;
+
+		if (opt_process && (rc = print_process(argv[i])))
+			return rc == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
 		else if (!opt_process)
-			printf("%s", argv[i]);
+			fputs(argv[i], stdout);
 
 		if (i + 1 < argc)
 			fputc(' ', stdout);
@@ -90,5 +101,12 @@ int main(int argc, char *argv[])
 			fputc('\n', stdout);
 	}
 
+	return EXIT_SUCCESS;
+}
 
+#ifndef SH_BUILTIN
+int main(int argc, char *argv[])
+{
+	exit(echo_main(argc, argv));
 }
+#endif
@@ -2,53 +2,97 @@
 
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
 #include <err.h>
+#include <fcntl.h>
 #include <stdio.h>
 
 static void show_usage()
 {
 	fprintf(stderr,
-			"Usage: head [-n number] [file...]\n");
+			"Usage: head [-c number|-n number] [file...]\n");
 	exit(EXIT_FAILURE);
 }
 
-static int opt_number_lines = 10;
+static bool opt_bytes = false;
+static long long opt_count = 10;
 
+#define	HEAD_BLOCK	(64 * 1024)
+
+static void write_all(const char *p, size_t len)
+{
+	ssize_t wr;
+
+	while (len)
+	{
+		if ((wr = write(STDOUT_FILENO, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "write");
+		}
+		p += wr;
+		len -= wr;
+	}
+}
+
+/*
+ * Reads a block at a time and stops as soon as count lines or bytes
+ * are out. Whatever was read past them is given back where the input
+ * can seek, so a following reader of the same fd starts in the right place.
+ */
 static int head_file(const char *file)
 {
-	int rc = 0;
-	FILE *fp;
+	static char buf[HEAD_BLOCK];
+	const char *const name = file ? file : "<stdin>";
+	long long left = opt_count;
+	int fd = STDIN_FILENO, rc = 0;
 
-	if (!file)
-		fp = stdin;
-	else if ((fp = fopen(file, "r")) == NULL) {
-		warnx("%s", file);
+	if (file && (fd = open(file, O_RDONLY)) == -1) {
+		warn("%s", file);
 		return 1;
 	}
 
-	char buf[BUFSIZ];
-	int lines = 0;
-
-	while (1)
+	while (left > 0)
 	{
-		if (feof(fp))
-			break;
+		ssize_t rd;
 
-		if (ferror(fp)) {
+		if ((rd = read(fd, buf, sizeof(buf))) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("%s", name);
 			rc = 1;
 			break;
 		}
-		if (lines == opt_number_lines)
+		if (rd == 0)
 			break;
 
-		if (fgets(buf, BUFSIZ, fp)) {
-			printf("%s", buf);
-			lines++;
+		size_t len = rd;
+
+		if (opt_bytes) {
+			if ((long long)len > left)
+				len = left;
+			left -= len;
+		} else {
+			const char *p = buf, *const end = buf + rd;
+
+			while (left && (p = memchr(p, '\n', end - p)) != NULL) {
+				p++;
+				left--;
+			}
+			if (left == 0)
+				len = p - buf;
 		}
+
+		write_all(buf, len);
+
+		if (len < (size_t)rd)
+			lseek(fd, (off_t)len - rd, SEEK_CUR);
 	}
 
 	if (file)
-		fclose(fp);
+		close(fd);
 	return rc;
 }
 
@@ -57,12 +101,14 @@ int main(int argc, char *argv[])
 	{
 		int opt;
 		char *err;
-		while ((opt = getopt(argc, argv, "n:")) != -1)
+		while ((opt = getopt(argc, argv, "c:n:")) != -1)
 		{
 			switch (opt)
 			{
+				case 'c':
 				case 'n':
-					opt_number_lines = strtol(optarg, &err, 10);
+					opt_bytes = opt == 'c';
+					opt_count = strtoll(optarg, &err, 10);
 					if(!*optarg || *err != '\0')
 						errx(EXIT_FAILURE, "%s: not a number", optarg);
 					break;
@@ -71,7 +117,7 @@ int main(int argc, char *argv[])
 			}
 		}
 
-		if (opt_number_lines <= 0)
+		if (opt_count <= 0)
 			show_usage();
 	}
 
@@ -84,10 +130,8 @@ int main(int argc, char *argv[])
 
 	for (int i = optind; i < argc; i++)
 	{
-		if (num_files > 1 && i == optind)
-			printf("==> %s <==\n", argv[i]);
-		else if (num_files > 1)
-			printf("\n==> %s <==\n", argv[i]);
+		if (num_files > 1)
+			dprintf(STDOUT_FILENO, "%s==> %s <==\n", i == optind ? "" : "\n", argv[i]);
 
 		rc += head_file(argv[i]);
 	}
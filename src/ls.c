@@ -1,6 +1,8 @@
-#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE /* statx() */
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
@@ -12,11 +14,17 @@
 #include <pwd.h>
 #include <grp.h>
 #include <time.h>
-#include <libgen.h>
+#include <locale.h>
+#include <wchar.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <pthread.h>
+#include <sys/syscall.h>
 
 static void show_usage()
 {
-	fprintf(stderr, "Usage: ls [-CFRacdilqrtu1] [file...]\n");
+	fprintf(stderr, "Usage: ls [-CFRSacdilnpqrtu1] [-j jobs] [file...]\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -36,11 +44,10 @@ static int opt_sort_lastacc = 0;
 static int opt_show_all = 0;
 static int opt_multi_header = 0;
 static int opt_supress_names = 0;
+static int opt_sort_size = 0;
 
-static char *file_mode(mode_t mode)
+static void file_mode(const mode_t mode, char ret[11])
 {
-	char *ret = calloc(1, 16);
-
 	char c;
 
 	if( S_ISREG(mode) ) c = '-';
@@ -48,186 +55,1080 @@ static char *file_mode(mode_t mode)
 	else if( S_ISDIR(mode) ) c = 'd';
 	else if( S_ISCHR(mode) ) c = 'c';
 	else if( S_ISFIFO(mode) ) c = 'p';
+	else if( S_ISLNK(mode) ) c = 'l';
+	else if( S_ISSOCK(mode) ) c = 's';
 	else c = '?';
 
-	snprintf(ret, 16, "%c%c%c%c%c%c%c%c%c%c%c", 
-			c,
+	ret[0] = c;
+
+	ret[1] = (mode & S_IRUSR) ? 'r' : '-';
+	ret[2] = (mode & S_IWUSR) ? 'w' : '-';
+	ret[3] = (mode & S_IXUSR) ? (mode & S_ISUID ? 's': 'x') : (mode & S_ISUID ? 'S' : '-');
+
+	ret[4] = (mode & S_IRGRP) ? 'r' : '-';
+	ret[5] = (mode & S_IWGRP) ? 'w' : '-';
+	ret[6] = (mode & S_IXGRP) ? (mode & S_ISGID ? 's': 'x') : (mode & S_ISGID ? 'S' : '-');
+
+	ret[7] = (mode & S_IROTH) ? 'r' : '-';
+	ret[8] = (mode & S_IWOTH) ? 'w' : '-';
+	ret[9] = (mode & S_IXOTH) ? (mode & S_ISVTX ? 't': 'x') : (mode & S_ISVTX ? 'T' : '-');
+
+	ret[10] = '\0';
+}
+
+/*
+ * Output is rendered into one large buffer and written out in big
+ * blocks, rather than a printf() and fflush() per entry.
+ */
+#define	OUT_BUF		(256*1024)
+
+static char out_buf[OUT_BUF];
+static size_t out_len = 0;
+
+static void out_flush(void)
+{
+	size_t off = 0;
+	ssize_t rc;
+
+	while (off < out_len)
+	{
+		if ((rc = write(STDOUT_FILENO, out_buf + off, out_len - off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			/* also runs from atexit(), where exit() must not be called again */
+			warn("write");
+			_exit(EXIT_FAILURE);
+		}
+		off += rc;
+	}
+
+	out_len = 0;
+}
 
-			(mode & S_IRUSR) ? 'r' : '-',
-			(mode & S_IWUSR) ? 'w' : '-',
-			(mode & S_IXUSR) ? (mode & S_ISUID ? 's': 'x') : (mode & S_ISUID ? 'S' : '-'),
+static void out_bytes(const char *str, size_t len)
+{
+	while (len)
+	{
+		if (out_len == OUT_BUF)
+			out_flush();
 
-			(mode & S_IRGRP) ? 'r' : '-',
-			(mode & S_IWGRP) ? 'w' : '-',
-			(mode & S_IXGRP) ? (mode & S_ISGID ? 's': 'x') : (mode & S_ISGID ? 'S' : '-'),
+		size_t cnt = OUT_BUF - out_len < len ? OUT_BUF - out_len : len;
 
-			(mode & S_IROTH) ? 'r' : '-',
-			(mode & S_IWOTH) ? 'w' : '-',
-			(mode & S_IXOTH) ? 'x' : '-',
+		memcpy(out_buf + out_len, str, cnt);
+		out_len += cnt;
+		str += cnt;
+		len -= cnt;
+	}
+}
 
-			(mode & S_ISVTX) ? 't' : '-'
-			);
-	return ret;
+static void out_char(const char c)
+{
+	if (out_len == OUT_BUF)
+		out_flush();
+	out_buf[out_len++] = c;
+}
+
+static void out_pad(size_t cnt)
+{
+	while (cnt--)
+		out_char(' ');
+}
+
+__attribute__((format(printf, 1, 2)))
+static void out_printf(const char *fmt, ...)
+{
+	char buf[PATH_MAX + 256];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (len > 0)
+		out_bytes(buf, (size_t)len < sizeof(buf) ? (size_t)len : sizeof(buf) - 1);
+}
+
+/*
+ * A directory is listed in two phases. All entries are read first with
+ * getdents64(), then each is stat'd relative to the directory fd, asking
+ * statx() for only the fields the options print or sort on. Plain
+ * listings, -i, -p and -R usually need no stat at all, d_type and d_ino
+ * say enough.
+ */
+
+/* for stat_need */
+#define	NEED_TYPE	(1<<0)		/* d_type does, unless DT_UNKNOWN */
+#define	NEED_MODE	(1<<1)
+#define	NEED_LINKS	(1<<2)
+#define	NEED_OWNER	(1<<3)
+#define	NEED_SIZE	(1<<4)
+#define	NEED_TIME	(1<<5)
+
+static int stat_need = 0;
+
+typedef struct {
+	char			*name;
+	size_t			 name_off;		/* into dir_t.names, until reading is done */
+	ino_t			 ino;
+	unsigned char	 d_type;
+	bool			 valid;			/* sb holds what stat_need asked for */
+	struct stat		 sb;			/* lstat() of the entry, only what stat_need asked for */
+	const char		*key;			/* collation key, computed once before sorting */
+	size_t			 key_off;
+	size_t			 width;			/* display width of name, for -C */
+} entry_t;
+
+typedef struct {
+	entry_t	*ents;
+	size_t	 cnt;
+	size_t	 size;
+	char	*names;
+	size_t	 names_len;
+	size_t	 names_size;
+	char	*keys;
+	entry_t	**list;				/* the valid entries, in output order */
+	size_t	 list_cnt;
+} dir_t;
+
+static bool dir_add(dir_t *d, const char *name, const size_t len, const ino_t ino,
+		const unsigned char d_type)
+{
+	if (d->cnt == d->size) {
+		entry_t *tmp = realloc(d->ents, sizeof(entry_t) * (d->size = d->size ? d->size * 2 : 64));
+		if (tmp == NULL)
+			return false;
+		d->ents = tmp;
+	}
+
+	if (d->names_len + len + 1 > d->names_size) {
+		size_t size = d->names_size ? d->names_size : 4096;
+		while (size < d->names_len + len + 1)
+			size *= 2;
+		char *tmp = realloc(d->names, size);
+		if (tmp == NULL)
+			return false;
+		d->names = tmp;
+		d->names_size = size;
+	}
+
+	entry_t *e = &d->ents[d->cnt++];
+
+	memset(e, 0, sizeof(entry_t));
+	e->name_off = d->names_len;
+	e->ino = ino;
+	e->d_type = d_type;
+
+	memcpy(d->names + d->names_len, name, len + 1);
+	d->names_len += len + 1;
+
+	return true;
+}
+
+static void dir_free(dir_t *d)
+{
+	free(d->ents);
+	free(d->names);
+	free(d->keys);
+	free(d->list);
+}
+
+#ifdef SYS_getdents64
+struct linux_dirent64 {
+	ino64_t			d_ino;
+	off64_t			d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char			d_name[];
+};
+
+#define DENTS_BUF	(64*1024)
+#endif
+
+/* read every entry of dfd into d, honouring -a */
+static int dir_read(const int dfd, dir_t *d)
+{
+#ifdef SYS_getdents64
+	char *buf;
+	long rc;
+
+	if ((buf = malloc(DENTS_BUF)) == NULL)
+		return -1;
+
+	while ((rc = syscall(SYS_getdents64, dfd, buf, DENTS_BUF)) > 0)
+	{
+		for (long off = 0; off < rc; )
+		{
+			const struct linux_dirent64 *ent = (void *)(buf + off);
+
+			off += ent->d_reclen;
+			if (!opt_show_all && ent->d_name[0] == '.')
+				continue;
+			if (!dir_add(d, ent->d_name, strlen(ent->d_name), ent->d_ino, ent->d_type)) {
+				free(buf);
+				return -1;
+			}
+		}
+	}
+
+	free(buf);
+	if (rc == -1)
+		return -1;
+#else
+	DIR *dir;
+	struct dirent *ent;
+	int fd;
+
+	if ((fd = dup(dfd)) == -1 || (dir = fdopendir(fd)) == NULL)
+		return -1;
+
+	while ((errno = 0, ent = readdir(dir)) != NULL)
+	{
+		if (!opt_show_all && ent->d_name[0] == '.')
+			continue;
+		if (!dir_add(d, ent->d_name, strlen(ent->d_name), ent->d_ino, DT_UNKNOWN)) {
+			closedir(dir);
+			return -1;
+		}
+	}
+
+	if (errno) {
+		closedir(dir);
+		return -1;
+	}
+	closedir(dir);
+#endif
+
+	for (size_t i = 0; i < d->cnt; i++)
+		d->ents[i].name = d->names + d->ents[i].name_off;
+
+	return 0;
+}
+
+/* lstat() relative to dfd, fetching only what stat_need asks for */
+static int entry_stat(const int dfd, const char *name, const int flags, struct stat *sb)
+{
+#ifdef STATX_BASIC_STATS
+	static bool no_statx = false;
+	struct statx sx;
+	unsigned mask = STATX_TYPE;
+
+	if (no_statx)
+		return fstatat(dfd, name, sb, flags);
+
+	if (stat_need & NEED_MODE)  mask |= STATX_MODE;
+	if (stat_need & NEED_LINKS) mask |= STATX_NLINK;
+	if (stat_need & NEED_OWNER) mask |= STATX_UID|STATX_GID;
+	if (stat_need & NEED_SIZE)  mask |= STATX_SIZE|STATX_BLOCKS;
+	if (stat_need & NEED_TIME)
+		mask |= opt_sort_lastacc ? STATX_ATIME : opt_sort_status_lastmod ? STATX_CTIME : STATX_MTIME;
+
+	if (statx(dfd, name, flags|AT_NO_AUTOMOUNT, mask, &sx) == -1) {
+		if (errno != ENOSYS)
+			return -1;
+		no_statx = true;
+		return fstatat(dfd, name, sb, flags);
+	}
+
+	memset(sb, 0, sizeof(struct stat));
+	sb->st_mode = sx.stx_mode;
+	sb->st_ino = sx.stx_ino;
+	sb->st_nlink = sx.stx_nlink;
+	sb->st_uid = sx.stx_uid;
+	sb->st_gid = sx.stx_gid;
+	sb->st_size = sx.stx_size;
+	sb->st_blocks = sx.stx_blocks;
+	sb->st_atim.tv_sec = sx.stx_atime.tv_sec;
+	sb->st_atim.tv_nsec = sx.stx_atime.tv_nsec;
+	sb->st_mtim.tv_sec = sx.stx_mtime.tv_sec;
+	sb->st_mtim.tv_nsec = sx.stx_mtime.tv_nsec;
+	sb->st_ctim.tv_sec = sx.stx_ctime.tv_sec;
+	sb->st_ctim.tv_nsec = sx.stx_ctime.tv_nsec;
+
+	return 0;
+#else
+	return fstatat(dfd, name, sb, flags);
+#endif
+}
+
+static mode_t dtype_to_mode(const unsigned char d_type)
+{
+	switch (d_type)
+	{
+		case DT_REG:	return S_IFREG;
+		case DT_DIR:	return S_IFDIR;
+		case DT_LNK:	return S_IFLNK;
+		case DT_FIFO:	return S_IFIFO;
+		case DT_SOCK:	return S_IFSOCK;
+		case DT_CHR:	return S_IFCHR;
+		case DT_BLK:	return S_IFBLK;
+	}
+	return 0;
+}
+
+/* stat the entries that need it; returns non-zero if any could not be */
+static int dir_stat(const int dfd, dir_t *d)
+{
+	int failure = 0;
+
+	for (size_t i = 0; i < d->cnt; i++)
+	{
+		entry_t *e = &d->ents[i];
+
+		if (!(stat_need & ~NEED_TYPE) && e->d_type != DT_UNKNOWN) {
+			e->sb.st_mode = dtype_to_mode(e->d_type);
+			e->sb.st_ino = e->ino;
+			e->valid = true;
+			continue;
+		}
+
+		if (entry_stat(dfd, e->name, AT_SYMLINK_NOFOLLOW, &e->sb) == -1) {
+			warn("cannot access %s", e->name);
+			failure = 1;
+			continue;
+		}
+
+		e->valid = true;
+		e->sb.st_ino = e->ino;
+	}
+
+	return failure;
+}
+
+/*
+ * getpwuid() and getgrgid() can go all the way to NSS for each call, so
+ * names are kept in a small cache indexed by id.
+ */
+#define	NAME_CACHE	256
+
+typedef struct {
+	unsigned	id;
+	bool		valid;
+	char		name[64];
+} name_cache_t;
+
+static name_cache_t uid_cache[NAME_CACHE];
+static name_cache_t gid_cache[NAME_CACHE];
+
+static const char *uid_name(const uid_t uid)
+{
+	name_cache_t *c = &uid_cache[uid % NAME_CACHE];
+
+	if (!c->valid || c->id != uid) {
+		struct passwd *pw = opt_supress_names ? NULL : getpwuid(uid);
+
+		if (pw)
+			snprintf(c->name, sizeof(c->name), "%s", pw->pw_name);
+		else
+			snprintf(c->name, sizeof(c->name), "%u", uid);
+		c->id = uid;
+		c->valid = true;
+	}
+
+	return c->name;
+}
+
+static const char *gid_name(const gid_t gid)
+{
+	name_cache_t *c = &gid_cache[gid % NAME_CACHE];
+
+	if (!c->valid || c->id != gid) {
+		struct group *gr = opt_supress_names ? NULL : getgrgid(gid);
+
+		if (gr)
+			snprintf(c->name, sizeof(c->name), "%s", gr->gr_name);
+		else
+			snprintf(c->name, sizeof(c->name), "%u", gid);
+		c->id = gid;
+		c->valid = true;
+	}
+
+	return c->name;
+}
+
+/*
+ * Sorting compares keys prepared once per entry: strxfrm() output for
+ * the name unless collation is plain C, where the name is its own key.
+ */
+static bool collate_c = true;
+
+static int dir_keys(dir_t *d)
+{
+	size_t len = 0, size = 0;
+
+	if (collate_c) {
+		for (size_t i = 0; i < d->list_cnt; i++)
+			d->list[i]->key = d->list[i]->name;
+		return 0;
+	}
+
+	for (size_t i = 0; i < d->list_cnt; i++)
+	{
+		entry_t *e = d->list[i];
+		size_t need;
+
+		while ((need = strxfrm(d->keys + len, e->name, size - len)) >= size - len)
+		{
+			size = size ? size * 2 : 4096;
+			while (size < len + need + 1)
+				size *= 2;
+			char *tmp = realloc(d->keys, size);
+			if (tmp == NULL)
+				return -1;
+			d->keys = tmp;
+		}
+		e->key_off = len;
+		len += need + 1;
+	}
+
+	for (size_t i = 0; i < d->list_cnt; i++)
+		d->list[i]->key = d->keys + d->list[i]->key_off;
+
+	return 0;
+}
+
+static const struct timespec *entry_time(const entry_t *e)
+{
+	return opt_sort_lastacc ? &e->sb.st_atim :
+		opt_sort_status_lastmod ? &e->sb.st_ctim : &e->sb.st_mtim;
+}
+
+static int cmp_name(const void *a, const void *b)
+{
+	return strcmp((*(entry_t * const *)a)->key, (*(entry_t * const *)b)->key);
+}
+
+/* newest first */
+static int cmp_time(const void *a, const void *b)
+{
+	const struct timespec *ta = entry_time(*(entry_t * const *)a);
+	const struct timespec *tb = entry_time(*(entry_t * const *)b);
+
+	if (ta->tv_sec != tb->tv_sec)
+		return ta->tv_sec < tb->tv_sec ? 1 : -1;
+	if (ta->tv_nsec != tb->tv_nsec)
+		return ta->tv_nsec < tb->tv_nsec ? 1 : -1;
+	return cmp_name(a, b);
+}
+
+/* largest first */
+static int cmp_size(const void *a, const void *b)
+{
+	const off_t sa = (*(entry_t * const *)a)->sb.st_size;
+	const off_t sb = (*(entry_t * const *)b)->sb.st_size;
+
+	if (sa != sb)
+		return sa < sb ? 1 : -1;
+	return cmp_name(a, b);
+}
+
+static int dir_sort(dir_t *d)
+{
+	if (dir_keys(d) == -1)
+		return -1;
+
+	qsort(d->list, d->list_cnt, sizeof(entry_t *),
+			opt_sort_size ? cmp_size : opt_sort_lastmod ? cmp_time : cmp_name);
+
+	if (opt_reverse)
+		for (size_t i = 0, j = d->list_cnt; i + 1 < j--; i++) {
+			entry_t *tmp = d->list[i];
+			d->list[i] = d->list[j];
+			d->list[j] = tmp;
+		}
+
+	return 0;
+}
+
+/* the valid entries, ready to sort */
+static int dir_list(dir_t *d)
+{
+	if ((d->list = malloc(sizeof(entry_t *) * (d->cnt + 1))) == NULL)
+		return -1;
+
+	d->list_cnt = 0;
+	for (size_t i = 0; i < d->cnt; i++)
+		if (d->ents[i].valid)
+			d->list[d->list_cnt++] = &d->ents[i];
+
+	return 0;
 }
 
 #define TIME_RECENT "%b %e %H:%M"
 #define TIME_OLD	"%b %e  %Y"
 #define SIX_MONTHS (60*60*24*(365/2))
 
-static int print_single_entry(char *name, struct stat *sb, struct stat *lsb)
+static time_t now;
+static size_t term_width = 80;
+
+static char entry_suffix(const struct stat *sb)
+{
+	if( opt_append_slash ) {
+		if( S_ISLNK(sb->st_mode) ) return '@';
+		else if( S_ISDIR(sb->st_mode) ) return '/';
+		else if( S_ISFIFO(sb->st_mode) ) return '|';
+		else if( S_ISSOCK(sb->st_mode) ) return '=';
+		else if( S_ISREG(sb->st_mode) && sb->st_mode & (S_IXUSR|S_IXGRP|S_IXOTH) ) return '*';
+	} else if( opt_append_slash_dirs ) {
+		if( S_ISDIR(sb->st_mode) ) return '/';
+	}
+	return 0;
+}
+
+static size_t num_width(unsigned long long num)
+{
+	size_t width = 1;
+
+	while (num >= 10) {
+		num /= 10;
+		width++;
+	}
+	return width;
+}
+
+/* columns a name takes on the terminal */
+static size_t name_width(const char *name)
+{
+	mbstate_t mbs;
+	size_t width = 0, len;
+	wchar_t wc;
+	int w;
+
+	if (MB_CUR_MAX == 1)
+		return strlen(name);
+
+	memset(&mbs, 0, sizeof(mbs));
+	while (*name)
+	{
+		len = mbrtowc(&wc, name, MB_CUR_MAX, &mbs);
+		if (len == (size_t)-1 || len == (size_t)-2) {
+			memset(&mbs, 0, sizeof(mbs));
+			len = 1;
+			w = 1;
+		} else if ((w = wcwidth(wc)) < 0)
+			w = 1;
+		name += len;
+		width += w;
+	}
+
+	return width;
+}
+
+/* name, with the -F/-p suffix; returns how many columns it took */
+static size_t render_name(const entry_t *e, const size_t ino_width)
+{
+	size_t width = 0;
+	char append;
+
+	if( opt_show_file_serial ) {
+		out_printf("%*lu ", (int)ino_width, (unsigned long)e->sb.st_ino);
+		width += ino_width + 1;
+	}
+
+	out_bytes(e->name, strlen(e->name));
+	width += e->width;
+
+	if( (append = entry_suffix(&e->sb)) ) {
+		out_char(append);
+		width++;
+	}
+
+	return width;
+}
+
+static size_t list_ino_width(entry_t **list, const size_t cnt)
 {
+	size_t width = 0;
+
 	if( opt_show_file_serial )
-		printf("%lu ", sb->st_ino);
+		for (size_t i = 0; i < cnt; i++)
+			if (num_width(list[i]->sb.st_ino) > width)
+				width = num_width(list[i]->sb.st_ino);
 
-	if( opt_show_long ) {
-		char ubuf[32], gbuf[32];
-		struct passwd *uid_nam = getpwuid(sb->st_uid);
-		struct group *gid_nam = getgrgid(sb->st_gid);
-		snprintf(ubuf, 32, "%u", sb->st_uid);
-		snprintf(gbuf, 32, "%u", sb->st_gid);
+	return width;
+}
+
+static void render_long(entry_t **list, const size_t cnt)
+{
+	size_t w_ino = list_ino_width(list, cnt), w_links = 0, w_owner = 0, w_group = 0, w_size = 0;
+	char tbuf[100], fm[11];
+	struct tm tm;
 
-		char tbuf[100];
+	for (size_t i = 0; i < cnt; i++)
+	{
+		const struct stat *sb = &list[i]->sb;
+		size_t w;
+
+		if ((w = num_width(sb->st_nlink)) > w_links) w_links = w;
+		if ((w = strlen(uid_name(sb->st_uid))) > w_owner) w_owner = w;
+		if ((w = strlen(gid_name(sb->st_gid))) > w_group) w_group = w;
+		if ((w = num_width(sb->st_size)) > w_size) w_size = w;
+	}
 
-		time_t point = sb->st_mtime;
-		time_t age = time(NULL) - point;
+	for (size_t i = 0; i < cnt; i++)
+	{
+		const struct stat *sb = &list[i]->sb;
+		time_t point = entry_time(list[i])->tv_sec;
+		time_t age = now - point;
 
-		strftime(tbuf, 100, age > SIX_MONTHS ? TIME_OLD : TIME_RECENT, localtime(&point));
+		strftime(tbuf, 100, (age > SIX_MONTHS || age < 0) ? TIME_OLD : TIME_RECENT, localtime_r(&point, &tm));
+		file_mode(sb->st_mode, fm);
 
-		char *fm = file_mode(sb->st_mode);
+		if( opt_show_file_serial )
+			out_printf("%*lu ", (int)w_ino, (unsigned long)sb->st_ino);
 
-		printf("%s %3lu %8s %8s %8lu %s %s",
+		out_printf("%s %*lu %-*s %-*s %*llu %s ",
 				fm,
-				sb->st_nlink,
-				uid_nam ? uid_nam->pw_name : ubuf,
-				gid_nam ? gid_nam->gr_name : gbuf,
-				sb->st_size,
-				tbuf,
-				basename(name)
-			  );
-
-
-		char append = 0;
-		if( opt_append_slash ) {
-			if( (lsb->st_mode & S_IFLNK) == S_IFLNK ) append = '@';
-			else if( S_ISDIR(sb->st_mode) ) append = '/';
-			else if( sb->st_mode & (S_IXUSR|S_IXGRP|S_IXOTH) ) append = '*';
-			else if( S_ISFIFO(sb->st_mode) ) append = '|';
-		} else if( opt_append_slash_dirs ) {
-			if( S_ISDIR(sb->st_mode) ) append = '/';
-		}
+				(int)w_links, (unsigned long)sb->st_nlink,
+				(int)w_owner, uid_name(sb->st_uid),
+				(int)w_group, gid_name(sb->st_gid),
+				(int)w_size, (unsigned long long)sb->st_size,
+				tbuf);
+
+		out_bytes(list[i]->name, strlen(list[i]->name));
+
+		char append = entry_suffix(sb);
 		if( append )
-			printf("%c", append);
+			out_char(append);
+		out_char('\n');
+	}
+}
 
-		free(fm);
+/* -C: filled down the columns first, as wide as the terminal allows */
+static void render_columns(entry_t **list, const size_t cnt)
+{
+	size_t w_ino = list_ino_width(list, cnt), max = 0, cols, rows;
+
+	if (cnt == 0)
+		return;
+
+	for (size_t i = 0; i < cnt; i++)
+	{
+		size_t w = (list[i]->width = name_width(list[i]->name));
+
+		if (opt_show_file_serial)
+			w += w_ino + 1;
+		if (entry_suffix(&list[i]->sb))
+			w++;
+		if (w > max)
+			max = w;
+	}
+
+	max += 2;
+	if ((cols = term_width / max) == 0)
+		cols = 1;
+	rows = (cnt + cols - 1) / cols;
+	cols = (cnt + rows - 1) / rows;
+
+	for (size_t r = 0; r < rows; r++)
+	{
+		for (size_t c = 0; c < cols; c++)
+		{
+			size_t idx = c * rows + r;
+
+			if (idx >= cnt)
+				break;
+
+			size_t w = render_name(list[idx], w_ino);
 
+			if (c + 1 < cols && idx + rows < cnt)
+				out_pad(max - w);
+		}
+		out_char('\n');
+	}
+}
+
+static void render(entry_t **list, const size_t cnt)
+{
+	if( opt_show_long ) {
+		render_long(list, cnt);
+	} else if( opt_multi_text_col ) {
+		render_columns(list, cnt);
 	} else {
-		printf("%s", basename(name));
-		// TODO opt_append_slash[_dirs]
+		size_t w_ino = list_ino_width(list, cnt);
+
+		for (size_t i = 0; i < cnt; i++)
+		{
+			list[i]->width = strlen(list[i]->name);
+			render_name(list[i], w_ino);
+			out_char('\n');
+		}
 	}
-	
-	if( opt_show_one || opt_show_long )
-		printf("\n");
-	else
-		printf(" ");
+}
+
+static int do_one_file(const char *path)
+{
+	entry_t e, *list = &e;
+
+	memset(&e, 0, sizeof(e));
+	if (entry_stat(AT_FDCWD, path, opt_show_long ? AT_SYMLINK_NOFOLLOW : 0, &e.sb) == -1) {
+		warn("cannot access %s", path);
+		return 1;
+	}
+
+	e.name = (char *)path;
+	render(&list, 1);
 
 	return 0;
 }
 
+/* read, stat and sort a directory; returns non-zero if any of it failed */
+static int dir_load(const int dfd, const char *path, dir_t *dir)
+{
+	int failure = 0;
+
+	memset(dir, 0, sizeof(dir_t));
+
+	if( dir_read(dfd, dir) == -1 ) {
+		warn("cannot read %s", path);
+		failure = 1;
+	}
+
+	if( dir_stat(dfd, dir) )
+		failure = 1;
+
+	if( dir_list(dir) == -1 || dir_sort(dir) == -1 ) {
+		warn("%s", path);
+		dir->list_cnt = 0;
+		failure = 1;
+	}
+
+	return failure;
+}
+
+static bool listed_any = false;
+
+static void dir_render(const char *path, dir_t *dir)
+{
+	if( opt_multi_header )
+		out_printf("%s%s:\n", listed_any ? "\n" : "", path);
+	listed_any = true;
+
+	if( opt_show_long ) {
+		unsigned long long blocks = 0;
+
+		for (size_t i = 0; i < dir->list_cnt; i++)
+			blocks += dir->list[i]->sb.st_blocks;
+		out_printf("total %llu\n", blocks / 2);
+	}
+
+	render(dir->list, dir->list_cnt);
+}
+
+static bool is_subdir(const entry_t *e)
+{
+	return S_ISDIR(e->sb.st_mode) && strcmp(e->name, ".") && strcmp(e->name, "..");
+}
+
+/*
+ * ls -R -j jobs: worker threads read and stat directories ahead of the
+ * output, while the main thread prints them in the order a serial walk
+ * would. Loaded directories wait in a tree; workers take pending ones
+ * from a stack, so the next to load is the next the output will reach.
+ * No more than TREE_AHEAD of them are held unprinted, unless the printer
+ * is itself waiting.
+ */
+#define	TREE_AHEAD	1024
+
+/* for tree_t */
+#define	T_PENDING	0
+#define	T_LOADING	1
+#define	T_DONE		2
+
+typedef struct tree {
+	char			 *path;
+	int				  state;
+	int				  failure;
+	bool			  opened;
+	dir_t			  dir;
+	struct tree		**children;
+	size_t			  nchildren;
+} tree_t;
+
+static int opt_jobs = 1;
+
+static pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tree_cond = PTHREAD_COND_INITIALIZER;
+static tree_t **tree_stack = NULL;
+static size_t tree_stack_cnt = 0;
+static size_t tree_stack_size = 0;
+static size_t tree_ahead = 0;
+static bool tree_waiting = false;
+static bool tree_quit = false;
+
+/* called with tree_lock held */
+static bool tree_push(tree_t *n)
+{
+	if (tree_stack_cnt == tree_stack_size) {
+		tree_t **tmp = realloc(tree_stack, sizeof(tree_t *) *
+				(tree_stack_size = tree_stack_size ? tree_stack_size * 2 : 256));
+		if (tmp == NULL)
+			return false;
+		tree_stack = tmp;
+	}
+
+	tree_stack[tree_stack_cnt++] = n;
+	return true;
+}
+
+/* the subdirectories of a loaded n become pending nodes */
+static void tree_children(tree_t *n)
+{
+	size_t cnt = 0;
+
+	for (size_t i = 0; i < n->dir.list_cnt; i++)
+		if (is_subdir(n->dir.list[i]))
+			cnt++;
+
+	if (cnt && (n->children = calloc(cnt, sizeof(tree_t *))) == NULL) {
+		warn("%s", n->path);
+		n->failure = 1;
+		return;
+	}
+
+	for (size_t i = 0; i < n->dir.list_cnt; i++)
+	{
+		entry_t *e = n->dir.list[i];
+		tree_t *c;
+
+		if (!is_subdir(e))
+			continue;
+
+		if ((c = calloc(1, sizeof(tree_t))) == NULL ||
+				asprintf(&c->path, "%s/%s", n->path, e->name) == -1) {
+			warn("%s", e->name);
+			free(c);
+			n->failure = 1;
+			continue;
+		}
+		n->children[n->nchildren++] = c;
+	}
+
+	pthread_mutex_lock(&tree_lock);
+	/* last child pushed first, so the first is popped next */
+	for (size_t i = n->nchildren; i-- > 0; )
+		if (!tree_push(n->children[i])) {
+			warnx("%s: out of memory", n->path);
+			n->failure = 1;
+			n->nchildren = i;
+			break;
+		}
+	n->state = T_DONE;
+	pthread_cond_broadcast(&tree_cond);
+	pthread_mutex_unlock(&tree_lock);
+}
+
+static void tree_load(tree_t *n)
+{
+	int dfd;
+
+	if( (dfd = open(n->path, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1 ) {
+		warn("cannot access %s", n->path);
+		n->failure = 1;
+	} else {
+		n->opened = true;
+		n->failure = dir_load(dfd, n->path, &n->dir);
+		close(dfd);
+	}
+
+	tree_children(n);
+}
+
+static void *tree_worker(void *arg)
+{
+	pthread_mutex_lock(&tree_lock);
+	while (1)
+	{
+		while (!tree_quit && (tree_stack_cnt == 0 || (tree_ahead >= TREE_AHEAD && !tree_waiting)))
+			pthread_cond_wait(&tree_cond, &tree_lock);
+		if (tree_quit)
+			break;
+
+		tree_t *n = tree_stack[--tree_stack_cnt];
+
+		n->state = T_LOADING;
+		tree_ahead++;
+		pthread_mutex_unlock(&tree_lock);
+		tree_load(n);
+		pthread_mutex_lock(&tree_lock);
+	}
+	pthread_mutex_unlock(&tree_lock);
+
+	return NULL;
+}
+
+/* print n once it is loaded, then its subdirectories in order */
+static int tree_walk(tree_t *n)
+{
+	int failure;
+
+	pthread_mutex_lock(&tree_lock);
+	while (n->state != T_DONE) {
+		tree_waiting = true;
+		pthread_cond_broadcast(&tree_cond);
+		pthread_cond_wait(&tree_cond, &tree_lock);
+	}
+	tree_waiting = false;
+	pthread_mutex_unlock(&tree_lock);
+
+	failure = n->failure;
+	if (n->opened)
+		dir_render(n->path, &n->dir);
+	dir_free(&n->dir);
+
+	pthread_mutex_lock(&tree_lock);
+	tree_ahead--;
+	pthread_cond_broadcast(&tree_cond);
+	pthread_mutex_unlock(&tree_lock);
+
+	for (size_t i = 0; i < n->nchildren; i++)
+	{
+		if (tree_walk(n->children[i]))
+			failure = 1;
+		free(n->children[i]->path);
+		free(n->children[i]);
+	}
+	free(n->children);
+
+	return failure;
+}
+
+static int do_tree(const char *path, const int dfd)
+{
+	pthread_t *workers;
+	tree_t root;
+	int failure, nworkers = 0;
+
+	memset(&root, 0, sizeof(root));
+	root.path = (char *)path;
+	root.opened = true;
+	root.failure = dir_load(dfd, path, &root.dir);
+	close(dfd);
+
+	tree_quit = false;
+	tree_ahead = 1;
+
+	if ((workers = calloc(opt_jobs, sizeof(pthread_t))) == NULL)
+		err(EXIT_FAILURE, "calloc");
+
+	for (int i = 0; i < opt_jobs; i++)
+	{
+		if ((errno = pthread_create(&workers[i], NULL, tree_worker, NULL))) {
+			warn("pthread_create");
+			break;
+		}
+		nworkers++;
+	}
+
+	if (nworkers == 0)
+		errx(EXIT_FAILURE, "no worker threads");
+
+	tree_children(&root);
+	failure = tree_walk(&root);
+
+	pthread_mutex_lock(&tree_lock);
+	tree_quit = true;
+	pthread_cond_broadcast(&tree_cond);
+	pthread_mutex_unlock(&tree_lock);
+
+	for (int i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+
+	free(tree_stack);
+	tree_stack = NULL;
+	tree_stack_cnt = tree_stack_size = 0;
+
+	return failure;
+}
+
 static int do_one_path(const char *tpath)
 {
 	int failure = 0;
 	char *path = strdup(tpath);
 	int pathlen = strlen(path);
-	char *name;
+	dir_t dir;
+	int dfd;
 
-	if( path[pathlen-1] == '/' ) {
+	if( pathlen > 1 && path[pathlen-1] == '/' ) {
 		path[pathlen-1] = '\0';
 		pathlen--;
 	}
 
-	DIR *dir = opendir(path);
-	struct dirent *ent = NULL;
+	if( opt_dirs_are_files ) {
+		failure = do_one_file(path);
+		free(path);
+		return failure;
+	}
 
-	if( dir == NULL ) {
+	if( (dfd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1 ) {
 		if (errno == ENOTDIR) {
-			name = path;
-			goto do_one_file;
+			failure = do_one_file(path);
+			free(path);
+			return failure;
 		}
-		errx(EXIT_FAILURE, "cannot access %s: %s [%d]", path, strerror(errno), errno);
+		warn("cannot access %s", path);
 		free(path);
-		return errno;
+		return 1;
 	}
 
-	if( opt_multi_header )
-		printf("\n%s:\n", path);
-	printf("total %u\n", 0);
-
-	do {
-		errno = 0;
-		ent = readdir(dir);
-		
-		if(ent == NULL && errno == 0) {
-			continue;
-		} else if(ent == NULL) {
-			warn("cannot read entry");
-			failure = 1;
-			continue;
-		} else if(ent->d_name[0] == '\0') {
-			continue;
-		} else {
-			if (!opt_show_all && ent->d_name[0] == '.')
+	if( opt_recurse && opt_jobs > 1 ) {
+		failure = do_tree(path, dfd);
+		free(path);
+		return failure;
+	}
+
+	failure = dir_load(dfd, path, &dir);
+	close(dfd);
+
+	dir_render(path, &dir);
+
+	/* subdirectories follow the whole listing of their parent */
+	if( opt_recurse ) {
+		for (size_t i = 0; i < dir.list_cnt; i++)
+		{
+			entry_t *e = dir.list[i];
+			char *name;
+
+			if( !is_subdir(e) )
 				continue;
-			struct stat buf, lbuf;
-			int namelen = pathlen + 1 + strlen(ent->d_name) + 1;
-			if ((name = calloc(1, namelen)) == NULL) {
-				warn("calloc: %s", ent->d_name);
+
+			if( asprintf(&name, "%s/%s", path, e->name) == -1 ) {
+				warn("%s", e->name);
 				failure = 1;
-			} else {
-				snprintf(name, namelen, "%s/%s", path, ent->d_name);
-do_one_file:
-				if (stat(name, &buf) == -1) {
-					warn("stat: %s", name);
-					failure = 1;
-				} else if (lstat(name, &lbuf) == -1) {
-					warn("%s", name);
-					failure = 1;
-				} else {
-					if( print_single_entry(name, &buf, &lbuf) )
-						failure = 1;
-					if (opt_recurse && S_ISDIR(buf.st_mode)) {
-						do_one_path(name);
-					}
-				}
+				continue;
 			}
-			if( name != NULL && name != path) 
-				free(name);
+			if( do_one_path(name) )
+				failure = 1;
+			free(name);
 		}
+	}
 
-		fflush(stdout);
-	} while(ent != NULL);
-
-	if(dir != NULL) 
-		closedir(dir);
-	if(path != NULL) 
-		free(path);
+	dir_free(&dir);
+	free(path);
 
-	if( !opt_show_one && !opt_show_long )
-		printf("\n");
 	return failure;
 }
 
 
 int main(int argc, char *argv[])
 {
-	if( !isatty(STDOUT_FILENO) )
-		opt_show_one = 1;
+	const char *lc;
+
+	setlocale(LC_ALL, "");
+	if ((lc = setlocale(LC_COLLATE, NULL)) != NULL)
+		collate_c = !strcmp(lc, "C") || !strcmp(lc, "POSIX");
 
 	int opt;
-	while( (opt = getopt(argc, argv, "CFRacdinplqrtu1")) != -1 )
+	while( (opt = getopt(argc, argv, "CFRSacdij:nplqrtu1")) != -1 )
 	{
 		switch( opt ) {
 			case 'C':
 				opt_multi_text_col = 1;
+				opt_show_one = 0;
+				break;
+			case 'S':
+				opt_sort_size = 1;
 				break;
 			case 'p':
 				opt_append_slash_dirs = 1;
@@ -250,14 +1151,21 @@ int main(int argc, char *argv[])
 			case 'i':
 				opt_show_file_serial = 1;
 				break;
+			case 'j':
+				if( (opt_jobs = atoi(optarg)) < 1 ) {
+					warnx("invalid number of jobs: %s", optarg);
+					show_usage();
+				}
+				break;
 			case 'n':
 				opt_supress_names = 1;
 				// fall through
 			case 'l':
 				opt_show_long = 1;
-				// fall through
+				break;
 			case '1':
 				opt_show_one = 1;
+				opt_multi_text_col = 0;
 				break;
 			case 'q':
 				opt_hide_non_print = 1;
@@ -277,19 +1185,46 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if( (opt_multi_text_col + opt_show_one > 1)
-			|| (opt_multi_text_col + opt_show_long > 1) 
-			|| (opt_sort_status_lastmod + opt_sort_lastacc > 1) ) {
+	if( opt_sort_status_lastmod + opt_sort_lastacc > 1 ) {
 		warnx("Conflicting options\n");
 		show_usage();
 	}
 
-	if( optind >= argc )
-		exit(do_one_path("."));
+	/* columns by default on a terminal, one per line otherwise */
+	if( !opt_show_long && !opt_show_one && !opt_multi_text_col && isatty(STDOUT_FILENO) )
+		opt_multi_text_col = 1;
+
+	if( opt_multi_text_col ) {
+		struct winsize ws;
+		const char *cols = getenv("COLUMNS");
+
+		if( cols && atoi(cols) > 0 )
+			term_width = atoi(cols);
+		else if( ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 )
+			term_width = ws.ws_col;
+	}
+
+	/* what has to be stat'd beyond what getdents64() returns */
+	if( opt_show_long )
+		stat_need |= NEED_TYPE|NEED_MODE|NEED_LINKS|NEED_OWNER|NEED_SIZE|NEED_TIME;
+	if( opt_sort_lastmod )
+		stat_need |= NEED_TIME;
+	if( opt_sort_size )
+		stat_need |= NEED_SIZE;
+	if( opt_append_slash )
+		stat_need |= NEED_TYPE|NEED_MODE;
+	if( opt_append_slash_dirs || opt_recurse )
+		stat_need |= NEED_TYPE;
+
+	now = time(NULL);
+	atexit(out_flush);
 
 	if( (argc - optind > 1) || opt_recurse )
 		opt_multi_header = 1;
 
+	if( optind >= argc )
+		exit(do_one_path("."));
+
 	int failure = EXIT_SUCCESS;
 	for( int i = optind; i<argc; i++ ) {
 		if( do_one_path(argv[i]) )
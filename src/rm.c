@@ -1,4 +1,4 @@
-#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,44 +6,28 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <unistd.h>
+#include <sys/resource.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <dirent.h>
+#include <pthread.h>
+
+#include "walk.h"
 
 static void show_usage()
 {
-	fprintf(stderr, "Usage: rm [-fiRr] file...\n");
+	fprintf(stderr, "Usage: rm [-fiRr] [-j jobs] file...\n");
 	exit(EXIT_FAILURE);
 }
 
 static int opt_force = 0;
 static int opt_interactive = 0;
 static int opt_recursive = 0;
-
-static int perform_rm(const char *name, mode_t mode) 
-{
-	if (S_ISDIR(mode)) {
-		printf("rmdir(%s)\n", name);
-		/*
-		if (rmdir(name)) {
-			warn("rmdir <%s>:", name);
-			return 1;
-		}
-		*/
-	} else {
-		printf("unlink(%s)\n", name);
-		/*
-		if (unlink(name)) {
-			warn("unlink <%s>:", name);
-			return 1;
-		}
-		*/
-	}
-
-	return 0;
-}
+static int opt_jobs = 1;
 
 static bool is_ok(const char *name)
 {
@@ -65,78 +49,399 @@ static bool is_ok(const char *name)
 	return false;
 }
 
-static int do_rm(const char *name)
+/*
+ * Trees are removed relative to directory fds: each directory is opened
+ * with openat() from its parent and its entries go with unlinkat(), so
+ * no path is ever resolved from the top and there is no length limit.
+ * d_type says which entries are directories; only a filesystem that does
+ * not fill it in costs a stat. The path is kept only for messages, and
+ * wdir_t keeps the fds held bounded however deep the tree.
+ */
+/* -i, or a write protected file with a terminal to ask on */
+static bool may_remove(const int dfd, const char *name, const char *path, const bool is_link)
 {
-	if (!strcmp(".", name) || !strcmp("..", name)) {
-		warnx("refusing to remove <%s>", name);
+	if (opt_force)
+		return true;
+	if (opt_interactive)
+		return is_ok(path);
+	if (!is_link && isatty(STDIN_FILENO) && faccessat(dfd, name, W_OK, 0))
+		return is_ok(path);
+	return true;
+}
+
+static int rm_unlink(const int dfd, const char *name, const char *path)
+{
+	if (unlinkat(dfd, name, 0) == -1) {
+		warn("%s", path);
 		return 1;
 	}
+	return 0;
+}
+
+/* DT_* of an entry, from d_type or, failing that, fstatat() */
+static int entry_type(const int dfd, const char *name, const unsigned char type)
+{
+	if (type != DT_UNKNOWN)
+		return type;
 
-    int rc = 0;
 	struct stat sb;
 
-	if ( (stat(name, &sb) == -1) && (errno == ENOENT) ) {
-		if (opt_force == 0)
-			warnx("file does not exist: %s", name);
+	if (fstatat(dfd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+		return -1;
+
+	return S_ISDIR(sb.st_mode) ? DT_DIR : S_ISLNK(sb.st_mode) ? DT_LNK : DT_REG;
+}
+
+typedef struct rm_task rm_task_t;
+
+static int rm_tree(wdir_t *up, const char *name, path_t *path);
+static bool rm_spawn(rm_task_t *parent, const char *name, const char *path);
+
+/*
+ * Remove everything in dir. Subdirectories are handed to the pool when
+ * there is a task to hang them off and room for their fds, and otherwise
+ * removed here.
+ */
+static int rm_entries(wdir_t *dir, path_t *path, rm_task_t *task)
+{
+	unsigned char d_type;
+	const char *name;
+	int failure = 0;
+
+	while ((name = wdir_read(dir, &d_type)) != NULL)
+	{
+		const int type = entry_type(dir->fd, name, d_type);
+		const size_t mark = path_push(path, name);
+
+		if (type == -1) {
+			warn("%s", path->buf);
+			failure = 1;
+		} else if (type == DT_DIR) {
+			if (opt_interactive && !is_ok(path->buf))
+				failure = 1;
+			else if (!(task && rm_spawn(task, name, path->buf)))
+				failure |= rm_tree(dir, name, path);
+		} else if (!may_remove(dir->fd, name, path->buf, type == DT_LNK) ||
+				rm_unlink(dir->fd, name, path->buf))
+			failure = 1;
+
+		path_pop(path, mark);
+
+		/* lost on the way back up */
+		if (dir->fd == -1)
+			return 1;
+	}
+
+	if (errno) {
+		warn("%s", path->buf);
 		return 1;
 	}
 
-	if (!S_ISDIR(sb.st_mode)) {
-do_dir:
-		if (!opt_force && ((access(name, W_OK) && isatty(STDIN_FILENO))
-					|| opt_interactive)) {
-			if (is_ok(name))
-				return rc + perform_rm(name, sb.st_mode);
-		} else {
-			return rc + perform_rm(name, sb.st_mode);
-		}
-	} else {
-		if (!opt_recursive) {
-			warnx("%s is a directory", name);
+	return failure;
+}
+
+static int rm_tree(wdir_t *up, const char *name, path_t *path)
+{
+	wdir_t dir;
+	int failure;
+
+	for (int pass = 0; ; pass++)
+	{
+		if (!wdir_open(&dir, up->fd, name, false)) {
+			warn("%s", path->buf);
 			return 1;
 		}
 
-		DIR *dir;
+		wdir_leave(up, dir.fd);
+		failure = rm_entries(&dir, path, NULL);
+		if (!wdir_back(up, dir.fd)) {
+			warn("%s/..", path->buf);
+			failure = 1;
+		}
+		wdir_close(&dir);
+
+		if (failure)
+			return failure;
+		if (unlinkat(up->fd, name, AT_REMOVEDIR) == 0)
+			return 0;
 
-		if ((dir = opendir(name)) == NULL) {
-			warn("opendir: %s", name);
+		/* some filesystems skip entries when the directory shrinks under readdir() */
+		if (errno != ENOTEMPTY || pass == 2) {
+			warn("rmdir %s", path->buf);
 			return 1;
 		}
+	}
+}
 
-		const struct dirent *dirp;
+/*
+ * rm -r -j jobs: subdirectories become tasks for a pool of threads. A
+ * task keeps its directory open until the last of its children is done,
+ * so they can be opened relative to it; whoever finishes last removes
+ * the directory and lets go of the parent in turn. Once too many fds are
+ * held, subdirectories are removed in place instead of queued.
+ */
+struct rm_task {
+	rm_task_t	*parent;
+	char		*name;			/* relative to the parent's fd */
+	char		*path;			/* for messages */
+	wdir_t		 dir;			/* kept open: the children use its fd */
+	atomic_int	 refs;			/* the scan itself, and each child not yet done */
+	atomic_int	 failure;
+};
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static rm_task_t **queue = NULL;
+static size_t queue_cnt = 0;
+static size_t queue_size = 0;
+static bool queue_done = false;
+static int tree_failure = 0;
+
+static atomic_int fds_held;
+static int fds_budget = 512;
+
+/* with queue_lock held */
+static bool queue_push(rm_task_t *t)
+{
+	if (queue_cnt == queue_size) {
+		const size_t size = queue_size ? queue_size * 2 : 64;
+		rm_task_t **tmp = realloc(queue, sizeof(rm_task_t *) * size);
+		if (tmp == NULL)
+			return false;
+		queue = tmp;
+		queue_size = size;
+	}
 
-		char buf[BUFSIZ];
+	queue[queue_cnt++] = t;
+	return true;
+}
 
-		while(1)
-		{
-			if ((dirp = readdir(dir)) == NULL)
-				break;
+static rm_task_t *rm_task(rm_task_t *parent, const char *name, const char *path)
+{
+	rm_task_t *t;
+
+	if ((t = calloc(1, sizeof(rm_task_t))) == NULL ||
+			(t->name = strdup(name)) == NULL ||
+			(t->path = strdup(path)) == NULL) {
+		if (t) {
+			free(t->name);
+			free(t);
+		}
+		return NULL;
+	}
 
-			if (!strcmp(".", dirp->d_name) || !strcmp("..", dirp->d_name))
-				continue;
-			
-			if ((size_t)snprintf(buf, 0, "%s/%s", name, dirp->d_name) > sizeof(buf)) {
-				rc++;
-				break;
+	t->parent = parent;
+	t->dir.fd = -1;
+	t->refs = 1;
+
+	return t;
+}
+
+static bool rm_spawn(rm_task_t *parent, const char *name, const char *path)
+{
+	rm_task_t *t;
+
+	if (fds_held >= fds_budget || (t = rm_task(parent, name, path)) == NULL)
+		return false;
+
+	pthread_mutex_lock(&queue_lock);
+	if (!queue_push(t)) {
+		pthread_mutex_unlock(&queue_lock);
+		free(t->path);
+		free(t->name);
+		free(t);
+		return false;
+	}
+	parent->refs++;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+
+	return true;
+}
+
+/* the scan or a child of t is done; the last one out removes t */
+static void rm_release(rm_task_t *t)
+{
+	while (t && --t->refs == 0)
+	{
+		rm_task_t *parent = t->parent;
+		wdir_t up = { .fd = parent ? parent->dir.fd : AT_FDCWD, .keep = true };
+
+		if (t->dir.fd != -1) {
+			wdir_close(&t->dir);
+			fds_held--;
+		}
+
+		if (!t->failure && unlinkat(up.fd, t->name, AT_REMOVEDIR) == -1) {
+			if (errno == ENOTEMPTY) {
+				path_t path;
+
+				memset(&path, 0, sizeof(path));
+				path_push(&path, t->path);
+				t->failure = rm_tree(&up, t->name, &path);
+				free(path.buf);
+			} else {
+				warn("rmdir %s", t->path);
+				t->failure = 1;
 			}
+		}
+
+		if (parent) {
+			if (t->failure)
+				parent->failure = 1;
+		} else {
+			pthread_mutex_lock(&queue_lock);
+			tree_failure = t->failure;
+			queue_done = true;
+			pthread_cond_broadcast(&queue_cond);
+			pthread_mutex_unlock(&queue_lock);
+		}
+
+		free(t->name);
+		free(t->path);
+		free(t);
+		t = parent;
+	}
+}
+
+static void rm_run(rm_task_t *t)
+{
+	const int pdfd = t->parent ? t->parent->dir.fd : AT_FDCWD;
+	path_t path;
+
+	if (!wdir_open(&t->dir, pdfd, t->name, false)) {
+		warn("%s", t->path);
+		t->failure = 1;
+	} else {
+		t->dir.keep = true;
+		fds_held++;
+		memset(&path, 0, sizeof(path));
+		path_push(&path, t->path);
+		if (rm_entries(&t->dir, &path, t))
+			t->failure = 1;
+		free(path.buf);
+	}
+
+	rm_release(t);
+}
+
+static void *rm_worker(void *arg)
+{
+	rm_task_t *t;
+
+	pthread_mutex_lock(&queue_lock);
+	while (1)
+	{
+		while (!queue_done && queue_cnt == 0)
+			pthread_cond_wait(&queue_cond, &queue_lock);
+		if (queue_done)
+			break;
+
+		t = queue[--queue_cnt];
+		pthread_mutex_unlock(&queue_lock);
+		rm_run(t);
+		pthread_mutex_lock(&queue_lock);
+	}
+	pthread_mutex_unlock(&queue_lock);
+
+	return NULL;
+}
+
+static int rm_parallel(const char *name)
+{
+	pthread_t *threads;
+	rm_task_t *root;
+	struct rlimit rl;
+	int nthreads = 0;
+
+	/* keep half the fds free for the threads' own use */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+		fds_budget = rl.rlim_cur < INT_MAX ? rl.rlim_cur / 2 : INT_MAX / 2;
 
-			snprintf(buf, sizeof(buf), "%s/%s", name, dirp->d_name);
+	if ((root = rm_task(NULL, name, name)) == NULL ||
+			(threads = calloc(opt_jobs, sizeof(pthread_t))) == NULL)
+		err(EXIT_FAILURE, "calloc");
 
-			do_rm(buf);
+	queue_done = false;
+	queue_cnt = 0;
+	if (!queue_push(root))
+		err(EXIT_FAILURE, "realloc");
+
+	for (int i = 0; i < opt_jobs; i++)
+	{
+		if ((errno = pthread_create(&threads[i], NULL, rm_worker, NULL))) {
+			warn("pthread_create");
+			break;
 		}
+		nthreads++;
+	}
+
+	if (nthreads == 0)
+		errx(EXIT_FAILURE, "no worker threads");
 
-		closedir(dir);
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	return tree_failure;
+}
+
+static int do_rm(const char *name)
+{
+	const char *base = strrchr(name, '/');
 
-        goto do_dir;
+	base = base && base[1] ? base + 1 : name;
+	if (!strcmp(".", base) || !strcmp("..", base)) {
+		warnx("refusing to remove <%s>", name);
+		return 1;
 	}
 
-	return 0;
+	struct stat sb;
+
+	if (lstat(name, &sb) == -1) {
+		if (errno == ENOENT && opt_force)
+			return 0;
+		if (errno == ENOENT)
+			warnx("file does not exist: %s", name);
+		else
+			warn("%s", name);
+		return 1;
+	}
+
+	if (!S_ISDIR(sb.st_mode)) {
+		if (!may_remove(AT_FDCWD, name, name, S_ISLNK(sb.st_mode)))
+			return 1;
+		return rm_unlink(AT_FDCWD, name, name);
+	}
+
+	if (!opt_recursive) {
+		warnx("%s is a directory", name);
+		return 1;
+	}
+
+	if (opt_interactive && !is_ok(name))
+		return 1;
+
+	/* prompts cannot come from several threads at once */
+	if (opt_jobs > 1 && !opt_interactive && (opt_force || !isatty(STDIN_FILENO)))
+		return rm_parallel(name);
+
+	wdir_t top = { .fd = AT_FDCWD, .keep = true };
+	path_t path;
+	int rc;
+
+	memset(&path, 0, sizeof(path));
+	path_push(&path, name);
+	rc = rm_tree(&top, name, &path);
+	free(path.buf);
+
+	return rc;
 }
 
 int main(int argc, char *argv[])
 {
-	char opt;
-	while ((opt = getopt(argc, argv, "fiRr")) != -1)
+	int opt;
+	while ((opt = getopt(argc, argv, "fiRrj:")) != -1)
 	{
 		switch (opt)
 		{
@@ -155,12 +460,21 @@ int main(int argc, char *argv[])
 				opt_recursive = 1;
 				break;
 
+			case 'j':
+				if ((opt_jobs = atoi(optarg)) < 1) {
+					warnx("invalid number of jobs: %s", optarg);
+					show_usage();
+				}
+				break;
+
 			default:
 				show_usage();
 		}
 	}
 
 	if ( (optind >= argc) || (argc - optind < 1) ) {
+		if (opt_force)
+			exit(EXIT_SUCCESS);
 		warnx("At least one file required.");
 		show_usage();
 	}
@@ -1,4 +1,5 @@
 #define _XOPEN_SOURCE 700
+#define _GNU_SOURCE	/* d_type, memfd_create(), F_GETPIPE_SZ */
 //#define NDEBUG
 
 #include <stdlib.h>
@@ -11,12 +12,24 @@
 //#include <regex.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <libgen.h>
 #include <termios.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdint.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pwd.h>
 
 #include "sh.h"
+#include "builtin.h"
 #include "sh.y.tab.h"
 #include "sh.grammar.yy.h"
 
@@ -26,6 +39,12 @@
 #define QUOTE_SPECIAL	(1<<1)
 #define QUOTE_DOUBLE	(1<<2)
 
+#define INPUT_BLOCK		(64 * 1024)
+
+/* for run_command() */
+#define RUN_FUNCTIONS	(1<<0)
+#define RUN_EXEC		(1<<1)
+
 /* types, structures & unions */
 typedef int (*builtin_t)(int, char *[]);
 
@@ -34,13 +53,35 @@ struct builtin {
 	const builtin_t func;
 	const int special;
 	const int fork;
+	const int pure;		/* no effect on the shell environment */
 };
 
+/* growable buffer with an append cursor */
+typedef struct {
+	char	*buf;
+	size_t	 len;
+	size_t	 size;
+} strbuf_t;
+
+/* NULL terminated list of strings, such as the fields of expanded words */
+typedef struct {
+	char	**list;
+	int		  cnt;
+	int		  size;
+} strlist_t;
+
 typedef struct {
 	const char  *str;
 	const int    tok;
 } map_t;
 
+typedef struct {
+	char			*file;			/* cache entry for this script */
+	char			*source;		/* canonical path of the script */
+	struct timespec	 mtime;
+	off_t			 size;
+} cache_t;
+
 static const map_t lookup[] = {
     {"&&",      AND_IF},
     {"||",      OR_IF},
@@ -52,6 +93,7 @@ static const map_t lookup[] = {
     {"<&",      LESSAND},
     {">&",      GREATAND},
     {"<>",      LESSGREAT},
+    {"time",    Time},
     {"<",       '<'},
     {">",       '>'},
 
@@ -95,22 +137,48 @@ static int cmd_read(int, char *[]);
 static int cmd_set(int, char *[]);
 static int cmd_pwd(/*int, char *[]*/);
 static int cmd_exit(int, char *[]);
+static int cmd_true(int, char *[]);
+static int cmd_false(int, char *[]);
+static int cmd_command(int, char *[]);
+static int cmd_printf(int, char *[]);
+static int cmd_jobs(int, char *[]);
+static int cmd_wait(int, char *[]);
+static int cmd_fg(int, char *[]);
+static int cmd_bg(int, char *[]);
+static int cmd_times(int, char *[]);
+static int run_command(const int, char *[], const int, const int);
 static bool get_next_parser_string(int);
+static void redirect_child(void);
+static void cache_save(const cache_t *, const node *);
+static void jobs_reset(void);
 
 /* constants */
 
 static const struct builtin builtins[] = {
 
-	{"basename",	cmd_basename,	0, 1},
-	{"cd",			cmd_cd,			0, 0},
-	{"exec",		cmd_exec,		1, 0},
-	{"exit",		cmd_exit,		1, 0},
-	{"pwd",			cmd_pwd,		0, 1},
-	{"umask",		cmd_umask,		0, 0},
-	{"read",		cmd_read,		0, 0},
-	{"set",			cmd_set,		0, 1},
-
-	{NULL, NULL, 0, 0}
+	{":",			cmd_true,		1, 0, 1},
+	{"[",			test_main,		0, 0, 1},
+	{"basename",	cmd_basename,	0, 1, 0},
+	{"bg",			cmd_bg,			0, 0, 0},
+	{"cd",			cmd_cd,			0, 0, 0},
+	{"command",		cmd_command,	0, 0, 0},
+	{"echo",		echo_main,		0, 0, 1},
+	{"exec",		cmd_exec,		1, 0, 0},
+	{"exit",		cmd_exit,		1, 0, 0},
+	{"false",		cmd_false,		0, 0, 1},
+	{"fg",			cmd_fg,			0, 0, 0},
+	{"jobs",		cmd_jobs,		0, 0, 0},
+	{"printf",		cmd_printf,		0, 0, 1},
+	{"pwd",			cmd_pwd,		0, 1, 0},
+	{"umask",		cmd_umask,		0, 0, 0},
+	{"read",		cmd_read,		0, 0, 0},
+	{"set",			cmd_set,		0, 0, 0},
+	{"test",		test_main,		0, 0, 1},
+	{"times",		cmd_times,		1, 0, 0},
+	{"true",		cmd_true,		0, 0, 1},
+	{"wait",		cmd_wait,		0, 0, 0},
+
+	{NULL, NULL, 0, 0, 0}
 };
 
 #if 0
@@ -136,8 +204,6 @@ static char *left			= NULL;
 static int yyline			= 0;
 static int yyrow			= 0;
 
-static char *here_doc_word		= NULL;
-static char *here_doc_remaining = NULL;
 #if 0
 static char *here_doc_delim		= NULL;
 static char *free_me			= NULL;
@@ -156,6 +222,16 @@ static int	in_if				= 0;
 
 shenv_t *cur_sh_env = NULL;
 static char *parser_string = NULL;
+static bool exec_in_place = false;		/* the next simple command can replace this child */
+
+/* compiled script cache */
+#define CACHE_MAGIC		"FSHC"
+#define CACHE_VERSION	1
+#define CACHE_NULL		UINT32_MAX
+
+static char *opt_cache_dir = NULL;
+static int opt_profile = 0;				/* report time spent in each function at exit */
+static int opt_command = 0;				/* -c: the first operand is the script */
 
 /* enviromental ones */
 static int opt_allexport = 0;
@@ -175,6 +251,8 @@ static int opt_xtrace = 0;
 
 extern YYSTYPE yylval;
 extern char **environ;
+extern int yyparse(void *);
+extern int yydebug;
 
 
 /* local function defintions */
@@ -214,6 +292,38 @@ static char **push(char ***list, char *ptr)
 	return *list;
 }
 
+/* make room for at least need more bytes and a terminating NUL */
+static bool strbuf_grow(strbuf_t *sbuf, const size_t need)
+{
+	if (sbuf->len + need + 1 <= sbuf->size)
+		return true;
+
+	size_t size = sbuf->size ? sbuf->size : 64;
+	while (size < sbuf->len + need + 1)
+		size *= 2;
+
+	char *tmp = realloc(sbuf->buf, size);
+	if (tmp == NULL) {
+		warn("strbuf_grow");
+		return false;
+	}
+
+	sbuf->buf = tmp;
+	sbuf->size = size;
+	return true;
+}
+
+static bool strbuf_append(strbuf_t *restrict sbuf, const char *restrict str, const size_t len)
+{
+	if (!strbuf_grow(sbuf, len))
+		return false;
+
+	memcpy(sbuf->buf + sbuf->len, str, len);
+	sbuf->len += len;
+	sbuf->buf[sbuf->len] = '\0';
+	return true;
+}
+
 /*
 static void farray(char **list)
 {
@@ -240,6 +350,64 @@ static env_t *getshenv(shenv_t *sh, char *name)
 	return ret;
 }
 
+static func_t *getfunc(shenv_t *sh, const char *name)
+{
+	if (!sh->functions)
+		return NULL;
+
+	func_t *ret = NULL;
+	for (int i = 0; (ret = sh->functions[i]); i++)
+		if (!strcmp(name, ret->name))
+			break;
+
+	return ret;
+}
+
+static node *dupNode(const node *, const bool);
+
+/* store a private copy of body, so the parse tree can be freed after the
+ * definition is evaluated and calls never have to go back to the lexer */
+static func_t *setfunc(shenv_t *restrict sh, const char *restrict name, const node *restrict body)
+{
+	int cnt = 0;
+	func_t *ret = getfunc(sh, name);
+
+	if (!ret)
+	{
+		if ((ret = calloc(1, sizeof(func_t))) == NULL)
+			return NULL;
+
+		if (sh->functions)
+			for (cnt = 0; sh->functions[cnt]; cnt++) ;
+
+		func_t **tmp = realloc(sh->functions, sizeof(func_t *) * (cnt+2));
+		if (tmp == NULL) {
+			free(ret);
+			return NULL;
+		}
+		sh->functions = tmp;
+
+		if ((ret->name = strdup(name)) == NULL) {
+			sh->functions[cnt] = NULL;
+			free(ret);
+			return NULL;
+		}
+
+		sh->functions[cnt++] = ret;
+		sh->functions[cnt] = NULL;
+	}
+
+	if (ret->body && ret->active) {
+		/* the old body is still being walked, free it once the call returns */
+		ret->body->next = ret->retired;
+		ret->retired = ret->body;
+	} else if (ret->body)
+		freeNode(ret->body, true);
+	ret->body = dupNode(body, true);
+
+	return ret;
+}
+
 static void exportenv(env_t *env)
 {
 	if (env->exported) return;
@@ -327,11 +495,6 @@ static const char *node_type(const enum node_en type)
 	return "!!UNKNOWN!!";
 }
 
-inline static int min(const int a, const int b)
-{
-	return (a < b) ? (a) : (b);
-}
-
 static const char *token(int t)
 {
 	static char tokbuf[2];
@@ -466,6 +629,51 @@ inline static int isifsspace(const char c, const char *restrict IFS)
 	return 0;
 }
 
+/*
+ * read() that never goes past a newline, so the rest of the input is
+ * left for whatever reads fd next. Seekable input is read in a block
+ * and the excess given back; pipes and terminals a byte at a time.
+ */
+static size_t read_to_newline(const int fd, char *buf, const size_t size)
+{
+	const off_t pos = lseek(fd, 0, SEEK_CUR);
+	ssize_t rc;
+	size_t len = 0;
+
+	if (pos != -1) {
+		char *nl;
+
+		while ((rc = read(fd, buf, size)) == -1 && errno == EINTR) ;
+		if (rc <= 0)
+			return 0;
+
+		if ((nl = memchr(buf, '\n', rc)) != NULL && (len = nl - buf + 1) < (size_t)rc)
+			lseek(fd, pos + len, SEEK_SET);
+		else
+			len = rc;
+	} else while (len < size) {
+		if ((rc = read(fd, buf + len, 1)) == -1 && errno == EINTR)
+			continue;
+		if (rc <= 0 || buf[len++] == '\n')
+			break;
+	}
+
+	return len;
+}
+
+/* fgets() on fd 0, leaving the rest of the input even after read's own redirection is undone */
+static char *read_line(char *buf, const int size)
+{
+	size_t len;
+
+	if (size < 2)
+		return NULL;
+
+	len = read_to_newline(STDIN_FILENO, buf, size - 1);
+	buf[len] = '\0';
+	return len ? buf : NULL;
+}
+
 static int cmd_read(int argc, char *argv[])
 {
 	int opt_raw = 0;
@@ -497,10 +705,11 @@ static int cmd_read(int argc, char *argv[])
 	char *restrict line = NULL;
 	int len = 0;
 
-	line = fgets(buf, BUFSIZ, stdin);
+	line = read_line(buf, BUFSIZ);
 
+	/* end of file, with nothing read */
 	if (line == NULL || !strlen(line) )
-		return EXIT_SUCCESS;
+		return EXIT_FAILURE;
 
 	len = strlen(line);
 
@@ -510,7 +719,7 @@ static int cmd_read(int argc, char *argv[])
 		{
 			buf[len-2] = IFS[0];
 			line = &buf[len-1];
-			line = fgets(line, BUFSIZ-len, stdin);
+			line = read_line(line, BUFSIZ-len);
 			len = strlen(buf);
 
 			if (line == NULL)
@@ -556,7 +765,7 @@ static int cmd_read(int argc, char *argv[])
 
 		if (numargs && arg < numargs-1) 
 		{
-			if (setenv(argv[optind+arg], str, 1) == -1) {
+			if (setshenv(cur_sh_env, argv[optind+arg], str) == NULL) {
 				warn(NULL);
 
 				if (str) {
@@ -598,6 +807,7 @@ static int cmd_read(int argc, char *argv[])
 				last = tmp;
 				last[oldlen] = delim;
 				last[oldlen+1] = '\0';
+				strcat(last, str);
 			} 
 			else 
 			{
@@ -624,14 +834,15 @@ static int cmd_read(int argc, char *argv[])
 	}
 
 	if (last && numargs) {
-		if (setenv(argv[numargs], last, 1) == -1) {
+		if (setshenv(cur_sh_env, argv[optind+numargs-1], last) == NULL) {
 			warn(NULL);
 		}
 		free(last);
 		last = NULL;
 	}
 
-	if (ferror(stdin) || feof(stdin))
+	/* a last line without a newline is still read, but ends the loop */
+	if (len == 0 || buf[len-1] != '\n')
 		return(EXIT_FAILURE);
 
 	return(EXIT_SUCCESS);
@@ -675,9 +886,323 @@ static int cmd_exec(__attribute__((unused)) const int ac, char *av[])
 	return EXIT_FAILURE;
 }
 
+static const struct builtin *find_builtin(const char *name)
+{
+	const struct builtin *bi;
+
+	for (size_t i = 0; (bi = &builtins[i])->name; i++)
+		if (!strcmp(name, bi->name))
+			break;
+
+	/* the terminating entry, with a NULL name, if there is no match */
+	return bi;
+}
+
+static int cmd_true(int argc, char *argv[])
+{
+	return EXIT_SUCCESS;
+}
+
+static int cmd_false(int argc, char *argv[])
+{
+	return EXIT_FAILURE;
+}
+
+/* search PATH for an executable, returns NULL if there is none */
+static const char *find_path(const char *restrict name, char *restrict buf, const size_t len)
+{
+	if (strchr(name, '/'))
+		return access(name, X_OK) ? NULL : name;
+
+	const char *path = getenv("PATH");
+
+	if (path == NULL)
+		path = "/bin:/usr/bin";
+
+	while (*path)
+	{
+		const char *end = strchr(path, ':');
+		const int dirlen = end ? end - path : (int)strlen(path);
+
+		if (snprintf(buf, len, "%.*s%s%s", dirlen, path, dirlen ? "/" : "", name) < (int)len &&
+				!access(buf, X_OK))
+			return buf;
+
+		if (!end)
+			break;
+		path = end + 1;
+	}
+
+	return NULL;
+}
+
+static int cmd_command(int argc, char *argv[])
+{
+	int opt_describe = 0;
+	int i;
+
+	/* not getopt(): options of the utility must not be permuted */
+	for (i = 1; i < argc && *argv[i] == '-' && argv[i][1]; i++)
+	{
+		if (!strcmp(argv[i], "--")) {
+			i++;
+			break;
+		}
+
+		for (const char *opt = argv[i] + 1; *opt; opt++)
+			switch (*opt)
+			{
+				case 'p':
+					break;
+				case 'v':
+					opt_describe = 'v';
+					break;
+				case 'V':
+					opt_describe = 'V';
+					break;
+				default:
+					fprintf(stderr, "Usage: command [-p] [-v|-V] command_name [argument...]\n");
+					return EXIT_FAILURE;
+			}
+	}
+
+	if (i == argc)
+		return EXIT_SUCCESS;
+
+	if (!opt_describe)
+		return run_command(argc - i, argv + i, 0, 0);
+
+	int rc = EXIT_SUCCESS;
+
+	for (; i < argc; i++)
+	{
+		const struct builtin *bi = find_builtin(argv[i]);
+		const char *path;
+		char buf[PATH_MAX];
+
+		if (getfunc(cur_sh_env, argv[i])) {
+			if (opt_describe == 'v') printf("%s\n", argv[i]);
+			else printf("%s is a function\n", argv[i]);
+		} else if (bi->name) {
+			if (opt_describe == 'v') printf("%s\n", argv[i]);
+			else printf("%s is a %sshell builtin\n", argv[i], bi->special ? "special " : "");
+		} else if ((path = find_path(argv[i], buf, sizeof(buf))) != NULL) {
+			if (opt_describe == 'v') printf("%s\n", path);
+			else printf("%s is %s\n", argv[i], path);
+		} else {
+			if (opt_describe == 'V')
+				fprintf(stderr, "%s: not found\n", argv[i]);
+			rc = EXIT_FAILURE;
+		}
+	}
+
+	return rc;
+}
+
+/* output backslash escapes as printf(1) does, returns 1 if \c was seen */
+static int printf_escape(const char **restrict src)
+{
+	const char *ptr = *src;
+	int val = 0;
+
+	switch (*ptr)
+	{
+		case 'a':  putchar('\a'); break;
+		case 'b':  putchar('\b'); break;
+		case 'f':  putchar('\f'); break;
+		case 'n':  putchar('\n'); break;
+		case 'r':  putchar('\r'); break;
+		case 't':  putchar('\t'); break;
+		case 'v':  putchar('\v'); break;
+		case '\\': putchar('\\'); break;
+		case 'c':  return 1;
+		case '0': case '1': case '2': case '3':
+		case '4': case '5': case '6': case '7':
+			for (int i = 0; i < 3 && *ptr >= '0' && *ptr <= '7'; i++, ptr++)
+				val = val * 8 + (*ptr - '0');
+			putchar(val);
+			*src = ptr;
+			return 0;
+		case '\0':
+			putchar('\\');
+			return 0;
+		default:
+			putchar('\\');
+			putchar(*ptr);
+			break;
+	}
+
+	*src = ptr + 1;
+	return 0;
+}
+
+/* a numeric argument: C syntax, or 'c for the value of c; empty is 0 */
+static bool printf_number(const char *val, long long *num)
+{
+	char *end;
+
+	*num = 0;
+	if (val == NULL || *val == '\0')
+		return true;
+	if (*val == '\'' || *val == '"') {
+		*num = (unsigned char)val[1];
+		return true;
+	}
+
+	errno = 0;
+	*num = strtoll(val, &end, 0);
+	if (errno || *end) {
+		warnx("%s: invalid number", val);
+		return false;
+	}
+
+	return true;
+}
+
+static int cmd_printf(int argc, char *argv[])
+{
+	int rc = EXIT_SUCCESS;
+	int arg = 2;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: printf format [argument...]\n");
+		return EXIT_FAILURE;
+	}
+
+	const char *fmt = argv[1];
+
+	/* the format is reused until all of the arguments are consumed */
+	do {
+		bool consumed = false;
+
+		for (const char *ptr = fmt; *ptr;)
+		{
+			if (*ptr == '\\') {
+				ptr++;
+				if (printf_escape(&ptr))
+					return rc;
+				continue;
+			} else if (*ptr != '%') {
+				putchar(*ptr++);
+				continue;
+			} else if (ptr[1] == '%') {
+				putchar('%');
+				ptr += 2;
+				continue;
+			}
+
+			/*
+			 * copy the conversion specification, minus the length modifiers,
+			 * with each * replaced by the argument it takes. room is left
+			 * for the ll, the conversion and the NUL added below.
+			 */
+			char spec[64];
+			size_t len = 0;
+
+			spec[len++] = *ptr++;
+			while (*ptr && strchr("-+ #0123456789.*", *ptr))
+			{
+				long long num = 0;
+
+				if (len + 24 > sizeof(spec) - 4) {
+					warnx("%s: conversion specification too long", fmt);
+					return EXIT_FAILURE;
+				}
+				if (*ptr++ != '*') {
+					spec[len++] = ptr[-1];
+					continue;
+				}
+
+				if (!printf_number(arg < argc ? argv[arg++] : NULL, &num))
+					rc = EXIT_FAILURE;
+				consumed = true;
+
+				/* a negative precision is as if none were given, a negative width is left-justified */
+				if (num < 0 && spec[len - 1] == '.')
+					len--;
+				else
+					len += snprintf(spec + len, sizeof(spec) - len, "%d",
+							num > INT_MAX ? INT_MAX : num < -INT_MAX ? -INT_MAX : (int)num);
+			}
+
+			const char conv = *ptr ? *ptr++ : 's';
+			const char *val = arg < argc ? argv[arg++] : NULL;
+			consumed = true;
+
+			switch (conv)
+			{
+				case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+					{
+						long long num;
+
+						if (!printf_number(val, &num))
+							rc = EXIT_FAILURE;
+
+						spec[len++] = 'l';
+						spec[len++] = 'l';
+						spec[len++] = conv;
+						spec[len] = '\0';
+						printf(spec, num);
+					}
+					break;
+				case 'a': case 'A': case 'e': case 'E':
+				case 'f': case 'F': case 'g': case 'G':
+					{
+						char *end = NULL;
+						double num = 0;
+
+						if (val && (*val == '\'' || *val == '"')) {
+							num = (unsigned char)val[1];
+						} else if (val && *val) {
+							num = strtod(val, &end);
+							if (end == val || *end) {
+								warnx("%s: invalid number", val);
+								rc = EXIT_FAILURE;
+							}
+						}
+
+						spec[len++] = conv;
+						spec[len] = '\0';
+						printf(spec, num);
+					}
+					break;
+				case 'c':
+					if (val && *val)
+						putchar(*val);
+					break;
+				case 'b':
+					for (const char *esc = val ? val : ""; *esc;)
+					{
+						if (*esc != '\\') {
+							putchar(*esc++);
+							continue;
+						}
+						esc++;
+						if (printf_escape(&esc))
+							return rc;
+					}
+					break;
+				case 's':
+					spec[len++] = 's';
+					spec[len] = '\0';
+					printf(spec, val ? val : "");
+					break;
+				default:
+					warnx("%%%c: invalid conversion", conv);
+					return EXIT_FAILURE;
+			}
+		}
+
+		if (!consumed)
+			break;
+	} while (arg < argc);
+
+	return rc;
+}
+
 static int parse_set(char mod, char opt)
 {
-	int add = mod == '+' ? 1 : 0;
+	int add = mod == '-' ? 1 : 0;
 
 	switch (opt)
 	{
@@ -768,6 +1293,14 @@ static int cmd_set(const int ac, char *av[])
 	int opt_show_vars = (ac == 1);
 	int opt_show_options = 0;
 
+	/* +x and friends turn options off, which getopt does not handle */
+	if (ac > 1 && av[1][0] == '+' && av[1][1] != 'o') {
+		for (const char *opt = av[1] + 1; *opt; opt++)
+			if (parse_set('+', *opt))
+				return EXIT_FAILURE;
+		return EXIT_SUCCESS;
+	}
+
 	{
 		int opt;
 		while ((opt = getopt(ac, av, "abCefhmnuvxo")) != -1)
@@ -912,718 +1445,4074 @@ void print_node(const node *n, int pad, int print_next)
 	}
 }
 
-static char *parseenv(const char *restrict val, int *restrict rc)
+/* CPU time of every child waited for, so time can report its children */
+static struct timeval child_utime, child_stime;
+static uint64_t shell_start;			/* for xtrace timestamps */
+static uint64_t prof_inner = 0;			/* time spent in functions called by this one */
+
+static uint64_t now_ns(void)
 {
-	const char *ptr = val;
-	const char *start = NULL;
-	char buf[BUFSIZ];
-	char *env = NULL, *ret = NULL;
-	env_t *genv = NULL;
-
-	int opt_default = 0, opt_assign_def = 0, opt_err = 0, opt_alternate = 0;
-	int opt_colon = 0;
-	int opt_length = 0;
-	int opt_rem_l_suf = 0, opt_rem_s_suf = 0;
-	int opt_rem_l_pre = 0, opt_rem_s_pre = 0;
-
-	if (*ptr == '#') { opt_length = 1; }
-	
-	start = ptr;
-	while (*ptr && (isalnum(*ptr) || *ptr == '_')) ptr++;
-	env = strndup(start, ptr - start);
-	
-	if(!strncmp(ptr, ":-", 2)) { opt_colon=1; opt_default=1; ptr+=2; }
-	else if(!strncmp(ptr, ":=", 2)) { opt_colon=1; opt_assign_def=1; ptr+=2; }
-	else if(!strncmp(ptr, ":?", 2)) { opt_colon=1; opt_err=1; ptr+=2; }
-	else if(!strncmp(ptr, ":+", 2)) { opt_colon=1; opt_alternate=1; ptr+=2; }
-	else if(!strncmp(ptr, "%%", 2)) { opt_rem_l_suf=1; ptr+=2; }
-	else if(!strncmp(ptr, "##", 2)) { opt_rem_l_pre=1; ptr+=2; }
-	else if(*ptr == '-') { opt_default=1; ptr++; }
-	else if(*ptr == '=') { opt_assign_def=1; ptr++; }
-	else if(*ptr == '?') { opt_err=1; ptr++; }
-	else if(*ptr == '+') { opt_alternate=1; ptr++; }
-	else if(*ptr == '%') { opt_rem_s_suf=1; ptr++; }
-	else if(*ptr == '#') { opt_rem_l_pre=1; ptr++; }
-
-	start = ptr;
-
-	genv = getshenv(cur_sh_env, env);
-	size_t genv_len = genv ? strlen(genv->val) : 0;
+	struct timespec ts;
 
-	if (opt_length) {
-		if (!genv) goto fail;
-		snprintf(buf, BUFSIZ, "%lu", strlen(genv->val));
-		ret = strdup(buf);
-	} else if (opt_rem_l_suf + opt_rem_l_pre + opt_rem_s_pre + opt_rem_s_suf) {
-		// TODO
-	} else if (opt_alternate) {
-		/* :+ or : */
-		if (genv && genv_len) ret = strdup(start);
-		else if(genv) {
-			/* set but null */
-			if (opt_colon) ret = strdup("");
-			else ret = strdup(start);
-		} else {
-			/* unset */
-			ret = strdup("");
-		}
-	} else if (genv && strlen(genv->val)) {
-		/* set and not null */
-		ret = strdup(genv->val);
-	} else if (opt_default) {
-		/* :- or - */
-		if (!genv || opt_colon) ret = strdup(start);
-		else ret = strdup("");
-	} else if (opt_assign_def) {
-		/* := or = */
-		if (!genv || opt_colon) {
-			setshenv(cur_sh_env, env, start);
-			ret = strdup(start);
-		} else ret = strdup("");
-	} else if (opt_err) {
-		/* :? or ? */
-		if (!genv || opt_colon) {
-			warnx("%s: parameter null or not set", env);
-			*rc = 1;
-			goto fail;
-		} else {
-            char buf[16];
-            snprintf(buf, sizeof(buf), "%d", cur_sh_env->rc);
-			ret = strdup(buf);
-        }
-	} else {
-		return "";
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* waitpid() that also accounts the CPU time of children that have finished */
+static pid_t wait_child(const pid_t pid, int *status, const int options)
+{
+	struct rusage ru;
+	pid_t ret;
+
+	if ((ret = wait4(pid, status, options, &ru)) > 0 && (WIFEXITED(*status) || WIFSIGNALED(*status))) {
+		timeradd(&child_utime, &ru.ru_utime, &child_utime);
+		timeradd(&child_stime, &ru.ru_stime, &child_stime);
 	}
-//	} else {
-//		errx(EXIT_FAILURE, "reached a place we shouldn't get to");
-//	}
 
-//done:
-	if (env) { free(env); env = NULL; }
 	return ret;
-fail:
-	if (env) { free(env); env = NULL; }
-	return NULL;
 }
 
-static size_t do_math(char *dst __attribute__((unused)), const char *func)
+/* parsed bodies of $( ) and ` `, so loops do not re-parse them */
+#define SUBST_CACHE	32
+
+static struct {
+	char	*text;
+	node	*tree;
+	int		 active;
+} subst_cache[SUBST_CACHE];
+
+static int subst_next = 0;
+static node **parse_into = NULL;
+
+/* parse a string into a tree without executing it */
+static node *parse_string(const char *str, const size_t len)
 {
-	debug_printf("do_math: <%s>\n", func);
-	return 0;
+	shell_state_t state;
+	void *scanner;
+	node *ret = NULL;
+	node **save = parse_into;
+
+	memset(&state, 0, sizeof(state));
+
+	if (yylex_init_extra(&state, &scanner))
+		return NULL;
+
+	parse_into = &ret;
+	yy_scan_bytes(str, len, scanner);
+	yyparse(scanner);
+	yylex_destroy(scanner);
+	parse_into = save;
+
+	return ret;
 }
 
-/* TODO this should be replaced with lex/yacc combination */
-char *expand(const char *restrict str, int *rc)
+static int subst_lookup(const char *str, const size_t len)
 {
-	char buf[BUFSIZ] = {0};
-	char var[BUFSIZ] = {0};
-	const char *src = str;
-	char *dst = buf, *tmp = NULL, *val = NULL;
-	bool in_double_quotes = false;
-	size_t len = 0;
-	env_t *env = NULL;
+	int i;
+	node *tree;
 
-	debug_printf("expand: <%s>\n", str);
+	for (i = 0; i < SUBST_CACHE; i++)
+		if (subst_cache[i].text && !strncmp(subst_cache[i].text, str, len) &&
+				subst_cache[i].text[len] == '\0')
+			return i;
 
-	if (!src) return NULL;
+	if ((tree = parse_string(str, len)) == NULL)
+		return -1;
 
-	while (*src)
-	{
-		char next = *(src+1);
-
-		if (*src == '$') {
-			if (next == '(' && *(src+2) == '(') {
-				src+=3;
-				const char *start = src;	
-				debug_printf("expand_math: %s\n", src);
-				while (*src && *src != ')' && *(src+1) != ')') src++;
-				if (!*src) return NULL;
-				src+=2;
-				/* FIXME bounds checking */
-				debug_printf("expand_math: len(%ld)\n", src - start);
-				char *maths = strndup(start, src - start - 4);
-				dst += do_math(buf, maths);
-				free(maths);
-				continue;
-			} else if (next == '(') {
-				src+=2;
-				debug_printf("expand_subshell: %s\n", src);
-				while (*src++ != ')') ; 
-			} else if (next == '{') {
-				src+=2; tmp = var;
-				debug_printf("expand_var: %s\n", src);
-				while(*src && *src != '}') *tmp++ = *src++;
-				*tmp = '\0';
-				debug_printf("expand_var: %s\n", var);
-				val = parseenv(var, rc);
-				if (val && *val) {
-					dst += (len = min(BUFSIZ - strlen(buf), strlen(val)));
-					strncat(buf, val, len);
-					free(val); val = NULL;
-				} else
-					strncat(buf, "", BUFSIZ-strlen(buf));
-				src++;
-				continue;
-			} else if (isalpha(next)) {
-				src++; tmp = var;
-				debug_printf("expand_var: %s\n", src);
-				while(*src && !isblank(*src)) *tmp++ = *src++;
-				*tmp = '\0';
-				debug_printf("expand_var: %s\n", var);
-				env = getshenv(cur_sh_env, var);
-				if (env && *(env->val)) {
-					dst += (len = min(BUFSIZ - strlen(buf), strlen(env->val)));
-					strncat(buf, env->val, len);
-				}
-				continue;
-			} else if (isdigit(next)) {
-				src+=2;
-			} else if (next == '?') {
-				dst += snprintf(buf, BUFSIZ, "%u", cur_sh_env->rc/**rc*/);
-				src+=2;
-			} else if (next == '*') {
-				src+=2;
-			} else if (next == '@') {
-				src+=2;
-			} else if (next == '-') {
-				src+=2;
-			} else if (next == '$') {
-				dst += snprintf(buf, BUFSIZ, "%u", getpid());
-				src+=2;
-			} else if (next == '!') {
-				src+=2;
-			} else if (next == '#') {
-				src+=2;
-			}
-		} else if(*src == '"') {
-			in_double_quotes = !in_double_quotes;
-			src++; 
-			continue;
-		} else if(!in_double_quotes && *src == '\'') {
-			src++;
-			while (*src && *src != '\'') *dst++ = *src++;
-			src++;
-			continue;
-		} else if(*src == '\\') {
-			src++;
-		} else if(*src == '`') {
-			src++;
-			// FIXME mirror $( )
-		} else
-			*dst++ = *src++;
+	/* never evict a tree that is being evaluated */
+	for (i = 0; i < SUBST_CACHE && subst_cache[subst_next].active; i++)
+		subst_next = (subst_next + 1) % SUBST_CACHE;
+
+	if (i == SUBST_CACHE) {
+		freeNode(tree, true);
+		return -1;
 	}
 
-	*dst = '\0';
+	i = subst_next;
+	subst_next = (subst_next + 1) % SUBST_CACHE;
 
-	return strdup(buf);
+	if (subst_cache[i].text) free(subst_cache[i].text);
+	if (subst_cache[i].tree) freeNode(subst_cache[i].tree, true);
+
+	subst_cache[i].text = strndup(str, len);
+	subst_cache[i].tree = tree;
+
+	return i;
 }
 
+static bool subst_safe_word(const char *str)
+{
+	return !strchr(str, '`') && !strstr(str, "$(") && !strstr(str, "${");
+}
 
-int evaluate(node *n, int pad, int do_next)
+/* true if a substitution can run without a subshell: only builtins that do
+ * not touch the shell environment, and no assignments or redirections */
+static bool subst_inprocess(const node *n)
 {
-	debug_printf("%*sEVAL: [%s]", pad, pad_str, node_type(n->type));
-	node *tmp;
-	int rc = 0;
-	switch(n->type)
+	const node *tmp;
+	const struct builtin *bi;
+
+	for (; n; n = n->next)
 	{
-		case N_FUNC:
-			debug_printf(": name=%s\n", n->value);
-			if (n->arg0) {
-				debug_printf("%*sbody:\n", pad+1, pad_str);
-				evaluate(n->arg0, pad+2, 1);
-			}
-			rc = true;
-			break;
-		case N_CASE:
-			// TODO
-			break;
-		case N_STRING:
-			rc = 0;
-			n->evaluated = expand(n->value, &rc);
-			debug_printf(": %s => %s\n", n->value, n->evaluated);
-			break;
-		case N_ASSIGN:
-			debug_printf(": %s = ", n->value);
-			if (n->arg0) {
-				n->arg0->evaluated = expand(n->arg0->value, &rc);
-				setshenv(cur_sh_env, n->value, n->arg0->evaluated);
-			} else
-				setshenv(cur_sh_env, n->value, "");
-			break;
-		case N_COMPOUND_COMMAND:
-			debug_printf(":\n");
-			if (n->arg0)
-				rc = evaluate(n->arg0, pad+1, do_next);
-			break;
-		case N_IF:
-			debug_printf("\n");
-			if (n->arg0) {
-				debug_printf("%*sif  :\n", pad+1, pad_str);
-				rc = evaluate(n->arg0, pad+2, 1);
-			}
-			if (rc && n->arg1) {
-				debug_printf("%*sthen:\n", pad+1, pad_str);
-				evaluate(n->arg1, pad+2, 1);
-			}
-			if (!rc && n->arg2) {
-				debug_printf("%*selse:\n", pad+1, pad_str);
-				evaluate(n->arg2, pad+2, 1);
-			}
-			break;
-		case N_SIMPLE:
-			debug_printf("\n");
+		if (n->sep == '&')
+			return false;
 
-			if (n->arg0) {
-				debug_printf("%*spre:\n", pad+1, pad_str);
-				evaluate(n->arg0, pad+2, 1); 
-			}
+		switch (n->type)
+		{
+			case N_SIMPLE:
+				if (n->arg0 || !n->arg1 || n->arg1->type != N_STRING ||
+						!subst_safe_word(n->arg1->value))
+					return false;
+				for (tmp = n->arg2; tmp; tmp = tmp->next)
+					if (tmp->type != N_STRING || !subst_safe_word(tmp->value))
+						return false;
+
+				bi = find_builtin(n->arg1->value);
+				if (!bi->name || !bi->pure || bi->fork || getfunc(cur_sh_env, bi->name))
+					return false;
+				break;
+			case N_OP:
+				if (n->token == '|')
+					return false;
+				if (n->arg0 && !subst_inprocess(n->arg0))
+					return false;
+				if (n->arg1 && !subst_inprocess(n->arg1))
+					return false;
+				break;
+			default:
+				return false;
+		}
+	}
 
-			if (n->arg1) {
-				char **tmpargs = NULL;
-				int tmpargc = 1;
-				debug_printf("%*scmd:", pad+1, pad_str);
-				
-#ifdef NDEBUG
-				print_node(n->arg1, pad+1, 1);
-#endif
-				if (n->arg1->type == N_STRING)
-					n->arg1->evaluated = expand(n->arg1->value, &rc);
-				else
-					errx(EXIT_FAILURE, "N_SIMPLE");
-				push(&tmpargs, n->arg1->evaluated);
+	return true;
+}
 
-				if (n->arg2) {
-					for (tmp = n->arg2; tmp; tmp=tmp->next)
-					{
-						if (tmp->type != N_STRING)
-							continue;
-						if (!push(&tmpargs, (tmp->evaluated = expand(tmp->value, &rc)))) {
-							rc = 1;
-							break;
-						}
-					}
-					for (size_t i = 0; tmpargs && tmpargs[i]; i++, tmpargc++) {
-						debug_printf("%*sarg[%lu]=<%s>\n", pad+2, pad_str, i, tmpargs[i]);
-					}
-				}
+/* run a command list and capture its standard output, less any trailing
+ * newlines. The result is malloc()ed, and its length stored in *outlen */
+static char *command_subst(const char *str, const size_t len, size_t *outlen)
+{
+	strbuf_t out = {0};
+	node *tree;
+	int idx, res = 0;
+	int fds[2];
+	pid_t pid;
+
+	if ((idx = subst_lookup(str, len)) == -1)
+		goto done;
+
+	tree = subst_cache[idx].tree;
+	subst_cache[idx].active++;
+
+	if (subst_inprocess(tree)) {
+		FILE *save = stdout;
+		char *buf = NULL;
+		size_t buflen = 0;
+
+		fflush(stdout);
+		if ((stdout = open_memstream(&buf, &buflen)) != NULL) {
+			cur_sh_env->rc = evaluate(tree, 0, 1);
+			fclose(stdout);
+			stdout = save;
+			out.buf = buf;
+			out.len = buflen;
+			out.size = buflen + 1;
+			goto finished;
+		}
+		stdout = save;
+	}
 
-				// check for builtins etc FIXME
-				
-				const struct builtin *bi = NULL;
-				for (size_t i = 0; (bi = &builtins[i])->name; i++)
-					if (!strcmp(tmpargs[0], bi->name))
-						break;
+	if (pipe(fds) == -1) {
+		warn("pipe");
+		goto finished;
+	}
 
-				pid_t chd_pid;
+	fflush(stdout);
+
+	if ((pid = fork()) == -1) {
+		warn("fork");
+		close(fds[0]);
+		close(fds[1]);
+		goto finished;
+	} else if (pid == 0) {
+		jobs_reset();
+		redirect_child();
+		close(fds[0]);
+		if (fds[1] != STDOUT_FILENO) {
+			dup2(fds[1], STDOUT_FILENO);
+			close(fds[1]);
+		}
+		exit(evaluate(tree, 0, 1));
+	}
 
-				//printf("sh: about to fork (bi=%p)\n", (void *)bi);
-				
-				if ( (bi && bi->name && bi->fork) || !bi || !bi->name) {
-					chd_pid = fork();
-					//printf("sh: fork returned %u\n", chd_pid);
-				} else
-					chd_pid = 0;
-
-				if (chd_pid == 0) {
-					//printf("sh: forked\n");
-					int rc;
-					if (bi->name)
-						rc = bi->func(tmpargc, tmpargs);
-					else {
-						//printf("sh: about to execvp(%s, %s)\n", n->arg1->evaluated,
-						//		tmpargs[0]);
-						rc = execvp(n->arg1->evaluated, tmpargs);
-						//printf("sh: execvp returned\n");
-						if (rc)
-							err(EXIT_FAILURE, "execvp: %s", n->arg1->evaluated);
-					}
-				} else if (chd_pid == -1) {
-					warn("execvp");
-					rc = EXIT_FAILURE;
-				} else {
-					rc = EXIT_SUCCESS;
-					int res = 0;
-					waitpid(chd_pid, &res, 0);
-					if (WIFEXITED(rc)) rc = WEXITSTATUS(res);
-				}
+	close(fds[1]);
 
-				if (tmpargs) {
-					/* tmpargs contains n->evaluated pointers, freeNode() handles these */
-					free(tmpargs);
-					tmpargs = NULL;
-				}
-			}
+	/* read straight into the spare capacity, which doubles as needed */
+	while (strbuf_grow(&out, INPUT_BLOCK))
+	{
+		ssize_t rc;
 
+		if ((rc = read(fds[0], out.buf + out.len, out.size - out.len - 1)) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("read");
 			break;
-
-		default:
-			debug_printf("\n");
+		}
+		if (rc == 0)
 			break;
+		out.len += rc;
 	}
 
-	if (n->next && do_next)
-		return evaluate(n->next, pad, 1);
+	close(fds[0]);
+
+	while (wait_child(pid, &res, 0) == -1 && errno == EINTR) ;
+	cur_sh_env->rc = WIFEXITED(res) ? WEXITSTATUS(res) : EXIT_FAILURE;
+
+finished:
+	subst_cache[idx].active--;
+done:
+	while (out.len && out.buf[out.len - 1] == '\n')
+		out.len--;
+
+	if (out.buf)
+		out.buf[out.len] = '\0';
 	else
-		return rc;
+		out.buf = strdup("");
+
+	*outlen = out.len;
+	return out.buf;
 }
 
-static node *newNode(const enum node_en type)
+/* returns the ')' that closes a $( starting at src, skipping quoted text */
+static const char *subst_end(const char *src)
 {
-	node *ret = NULL;
-	if ((ret = calloc(1, sizeof(node))) == NULL)
-		err(EXIT_FAILURE, "newNode");
+	int depth = 1;
 
-	ret->type = type;
-	return ret;
+	for (; *src; src++)
+	{
+		switch (*src)
+		{
+			case '\\':
+				if (src[1]) src++;
+				break;
+			case '\'':
+				while (src[1] && *++src != '\'') ;
+				break;
+			case '"':
+				while (src[1] && *++src != '"')
+					if (*src == '\\' && src[1]) src++;
+				break;
+			case '(':
+				depth++;
+				break;
+			case ')':
+				if (--depth == 0)
+					return src;
+				break;
+		}
+	}
+
+	return NULL;
 }
 
-void freeNode(node *restrict node, const bool free_next)
-{
-	if (!node) return;
+/*
+ * Word expansion is a single pass over the word, appending to a growable
+ * buffer. Each output byte carries flags recording how it was produced,
+ * which field splitting and pathname expansion use afterwards.
+ */
+#define EXP_QUOTED	(1<<0)	/* quoted: never split, never a pattern character */
+#define EXP_SPLIT	(1<<1)	/* from an unquoted expansion: subject to IFS */
+#define EXP_MARK	(1<<2)	/* not output: quoted (possibly empty) text was here */
+#define EXP_BREAK	(1<<3)	/* not output: field boundary between "$@" parameters */
 
-	if(node->arg0)  { freeNode(node->arg0, true);	node->arg0 = NULL;		}
-	if(node->arg1)  { freeNode(node->arg1, true);	node->arg1 = NULL;		}
-	if(node->arg2)  { freeNode(node->arg2, true);	node->arg2 = NULL;		}
-	if(node->arg3)  { freeNode(node->arg3, true);	node->arg3 = NULL;		}
-	if(node->value) { free(node->value);			node->value = NULL;		}
-	if(node->evaluated) { free(node->evaluated);	node->evaluated = NULL; }
+typedef struct {
+	strbuf_t	text;
+	strbuf_t	flags;
+	bool		at_empty;		/* "$@" with no parameters */
+	bool		here;			/* a here-document body: " is an ordinary character */
+} expansion_t;
 
-	if(free_next && node->next) { freeNode(node->next, true); node->next = NULL; }
-	
-	free(node);
-}
+static bool expand_into(expansion_t *, const char *, const char *, bool, const bool, int *);
+static char *expand_string(const char *, const size_t, int *, const bool);
 
-node *nCaseItem(node *restrict pattern, node *restrict compound_list)
+static bool exp_append(expansion_t *restrict e, const char *restrict str, const size_t len, const char flag)
 {
-	node *ret = newNode(N_CASEITEM);
-	ret->arg0 = pattern;
-	ret->arg1 = compound_list;
-	return ret;
+	if (!strbuf_append(&e->text, str, len) || !strbuf_grow(&e->flags, len))
+		return false;
+
+	memset(e->flags.buf + e->flags.len, flag, len);
+	e->flags.len += len;
+	return true;
 }
 
-node *nFunc(char *restrict fname, node *restrict body)
+static void exp_free(expansion_t *e)
 {
-	node *ret = newNode(N_FUNC);
-	ret->value = strdup(fname);
-	ret->arg0 = body;
-	return ret;
+	free(e->text.buf);
+	free(e->flags.buf);
+	memset(e, 0, sizeof(expansion_t));
 }
 
-node *nAssign(char *restrict str)
+/* value of a parameter, NULL if it is unset. tmp holds numeric results */
+static const char *param_value(const char *restrict name, const size_t len, char *restrict tmp, const size_t tmplen)
 {
-	if (!str) 
-		return NULL;
+	const env_t *env;
+	char var[BUFSIZ];
 
-	node *ret = newNode(N_ASSIGN);
-	char *tok = strchr(str, '=');
-	if (!tok) 
-		return NULL;
+	if (len == 1) {
+		switch (*name)
+		{
+			case '?':
+				snprintf(tmp, tmplen, "%d", cur_sh_env->rc);
+				return tmp;
+			case '$':
+				snprintf(tmp, tmplen, "%d", (int)getpid());
+				return tmp;
+			case '#':
+				snprintf(tmp, tmplen, "%d", cur_sh_env->argc ? cur_sh_env->argc - 1 : 0);
+				return tmp;
+			case '!':
+				if (!cur_sh_env->last_async)
+					return NULL;
+				snprintf(tmp, tmplen, "%d", (int)cur_sh_env->last_async);
+				return tmp;
+			case '-':
+				{
+					char *ptr = tmp;
+					if (opt_allexport) *ptr++ = 'a';
+					if (opt_notify)    *ptr++ = 'b';
+					if (opt_noclobber) *ptr++ = 'C';
+					if (opt_errexit)   *ptr++ = 'e';
+					if (opt_noglob)    *ptr++ = 'f';
+					if (opt_monitor)   *ptr++ = 'm';
+					if (opt_noexec)    *ptr++ = 'n';
+					if (opt_nounset)   *ptr++ = 'u';
+					if (opt_verbose)   *ptr++ = 'v';
+					if (opt_xtrace)    *ptr++ = 'x';
+					*ptr = '\0';
+				}
+				return tmp;
+		}
+	}
 
-	ret->value = strndup(str, tok - str);
-	ret->arg0 = nString(tok + 1);
-	return ret;
-}
+	if (isdigit(*name)) {
+		const int idx = atoi(name);
 
-node *nFor(char *restrict name, char *restrict wordlist, node *restrict do_group)
-{
-	node *ret = newNode(N_FOR);
-	ret->value = strdup(name);
-	if (wordlist)
-		ret->arg0 = nString(wordlist);
-	ret->arg1 = do_group;
-	return ret;
-}
+		if (idx == 0)
+			return cur_sh_env->argc ? cur_sh_env->argv[0] : "sh";
+		return idx < cur_sh_env->argc ? cur_sh_env->argv[idx] : NULL;
+	}
 
-node *nWhile(node *restrict compound_list, node *restrict do_group)
-{
-	node *ret = newNode(N_WHILE);
-	ret->arg0 = compound_list;
-	ret->arg1 = do_group;
-	return ret;
-}
+	if (len >= sizeof(var))
+		return NULL;
 
-node *nUntil(node *restrict compound_list, node *restrict do_group)
-{
-	node *ret = newNode(N_UNTIL);
-	ret->arg0 = compound_list;
-	ret->arg1 = do_group;
-	return ret;
-}
+	memcpy(var, name, len);
+	var[len] = '\0';
 
-node *nCompound(node *restrict command, node *restrict redirect)
-{
-	node *ret = newNode(N_COMPOUND_COMMAND);
-	ret->arg0 = command;
-	ret->arg1 = redirect;
-	return ret;
-}
+	if ((env = getshenv(cur_sh_env, var)) == NULL)
+		return NULL;
 
-node *nodeAppend(node *restrict item, node *restrict to)
-{
-	node *tmp = to;
-	for(; tmp->next; tmp=tmp->next) ;
-	//printf(" appending %p[%s] to %p[%s]\n", item, node_type(item->type), tmp, node_type(tmp->type));
-	tmp->next = item;
-	return to;
+	return env->val;
 }
 
-node *nIf(node *restrict ifstmt, node *restrict iftrue, node *restrict iffalse)
+/* length of the parameter name at str: a name, positional digit(s) or special */
+static size_t param_name_len(const char *restrict str, const char *restrict end, const bool braced)
 {
-	node *ret = newNode(N_IF);
-	ret->arg0 = ifstmt;
-	ret->arg1 = iftrue;
-	ret->arg2 = iffalse;
-	return ret;
-}
+	const char *ptr = str;
 
-node *nSimple(node *restrict pre, node *restrict cmd, node *restrict suf)
-{
-	node *ret = newNode(N_SIMPLE);
-	ret->arg0 = pre;
-	ret->arg1 = cmd;
-	ret->arg2 = suf;
-	//printf(" creating nSimple(%s,%s,%s)\n",
-	//		pre ? node_type(pre->type) : "",
-	//		cmd ? node_type(cmd->type) : "",
-	//		suf ? node_type(suf->type) : ""
-	//		);
-	return ret;
-}
+	if (ptr >= end)
+		return 0;
 
-node *nCase(char *restrict word, node *restrict case_list)
-{
-	node *ret = newNode(N_CASE);
-	ret->value = strdup(word);
-	ret->arg0 = case_list;
-	return ret;
+	if (isalpha(*ptr) || *ptr == '_') {
+		while (ptr < end && (isalnum(*ptr) || *ptr == '_'))
+			ptr++;
+	} else if (isdigit(*ptr)) {
+		/* $10 is ${1}0, but ${10} is the tenth parameter */
+		ptr++;
+		while (braced && ptr < end && isdigit(*ptr))
+			ptr++;
+	} else if (strchr("@*#?-$!", *ptr))
+		ptr++;
+
+	return ptr - str;
 }
 
-node *nIoRedirect(int func, char *restrict iofile)
+/* append $@ or $*, in double quotes $* is joined by the first character of IFS */
+static bool expand_params(expansion_t *e, const char which, const bool dq)
 {
-	// FIXME
-	node *ret = newNode(N_IOREDIRECT);
-	ret->token = func;
-	switch(func)
+	const env_t *ifs = getshenv(cur_sh_env, "IFS");
+	const char sep = (ifs && ifs->val) ? *ifs->val : ' ';
+
+	if (dq && which == '@' && cur_sh_env->argc <= 1)
+		e->at_empty = true;
+
+	for (int i = 1; i < cur_sh_env->argc; i++)
 	{
-		case '>':
-		case DGREAT:
-		case GREATAND:
-		case CLOBBER:
-			ret->num = 1;
-			break;
-		case LESSAND:
-		case '<':
-		case DLESS:
-			ret->num = 0;
-			break;
-		default:
-			errx(EXIT_FAILURE, "nIoRedirect: unknown %d", func);
+		const char *arg = cur_sh_env->argv[i];
+
+		if (i > 1) {
+			if (dq && which == '*') {
+				if (sep && !exp_append(e, &sep, 1, EXP_QUOTED))
+					return false;
+			} else if (!exp_append(e, " ", 1, EXP_BREAK))
+				return false;
+		}
 
+		if (dq && !exp_append(e, "", 1, EXP_MARK))
+			return false;
+		if (!exp_append(e, arg, strlen(arg), dq ? EXP_QUOTED : EXP_SPLIT))
+			return false;
 	}
-	ret->value = strdup(iofile);
-	return ret;
-}
 
-node *nPattern(char *restrict str)
-{
-	node *ret = newNode(N_PATTERN);
-	ret->value = strdup(str);
-	return ret;
+	return true;
 }
 
-node *nString(char *restrict str)
+/* returns the '}' closing a ${ that starts at src */
+static const char *brace_end(const char *src, const char *end)
 {
-	node *ret = newNode(N_STRING);
-	ret->value = strdup(str);
-	return ret;
-}
+	int depth = 1;
 
-node *nOp(int op, node *restrict lhs, node *restrict rhs)
-{
-	node *ret = newNode(N_OP);
-	ret->token = op;
-	ret->arg0 = lhs;
-	ret->arg1 = rhs;
-	return ret;
+	for (; src < end; src++)
+	{
+		switch (*src)
+		{
+			case '\\':
+				src++;
+				break;
+			case '\'':
+				while (src + 1 < end && *++src != '\'') ;
+				break;
+			case '"':
+				while (src + 1 < end && *++src != '"')
+					if (*src == '\\') src++;
+				break;
+			case '{':
+				depth++;
+				break;
+			case '}':
+				if (--depth == 0)
+					return src;
+				break;
+		}
+	}
+
+	return NULL;
 }
 
-node *nSubshell(node *restrict body)
+/* remove the shortest or longest prefix or suffix matching pattern */
+static char *param_trim(const char *restrict val, const char *restrict pattern, const bool suffix, const bool longest)
 {
-	node *ret = newNode(N_SUBSHELL);
-	ret->arg0 = body;
-	return ret;
+	const size_t len = strlen(val);
+	char *tmp;
+
+	if ((tmp = strdup(val)) == NULL)
+		return NULL;
+
+	for (size_t i = 0; i <= len; i++)
+	{
+		if (suffix) {
+			/* the longest suffix starts at 0, the shortest is the empty one at len */
+			const size_t start = longest ? i : len - i;
+
+			if (!fnmatch(pattern, val + start, 0)) {
+				tmp[start] = '\0';
+				return tmp;
+			}
+		} else {
+			/* try the prefix of length cut */
+			const size_t plen = longest ? len - i : i;
+			const char save = tmp[plen];
+
+			tmp[plen] = '\0';
+			if (!fnmatch(pattern, tmp, 0)) {
+				memmove(tmp, val + plen, len - plen + 1);
+				return tmp;
+			}
+			tmp[plen] = save;
+		}
+	}
+
+	return tmp;
 }
 
-#if 0
-static bool isquote(const char chr, const int type)
+/* ${...}, src is the first character after the brace */
+static bool expand_braced(expansion_t *e, const char *src, const char *end, const bool dq, int *rc)
 {
-	static const char base[]	= "|&;<>()$`\\\"' \t\n";
-	static const char special[]	= "*?[#~=%";
-	static const char doubleq[]	= "$`\"\\\n";
+	char num[64];
+	bool opt_length = false;
 
-	if (chr == '\0') return false;
-	else if (type & QUOTE_BASE && (strchr(base, chr) != NULL)) return true;
-	else if (type & QUOTE_SPECIAL && (strchr(special, chr) != NULL)) return true;
-	else if (type & QUOTE_DOUBLE && (strchr(doubleq, chr) != NULL)) return true;
+	if (*src == '#' && src + 1 < end) {
+		opt_length = true;
+		src++;
+	}
+
+	const size_t nlen = param_name_len(src, end, true);
+
+	if (nlen == 0) {
+		warnx("${%.*s}: bad substitution", (int)(end - src), src);
+		*rc = 1;
+		return false;
+	}
+
+	const char *name = src;
+	const char *val = param_value(name, nlen, num, sizeof(num));
+	const bool is_list = nlen == 1 && (*name == '@' || *name == '*');
+	const char *op = src + nlen;
+	bool colon = false;
+
+	if (opt_length) {
+		if (op != end) {
+			warnx("${#%.*s}: bad substitution", (int)(end - name), name);
+			*rc = 1;
+			return false;
+		}
+		if (is_list)
+			snprintf(num, sizeof(num), "%d", cur_sh_env->argc ? cur_sh_env->argc - 1 : 0);
+		else
+			snprintf(num, sizeof(num), "%zu", val ? strlen(val) : 0);
+		return exp_append(e, num, strlen(num), dq ? EXP_QUOTED : EXP_SPLIT);
+	}
+
+	if (op == end) {
+		if (is_list)
+			return expand_params(e, *name, dq);
+		if (!val && opt_nounset) {
+			warnx("%.*s: parameter not set", (int)nlen, name);
+			*rc = 1;
+			return false;
+		}
+		return val ? exp_append(e, val, strlen(val), dq ? EXP_QUOTED : EXP_SPLIT) : true;
+	}
+
+	if (*op == ':') {
+		colon = true;
+		op++;
+	}
+
+	const char *word = op + 1;
+	const bool unset = !val || (colon && !*val);
+
+	switch (*op)
+	{
+		case '-':
+			if (unset)
+				return expand_into(e, word, end, dq, false, rc);
+			break;
+		case '=':
+			if (unset) {
+				char *tmp, var[BUFSIZ];
+
+				if (!isalpha(*name) && *name != '_') {
+					warnx("%.*s: cannot assign in this way", (int)nlen, name);
+					*rc = 1;
+					return false;
+				}
+				if ((tmp = expand_string(word, end - word, rc, false)) == NULL)
+					return false;
+				snprintf(var, sizeof(var), "%.*s", (int)nlen, name);
+				setshenv(cur_sh_env, var, tmp);
+				const bool ret = exp_append(e, tmp, strlen(tmp), dq ? EXP_QUOTED : EXP_SPLIT);
+				free(tmp);
+				return ret;
+			}
+			break;
+		case '?':
+			if (unset) {
+				char *tmp = expand_string(word, end - word, rc, false);
+				warnx("%.*s: %s", (int)nlen, name, (tmp && *tmp) ? tmp : "parameter null or not set");
+				free(tmp);
+				*rc = 1;
+				return false;
+			}
+			break;
+		case '+':
+			if (!unset)
+				return expand_into(e, word, end, dq, false, rc);
+			return true;
+		case '%':
+		case '#':
+			if (colon)
+				goto bad;
+			{
+				const bool suffix = *op == '%';
+				const bool longest = word < end && *word == *op;
+				char *pattern, *tmp;
+
+				if (longest)
+					word++;
+				if ((pattern = expand_string(word, end - word, rc, true)) == NULL)
+					return false;
+				tmp = param_trim(val ? val : "", pattern, suffix, longest);
+				free(pattern);
+				if (tmp == NULL)
+					return false;
+				const bool ret = exp_append(e, tmp, strlen(tmp), dq ? EXP_QUOTED : EXP_SPLIT);
+				free(tmp);
+				return ret;
+			}
+		default:
+			goto bad;
+	}
+
+	if (is_list)
+		return expand_params(e, *name, dq);
 
+	return val ? exp_append(e, val, strlen(val), dq ? EXP_QUOTED : EXP_SPLIT) : true;
+bad:
+	warnx("${%.*s}: bad substitution", (int)(end - name), name);
+	*rc = 1;
 	return false;
 }
 
-static int isoperator(const char *src)
-{
-	static const char *ops2[] = {
-		"&&",
-		"||",
-		";;",
-		"<<",
-		">>",
-		"<&",
-		">&",
-		"<>",
-		">|",
-		NULL
-	};
-	static const char ops1[] = "&()\n|;<>";
+/* arithmetic expansion: expressions are parsed once into a tree and kept
+ * in a small cache keyed by their unexpanded text, so $((i+1)) and
+ * $(($i + 1)) in a loop are only parsed on the first iteration. A plain
+ * $name is read when the tree is evaluated, rather than expanded first */
 
-	if (!*src) return 0;
+enum {
+	A_NUM, A_VAR, A_UNARY, A_BINARY, A_AND, A_OR, A_COND, A_ASSIGN
+};
 
-	if (!strncmp("<<-", src, 3)) return 3;
+/* two character operators, the rest use their ASCII value */
+enum {
+	A_SHL = 256, A_SHR, A_LE, A_GE, A_EQ, A_NE
+};
 
-	for (int i = 0; ops2[i]; i++)
-		if (!strncmp(ops2[i], src, 2)) return 2;
+typedef struct arith {
+	int				 type;
+	int				 op;		/* operator, 0 for plain =, or '$' for $name */
+	long			 num;
+	char			*name;
+	struct arith	*lhs;
+	struct arith	*rhs;
+	struct arith	*cond;
+} arith_t;
+
+static const struct {
+	const char	*str;
+	int			 op;
+	int			 prec;
+} arith_ops[] = {
+	{"||",	A_OR,	1},
+	{"&&",	A_AND,	2},
+	{"==",	A_EQ,	6},
+	{"!=",	A_NE,	6},
+	{"<=",	A_LE,	7},
+	{">=",	A_GE,	7},
+	{"<<",	A_SHL,	8},
+	{">>",	A_SHR,	8},
+	{"|",	'|',	3},
+	{"^",	'^',	4},
+	{"&",	'&',	5},
+	{"<",	'<',	7},
+	{">",	'>',	7},
+	{"+",	'+',	9},
+	{"-",	'-',	9},
+	{"*",	'*',	10},
+	{"/",	'/',	10},
+	{"%",	'%',	10},
+	{NULL,	0,		0}
+};
 
-	if (strchr(ops1, *src) != NULL) {
-		return 1;
-	}
+/* compound assignment operators, longest first */
+static const struct {
+	const char	*str;
+	int			 op;
+} arith_assign_ops[] = {
+	{"<<=",	A_SHL},
+	{">>=",	A_SHR},
+	{"*=",	'*'},
+	{"/=",	'/'},
+	{"%=",	'%'},
+	{"+=",	'+'},
+	{"-=",	'-'},
+	{"&=",	'&'},
+	{"^=",	'^'},
+	{"|=",	'|'},
+	{"=",	0},
+	{NULL,	0}
+};
 
-	return 0;
+typedef struct {
+	const char	*ptr;
+	const char	*expr;
+} arith_parser_t;
+
+static arith_t *arith_assign(arith_parser_t *);
+
+static void arith_free(arith_t *a)
+{
+	if (!a)
+		return;
+
+	arith_free(a->lhs);
+	arith_free(a->rhs);
+	arith_free(a->cond);
+	free(a->name);
+	free(a);
 }
 
-inline static const map_t *lookup_token(const char *token)
+static arith_t *arith_new(const int type, const int op, arith_t *lhs, arith_t *rhs)
 {
-	for (int i = 0; lookup[i].str; i++) {
-		if (!strcmp(token, lookup[i].str)) return &lookup[i];
+	arith_t *ret;
+
+	if ((ret = calloc(1, sizeof(arith_t))) == NULL) {
+		warn("arith_new");
+		arith_free(lhs);
+		arith_free(rhs);
+		return NULL;
 	}
+
+	ret->type = type;
+	ret->op = op;
+	ret->lhs = lhs;
+	ret->rhs = rhs;
+	return ret;
+}
+
+static const char *arith_skip(arith_parser_t *p)
+{
+	while (isspace(*p->ptr))
+		p->ptr++;
+
+	return p->ptr;
+}
+
+static arith_t *arith_error(arith_parser_t *p, arith_t *a)
+{
+	if (*p->ptr)
+		warnx("%s: syntax error near '%s'", p->expr, p->ptr);
+	else
+		warnx("%s: syntax error", p->expr);
+	arith_free(a);
 	return NULL;
 }
-#endif
 
-static void cleanup()
+/* number, variable, parenthesised expression or unary operator */
+static arith_t *arith_unary(arith_parser_t *p)
 {
-	/*
-	regfree(&reg_assignment);
-	regfree(&reg_name);
-	*/
-	if (here_doc_remaining) free(here_doc_remaining);
-	if (here_doc_word) free(here_doc_word);
-	if (cur_sh_env) {
-		if (cur_sh_env->private_envs) {
-			for (int i = 0; cur_sh_env->private_envs[i]; i++)
-				free(cur_sh_env->private_envs[i]);
-			free(cur_sh_env->private_envs);
+	const char *src = arith_skip(p);
+	arith_t *ret;
+
+	if (*src == '(') {
+		p->ptr++;
+		if ((ret = arith_assign(p)) == NULL)
+			return NULL;
+		if (*arith_skip(p) != ')')
+			return arith_error(p, ret);
+		p->ptr++;
+		return ret;
+	}
+
+	if (*src && strchr("+-~!", *src)) {
+		p->ptr++;
+		if ((ret = arith_unary(p)) == NULL)
+			return NULL;
+		return arith_new(A_UNARY, *src, ret, NULL);
+	}
+
+	if (isdigit(*src)) {
+		char *end;
+
+		errno = 0;
+		const long num = strtol(src, &end, 0);
+		if (errno || isalnum(*end) || *end == '_') {
+			p->ptr = src;
+			return arith_error(p, NULL);
 		}
-		free(cur_sh_env);
+		p->ptr = end;
+		if ((ret = arith_new(A_NUM, 0, NULL, NULL)) != NULL)
+			ret->num = num;
+		return ret;
+	}
+
+	/* $name and ${name}, only seen when expand_dollar() found nothing else to expand */
+	const bool dollar = *src == '$';
+	const bool brace = dollar && src[1] == '{';
+	const char *name = src + dollar + brace;
+
+	if (isalpha(*name) || *name == '_') {
+		for (p->ptr = name; isalnum(*p->ptr) || *p->ptr == '_'; )
+			p->ptr++;
+		if (brace && *p->ptr++ != '}')
+			return arith_error(p, NULL);
+		if ((ret = arith_new(A_VAR, dollar ? '$' : 0, NULL, NULL)) == NULL)
+			return NULL;
+		if ((ret->name = strndup(name, p->ptr - brace - name)) == NULL) {
+			warn("arith_unary");
+			arith_free(ret);
+			return NULL;
+		}
+		return ret;
 	}
+
+	return arith_error(p, NULL);
 }
 
-#if 0
-static const map_t *category(const char *token, const char *next, const map_t *restrict prev)
+/* precedence climbing over the left associative binary operators */
+static arith_t *arith_binary(arith_parser_t *p, const int min_prec)
 {
-	size_t len = 0;
-	const map_t *map = NULL;
+	arith_t *lhs, *rhs;
 
-	if (token == NULL || !strlen(token)) {
+	if ((lhs = arith_unary(p)) == NULL)
 		return NULL;
-	} else if ((map = lookup_token(token))) {
-		if (map->tok == Lbrace) {
-			if(in_func) func_brace = in_brace;
-			in_brace++;
-		} else if (map->tok == Rbrace) {
-			in_brace--;
-			if(in_brace == func_brace) in_func=0;
-		} else if (map->tok == If) {
-			in_if++;
-		} else if (map->tok == Fi) {
-			in_if--;
-		} else if (map->tok == Case) {
-			in_case = true;
-		} else if (map->tok == For) {
-			in_for = true;
-		/* to support "A=1) ;;" */
-		} else if (in_case && map->tok == In) {
-			in_case_in = true;
-		} else if (in_for && map->tok == In) {
-			in_for_in = true;
-		} else if (map->tok == Esac) {
-			in_case = false; in_case_in = false;
-		} else if (map->tok == DSEMI) {
-			in_case_in = true;
-		} else if (map->tok == Do) {
-			in_for_in = false;
-			in_do++;
-		} else if (map->tok == Done) {
-			in_do--;
-			in_for_in = false;
-			in_for = false;
-		}
-		return map;
-	} else if ((!in_case && !in_case_in) && regexec(&reg_assignment, token, 0, NULL, 0) == 0) {
-		return &assignment_word;
-	} else if (isdigit(*token)) {
-		char *tmp = (char *)(token + 1);
-		while(*tmp) {
-			if (!isdigit(*tmp) && (len = isoperator(tmp)) && (strlen(tmp) == len)) {
-				*tmp = '\0';
-				return &io_number;
-			}
-			else if (isdigit(*tmp)) tmp++;
-			else break;
+
+	while (1)
+	{
+		const char *src = arith_skip(p);
+		int i;
+
+		for (i = 0; arith_ops[i].str; i++)
+			if (!strncmp(src, arith_ops[i].str, strlen(arith_ops[i].str)))
+				break;
+
+		/* stop at lower precedence, and at assignments such as x+=1 */
+		if (!arith_ops[i].str || arith_ops[i].prec < min_prec)
+			break;
+		if (src[strlen(arith_ops[i].str)] == '=' && arith_ops[i].op != A_EQ &&
+				arith_ops[i].op != A_NE && arith_ops[i].op != A_LE && arith_ops[i].op != A_GE)
+			break;
+
+		p->ptr += strlen(arith_ops[i].str);
+
+		if ((rhs = arith_binary(p, arith_ops[i].prec + 1)) == NULL) {
+			arith_free(lhs);
+			return NULL;
 		}
-	} else if (regexec(&reg_name, token, 0, NULL, 0) == 0) {
-		if (prev && prev->tok == For) return &name;
-		else if (next && *next) {
-			char *tmp = (char *)next;
-			while (*tmp) {
-				if (isblank(*tmp)) tmp++;
-				else if (*tmp == '(') {
-					if (in_func) {
-						warnx("nested functions are not supported");
-						break;
-					}
-					in_func = 1;
-					return &name;
-				}
-				else break;
-			}
+
+		switch (arith_ops[i].op)
+		{
+			case A_AND:
+				lhs = arith_new(A_AND, 0, lhs, rhs);
+				break;
+			case A_OR:
+				lhs = arith_new(A_OR, 0, lhs, rhs);
+				break;
+			default:
+				lhs = arith_new(A_BINARY, arith_ops[i].op, lhs, rhs);
+				break;
 		}
+
+		if (lhs == NULL)
+			return NULL;
 	}
-	return &word;
+
+	return lhs;
 }
-#endif
 
-#if 0
-static char *get_next_token(char *const str, char **next)
+/* cond ? expr : cond */
+static arith_t *arith_cond(arith_parser_t *p)
 {
-	static char buf[BUFSIZ];
-	char *dst = buf;
-	char *src = str;
-	char *mark = NULL, *tmp = NULL;
-	size_t len = 0;
+	arith_t *cond, *ret;
 
-	memset(buf, 0, sizeof(buf));
+	if ((cond = arith_binary(p, 1)) == NULL)
+		return NULL;
 
-	if (!src) return NULL;
+	if (*arith_skip(p) != '?')
+		return cond;
 
-	while(*src)
-	{
-		if (*src == '\\' && isquote(*(src+1), QUOTE_BASE)) {
-			*dst++ = *++src;
-		} else if (*src == '"') {
-			mark = src;
-			*dst++ = *src++;
-			while(*src)
-			{
-				if (*src == '\\' && isquote(*(src+1), QUOTE_DOUBLE)) {
+	p->ptr++;
+
+	if ((ret = arith_new(A_COND, 0, NULL, NULL)) == NULL) {
+		arith_free(cond);
+		return NULL;
+	}
+	ret->cond = cond;
+
+	if ((ret->lhs = arith_assign(p)) == NULL)
+		return arith_error(p, ret);
+	if (*arith_skip(p) != ':')
+		return arith_error(p, ret);
+	p->ptr++;
+	if ((ret->rhs = arith_cond(p)) == NULL)
+		return arith_error(p, ret);
+
+	return ret;
+}
+
+/* name op= expr, which is right associative, or a conditional expression */
+static arith_t *arith_assign(arith_parser_t *p)
+{
+	const char *src = arith_skip(p);
+	const char *ptr = src;
+	arith_t *ret;
+
+	if (isalpha(*ptr) || *ptr == '_') {
+		while (isalnum(*ptr) || *ptr == '_')
+			ptr++;
+
+		const char *name_end = ptr;
+
+		while (isspace(*ptr))
+			ptr++;
+
+		for (int i = 0; arith_assign_ops[i].str; i++)
+		{
+			const size_t len = strlen(arith_assign_ops[i].str);
+
+			if (strncmp(ptr, arith_assign_ops[i].str, len) || (len == 1 && ptr[1] == '='))
+				continue;
+
+			p->ptr = ptr + len;
+
+			if ((ret = arith_new(A_ASSIGN, arith_assign_ops[i].op, NULL, NULL)) == NULL)
+				return NULL;
+			if ((ret->name = strndup(src, name_end - src)) == NULL) {
+				warn("arith_assign");
+				arith_free(ret);
+				return NULL;
+			}
+			if ((ret->rhs = arith_assign(p)) == NULL) {
+				arith_free(ret);
+				return NULL;
+			}
+			return ret;
+		}
+	}
+
+	return arith_cond(p);
+}
+
+static arith_t *arith_parse(const char *expr)
+{
+	arith_parser_t p = { .ptr = expr, .expr = expr };
+	arith_t *ret;
+
+	if ((ret = arith_assign(&p)) == NULL)
+		return NULL;
+
+	if (*arith_skip(&p))
+		return arith_error(&p, ret);
+
+	return ret;
+}
+
+static bool arith_getvar(const char *name, long *val)
+{
+	const env_t *env = getshenv(cur_sh_env, (char *)name);
+	char *end;
+
+	if (env == NULL || env->val == NULL || !*env->val) {
+		if (env == NULL && opt_nounset) {
+			warnx("%s: parameter not set", name);
+			return false;
+		}
+		*val = 0;
+		return true;
+	}
+
+	errno = 0;
+	*val = strtol(env->val, &end, 0);
+	while (isspace(*end))
+		end++;
+
+	if (errno || *end) {
+		warnx("%s: %s: bad number", name, env->val);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * set when a $name holds something other than a number: it then has to be
+ * substituted as text and the result parsed, as POSIX describes
+ */
+static bool arith_textual = false;
+
+static bool arith_getdollar(const char *name, long *val)
+{
+	const env_t *env = getshenv(cur_sh_env, (char *)name);
+	char *end;
+
+	if (env == NULL || env->val == NULL || !*env->val) {
+		arith_textual = true;
+		return false;
+	}
+
+	errno = 0;
+	*val = strtol(env->val, &end, 0);
+	while (isspace(*end))
+		end++;
+
+	if (errno || *end || end == env->val) {
+		arith_textual = true;
+		return false;
+	}
+
+	return true;
+}
+
+static bool arith_binop(const int op, const long lhs, const long rhs, long *val)
+{
+	/* wrap on overflow rather than invoking undefined behaviour */
+	const unsigned long ul = lhs, ur = rhs;
+
+	switch (op)
+	{
+		case '+':	*val = (long)(ul + ur); break;
+		case '-':	*val = (long)(ul - ur); break;
+		case '*':	*val = (long)(ul * ur); break;
+		case '/':
+		case '%':
+			if (rhs == 0) {
+				warnx("division by zero");
+				return false;
+			}
+			if (lhs == LONG_MIN && rhs == -1)
+				*val = op == '/' ? LONG_MIN : 0;
+			else
+				*val = op == '/' ? lhs / rhs : lhs % rhs;
+			break;
+		case A_SHL:	*val = (long)(ul << (ur & 63)); break;
+		case A_SHR:	*val = lhs >> (ur & 63); break;
+		case '<':	*val = lhs < rhs; break;
+		case '>':	*val = lhs > rhs; break;
+		case A_LE:	*val = lhs <= rhs; break;
+		case A_GE:	*val = lhs >= rhs; break;
+		case A_EQ:	*val = lhs == rhs; break;
+		case A_NE:	*val = lhs != rhs; break;
+		case '&':	*val = lhs & rhs; break;
+		case '^':	*val = lhs ^ rhs; break;
+		case '|':	*val = lhs | rhs; break;
+		default:
+			warnx("arith_binop: unknown operator %d", op);
+			return false;
+	}
+
+	return true;
+}
+
+static bool arith_eval(const arith_t *a, long *val)
+{
+	long lhs, rhs;
+
+	switch (a->type)
+	{
+		case A_NUM:
+			*val = a->num;
+			return true;
+		case A_VAR:
+			return a->op == '$' ? arith_getdollar(a->name, val) : arith_getvar(a->name, val);
+		case A_UNARY:
+			if (!arith_eval(a->lhs, &lhs))
+				return false;
+			switch (a->op)
+			{
+				case '-':	*val = (long)(0UL - (unsigned long)lhs); break;
+				case '~':	*val = ~lhs; break;
+				case '!':	*val = !lhs; break;
+				default:	*val = lhs; break;
+			}
+			return true;
+		case A_BINARY:
+			return arith_eval(a->lhs, &lhs) && arith_eval(a->rhs, &rhs) &&
+				arith_binop(a->op, lhs, rhs, val);
+		case A_AND:
+		case A_OR:
+			/* the right hand side is only evaluated when it decides the result */
+			if (!arith_eval(a->lhs, &lhs))
+				return false;
+			if ((a->type == A_AND) == !lhs) {
+				*val = !!lhs;
+				return true;
+			}
+			if (!arith_eval(a->rhs, &rhs))
+				return false;
+			*val = !!rhs;
+			return true;
+		case A_COND:
+			if (!arith_eval(a->cond, &lhs))
+				return false;
+			return arith_eval(lhs ? a->lhs : a->rhs, val);
+		case A_ASSIGN:
+			{
+				char buf[32];
+
+				if (!arith_eval(a->rhs, &rhs))
+					return false;
+				if (a->op) {
+					if (!arith_getvar(a->name, &lhs) || !arith_binop(a->op, lhs, rhs, &rhs))
+						return false;
+				}
+				snprintf(buf, sizeof(buf), "%ld", rhs);
+				setshenv(cur_sh_env, a->name, buf);
+				*val = rhs;
+			}
+			return true;
+	}
+
+	return false;
+}
+
+#define MATH_CACHE	64
+
+static struct {
+	char	*text;
+	arith_t	*tree;
+} math_cache[MATH_CACHE];
+
+static int math_next = 0;
+
+static arith_t *math_lookup(const char *str, const size_t len)
+{
+	arith_t *tree;
+	char *text;
+	int i;
+
+	for (i = 0; i < MATH_CACHE; i++)
+		if (math_cache[i].text && !strncmp(math_cache[i].text, str, len) &&
+				math_cache[i].text[len] == '\0')
+			return math_cache[i].tree;
+
+	if ((text = strndup(str, len)) == NULL)
+		return NULL;
+
+	if ((tree = arith_parse(text)) == NULL) {
+		free(text);
+		return NULL;
+	}
+
+	i = math_next;
+	math_next = (math_next + 1) % MATH_CACHE;
+
+	if (math_cache[i].text) free(math_cache[i].text);
+	if (math_cache[i].tree) arith_free(math_cache[i].tree);
+
+	math_cache[i].text = text;
+	math_cache[i].tree = tree;
+
+	return tree;
+}
+
+/* evaluate the arithmetic expression in expr, which holds nothing left to expand
+ * but plain $name. false without setting *rc when one of those must be expanded first */
+static bool do_math(const char *expr, const size_t len, long *val, int *rc)
+{
+	const arith_t *tree;
+
+	debug_printf("do_math: <%.*s>\n", (int)len, expr);
+
+	arith_textual = false;
+	if ((tree = math_lookup(expr, len)) == NULL || !arith_eval(tree, val)) {
+		if (!arith_textual)
+			*rc = 1;
+		return false;
+	}
+
+	return true;
+}
+
+/* true when the only expansions in an arithmetic expression are $name or ${name} on their own */
+static bool math_plain(const char *str, const size_t len)
+{
+	const char *const end = str + len;
+
+	if (memchr(str, '`', len) || memchr(str, '\\', len) || memchr(str, '"', len) || memchr(str, '\'', len))
+		return false;
+
+	for (const char *ptr = str; (ptr = memchr(ptr, '$', end - ptr)) != NULL; )
+	{
+		const bool brace = ptr + 1 < end && ptr[1] == '{';
+		const char *name = ptr + 1 + brace;
+
+		/* pasted to a word, as in 1$x, the text has to be substituted */
+		if (ptr > str && (isalnum(ptr[-1]) || ptr[-1] == '_' || ptr[-1] == '$'))
+			return false;
+		if (name >= end || !(isalpha(*name) || *name == '_'))
+			return false;
+		for (ptr = name; ptr < end && (isalnum(*ptr) || *ptr == '_'); )
+			ptr++;
+		if (brace && (ptr >= end || *ptr++ != '}'))
+			return false;
+		if (ptr < end && (isalnum(*ptr) || *ptr == '_'))
+			return false;
+	}
+
+	return true;
+}
+
+/* $..., *srcp points at the '$' and is left after the expansion */
+static bool expand_dollar(expansion_t *e, const char **srcp, const char *end, const bool dq, int *rc)
+{
+	const char *src = *srcp + 1;
+	const char flag = dq ? EXP_QUOTED : EXP_SPLIT;
+	const char *close;
+	char num[64];
+
+	if (src < end && *src == '(') {
+		close = subst_end(src + 1);
+
+		if (close == NULL || close >= end) {
+			warnx("unterminated $(");
+			*rc = 1;
+			return false;
+		}
+
+		/* $(( expr )), unless the inner parenthesis closes early as in $( (cmd); cmd ) */
+		if (src[1] == '(' && close[-1] == ')' && subst_end(src + 2) == close - 1) {
+			const char *start = src + 2;
+			const size_t len = close - 1 - start;
+			char *expr = NULL;
+			long val;
+			bool ret = false;
+
+			/* the common cases, $((i+1)) and $(($i+1)), are parsed as they are written */
+			if (!math_plain(start, len) || (!(ret = do_math(start, len, &val, rc)) && arith_textual)) {
+				if ((expr = expand_string(start, len, rc, false)) == NULL)
+					return false;
+				ret = do_math(expr, strlen(expr), &val, rc);
+			}
+
+			free(expr);
+			if (!ret)
+				return false;
+			*srcp = close + 1;
+			snprintf(num, sizeof(num), "%ld", val);
+			return exp_append(e, num, strlen(num), flag);
+		}
+
+		size_t outlen;
+		char *out = command_subst(src + 1, close - (src + 1), &outlen);
+		const bool ret = exp_append(e, out, outlen, flag);
+
+		free(out);
+		*srcp = close + 1;
+		return ret;
+	}
+
+	if (src < end && *src == '{') {
+		if ((close = brace_end(src + 1, end)) == NULL) {
+			warnx("unterminated ${");
+			*rc = 1;
+			return false;
+		}
+		*srcp = close + 1;
+		return expand_braced(e, src + 1, close, dq, rc);
+	}
+
+	const size_t nlen = param_name_len(src, end, false);
+
+	/* a lone $ is literal */
+	if (nlen == 0) {
+		*srcp = src;
+		return exp_append(e, "$", 1, dq ? EXP_QUOTED : 0);
+	}
+
+	*srcp = src + nlen;
+
+	if (nlen == 1 && (*src == '@' || *src == '*'))
+		return expand_params(e, *src, dq);
+
+	const char *val = param_value(src, nlen, num, sizeof(num));
+
+	if (val == NULL && opt_nounset && *src != '!') {
+		warnx("%.*s: parameter not set", (int)nlen, src);
+		*rc = 1;
+		return false;
+	}
+
+	return val ? exp_append(e, val, strlen(val), flag) : true;
+}
+
+/* ~ or ~user at the start of a word, *srcp is left after the login name */
+static bool expand_tilde(expansion_t *e, const char **srcp, const char *end)
+{
+	const char *src = *srcp + 1;
+	const char *start = src;
+	const char *home = NULL;
+
+	while (src < end && *src != '/')
+	{
+		if (!isalnum(*src) && *src != '_' && *src != '-' && *src != '.') {
+			(*srcp)++;
+			return exp_append(e, "~", 1, 0);
+		}
+		src++;
+	}
+
+	if (src == start) {
+		const env_t *env = getshenv(cur_sh_env, "HOME");
+		home = env ? env->val : getenv("HOME");
+	} else {
+		char name[LOGIN_NAME_MAX + 1];
+		const struct passwd *pw;
+
+		if ((size_t)(src - start) < sizeof(name)) {
+			memcpy(name, start, src - start);
+			name[src - start] = '\0';
+			if ((pw = getpwnam(name)) != NULL)
+				home = pw->pw_dir;
+		}
+	}
+
+	/* unknown users are left alone */
+	if (home == NULL) {
+		(*srcp)++;
+		return exp_append(e, "~", 1, 0);
+	}
+
+	*srcp = src;
+	return exp_append(e, "", 1, EXP_MARK) && exp_append(e, home, strlen(home), EXP_QUOTED);
+}
+
+/* expand the text between src and end, appending to e */
+static bool expand_into(expansion_t *e, const char *src, const char *end, bool dq, const bool tilde, int *rc)
+{
+	size_t dq_start = e->text.len;
+
+	if (tilde && !dq && src < end && *src == '~' && !expand_tilde(e, &src, end))
+		return false;
+
+	while (src < end)
+	{
+		switch (*src)
+		{
+			case '$':
+				if (!expand_dollar(e, &src, end, dq, rc))
+					return false;
+				continue;
+
+			case '`':
+				{
+					strbuf_t cmd = {0};
+					size_t outlen;
+
+					/* only \$, \` and \\ are special inside backquotes */
+					for (src++; src < end && *src != '`'; src++)
+					{
+						if (*src == '\\' && src + 1 < end &&
+								(src[1] == '$' || src[1] == '`' || src[1] == '\\' || (dq && src[1] == '"')))
+							src++;
+						strbuf_append(&cmd, src, 1);
+					}
+					if (src < end)
+						src++;
+
+					char *out = command_subst(cmd.buf ? cmd.buf : "", cmd.len, &outlen);
+					const bool ret = exp_append(e, out, outlen, dq ? EXP_QUOTED : EXP_SPLIT);
+					free(out);
+					free(cmd.buf);
+					if (!ret)
+						return false;
+				}
+				continue;
+
+			case '"':
+				if (e->here)
+					break;
+				/* "" is an empty field, but "$@" with no parameters is none */
+				if (!dq) {
+					e->at_empty = false;
+					dq_start = e->text.len;
+				} else if (e->text.len == dq_start && !e->at_empty &&
+						!exp_append(e, "", 1, EXP_MARK))
+					return false;
+				dq = !dq;
+				src++;
+				continue;
+
+			case '\'':
+				if (dq)
+					break;
+				{
+					const char *start = ++src;
+
+					while (src < end && *src != '\'')
+						src++;
+					if (!exp_append(e, "", 1, EXP_MARK) ||
+							!exp_append(e, start, src - start, EXP_QUOTED))
+						return false;
+					if (src < end)
+						src++;
+				}
+				continue;
+
+			case '\\':
+				if (src + 1 >= end) 
+					break;
+				if (dq && !strchr(e->here ? "$`\\\n" : "$`\"\\\n", src[1]))
+					break;
+				src++;
+				/* backslash-newline is a line continuation */
+				if (*src == '\n') {
+					src++;
+					continue;
+				}
+				if (!exp_append(e, src++, 1, EXP_QUOTED))
+					return false;
+				continue;
+		}
+
+		if (!exp_append(e, src++, 1, dq ? EXP_QUOTED : 0))
+			return false;
+	}
+
+	return true;
+}
+
+static bool strlist_push(strlist_t *sl, char *str)
+{
+	if (sl->cnt + 2 > sl->size) {
+		const int size = sl->size ? sl->size * 2 : 8;
+		char **tmp = realloc(sl->list, size * sizeof(char *));
+
+		if (tmp == NULL) {
+			warn("strlist_push");
+			return false;
+		}
+		sl->list = tmp;
+		sl->size = size;
+	}
+
+	sl->list[sl->cnt++] = str;
+	sl->list[sl->cnt] = NULL;
+	return true;
+}
+
+static void strlist_free(strlist_t *sl)
+{
+	for (int i = 0; i < sl->cnt; i++)
+		free(sl->list[i]);
+	free(sl->list);
+	memset(sl, 0, sizeof(strlist_t));
+}
+
+/*
+ * join the expansion into one string. with pattern set, quoted pattern
+ * characters are escaped so fnmatch(3) and glob(3) treat them literally
+ */
+static char *exp_join(const expansion_t *e, const size_t from, const size_t to, const bool pattern)
+{
+	strbuf_t out = {0};
+
+	if (!strbuf_grow(&out, to - from))
+		return NULL;
+
+	for (size_t i = from; i < to; i++)
+	{
+		const char c = e->text.buf[i];
+		const char flag = e->flags.buf[i];
+
+		if (flag & EXP_MARK)
+			continue;
+		if (flag & EXP_BREAK) {
+			strbuf_append(&out, " ", 1);
+			continue;
+		}
+		if (pattern && (flag & EXP_QUOTED) && strchr("*?[]\\", c))
+			strbuf_append(&out, "\\", 1);
+		if (!strbuf_append(&out, &c, 1)) {
+			free(out.buf);
+			return NULL;
+		}
+	}
+
+	out.buf[out.len] = '\0';
+	return out.buf;
+}
+
+static char *expand_string(const char *src, const size_t len, int *rc, const bool pattern)
+{
+	expansion_t e = {0};
+	char *ret = NULL;
+
+	if (expand_into(&e, src, src + len, false, false, rc))
+		ret = exp_join(&e, 0, e.text.len, pattern);
+
+	exp_free(&e);
+	return ret;
+}
+
+/*
+ * Pathname expansion. Each directory a pattern segment needs is read once,
+ * keeping d_type so that only symbolic links and unknown types are
+ * stat'd, and the listing is kept until the current command has been
+ * expanded, so "*.c *.h" reads the directory once.
+ */
+#define DIR_CACHE	16
+
+typedef struct {
+	char			*path;		/* as written in the pattern, "" for . */
+	char			*names;		/* entry names, each NUL terminated */
+	size_t			*offs;		/* start of each name */
+	unsigned char	*types;		/* d_type of each entry */
+	size_t			 cnt;
+} dirlist_t;
+
+static dirlist_t dir_cache[DIR_CACHE];
+static int dir_cache_next = 0;
+
+/* a pattern segment, with the common forms matched without fnmatch(3) */
+enum { SEG_LITERAL, SEG_ANY, SEG_PREFIX, SEG_SUFFIX, SEG_FNMATCH };
+
+typedef struct {
+	char		*pat;
+	char		*lit;			/* unescaped literal part */
+	size_t		 litlen;
+	int			 kind;
+	bool		 dot;			/* matches names starting with . */
+} globseg_t;
+
+static void dirlist_free(dirlist_t *dl)
+{
+	free(dl->path);
+	free(dl->names);
+	free(dl->offs);
+	free(dl->types);
+	memset(dl, 0, sizeof(dirlist_t));
+}
+
+/* called once the words of a command have been expanded */
+static void dir_cache_flush(void)
+{
+	for (int i = 0; i < DIR_CACHE; i++)
+		if (dir_cache[i].path)
+			dirlist_free(&dir_cache[i]);
+	dir_cache_next = 0;
+}
+
+static const dirlist_t *dir_read(const char *path)
+{
+	strbuf_t names = {0};
+	size_t *offs = NULL;
+	unsigned char *types = NULL;
+	size_t cnt = 0, size = 0;
+	const struct dirent *ent;
+	dirlist_t *dl;
+	DIR *dir;
+
+	for (int i = 0; i < DIR_CACHE; i++)
+		if (dir_cache[i].path && !strcmp(dir_cache[i].path, path))
+			return &dir_cache[i];
+
+	if ((dir = opendir(*path ? path : ".")) == NULL)
+		return NULL;
+
+	while ((ent = readdir(dir)) != NULL)
+	{
+		if (ent->d_name[0] == '.' && (!ent->d_name[1] || (ent->d_name[1] == '.' && !ent->d_name[2])))
+			continue;
+
+		if (cnt == size) {
+			size_t *tmp_offs;
+			unsigned char *tmp_types;
+
+			size = size ? size * 2 : 64;
+			if ((tmp_offs = realloc(offs, size * sizeof(size_t))) == NULL)
+				goto fail;
+			offs = tmp_offs;
+			if ((tmp_types = realloc(types, size)) == NULL)
+				goto fail;
+			types = tmp_types;
+		}
+
+		offs[cnt] = names.len;
+		types[cnt++] = ent->d_type;
+		if (!strbuf_append(&names, ent->d_name, strlen(ent->d_name) + 1))
+			goto fail;
+	}
+
+	closedir(dir);
+
+	dl = &dir_cache[dir_cache_next];
+	dir_cache_next = (dir_cache_next + 1) % DIR_CACHE;
+	if (dl->path)
+		dirlist_free(dl);
+
+	if ((dl->path = strdup(path)) == NULL) {
+		free(names.buf);
+		free(offs);
+		free(types);
+		return NULL;
+	}
+
+	dl->names = names.buf;
+	dl->offs = offs;
+	dl->types = types;
+	dl->cnt = cnt;
+	return dl;
+fail:
+	warn("dir_read");
+	closedir(dir);
+	free(names.buf);
+	free(offs);
+	free(types);
+	return NULL;
+}
+
+/* true if the pattern has an unescaped *, ? or [ */
+static bool glob_has_meta(const char *pat)
+{
+	for (; *pat; pat++)
+	{
+		if (*pat == '\\' && pat[1])
+			pat++;
+		else if (*pat == '*' || *pat == '?' || *pat == '[')
+			return true;
+	}
+
+	return false;
+}
+
+static void glob_seg_init(globseg_t *seg, char *pat)
+{
+	const size_t len = strlen(pat);
+	char *dst;
+
+	seg->pat = pat;
+	seg->dot = *pat == '.' || (*pat == '\\' && pat[1] == '.');
+	seg->litlen = 0;
+
+	if ((seg->lit = malloc(len + 1)) == NULL) {
+		seg->kind = SEG_FNMATCH;
+		return;
+	}
+
+	/* *literal and literal* need no fnmatch */
+	if (!glob_has_meta(pat))
+		seg->kind = SEG_LITERAL;
+	else if (*pat == '*' && !glob_has_meta(pat + 1))
+		seg->kind = pat[1] ? SEG_SUFFIX : SEG_ANY;
+	else if (len > 1 && pat[len - 1] == '*' && pat[len - 2] != '\\') {
+		pat[len - 1] = '\0';
+		seg->kind = glob_has_meta(pat) ? SEG_FNMATCH : SEG_PREFIX;
+		pat[len - 1] = '*';
+	} else
+		seg->kind = SEG_FNMATCH;
+
+	dst = seg->lit;
+	for (const char *src = pat + (seg->kind == SEG_SUFFIX || seg->kind == SEG_ANY);
+			*src && !(seg->kind == SEG_PREFIX && src == pat + len - 1); src++)
+	{
+		if (*src == '\\' && src[1])
+			src++;
+		*dst++ = *src;
+	}
+	*dst = '\0';
+	seg->litlen = dst - seg->lit;
+}
+
+static bool glob_seg_match(const globseg_t *seg, const char *name)
+{
+	if (*name == '.' && !seg->dot)
+		return false;
+
+	switch (seg->kind)
+	{
+		case SEG_LITERAL:
+			return !strcmp(name, seg->lit);
+		case SEG_ANY:
+			return true;
+		case SEG_PREFIX:
+			return !strncmp(name, seg->lit, seg->litlen);
+		case SEG_SUFFIX:
+			{
+				const size_t len = strlen(name);
+				return len >= seg->litlen && !memcmp(name + len - seg->litlen, seg->lit, seg->litlen);
+			}
+	}
+
+	return !fnmatch(seg->pat, name, FNM_PERIOD);
+}
+
+static bool glob_walk(strbuf_t *path, globseg_t *segs, const int nsegs, const int idx, strlist_t *out)
+{
+	const globseg_t *seg = &segs[idx];
+	const size_t len = path->len;
+	const bool last = idx == nsegs - 1;
+	const dirlist_t *dl;
+	struct stat sb;
+
+	/* literal segments are only checked for once the whole path is built */
+	if (seg->kind == SEG_LITERAL) {
+		if (!strbuf_append(path, seg->lit, seg->litlen))
+			return false;
+
+		if (!last) {
+			const bool ret = strbuf_append(path, "/", 1) && glob_walk(path, segs, nsegs, idx + 1, out);
+			path->len = len;
+			return ret;
+		}
+
+		if (lstat(path->buf, &sb) == 0) {
+			char *tmp = strdup(path->buf);
+			if (tmp == NULL || !strlist_push(out, tmp)) {
+				free(tmp);
+				return false;
+			}
+		}
+		path->len = len;
+		return true;
+	}
+
+	if (!strbuf_grow(path, 0))
+		return false;
+	path->buf[len] = '\0';
+
+	if ((dl = dir_read(path->buf)) == NULL)
+		return true;
+
+	for (size_t i = 0; i < dl->cnt; i++)
+	{
+		const char *name = dl->names + dl->offs[i];
+
+		if (!glob_seg_match(seg, name))
+			continue;
+
+		if (!strbuf_append(path, name, strlen(name)))
+			return false;
+
+		if (last) {
+			char *tmp = strdup(path->buf);
+			if (tmp == NULL || !strlist_push(out, tmp)) {
+				free(tmp);
+				return false;
+			}
+		} else if (dl->types[i] == DT_DIR || ((dl->types[i] == DT_LNK || dl->types[i] == DT_UNKNOWN) &&
+					stat(path->buf, &sb) == 0 && S_ISDIR(sb.st_mode))) {
+			if (!strbuf_append(path, "/", 1) || !glob_walk(path, segs, nsegs, idx + 1, out))
+				return false;
+
+			/* the listing may have been evicted by a deeper level */
+			path->len = len;
+			path->buf[len] = '\0';
+			if ((dl = dir_read(path->buf)) == NULL)
+				return true;
+		}
+
+		path->len = len;
+	}
+
+	return true;
+}
+
+/* byte order, so results do not depend on the locale */
+static int glob_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* expand the pattern, appending sorted matches to out */
+static bool glob_expand(const char *pattern, strlist_t *out)
+{
+	globseg_t *segs = NULL;
+	strbuf_t path = {0};
+	char *pat, *ptr;
+	int nsegs = 1;
+	const int start = out->cnt;
+	bool ret = false;
+
+	if ((pat = strdup(pattern)) == NULL)
+		return false;
+
+	for (ptr = pat; *ptr; ptr++)
+		if (*ptr == '/')
+			nsegs++;
+
+	if ((segs = calloc(nsegs, sizeof(globseg_t))) == NULL)
+		goto done;
+
+	nsegs = 0;
+	for (ptr = pat;; ptr++)
+	{
+		char *end = strchr(ptr, '/');
+
+		if (end)
+			*end = '\0';
+		glob_seg_init(&segs[nsegs++], ptr);
+		if (segs[nsegs - 1].lit == NULL || !end)
+			break;
+		ptr = end;
+	}
+
+	if (segs[nsegs - 1].lit == NULL)
+		goto done;
+
+	ret = glob_walk(&path, segs, nsegs, 0, out);
+
+	if (out->cnt - start > 1)
+		qsort(out->list + start, out->cnt - start, sizeof(char *), glob_cmp);
+
+done:
+	for (int i = 0; segs && i < nsegs; i++)
+		free(segs[i].lit);
+	free(segs);
+	free(path.buf);
+	free(pat);
+	return ret;
+}
+
+/* add the field between from and to, performing pathname expansion */
+static bool exp_field(const expansion_t *e, const size_t from, const size_t to, strlist_t *out)
+{
+	bool pattern = false;
+
+	for (size_t i = from; !opt_noglob && i < to; i++)
+		if (!e->flags.buf[i] && strchr("*?[", e->text.buf[i])) {
+			pattern = true;
+			break;
+		}
+
+	if (pattern) {
+		char *pat = exp_join(e, from, to, true);
+		const int before = out->cnt;
+
+		if (pat == NULL)
+			return false;
+
+		const bool ret = glob_expand(pat, out);
+		free(pat);
+
+		/* a pattern that matches nothing is left as it is */
+		if (!ret || out->cnt > before)
+			return ret;
+	}
+
+	char *tmp = exp_join(e, from, to, false);
+	if (tmp == NULL || !strlist_push(out, tmp)) {
+		free(tmp);
+		return false;
+	}
+	return true;
+}
+
+/* split the expansion into fields using IFS, then expand pathnames */
+static bool exp_split(const expansion_t *e, strlist_t *out)
+{
+	const env_t *env = getshenv(cur_sh_env, "IFS");
+	const char *ifs = env ? env->val : " \t\n";
+	const char *text = e->text.buf;
+	const char *flags = e->flags.buf;
+	size_t start = 0;
+	bool have_field = false, ws_ended = false;
+
+	for (size_t i = 0; i < e->text.len; i++)
+	{
+		if (flags[i] & EXP_BREAK) {
+			if (have_field && !exp_field(e, start, i, out))
+				return false;
+			have_field = ws_ended = false;
+			start = i + 1;
+			continue;
+		}
+
+		if (!(flags[i] & EXP_SPLIT) || !*ifs || !strchr(ifs, text[i])) {
+			have_field = true;
+			ws_ended = false;
+			continue;
+		}
+
+		if (isspace(text[i])) {
+			/* IFS white space ends a field, runs of it are one delimiter */
+			if (have_field) {
+				if (!exp_field(e, start, i, out))
+					return false;
+				ws_ended = true;
+			}
+		} else if (ws_ended)
+			/* other IFS characters absorb the white space before them */
+			ws_ended = false;
+		else if (!exp_field(e, start, i, out))
+			return false;
+
+		have_field = false;
+		start = i + 1;
+	}
+
+	if (have_field && !exp_field(e, start, e->text.len, out))
+		return false;
+
+	return true;
+}
+
+/* expand a word without field splitting or pathname expansion */
+char *expand(const char *restrict str, int *rc)
+{
+	if (!str)
+		return NULL;
+
+	debug_printf("expand: <%s>\n", str);
+
+	return expand_string(str, strlen(str), rc, false);
+}
+
+/* expand the body of a here-document: parameters, commands and arithmetic,
+ * with backslash quoting only $, `, \ and newline */
+static char *expand_here_doc(const char *restrict str, const size_t len, int *rc)
+{
+	expansion_t e = {0};
+	char *ret = NULL;
+
+	e.here = true;
+	if (expand_into(&e, str, str + len, true, false, rc))
+		ret = exp_join(&e, 0, e.text.len, false);
+
+	exp_free(&e);
+	return ret;
+}
+
+/* expand a word into zero or more fields, appending them to out */
+static bool expand_fields(const char *restrict str, strlist_t *restrict out, int *rc)
+{
+	expansion_t e = {0};
+	bool ret;
+
+	debug_printf("expand_fields: <%s>\n", str);
+
+	if ((ret = expand_into(&e, str, str + strlen(str), false, true, rc)))
+		ret = exp_split(&e, out);
+
+	exp_free(&e);
+	return ret;
+}
+
+/* expand a node, discarding any previous result so the same tree can be
+ * evaluated again, e.g. by a loop or function body */
+static char *reexpand(node *n, int *rc)
+{
+	if (n->evaluated) {
+		free(n->evaluated);
+		n->evaluated = NULL;
+	}
+
+	return (n->evaluated = expand(n->value, rc));
+}
+
+static int call_function(func_t *fn, const int argc, char *argv[], int pad)
+{
+	char **save_argv = cur_sh_env->argv;
+	const int save_argc = cur_sh_env->argc;
+	char **args = NULL;
+	int rc = 0;
+
+	/* argv points into the caller's tree, which a recursive call will re-expand */
+	for (int i = 0; i < argc; i++)
+		if (!push(&args, strdup(argv[i])))
+			return EXIT_FAILURE;
+
+	cur_sh_env->argv = args;
+	cur_sh_env->argc = argc;
+	fn->active++;
+
+	const uint64_t start = opt_profile ? now_ns() : 0;
+	const uint64_t inner = prof_inner;
+	prof_inner = 0;
+
+	if (fn->body)
+		rc = evaluate(fn->body, pad, 1);
+
+	if (opt_profile) {
+		const uint64_t elapsed = now_ns() - start;
+
+		fn->calls++;
+		fn->prof_total += elapsed;
+		fn->prof_self += elapsed - prof_inner;
+		prof_inner = inner + elapsed;
+	}
+
+	if (--fn->active == 0 && fn->retired) {
+		freeNode(fn->retired, true);
+		fn->retired = NULL;
+	}
+
+	cur_sh_env->argv = save_argv;
+	cur_sh_env->argc = save_argc;
+
+	for (int i = 0; args && args[i]; i++)
+		free(args[i]);
+	free(args);
+
+	return rc;
+}
+
+/*
+ * Redirections are not made in the shell itself. The fds a command
+ * redirects are opened into cur_sh_env->fds[], above the range a command
+ * can name, and redirect_child() moves them into place in the next child
+ * the shell creates, so a redirected function or loop passes them on to
+ * the commands it runs. Builtins that run in the shell swap them in and
+ * out around the call, with redirect_enter() and redirect_leave().
+ */
+
+/* move fd out of the way of the fds commands redirect */
+static int fd_high(const int fd)
+{
+	int ret;
+
+	if (fd == -1 || fd >= NUM_FDS)
+		return fd;
+
+	if ((ret = fcntl(fd, F_DUPFD_CLOEXEC, NUM_FDS)) == -1)
+		warn("fcntl");
+	close(fd);
+	return ret;
+}
+
+static bool write_all(const int fd, const char *buf, size_t len)
+{
+	ssize_t rc;
+
+	while (len)
+	{
+		if ((rc = write(fd, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		buf += rc;
+		len -= rc;
+	}
+
+	return true;
+}
+
+/*
+ * An fd to read a here-document from. A body that fits in a pipe is
+ * written to it before the command starts, a larger one goes to an
+ * anonymous memory file, so no here-document ever touches the disk.
+ */
+static int here_doc_open(const char *body, const size_t len)
+{
+	int fds[2];
+	long size = PIPE_BUF;
+	pid_t pid;
+
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		warn("pipe");
+		return -1;
+	}
+
+#ifdef F_GETPIPE_SZ
+	if ((size = fcntl(fds[1], F_GETPIPE_SZ)) == -1)
+		size = PIPE_BUF;
+#endif
+
+	if ((size_t)size >= len) {
+		if (!write_all(fds[1], body, len))
+			warn("here-document");
+		close(fds[1]);
+		return fd_high(fds[0]);
+	}
+
+#ifdef MFD_CLOEXEC
+	int fd;
+
+	if ((fd = memfd_create("sh-here-doc", MFD_CLOEXEC)) != -1) {
+		close(fds[0]);
+		close(fds[1]);
+
+		if (!write_all(fd, body, len) || lseek(fd, 0, SEEK_SET) == -1) {
+			warn("here-document");
+			close(fd);
+			return -1;
+		}
+		return fd_high(fd);
+	}
+#endif
+
+	/* no memory files: a grandchild, which nobody waits for, fills the pipe */
+	if ((pid = fork()) == -1) {
+		warn("fork");
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	} else if (pid == 0) {
+		if (fork() == 0) {
+			close(fds[0]);
+			_exit(write_all(fds[1], body, len) ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+		_exit(EXIT_SUCCESS);
+	}
+
+	while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) ;
+	close(fds[1]);
+	return fd_high(fds[0]);
+}
+
+/* in a new child: put the fds of the command it runs in place */
+static void redirect_child(void)
+{
+	for (int i = 0; i < NUM_FDS; i++)
+	{
+		const int fd = cur_sh_env->fds[i];
+
+		if (fd == -1)
+			continue;
+
+		if (fd == FD_CLOSED)
+			close(i);
+		else if (dup2(fd, i) == -1)
+			warn("dup2");
+		else
+			close(fd);
+		cur_sh_env->fds[i] = -1;
+	}
+}
+
+/* after a builtin run in the shell: put the shell's own fds back */
+static void redirect_leave(const int save[NUM_FDS])
+{
+	fflush(stdout);
+
+	for (int i = 0; i < NUM_FDS; i++)
+	{
+		if (save[i] == -1)
+			continue;
+
+		if (save[i] == FD_CLOSED)
+			close(i);
+		else {
+			dup2(save[i], i);
+			close(save[i]);
+		}
+
+		/* an end of file seen on the redirection is not the shell's */
+		if (i == STDIN_FILENO)
+			clearerr(stdin);
+	}
+}
+
+/* for a builtin run in the shell: the shell's own fds are kept in save */
+static bool redirect_enter(int save[NUM_FDS])
+{
+	fflush(stdout);
+
+	for (int i = 0; i < NUM_FDS; i++)
+		save[i] = -1;
+
+	for (int i = 0; i < NUM_FDS; i++)
+	{
+		const int fd = cur_sh_env->fds[i];
+
+		if (fd == -1)
+			continue;
+
+		if ((save[i] = fcntl(i, F_DUPFD_CLOEXEC, NUM_FDS)) == -1) {
+			if (errno != EBADF) {
+				warn("fcntl");
+				redirect_leave(save);
+				return false;
+			}
+			save[i] = FD_CLOSED;
+		}
+
+		if (fd == FD_CLOSED)
+			close(i);
+		else if (dup2(fd, i) == -1) {
+			warn("dup2");
+			redirect_leave(save);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* in the shell, once the command has run: close its fds */
+static void redirect_restore(const int save[NUM_FDS])
+{
+	for (int i = 0; i < NUM_FDS; i++)
+	{
+		if (cur_sh_env->fds[i] != save[i] && cur_sh_env->fds[i] >= 0)
+			close(cur_sh_env->fds[i]);
+		cur_sh_env->fds[i] = save[i];
+	}
+}
+
+/* open the file a redirection names, with noclobber honoured by > */
+static int redirect_file(const int token, const char *path)
+{
+	struct stat sb;
+	int fd;
+
+	switch (token)
+	{
+		case '<':
+			return open(path, O_RDONLY|O_CLOEXEC);
+		case LESSGREAT:
+			return open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0666);
+		case DGREAT:
+			return open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0666);
+		case '>':
+			if (opt_noclobber) {
+				if ((fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0666)) != -1 || errno != EEXIST)
+					return fd;
+				/* only an existing regular file is protected, not e.g. /dev/null */
+				if ((fd = open(path, O_WRONLY|O_CLOEXEC)) != -1 && fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+					close(fd);
+					errno = EEXIST;
+					return -1;
+				}
+				return fd;
+			}
+			/* FALLTHROUGH */
+		case CLOBBER:
+			return open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+/* n>&m or n<&m: a copy of whatever m is for this command, or - to close n */
+static int redirect_dup(const char *word, const int fds[NUM_FDS])
+{
+	char *end;
+	long src;
+	int fd;
+
+	if (!strcmp(word, "-"))
+		return FD_CLOSED;
+
+	errno = 0;
+	src = strtol(word, &end, 10);
+	if (!*word || *end || errno || src < 0 || src > INT_MAX) {
+		warnx("%s: ambiguous redirect", word);
+		return -1;
+	}
+
+	if (src < NUM_FDS && fds[src] == FD_CLOSED) {
+		warnx("%s: bad file descriptor", word);
+		return -1;
+	}
+
+	if (src < NUM_FDS && fds[src] != -1)
+		src = fds[src];
+
+	if ((fd = fcntl(src, F_DUPFD_CLOEXEC, NUM_FDS)) == -1)
+		warn("%s", word);
+
+	return fd;
+}
+
+/*
+ * Open the redirections of a command, left to right, so 2>&1 copies what
+ * fd 1 is by then. Nothing is installed until every one has been opened,
+ * so command substitutions in a file name or here-document never see the
+ * others. The fds that were pending before are left in save.
+ */
+static bool redirect_open(const node *list0, const node *list1, int save[NUM_FDS], int *rc)
+{
+	const node *lists[2] = { list0, list1 };
+	int fds[NUM_FDS];
+	bool ret = true;
+
+	memcpy(save, cur_sh_env->fds, sizeof(int) * NUM_FDS);
+	memcpy(fds, cur_sh_env->fds, sizeof(int) * NUM_FDS);
+
+	for (int i = 0; ret && i < 2; i++)
+		for (const node *tmp = lists[i]; tmp; tmp = tmp->next)
+		{
+			const int num = tmp->num;
+			char *word = NULL;
+			int fd = -1;
+
+			if (tmp->type != N_IOREDIRECT)
+				continue;
+
+			if (num < 0 || num >= NUM_FDS) {
+				warnx("%d: bad file descriptor", num);
+				ret = false;
+				break;
+			}
+
+			if (tmp->token == DLESS || tmp->token == DLESSDASH) {
+				const char *body = tmp->arg0 ? tmp->arg0->value : "";
+
+				/* a quoted delimiter, or a body with nothing to expand, is used as is */
+				if (strpbrk(tmp->value, "'\"\\") || !strpbrk(body, "$`\\"))
+					fd = here_doc_open(body, strlen(body));
+				else if ((word = expand_here_doc(body, strlen(body), rc)) != NULL)
+					fd = here_doc_open(word, strlen(word));
+			} else if ((word = expand(tmp->value, rc)) == NULL) {
+				fd = -1;
+			} else if (tmp->token == LESSAND || tmp->token == GREATAND) {
+				fd = redirect_dup(word, fds);
+			} else if ((fd = fd_high(redirect_file(tmp->token, word))) == -1) {
+				warn("%s", word);
+			}
+
+			free(word);
+
+			if (fd == -1) {
+				ret = false;
+				break;
+			}
+
+			if (fds[num] != save[num] && fds[num] >= 0)
+				close(fds[num]);
+			fds[num] = fd;
+		}
+
+	if (!ret) {
+		for (int i = 0; i < NUM_FDS; i++)
+			if (fds[i] != save[i] && fds[i] >= 0)
+				close(fds[i]);
+		*rc = EXIT_FAILURE;
+		return false;
+	}
+
+	memcpy(cur_sh_env->fds, fds, sizeof(int) * NUM_FDS);
+	return true;
+}
+
+/* job control: every child the shell does not wait for straight away is a
+ * job. SIGCHLD only writes to a self-pipe, made once at startup and again
+ * in each subshell, so a job stopped in the foreground and resumed with bg
+ * is seen too; children are reaped at safe points, and wait sleeps on the
+ * pipe rather than polling */
+
+static int sigchld_pipe[2] = {-1, -1};
+static pid_t shell_pgid = 0;
+static bool have_tty = false;		/* the shell owns the terminal, for fg */
+static bool interactive = false;
+
+static void sigchld_handler(int sig __attribute__((unused)))
+{
+	const int save = errno;
+
+	/* fails harmlessly when the pipe is full or there are no jobs */
+	if (write(sigchld_pipe[1], "", 1) == -1) {
+	}
+	errno = save;
+}
+
+/* above the fds commands redirect, so an exec 3>file never lands on it */
+static bool jobs_pipe(void)
+{
+	if (pipe2(sigchld_pipe, O_CLOEXEC|O_NONBLOCK) == -1) {
+		warn("pipe");
+		sigchld_pipe[0] = sigchld_pipe[1] = -1;
+		return false;
+	}
+
+	sigchld_pipe[0] = fd_high(sigchld_pipe[0]);
+	sigchld_pipe[1] = fd_high(sigchld_pipe[1]);
+	return true;
+}
+
+static void jobs_init(void)
+{
+	struct sigaction sa;
+
+	/* made before any child can exist, so no SIGCHLD is missed */
+	jobs_pipe();
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigchld_handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+
+	if (!opt_monitor || !isatty(STDIN_FILENO))
+		return;
+
+	/* wait until we are in the foreground, then take our own process group */
+	while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp()))
+		kill(-shell_pgid, SIGTTIN);
+
+	signal(SIGTSTP, SIG_IGN);
+	signal(SIGTTIN, SIG_IGN);
+	signal(SIGTTOU, SIG_IGN);
+
+	shell_pgid = getpid();
+	if (setpgid(0, shell_pgid) == -1 && errno != EPERM)
+		warn("setpgid");
+	have_tty = tcsetpgrp(STDIN_FILENO, shell_pgid) == 0;
+}
+
+static void job_free(job_t *job)
+{
+	if (!job)
+		return;
+
+	free(job->pids);
+	free(job->status);
+	free(job->cmd);
+	free(job);
+}
+
+/* a subshell starts with no jobs of its own and no job control */
+static void jobs_reset(void)
+{
+	job_t **jobs = cur_sh_env->jobs;
+
+	for (int i = 0; jobs && jobs[i]; i++)
+		job_free(jobs[i]);
+	free(jobs);
+	cur_sh_env->jobs = NULL;
+	cur_sh_env->last_async = 0;
+
+	/* a pipe of its own, so its children do not wake the parent */
+	if (sigchld_pipe[0] != -1) {
+		close(sigchld_pipe[0]);
+		close(sigchld_pipe[1]);
+	}
+	jobs_pipe();
+
+	opt_monitor = 0;
+	have_tty = false;
+	interactive = false;
+}
+
+/* called in each child: its own process group under job control */
+static void job_child(pid_t pgid, const bool fg)
+{
+	if (opt_monitor) {
+		if (pgid == 0)
+			pgid = getpid();
+		setpgid(0, pgid);
+		if (fg && have_tty)
+			tcsetpgrp(STDIN_FILENO, pgid);
+		signal(SIGTSTP, SIG_DFL);
+		signal(SIGTTIN, SIG_DFL);
+		signal(SIGTTOU, SIG_DFL);
+	}
+
+	jobs_reset();
+	redirect_child();
+}
+
+static job_t *job_new(const char *cmd)
+{
+	job_t *job;
+
+	if ((job = calloc(1, sizeof(job_t))) == NULL ||
+			(job->cmd = strdup(cmd ? cmd : "")) == NULL) {
+		warn("job_new");
+		free(job);
+		return NULL;
+	}
+
+	return job;
+}
+
+static bool job_add_pid(job_t *job, const pid_t pid)
+{
+	pid_t *pids;
+	int *status;
+
+	if ((pids = realloc(job->pids, sizeof(pid_t) * (job->npids + 1))) == NULL)
+		goto fail;
+	job->pids = pids;
+
+	if ((status = realloc(job->status, sizeof(int) * (job->npids + 1))) == NULL)
+		goto fail;
+	job->status = status;
+
+	if (job->pgid == 0)
+		job->pgid = pid;
+	if (opt_monitor)
+		setpgid(pid, job->pgid);
+
+	job->pids[job->npids] = pid;
+	job->status[job->npids++] = -1;
+	return true;
+fail:
+	warn("job_add_pid");
+	return false;
+}
+
+/* add a job to the table, giving it the lowest free job number */
+static bool job_register(job_t *job)
+{
+	job_t **jobs = cur_sh_env->jobs;
+	int cnt = 0, id = 1;
+
+	for (cnt = 0; jobs && jobs[cnt]; cnt++)
+		if (jobs[cnt]->id >= id)
+			id = jobs[cnt]->id + 1;
+
+	if ((jobs = realloc(jobs, sizeof(job_t *) * (cnt + 2))) == NULL) {
+		warn("job_register");
+		return false;
+	}
+
+	job->id = id;
+	jobs[cnt] = job;
+	jobs[cnt + 1] = NULL;
+	cur_sh_env->jobs = jobs;
+	return true;
+}
+
+static void job_remove(job_t *job)
+{
+	job_t **jobs = cur_sh_env->jobs;
+	int i;
+
+	for (i = 0; jobs && jobs[i] && jobs[i] != job; i++) ;
+
+	if (jobs && jobs[i])
+		for (; jobs[i]; i++)
+			jobs[i] = jobs[i + 1];
+
+	job_free(job);
+}
+
+static int status_rc(const int status)
+{
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	if (WIFSTOPPED(status))
+		return 128 + WSTOPSIG(status);
+	return EXIT_FAILURE;
+}
+
+static const char *job_state(const job_t *job)
+{
+	switch (job->state)
+	{
+		case JOB_RUNNING:	return "Running";
+		case JOB_STOPPED:	return "Stopped";
+	}
+
+	return job->npids && status_rc(job->status[job->npids - 1]) ? "Done(1)" : "Done";
+}
+
+/* collect every child that has changed state, without blocking */
+static void jobs_reap(void)
+{
+	char buf[64];
+	int status;
+	pid_t pid;
+
+	if (cur_sh_env->jobs == NULL)
+		return;
+
+	if (sigchld_pipe[0] != -1)
+		while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0) ;
+
+	while ((pid = wait_child(-1, &status, WNOHANG|WUNTRACED|WCONTINUED)) > 0)
+	{
+		for (int i = 0; cur_sh_env->jobs[i]; i++)
+		{
+			job_t *job = cur_sh_env->jobs[i];
+			int j, running = 0;
+
+			for (j = 0; j < job->npids && job->pids[j] != pid; j++) ;
+			if (j == job->npids)
+				continue;
+
+			if (WIFSTOPPED(status))
+				job->state = JOB_STOPPED;
+			else if (WIFCONTINUED(status))
+				job->state = JOB_RUNNING;
+			else
+				job->status[j] = status;
+
+			for (j = 0; j < job->npids; j++)
+				if (job->status[j] == -1)
+					running++;
+			if (!running)
+				job->state = JOB_DONE;
+			break;
+		}
+	}
+}
+
+/* sleep until a child changes state */
+static void jobs_block(void)
+{
+	struct pollfd pfd = { .fd = sigchld_pipe[0], .events = POLLIN };
+
+	/* without the pipe, which only fails to be made when out of fds, wake up now and then */
+	while (poll(&pfd, 1, sigchld_pipe[0] == -1 ? 100 : -1) == -1 && errno == EINTR) ;
+}
+
+/* report finished jobs before an interactive prompt */
+static void jobs_notify(void)
+{
+	job_t **jobs = cur_sh_env->jobs;
+
+	jobs_reap();
+
+	for (int i = 0; jobs && jobs[i];)
+	{
+		if (jobs[i]->state != JOB_DONE) {
+			i++;
+			continue;
+		}
+		if (interactive)
+			fprintf(stderr, "[%d]   %s\t\t%s\n", jobs[i]->id, job_state(jobs[i]), jobs[i]->cmd);
+		job_remove(jobs[i]);
+	}
+}
+
+/* wait for a foreground job. under job control a stopped job is kept in
+ * the table, and the terminal is given back to the shell */
+static int job_wait_fg(job_t *job)
+{
+	bool stopped = false;
+	int rc, status = 0;
+
+	for (int i = 0; i < job->npids && !stopped; i++)
+	{
+		while (job->status[i] == -1)
+		{
+			if (wait_child(job->pids[i], &status, opt_monitor ? WUNTRACED : 0) == -1) {
+				if (errno == EINTR)
+					continue;
+				job->status[i] = 0;
+				break;
+			}
+			if (WIFSTOPPED(status)) {
+				stopped = true;
+				break;
+			}
+			job->status[i] = status;
+		}
+	}
+
+	if (have_tty && opt_monitor)
+		tcsetpgrp(STDIN_FILENO, shell_pgid);
+
+	if (stopped) {
+		job->state = JOB_STOPPED;
+		if (job->id || job_register(job)) {
+			fprintf(stderr, "\n[%d]+  Stopped\t\t%s\n", job->id, job->cmd);
+			return status_rc(status);
+		}
+	}
+
+	rc = status_rc(job->status[job->npids - 1]);
+
+	if (job->id)
+		job_remove(job);
+	else
+		job_free(job);
+
+	return rc;
+}
+
+/* a short description of a command, for jobs */
+static void node_text(const node *n, strbuf_t *sb)
+{
+	const node *tmp;
+
+	if (!n)
+		return;
+
+	switch (n->type)
+	{
+		case N_SIMPLE:
+			for (tmp = n->arg0; tmp; tmp = tmp->next)
+			{
+				strbuf_append(sb, tmp->value, strlen(tmp->value));
+				strbuf_append(sb, " ", 1);
+			}
+			for (tmp = n->arg1; tmp; tmp = (tmp == n->arg1) ? n->arg2 : tmp->next)
+			{
+				if (tmp->type != N_STRING)
+					continue;
+				if (tmp != n->arg1)
+					strbuf_append(sb, " ", 1);
+				strbuf_append(sb, tmp->value, strlen(tmp->value));
+			}
+			break;
+		case N_OP:
+			if (n->arg0) {
+				node_text(n->arg0, sb);
+				strbuf_append(sb, " ", 1);
+			}
+			strbuf_append(sb, token(n->token), strlen(token(n->token)));
+			strbuf_append(sb, " ", 1);
+			node_text(n->arg1, sb);
+			break;
+		default:
+			strbuf_append(sb, "{ ... }", 7);
+			break;
+	}
+}
+
+static job_t *job_new_node(const node *n)
+{
+	strbuf_t sb = {0};
+	job_t *job;
+
+	node_text(n, &sb);
+	job = job_new(sb.buf);
+	free(sb.buf);
+	return job;
+}
+
+/* cmd &: run the list in a child and carry on */
+static int run_async(node *n, const int pad)
+{
+	job_t *job;
+	pid_t pid;
+
+	/* pick up finished jobs so a loop starting many does not fill the process table */
+	jobs_reap();
+
+	if ((job = job_new_node(n)) == NULL)
+		return EXIT_FAILURE;
+
+	fflush(stdout);
+
+	if ((pid = fork()) == -1) {
+		warn("fork");
+		job_free(job);
+		return EXIT_FAILURE;
+	} else if (pid == 0) {
+		const bool monitor = opt_monitor;
+
+		job_child(0, false);
+
+		/* without job control, background jobs ignore the terminal */
+		if (!monitor) {
+			int fd;
+
+			signal(SIGINT, SIG_IGN);
+			signal(SIGQUIT, SIG_IGN);
+			if ((fd = open("/dev/null", O_RDONLY)) != -1) {
+				dup2(fd, STDIN_FILENO);
+				if (fd != STDIN_FILENO)
+					close(fd);
+			}
+		}
+
+		n->sep = 0;
+		exec_in_place = n->type == N_SIMPLE;
+		exit(evaluate(n, pad, 0));
+	}
+
+	if (!job_add_pid(job, pid) || !job_register(job)) {
+		job_free(job);
+		return EXIT_FAILURE;
+	}
+
+	cur_sh_env->last_async = pid;
+
+	if (interactive)
+		fprintf(stderr, "[%d] %d\n", job->id, (int)pid);
+
+	return EXIT_SUCCESS;
+}
+
+/* a | b | c: each command runs in its own child, connected by pipes */
+static int run_pipeline(node *n, const int pad)
+{
+	node **cmds = NULL;
+	job_t *job;
+	int cnt = 0, in = -1;
+
+	for (node *tmp = n; tmp; tmp = tmp->arg0)
+	{
+		node **list;
+
+		if ((list = realloc(cmds, sizeof(node *) * (cnt + 1))) == NULL) {
+			warn("run_pipeline");
+			free(cmds);
+			return EXIT_FAILURE;
+		}
+		cmds = list;
+
+		if (tmp->type != N_OP || tmp->token != '|') {
+			cmds[cnt++] = tmp;
+			break;
+		}
+		cmds[cnt++] = tmp->arg1;
+	}
+
+	if ((job = job_new_node(n)) == NULL) {
+		free(cmds);
+		return EXIT_FAILURE;
+	}
+
+	/* cmds is in reverse order */
+	for (int i = cnt - 1; i >= 0; i--)
+	{
+		int fds[2] = {-1, -1};
+		pid_t pid;
+
+		if (i && pipe(fds) == -1) {
+			warn("pipe");
+			break;
+		}
+
+		fflush(stdout);
+
+		if ((pid = fork()) == -1) {
+			warn("fork");
+			if (i) {
+				close(fds[0]);
+				close(fds[1]);
+			}
+			break;
+		} else if (pid == 0) {
+			job_child(job->pgid, true);
+
+			if (in != -1) {
+				dup2(in, STDIN_FILENO);
+				close(in);
+			}
+			if (fds[1] != -1) {
+				close(fds[0]);
+				dup2(fds[1], STDOUT_FILENO);
+				close(fds[1]);
+			}
+
+			exec_in_place = cmds[i]->type == N_SIMPLE;
+			exit(evaluate(cmds[i], pad, 0));
+		}
+
+		job_add_pid(job, pid);
+
+		if (in != -1)
+			close(in);
+		if (fds[1] != -1)
+			close(fds[1]);
+		in = fds[0];
+	}
+
+	if (in != -1)
+		close(in);
+
+	free(cmds);
+
+	if (job->npids == 0) {
+		job_free(job);
+		return EXIT_FAILURE;
+	}
+
+	return job_wait_fg(job);
+}
+
+/* %n, %+, %%, %-, %string or a process ID */
+static job_t *job_find(const char *spec)
+{
+	job_t **jobs = cur_sh_env->jobs;
+	int cnt;
+
+	for (cnt = 0; jobs && jobs[cnt]; cnt++) ;
+
+	if (spec == NULL || !strcmp(spec, "%%") || !strcmp(spec, "%+") || !strcmp(spec, "%"))
+		return cnt ? jobs[cnt - 1] : NULL;
+
+	if (!strcmp(spec, "%-"))
+		return cnt > 1 ? jobs[cnt - 2] : NULL;
+
+	if (*spec == '%' && isdigit(spec[1])) {
+		const int id = atoi(spec + 1);
+
+		for (int i = 0; i < cnt; i++)
+			if (jobs[i]->id == id)
+				return jobs[i];
+		return NULL;
+	}
+
+	if (*spec == '%') {
+		for (int i = cnt - 1; i >= 0; i--)
+			if (!strncmp(jobs[i]->cmd, spec + 1, strlen(spec + 1)))
+				return jobs[i];
+		return NULL;
+	}
+
+	const pid_t pid = atoi(spec);
+
+	for (int i = 0; i < cnt; i++)
+		for (int j = 0; j < jobs[i]->npids; j++)
+			if (jobs[i]->pids[j] == pid)
+				return jobs[i];
+
+	return NULL;
+}
+
+static int cmd_jobs(int argc, char *argv[])
+{
+	int opt_long = 0, opt_pids = 0;
+
+	{
+		int opt;
+
+		while ((opt = getopt(argc, argv, "lp")) != -1)
+		{
+			switch (opt)
+			{
+				case 'l':
+					opt_long = 1;
+					break;
+				case 'p':
+					opt_pids = 1;
+					break;
+				default:
+					return EXIT_FAILURE;
+			}
+		}
+	}
+
+	jobs_reap();
+
+	for (int i = 0; cur_sh_env->jobs && cur_sh_env->jobs[i];)
+	{
+		job_t *job = cur_sh_env->jobs[i];
+
+		if (optind < argc) {
+			int j;
+
+			for (j = optind; j < argc && job_find(argv[j]) != job; j++) ;
+			if (j == argc) {
+				i++;
+				continue;
+			}
+		}
+
+		if (opt_pids)
+			printf("%d\n", (int)job->pgid);
+		else if (opt_long)
+			printf("[%d]%c %d %s\t\t%s\n", job->id, cur_sh_env->jobs[i + 1] ? ' ' : '+',
+					(int)job->pgid, job_state(job), job->cmd);
+		else
+			printf("[%d]%c  %s\t\t%s\n", job->id, cur_sh_env->jobs[i + 1] ? ' ' : '+',
+					job_state(job), job->cmd);
+
+		/* finished jobs are forgotten once reported */
+		if (job->state == JOB_DONE)
+			job_remove(job);
+		else
+			i++;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int cmd_wait(int argc, char *argv[])
+{
+	int rc = EXIT_SUCCESS;
+
+	if (argc < 2) {
+		while (1)
+		{
+			int running = 0;
+
+			jobs_reap();
+			for (int i = 0; cur_sh_env->jobs && cur_sh_env->jobs[i]; i++)
+				if (cur_sh_env->jobs[i]->state == JOB_RUNNING)
+					running++;
+			if (!running)
+				break;
+			jobs_block();
+		}
+
+		/* every finished job has now been waited for */
+		for (int i = 0; cur_sh_env->jobs && cur_sh_env->jobs[i];)
+			if (cur_sh_env->jobs[i]->state == JOB_DONE)
+				job_remove(cur_sh_env->jobs[i]);
+			else
+				i++;
+
+		return EXIT_SUCCESS;
+	}
+
+	for (int i = 1; i < argc; i++)
+	{
+		job_t *job;
+		pid_t pid = 0;
+
+		jobs_reap();
+
+		if ((job = job_find(argv[i])) == NULL) {
+			rc = 127;
+			continue;
+		}
+
+		if (*argv[i] != '%')
+			pid = atoi(argv[i]);
+
+		while (job->state == JOB_RUNNING)
+		{
+			jobs_block();
+			jobs_reap();
+		}
+
+		if (job->state == JOB_STOPPED) {
+			rc = 128 + SIGTSTP;
+			continue;
+		}
+
+		rc = status_rc(job->status[job->npids - 1]);
+		for (int j = 0; pid && j < job->npids; j++)
+			if (job->pids[j] == pid)
+				rc = status_rc(job->status[j]);
+
+		job_remove(job);
+	}
+
+	return rc;
+}
+
+/* fg and bg */
+static int job_continue(int argc, char *argv[], const bool fg)
+{
+	job_t *job;
+
+	if (!opt_monitor) {
+		warnx("%s: no job control", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	jobs_reap();
+
+	if ((job = job_find(argc > 1 ? argv[1] : NULL)) == NULL) {
+		warnx("%s: %s: no such job", argv[0], argc > 1 ? argv[1] : "current");
+		return EXIT_FAILURE;
+	}
+
+	if (job->state == JOB_DONE) {
+		warnx("%s: job has terminated", argv[0]);
+		job_remove(job);
+		return EXIT_FAILURE;
+	}
+
+	if (fg) {
+		printf("%s\n", job->cmd);
+		fflush(stdout);
+		if (have_tty)
+			tcsetpgrp(STDIN_FILENO, job->pgid);
+	} else
+		printf("[%d] %s &\n", job->id, job->cmd);
+
+	if (kill(-job->pgid, SIGCONT) == -1)
+		warn("%s: kill", argv[0]);
+	job->state = JOB_RUNNING;
+
+	return fg ? job_wait_fg(job) : EXIT_SUCCESS;
+}
+
+static int cmd_fg(int argc, char *argv[])
+{
+	return job_continue(argc, argv, true);
+}
+
+static int cmd_bg(int argc, char *argv[])
+{
+	return job_continue(argc, argv, false);
+}
+
+/* m and s, as used by times and the long TIMEFORMAT form */
+static void print_minsec(FILE *fp, const double secs, const int prec)
+{
+	const int mins = (int)(secs / 60);
+
+	fprintf(fp, "%dm%.*fs", mins, prec, secs - mins * 60);
+}
+
+static double tv_secs(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static int cmd_times(int argc __attribute__((unused)), char *argv[] __attribute__((unused)))
+{
+	struct rusage self, children;
+
+	getrusage(RUSAGE_SELF, &self);
+	getrusage(RUSAGE_CHILDREN, &children);
+
+	print_minsec(stdout, tv_secs(&self.ru_utime), 3);
+	putchar(' ');
+	print_minsec(stdout, tv_secs(&self.ru_stime), 3);
+	putchar('\n');
+	print_minsec(stdout, tv_secs(&children.ru_utime), 3);
+	putchar(' ');
+	print_minsec(stdout, tv_secs(&children.ru_stime), 3);
+	putchar('\n');
+
+	return EXIT_SUCCESS;
+}
+
+/* TIMEFORMAT: %[p][l]R, %[p][l]U and %[p][l]S are the real, user and
+ * system time with p decimal places, in XmY.YYYs form with l. %P is the
+ * CPU percentage */
+static void time_report(const char *fmt, const double real, const double user, const double sys)
+{
+	strbuf_t out = {0};
+	FILE *fp;
+
+	if ((fp = open_memstream(&out.buf, &out.len)) == NULL)
+		return;
+
+	for (; *fmt; fmt++)
+	{
+		int prec = 3;
+		bool opt_long = false;
+		double val;
+
+		if (*fmt != '%' || !fmt[1]) {
+			fputc(*fmt, fp);
+			continue;
+		}
+
+		if (*++fmt == '%') {
+			fputc('%', fp);
+			continue;
+		}
+
+		if (isdigit(*fmt)) {
+			prec = *fmt++ - '0';
+			if (prec > 3)
+				prec = 3;
+		}
+		if (*fmt == 'l') {
+			opt_long = true;
+			fmt++;
+		}
+
+		switch (*fmt)
+		{
+			case 'R':	val = real; break;
+			case 'U':	val = user; break;
+			case 'S':	val = sys; break;
+			case 'P':
+				fprintf(fp, "%.*f", prec, real > 0 ? (user + sys) * 100 / real : 0);
+				continue;
+			default:
+				fputc('%', fp);
+				if (!*fmt)
+					goto done;
+				fputc(*fmt, fp);
+				continue;
+		}
+
+		if (opt_long)
+			print_minsec(fp, val, prec);
+		else
+			fprintf(fp, "%.*f", prec, val);
+	}
+done:
+	fputc('\n', fp);
+	fclose(fp);
+
+	/* one write, so the report is not interleaved with other output */
+	fwrite(out.buf, 1, out.len, stderr);
+	free(out.buf);
+}
+
+/* time pipeline: wall clock from a monotonic clock, CPU time from the
+ * shell's own usage and the rusage of the children waited for */
+static int time_pipeline(node *n, const int pad)
+{
+	const struct timeval cu = child_utime, cs = child_stime;
+	const env_t *env = getshenv(cur_sh_env, "TIMEFORMAT");
+	struct rusage before, after;
+	struct timeval user, sys;
+	uint64_t start;
+	int rc;
+
+	getrusage(RUSAGE_SELF, &before);
+	start = now_ns();
+
+	rc = evaluate(n, pad, 0);
+
+	const double real = (now_ns() - start) / 1e9;
+	getrusage(RUSAGE_SELF, &after);
+
+	timersub(&after.ru_utime, &before.ru_utime, &user);
+	timersub(&after.ru_stime, &before.ru_stime, &sys);
+	timeradd(&user, &child_utime, &user);
+	timersub(&user, &cu, &user);
+	timeradd(&sys, &child_stime, &sys);
+	timersub(&sys, &cs, &sys);
+
+	/* a null TIMEFORMAT disables the report */
+	if (env == NULL || env->val == NULL)
+		time_report("\nreal\t%3lR\nuser\t%3lU\nsys\t%3lS", real, tv_secs(&user), tv_secs(&sys));
+	else if (*env->val)
+		time_report(env->val, real, tv_secs(&user), tv_secs(&sys));
+
+	return rc;
+}
+
+/* set -x: the expanded command on stderr after PS4. with XTRACETIME set,
+ * lines carry the seconds since the shell started and each command that
+ * finishes reports how long it took */
+static uint64_t trace_command(const int argc, char *argv[])
+{
+	const env_t *ps4 = getshenv(cur_sh_env, "PS4");
+	const env_t *timed = getshenv(cur_sh_env, "XTRACETIME");
+	strbuf_t line = {0};
+	char *prefix = NULL;
+	uint64_t now = 0;
+	int rc = 0;
+
+	if (ps4 && ps4->val)
+		prefix = expand(ps4->val, &rc);
+
+	if (timed && timed->val && *timed->val) {
+		char stamp[32];
+
+		now = now_ns();
+		snprintf(stamp, sizeof(stamp), "[%12.6f] ", (now - shell_start) / 1e9);
+		strbuf_append(&line, stamp, strlen(stamp));
+	}
+
+	strbuf_append(&line, prefix ? prefix : "+ ", strlen(prefix ? prefix : "+ "));
+	for (int i = 0; i < argc; i++)
+	{
+		if (i)
+			strbuf_append(&line, " ", 1);
+		strbuf_append(&line, argv[i], strlen(argv[i]));
+	}
+	strbuf_append(&line, "\n", 1);
+
+	if (line.buf)
+		fwrite(line.buf, 1, line.len, stderr);
+
+	free(line.buf);
+	free(prefix);
+	return now;
+}
+
+static void trace_done(const char *name, const uint64_t start, const int rc)
+{
+	const uint64_t now = now_ns();
+
+	fprintf(stderr, "[%12.6f] %s: %.6fs, status %d\n",
+			(now - shell_start) / 1e9, name, (now - start) / 1e9, rc);
+}
+
+/* run an expanded simple command: functions, then builtins, then external
+ * utilities, builtins that do not need to fork are run in-process. with
+ * RUN_EXEC the shell is already a child of its own and need not fork again */
+static int run_command(const int argc, char *argv[], const int flags, const int pad)
+{
+	const struct builtin *bi = find_builtin(argv[0]);
+	func_t *fn = NULL;
+	pid_t chd_pid;
+
+	if ((flags & RUN_FUNCTIONS) && !bi->special && (fn = getfunc(cur_sh_env, argv[0])) != NULL)
+		return call_function(fn, argc, argv, pad);
+
+	if (bi->name && !bi->fork) {
+		int save[NUM_FDS], rc;
+
+		if (!redirect_enter(save))
+			return EXIT_FAILURE;
+		optind = 1;
+		rc = bi->func(argc, argv);
+		redirect_leave(save);
+		return rc;
+	}
+
+	if (!(flags & RUN_EXEC)) {
+		/* stdout is fully buffered when not interactive */
+		fflush(stdout);
+
+		if ((chd_pid = fork()) == -1) {
+			warn("fork");
+			return EXIT_FAILURE;
+		} else if (chd_pid) {
+			strbuf_t cmd = {0};
+			job_t *job;
+
+			for (int i = 0; i < argc; i++)
+			{
+				if (i)
+					strbuf_append(&cmd, " ", 1);
+				strbuf_append(&cmd, argv[i], strlen(argv[i]));
+			}
+			job = job_new(cmd.buf);
+			free(cmd.buf);
+
+			if (job == NULL || !job_add_pid(job, chd_pid)) {
+				int res = 0;
+
+				job_free(job);
+				while (wait_child(chd_pid, &res, 0) == -1 && errno == EINTR) ;
+				return status_rc(res);
+			}
+
+			return job_wait_fg(job);
+		}
+
+		job_child(0, true);
+	} else
+		redirect_child();
+
+	if (bi->name) {
+		optind = 1;
+		exit(bi->func(argc, argv));
+	}
+
+	execvp(argv[0], argv);
+	err(EXIT_FAILURE, "execvp: %s", argv[0]);
+}
+
+static int evaluate_node(node *n, const int pad)
+{
+	debug_printf("%*sEVAL: [%s]", pad, pad_str, node_type(n->type));
+	node *tmp;
+	int rc = 0;
+
+	/* taken before anything is expanded, so command substitutions do not inherit it */
+	const bool exec_here = exec_in_place;
+	exec_in_place = false;
+
+	if (n->sep == '&') {
+		rc = run_async(n, pad);
+		cur_sh_env->rc = rc;
+		return rc;
+	}
+
+	switch(n->type)
+	{
+		case N_FUNC:
+			debug_printf(": name=%s\n", n->value);
+			if (setfunc(cur_sh_env, n->value, n->arg0) == NULL) {
+				warn("%s", n->value);
+				rc = EXIT_FAILURE;
+			}
+			break;
+		case N_CASE:
+			// TODO
+			break;
+		case N_STRING:
+			rc = 0;
+			reexpand(n, &rc);
+			debug_printf(": %s => %s\n", n->value, n->evaluated);
+			break;
+		case N_ASSIGN:
+			debug_printf(": %s = ", n->value);
+			if (n->arg0) {
+				reexpand(n->arg0, &rc);
+				setshenv(cur_sh_env, n->value, n->arg0->evaluated);
+			} else
+				setshenv(cur_sh_env, n->value, "");
+			break;
+		case N_COMPOUND_COMMAND:
+			debug_printf(":\n");
+			if (n->arg0) {
+				int save[NUM_FDS];
+
+				/* { ...; } <file: the redirections last for the whole body */
+				if (redirect_open(n->arg1, NULL, save, &rc)) {
+					rc = evaluate(n->arg0, pad+1, 1);
+					redirect_restore(save);
+				}
+			}
+			break;
+		case N_IF:
+			debug_printf("\n");
+			if (n->arg0) {
+				debug_printf("%*sif  :\n", pad+1, pad_str);
+				rc = evaluate(n->arg0, pad+2, 1);
+			}
+			if (!rc) {
+				debug_printf("%*sthen:\n", pad+1, pad_str);
+				rc = n->arg1 ? evaluate(n->arg1, pad+2, 1) : 0;
+			} else if (n->arg2) {
+				debug_printf("%*selse:\n", pad+1, pad_str);
+				rc = evaluate(n->arg2, pad+2, 1);
+			} else
+				rc = 0;
+			break;
+		case N_WHILE:
+		case N_UNTIL:
+			debug_printf("\n");
+			/* the condition and body are walked in place on each iteration */
+			while (1)
+			{
+				const int cond = n->arg0 ? evaluate(n->arg0, pad+1, 1) : 0;
+
+				if (n->type == N_WHILE ? cond : !cond)
+					break;
+				if (n->arg1)
+					rc = evaluate(n->arg1, pad+1, 1);
+			}
+			break;
+		case N_FOR:
+			debug_printf(": %s\n", n->value);
+			{
+				strlist_t words = {0};
+
+				if (n->arg0) {
+					for (tmp = n->arg0; tmp; tmp = tmp->next)
+						if (!expand_fields(tmp->value, &words, &rc))
+							break;
+					dir_cache_flush();
+				} else {
+					for (int i = 1; i < cur_sh_env->argc; i++)
+						strlist_push(&words, strdup(cur_sh_env->argv[i]));
+				}
+
+				if (!rc)
+					for (int i = 0; i < words.cnt; i++)
+					{
+						setshenv(cur_sh_env, n->value, words.list[i]);
+						if (n->arg1)
+							rc = evaluate(n->arg1, pad+1, 1);
+					}
+
+				strlist_free(&words);
+			}
+			break;
+		case N_SIMPLE:
+			debug_printf("\n");
+
+			if (n->arg0) {
+				debug_printf("%*spre:\n", pad+1, pad_str);
+				evaluate(n->arg0, pad+2, 1); 
+			}
+
+			/* no command: the files are still created, or the error reported */
+			if (n->arg1 == NULL) {
+				int save[NUM_FDS];
+
+				if (redirect_open(n->arg0, NULL, save, &rc))
+					redirect_restore(save);
+			}
+
+			if (n->arg1) {
+				strlist_t args = {0};
+				int save[NUM_FDS];
+				debug_printf("%*scmd:", pad+1, pad_str);
+				
+#ifdef NDEBUG
+				print_node(n->arg1, pad+1, 1);
+#endif
+				if (n->arg1->type != N_STRING)
+					errx(EXIT_FAILURE, "N_SIMPLE");
+
+				/* each word expands to zero or more fields */
+				for (tmp = n->arg1; tmp; tmp = (tmp == n->arg1) ? n->arg2 : tmp->next)
+				{
+					if (tmp->type != N_STRING)
+						continue;
+					if (!expand_fields(tmp->value, &args, &rc)) {
+						rc = 1;
+						break;
+					}
+				}
+				dir_cache_flush();
+
+				for (int i = 0; i < args.cnt; i++) {
+					debug_printf("%*sarg[%d]=<%s>\n", pad+2, pad_str, i, args.list[i]);
+				}
+
+				if (!rc && args.cnt && redirect_open(n->arg0, n->arg2, save, &rc)) {
+					const uint64_t start = opt_xtrace ? trace_command(args.cnt, args.list) : 0;
+
+					rc = run_command(args.cnt, args.list, RUN_FUNCTIONS | (exec_here ? RUN_EXEC : 0), pad+2);
+					if (start)
+						trace_done(args.list[0], start, rc);
+					redirect_restore(save);
+				}
+
+				strlist_free(&args);
+			}
+
+			break;
+
+		case N_OP:
+			debug_printf(": [%s]\n", token(n->token));
+			switch (n->token)
+			{
+				case AND_IF:
+					if ((rc = evaluate(n->arg0, pad+1, 0)) == 0)
+						rc = evaluate(n->arg1, pad+1, 0);
+					break;
+				case OR_IF:
+					if ((rc = evaluate(n->arg0, pad+1, 0)) != 0)
+						rc = evaluate(n->arg1, pad+1, 0);
+					break;
+				case '!':
+					rc = !evaluate(n->arg1, pad+1, 0);
+					break;
+				case Time:
+					rc = time_pipeline(n->arg1, pad+1);
+					break;
+				case '|':
+					rc = run_pipeline(n, pad+1);
+					break;
+				default:
+					warnx("%s: not supported", token(n->token));
+					rc = EXIT_FAILURE;
+					break;
+			}
+			break;
+
+		default:
+			debug_printf("\n");
+			break;
+	}
+
+	/* $? follows each command, not just each program */
+	if (n->type != N_STRING && n->type != N_ASSIGN)
+		cur_sh_env->rc = rc;
+
+	return rc;
+}
+
+/* a list is walked here rather than by recursing on ->next, so its length costs no stack */
+int evaluate(node *n, int pad, int do_next)
+{
+	int rc = 0;
+
+	for (; n; n = do_next ? n->next : NULL)
+		rc = evaluate_node(n, pad);
+
+	return rc;
+}
+
+/* called by the parser as each complete command is read */
+int execute_program(node *n)
+{
+	if (parse_into) {
+		*parse_into = *parse_into ? nodeAppend(n, *parse_into) : n;
+		return 0;
+	}
+
+	if (!n)
+		return cur_sh_env->rc;
+
+	cur_sh_env->rc = evaluate(n, 0, 1);
+	freeNode(n, true);
+
+	return cur_sh_env->rc;
+}
+
+static node *newNode(const enum node_en type)
+{
+	node *ret = NULL;
+	if ((ret = calloc(1, sizeof(node))) == NULL)
+		err(EXIT_FAILURE, "newNode");
+
+	ret->type = type;
+	return ret;
+}
+
+/* like evaluate(), these recurse into a node's arguments but walk its ->next */
+static node *dupNode(const node *restrict src, const bool dup_next)
+{
+	node *ret = NULL, **link = &ret;
+
+	for (; src; src = dup_next ? src->next : NULL)
+	{
+		node *tmp = newNode(src->type);
+
+		tmp->num   = src->num;
+		tmp->sep   = src->sep;
+		tmp->token = src->token;
+
+		if (src->value && (tmp->value = strdup(src->value)) == NULL)
+			err(EXIT_FAILURE, "dupNode");
+
+		tmp->arg0 = dupNode(src->arg0, true);
+		tmp->arg1 = dupNode(src->arg1, true);
+		tmp->arg2 = dupNode(src->arg2, true);
+		tmp->arg3 = dupNode(src->arg3, true);
+
+		*link = tmp;
+		link = &tmp->next;
+	}
+
+	return ret;
+}
+
+void freeNode(node *restrict node, const bool free_next)
+{
+	struct _node *next;
+
+	for (; node; node = free_next ? next : NULL)
+	{
+		next = node->next;
+
+		if(node->arg0)  { freeNode(node->arg0, true);	node->arg0 = NULL;		}
+		if(node->arg1)  { freeNode(node->arg1, true);	node->arg1 = NULL;		}
+		if(node->arg2)  { freeNode(node->arg2, true);	node->arg2 = NULL;		}
+		if(node->arg3)  { freeNode(node->arg3, true);	node->arg3 = NULL;		}
+		if(node->value) { free(node->value);			node->value = NULL;		}
+		if(node->evaluated) { free(node->evaluated);	node->evaluated = NULL; }
+
+		free(node);
+	}
+}
+
+node *nCaseItem(node *restrict pattern, node *restrict compound_list)
+{
+	node *ret = newNode(N_CASEITEM);
+	ret->arg0 = pattern;
+	ret->arg1 = compound_list;
+	return ret;
+}
+
+node *nFunc(char *restrict fname, node *restrict body)
+{
+	node *ret = newNode(N_FUNC);
+	ret->value = strdup(fname);
+	ret->arg0 = body;
+	return ret;
+}
+
+node *nAssign(char *restrict str)
+{
+	if (!str) 
+		return NULL;
+
+	node *ret = newNode(N_ASSIGN);
+	char *tok = strchr(str, '=');
+	if (!tok) 
+		return NULL;
+
+	ret->value = strndup(str, tok - str);
+	ret->arg0 = nString(tok + 1);
+	return ret;
+}
+
+node *nFor(char *restrict name, node *restrict wordlist, node *restrict do_group)
+{
+	node *ret = newNode(N_FOR);
+	ret->value = strdup(name);
+	ret->arg0 = wordlist;
+	ret->arg1 = do_group;
+	return ret;
+}
+
+node *nWhile(node *restrict compound_list, node *restrict do_group)
+{
+	node *ret = newNode(N_WHILE);
+	ret->arg0 = compound_list;
+	ret->arg1 = do_group;
+	return ret;
+}
+
+node *nUntil(node *restrict compound_list, node *restrict do_group)
+{
+	node *ret = newNode(N_UNTIL);
+	ret->arg0 = compound_list;
+	ret->arg1 = do_group;
+	return ret;
+}
+
+node *nCompound(node *restrict command, node *restrict redirect)
+{
+	node *ret = newNode(N_COMPOUND_COMMAND);
+	ret->arg0 = command;
+	ret->arg1 = redirect;
+	return ret;
+}
+
+/* the end of a list, found from where it last was so appending stays O(1) */
+static node *nodeLast(node *list)
+{
+	node *tmp = list->last ? list->last : list;
+	for(; tmp->next; tmp=tmp->next) ;
+	return list->last = tmp;
+}
+
+node *nodeAppend(node *restrict item, node *restrict to)
+{
+	node *tmp = nodeLast(to);
+	//printf(" appending %p[%s] to %p[%s]\n", item, node_type(item->type), tmp, node_type(tmp->type));
+	tmp->next = item;
+	to->last = nodeLast(item);
+	return to;
+}
+
+/* the separator after a list belongs to its last command, e.g. a; b & */
+node *nodeSep(node *restrict list, int sep)
+{
+	nodeLast(list)->sep = sep;
+	return list;
+}
+
+node *nIf(node *restrict ifstmt, node *restrict iftrue, node *restrict iffalse)
+{
+	node *ret = newNode(N_IF);
+	ret->arg0 = ifstmt;
+	ret->arg1 = iftrue;
+	ret->arg2 = iffalse;
+	return ret;
+}
+
+node *nSimple(node *restrict pre, node *restrict cmd, node *restrict suf)
+{
+	node *ret = newNode(N_SIMPLE);
+	ret->arg0 = pre;
+	ret->arg1 = cmd;
+	ret->arg2 = suf;
+	//printf(" creating nSimple(%s,%s,%s)\n",
+	//		pre ? node_type(pre->type) : "",
+	//		cmd ? node_type(cmd->type) : "",
+	//		suf ? node_type(suf->type) : ""
+	//		);
+	return ret;
+}
+
+node *nCase(char *restrict word, node *restrict case_list)
+{
+	node *ret = newNode(N_CASE);
+	ret->value = strdup(word);
+	ret->arg0 = case_list;
+	return ret;
+}
+
+/*
+ * Here-documents. The parser reduces a << redirection before the lexer
+ * reaches the end of its line, so each one is queued here, and the lexer
+ * then feeds the lines that follow to here_doc_line() until every queued
+ * body is complete. A body is kept as an N_STRING in arg0 of its
+ * redirection, so it is cached along with the rest of the tree.
+ */
+static node **here_doc_queue	= NULL;
+static int here_doc_cnt			= 0;
+static strbuf_t here_doc_body	= {0};
+static char *here_doc_delim		= NULL;	/* of here_doc_queue[0], unquoted */
+
+static void here_doc_queue_add(node *n)
+{
+	node **tmp;
+
+	if ((tmp = realloc(here_doc_queue, sizeof(node *) * (here_doc_cnt + 1))) == NULL)
+		err(EXIT_FAILURE, "here_doc_queue_add");
+
+	here_doc_queue = tmp;
+	here_doc_queue[here_doc_cnt++] = n;
+}
+
+/* the delimiter word with quote removal applied, but nothing expanded */
+static char *here_doc_unquote(const char *word)
+{
+	char *ret, *dst, quote = 0;
+
+	if ((ret = dst = malloc(strlen(word) + 1)) == NULL)
+		err(EXIT_FAILURE, "here_doc_unquote");
+
+	for (; *word; word++)
+	{
+		if (quote) {
+			if (*word == quote) {
+				quote = 0;
+				continue;
+			}
+		} else if (*word == '\'' || *word == '"') {
+			quote = *word;
+			continue;
+		} else if (*word == '\\' && word[1])
+			word++;
+		*dst++ = *word;
+	}
+
+	*dst = '\0';
+	return ret;
+}
+
+/* the body of the oldest queued here-document is complete */
+static void here_doc_finish(void)
+{
+	node *n = here_doc_queue[0];
+
+	n->arg0 = newNode(N_STRING);
+	if ((n->arg0->value = here_doc_body.buf ? here_doc_body.buf : strdup("")) == NULL)
+		err(EXIT_FAILURE, "here_doc_finish");
+	memset(&here_doc_body, 0, sizeof(here_doc_body));
+
+	free(here_doc_delim);
+	here_doc_delim = NULL;
+
+	memmove(here_doc_queue, here_doc_queue + 1, sizeof(node *) * --here_doc_cnt);
+}
+
+bool here_doc_pending(void)
+{
+	return here_doc_cnt != 0;
+}
+
+/* one line of input, without its newline: returns false once no bodies are pending */
+bool here_doc_line(const char *line, size_t len)
+{
+	if (here_doc_cnt == 0)
+		return false;
+
+	if (here_doc_queue[0]->token == DLESSDASH)
+		while (len && *line == '\t') {
+			line++;
+			len--;
+		}
+
+	if (here_doc_delim == NULL)
+		here_doc_delim = here_doc_unquote(here_doc_queue[0]->value);
+
+	if (len == strlen(here_doc_delim) && !memcmp(line, here_doc_delim, len)) {
+		here_doc_finish();
+		return here_doc_cnt != 0;
+	}
+
+	if (!strbuf_append(&here_doc_body, line, len) || !strbuf_append(&here_doc_body, "\n", 1))
+		exit(EXIT_FAILURE);
+
+	return true;
+}
+
+/* the input ended before every delimiter was seen: a terminal is asked for more */
+void here_doc_eof(void)
+{
+	while (here_doc_cnt)
+	{
+		if (interactive && !get_next_parser_string(1)) {
+			here_doc_line(parser_string, strlen(parser_string));
+			continue;
+		}
+
+		if (here_doc_delim == NULL)
+			here_doc_delim = here_doc_unquote(here_doc_queue[0]->value);
+		warnx("here-document delimited by end-of-file (wanted `%s')", here_doc_delim);
+		here_doc_finish();
+	}
+}
+
+/* forget any here-documents of a command that failed to parse */
+static void here_doc_reset(void)
+{
+	free(here_doc_queue);
+	free(here_doc_body.buf);
+	free(here_doc_delim);
+	here_doc_queue = NULL;
+	here_doc_cnt = 0;
+	memset(&here_doc_body, 0, sizeof(here_doc_body));
+	here_doc_delim = NULL;
+}
+
+node *nIoRedirect(int func, char *restrict iofile)
+{
+	// FIXME
+	node *ret = newNode(N_IOREDIRECT);
+	ret->token = func;
+	switch(func)
+	{
+		case '>':
+		case DGREAT:
+		case GREATAND:
+		case CLOBBER:
+			ret->num = 1;
+			break;
+		case LESSAND:
+		case LESSGREAT:
+		case '<':
+		case DLESS:
+		case DLESSDASH:
+			ret->num = 0;
+			break;
+		default:
+			errx(EXIT_FAILURE, "nIoRedirect: unknown %d", func);
+
+	}
+	ret->value = strdup(iofile);
+
+	if (func == DLESS || func == DLESSDASH)
+		here_doc_queue_add(ret);
+
+	return ret;
+}
+
+node *nPattern(char *restrict str)
+{
+	node *ret = newNode(N_PATTERN);
+	ret->value = strdup(str);
+	return ret;
+}
+
+node *nString(char *restrict str)
+{
+	node *ret = newNode(N_STRING);
+	ret->value = strdup(str);
+	return ret;
+}
+
+node *nOp(int op, node *restrict lhs, node *restrict rhs)
+{
+	node *ret = newNode(N_OP);
+	ret->token = op;
+	ret->arg0 = lhs;
+	ret->arg1 = rhs;
+	return ret;
+}
+
+node *nSubshell(node *restrict body)
+{
+	node *ret = newNode(N_SUBSHELL);
+	ret->arg0 = body;
+	return ret;
+}
+
+#if 0
+static bool isquote(const char chr, const int type)
+{
+	static const char base[]	= "|&;<>()$`\\\"' \t\n";
+	static const char special[]	= "*?[#~=%";
+	static const char doubleq[]	= "$`\"\\\n";
+
+	if (chr == '\0') return false;
+	else if (type & QUOTE_BASE && (strchr(base, chr) != NULL)) return true;
+	else if (type & QUOTE_SPECIAL && (strchr(special, chr) != NULL)) return true;
+	else if (type & QUOTE_DOUBLE && (strchr(doubleq, chr) != NULL)) return true;
+
+	return false;
+}
+
+static int isoperator(const char *src)
+{
+	static const char *ops2[] = {
+		"&&",
+		"||",
+		";;",
+		"<<",
+		">>",
+		"<&",
+		">&",
+		"<>",
+		">|",
+		NULL
+	};
+	static const char ops1[] = "&()\n|;<>";
+
+	if (!*src) return 0;
+
+	if (!strncmp("<<-", src, 3)) return 3;
+
+	for (int i = 0; ops2[i]; i++)
+		if (!strncmp(ops2[i], src, 2)) return 2;
+
+	if (strchr(ops1, *src) != NULL) {
+		return 1;
+	}
+
+	return 0;
+}
+
+inline static const map_t *lookup_token(const char *token)
+{
+	for (int i = 0; lookup[i].str; i++) {
+		if (!strcmp(token, lookup[i].str)) return &lookup[i];
+	}
+	return NULL;
+}
+#endif
+
+static void cleanup()
+{
+	/*
+	regfree(&reg_assignment);
+	regfree(&reg_name);
+	*/
+	here_doc_reset();
+	if (cur_sh_env) {
+		if (cur_sh_env->private_envs) {
+			for (int i = 0; cur_sh_env->private_envs[i]; i++)
+				free(cur_sh_env->private_envs[i]);
+			free(cur_sh_env->private_envs);
+		}
+		if (cur_sh_env->functions) {
+			for (int i = 0; cur_sh_env->functions[i]; i++) {
+				freeNode(cur_sh_env->functions[i]->body, true);
+				free(cur_sh_env->functions[i]->name);
+				free(cur_sh_env->functions[i]);
+			}
+			free(cur_sh_env->functions);
+		}
+		free(cur_sh_env);
+	}
+}
+
+#if 0
+static const map_t *category(const char *token, const char *next, const map_t *restrict prev)
+{
+	size_t len = 0;
+	const map_t *map = NULL;
+
+	if (token == NULL || !strlen(token)) {
+		return NULL;
+	} else if ((map = lookup_token(token))) {
+		if (map->tok == Lbrace) {
+			if(in_func) func_brace = in_brace;
+			in_brace++;
+		} else if (map->tok == Rbrace) {
+			in_brace--;
+			if(in_brace == func_brace) in_func=0;
+		} else if (map->tok == If) {
+			in_if++;
+		} else if (map->tok == Fi) {
+			in_if--;
+		} else if (map->tok == Case) {
+			in_case = true;
+		} else if (map->tok == For) {
+			in_for = true;
+		/* to support "A=1) ;;" */
+		} else if (in_case && map->tok == In) {
+			in_case_in = true;
+		} else if (in_for && map->tok == In) {
+			in_for_in = true;
+		} else if (map->tok == Esac) {
+			in_case = false; in_case_in = false;
+		} else if (map->tok == DSEMI) {
+			in_case_in = true;
+		} else if (map->tok == Do) {
+			in_for_in = false;
+			in_do++;
+		} else if (map->tok == Done) {
+			in_do--;
+			in_for_in = false;
+			in_for = false;
+		}
+		return map;
+	} else if ((!in_case && !in_case_in) && regexec(&reg_assignment, token, 0, NULL, 0) == 0) {
+		return &assignment_word;
+	} else if (isdigit(*token)) {
+		char *tmp = (char *)(token + 1);
+		while(*tmp) {
+			if (!isdigit(*tmp) && (len = isoperator(tmp)) && (strlen(tmp) == len)) {
+				*tmp = '\0';
+				return &io_number;
+			}
+			else if (isdigit(*tmp)) tmp++;
+			else break;
+		}
+	} else if (regexec(&reg_name, token, 0, NULL, 0) == 0) {
+		if (prev && prev->tok == For) return &name;
+		else if (next && *next) {
+			char *tmp = (char *)next;
+			while (*tmp) {
+				if (isblank(*tmp)) tmp++;
+				else if (*tmp == '(') {
+					if (in_func) {
+						warnx("nested functions are not supported");
+						break;
+					}
+					in_func = 1;
+					return &name;
+				}
+				else break;
+			}
+		}
+	}
+	return &word;
+}
+#endif
+
+#if 0
+static char *get_next_token(char *const str, char **next)
+{
+	static char buf[BUFSIZ];
+	char *dst = buf;
+	char *src = str;
+	char *mark = NULL, *tmp = NULL;
+	size_t len = 0;
+
+	memset(buf, 0, sizeof(buf));
+
+	if (!src) return NULL;
+
+	while(*src)
+	{
+		if (*src == '\\' && isquote(*(src+1), QUOTE_BASE)) {
+			*dst++ = *++src;
+		} else if (*src == '"') {
+			mark = src;
+			*dst++ = *src++;
+			while(*src)
+			{
+				if (*src == '\\' && isquote(*(src+1), QUOTE_DOUBLE)) {
 					*dst++ = *src++;
 					*dst++ = *src++;
 				} else if (*src == '"') {
@@ -1632,434 +5521,1215 @@ static char *get_next_token(char *const str, char **next)
 				} else
 					*dst++ = *src++;
 			}
-			if (!*src) errx(EXIT_FAILURE, "Unterminated double quote at: %s", mark);
-		} else if (*src == '\'') {
-			*dst++ = *src++;
-			while(*src && *src != '\'') *dst++ = *src++;
-			if (!*src) errx(EXIT_FAILURE, "Unterminated single quote");
-			*dst++ = *src++;
-		} else if (*src == '<' && *(src+1) == '<' && isalpha(*(src+2))) {
-			here_doc = true;
-			char *tmp = src+2;
+			if (!*src) errx(EXIT_FAILURE, "Unterminated double quote at: %s", mark);
+		} else if (*src == '\'') {
+			*dst++ = *src++;
+			while(*src && *src != '\'') *dst++ = *src++;
+			if (!*src) errx(EXIT_FAILURE, "Unterminated single quote");
+			*dst++ = *src++;
+		} else if (*src == '<' && *(src+1) == '<' && isalpha(*(src+2))) {
+			here_doc = true;
+			char *tmp = src+2;
+
+			while (*tmp)
+				if (!isalpha(*tmp)) break;
+				else tmp++;
+
+			if (tmp - (src+2) < 1)
+				errx(EXIT_FAILURE, "No delimiter for heredoc");
+			
+			here_doc_delim = strndup(src+2, tmp - (src+2));
+			if (here_doc_remaining)
+				free(here_doc_remaining);
+			here_doc_remaining = strdup(src + (tmp - src));
+			
+			if (next) *next = NULL;
+			return NULL;
+		} else if (*src == '$' || *src == '`') {
+			if (*src == '$') {
+				if (*(src+1) == '{') {
+					while (*src != '}')
+						*dst++ = *src++;
+				} else if (*(src+1) == '(' && *(src+2) == '(') {
+					char *end = strstr(src+3, "))");
+					if (!end) errx(EXIT_FAILURE, "Unterminated $((");
+					len = (end + 2) - src;
+					strncpy(dst, src, len);
+					dst += len;
+					src += len;
+				} else if (*(src+1) == '(') {
+					int depth = 1;
+					char *end = src+2;
+					while(*end && depth) {
+						if (*end == ')' && *(end-1) != '\\') depth--;
+						else if (*end == '$' && *(end+1) == '(') depth++;
+						else
+							end++;
+					}
+					if (depth) errx(EXIT_FAILURE, "Unterminated $(");
+					len = (end + 1) - src;
+					strncpy(dst, src, len);
+					dst += len;
+					src += len;
+				} else
+					*dst++ = *src++;
+			} else
+				*dst++ = *src++;
+		} else if ((len = isoperator(src)) != 0) {
+			if ( (*src == '<' || *src == '>') && dst > buf) {
+				for (tmp = src; tmp > str;) {
+					if (!isdigit(*(tmp-1))) break;
+					tmp--;
+				}
+
+				if (tmp >= str) {
+					//dst -= (src - tmp);
+					//*dst = '\0';
+					//src -= (src - tmp);
+					
+					/* the operator is not part of IO_NUMBER, but if we remove it, 
+					 * the categoriser has doesn't work */
+					strncat(buf, src, len);
+					break;
+				} else {
+					while(len--) *dst++ = *src++;
+					break;
+				}
+			}
+			if (dst > buf) break;
+			while(len--) *dst++ = *src++;
+			break;
+		} else if (isblank(*src)) {
+			while(*src && isblank(*src)) src++;
+			if (dst > buf) 
+				break;
+		} else if (*src == '#') {
+			while(*src && *src != '\n') src++;
+		} else
+			*dst++ = *src++;
+	}
+
+	if (next) {
+		if (*src) {
+			*next = src;
+		} else
+			*next = NULL;
+	}
+
+	len = strlen(buf) - 1;
+	for(int i = len; i >= 0 && isblank(buf[i]); i--)
+		buf[i] = '\0';
+
+	return strlen(buf) ? buf : NULL;
+}
+#endif
+
+static void parser_init()
+{
+	/*
+	if (regcomp(&reg_assignment, reg_assignment_str, REG_EXTENDED))
+		errx(EXIT_FAILURE, "regcomp");
+	if (regcomp(&reg_name, reg_name_str, REG_EXTENDED))
+		errx(EXIT_FAILURE, "regcomp");
+	*/
+	if ((cur_sh_env = calloc(1, sizeof(shenv_t))) == NULL)
+		err(EXIT_FAILURE, "calloc: cur_sh_env");
+	if ((cur_sh_env->private_envs = calloc(1, sizeof(env_t *))) == NULL)
+		err(EXIT_FAILURE, "calloc: cur_sh_env[0]");
+	for (int i = 0; i < NUM_FDS; i++)
+		cur_sh_env->fds[i] = -1;
+
+	char buf[BUFSIZ] = {0};
+
+	for (size_t i = 0; environ && environ[i]; i++) {
+		char *tok = strchr(environ[i], '=');
+		char *env = strndup(environ[i], environ[i] - tok);
+		setshenv(cur_sh_env, env, getenv(env));
+		free(env);
+	}
+
+	char *shlvl_str = getenv("SHLVL");
+	int shlvl = 1;
+	if (shlvl_str)
+		shlvl = atoi(shlvl_str) + 1;
+	snprintf(buf, 10, "%u", shlvl);
+
+	env_t *env = NULL;
+	if ((env = setshenv(cur_sh_env, "SHLVL", buf)) == NULL) {
+		if (errno)
+			err(EXIT_FAILURE, NULL);
+		else
+			err(EXIT_FAILURE, "Unable to set SHLVL");
+	}
+
+	exportenv(env);
+
+	atexit(cleanup);
+}
+
+/* global function defintions */
+
+#if 0
+int my_yylex()
+{
+	char *old = NULL;
+
+	if (left == NULL)
+	{
+		left = parser_string;
+		parser_string = NULL;
+	}
+
+	if (!left) return 0;
+
+	yyline++; yyrow=0;
+
+again:
+	while(*left && isblank(*left)) left++;
+	if (!*left) return 0;
+	/*
+	static char buf[BUFSIZ] = {0};
+	if (feof(stdin) || ferror(stdin)) return 0;
+	if (left == NULL || !*left) {
+		if ((left = fgets(buf, BUFSIZ, stdin)) == NULL)
+			return 0;
+
+		while(*left && isblank(*left)) left++;
+		if(!*left) goto again;
+
+		yyline++;
+		yyrow = 0;
+	}
+	*/
+
+	old = left;
+	if (here_doc)
+	{
+		char *tmp = NULL;
+
+		if (!strncmp(left, here_doc_delim, strlen(here_doc_delim)))
+		{
+			yylval.string = here_doc_word;
+			free(here_doc_delim);
+			here_doc_delim = NULL;
+			here_doc = false;
+			//here_doc_word = NULL;
+			prev = &word;
+			free_left = true;
+			left = here_doc_remaining;
+			free_me = here_doc_remaining;
+			//here_doc_remaining = NULL;
+			return word.tok;
+		}
+
+		if (here_doc_word == NULL && (here_doc_word = strdup(left)) == NULL) {
+			err(EXIT_FAILURE, "yylex: strdup");
+		} else if (here_doc_word) {
+			int newlen = strlen(here_doc_word) + strlen(left) + 1;
+			if ((tmp = realloc(here_doc_word, newlen)) == NULL) {
+				err(EXIT_FAILURE, "yylex: realloc");
+			} else {
+				here_doc_word = tmp;
+			}
+			strcat(here_doc_word, left);
+		}
+
+		left = NULL;
+		goto again;
+	}
+	else
+	{
+		char *yytext = NULL;
+		while(*left && isblank(*left)) left++;
+		if(!*left) goto again;
+		
+		//printf("get_next_token([%s])\n", left);
+		if ((yytext = get_next_token(left, &left)) == NULL) {
+			if (here_doc) 
+				goto again;
+			warnx("no match/no data for [%s@%p] %x\n", old, old, old ? *old : '!');
+			return 0;
+		}
+
+		int ret = 0;
+
+		if ((prev = category(yytext, left, prev)) != NULL) {
+			/*
+			printf("matched: %s: [%s] tok=%d\n", 
+					prev->tok != NEWLINE ? prev->str : "\\n", 
+					(yytext && *yytext && *yytext != '\n') ? yytext : "_" ,
+					prev->tok);
+					*/
+			if (prev->tok == NEWLINE) 
+				yylval.chr = '\n';
+			else
+				yylval.string = yytext;
+			ret = prev->tok;
+		} else {
+			warnx("failed to match [%s@%p] %x\n", yytext, yytext, yytext ? *yytext : '!');
+		}
+
+		if (!left || !*left) {
+			if (in_case || in_case_in || in_do>0 || in_for_in || in_for>0 || in_brace>0 || in_func || in_if>0) {
+				// FIXME && || and EOL
+				//printf("need more\n");
+				// FIXME only needed if iteractive, need old method otherwise? or not?
+				get_next_parser_string(1);
+			}
+		}
+
+		return ret;
+	}
+}
+#endif
+//int yylex_init(void *);
+//void *yy_scan_string (const char *yy_str, void *yyscanner );
+
+void yyerror(void *scanner, const char *s)
+{
+	(void)scanner;
+	warnx("\nsh: unable to parse: [%d:%d] %s", yyline, yyrow, s);
+	here_doc_reset();
+}
+
+/*
+ * Interactive line editing. Keys are read in blocks, and the line is only
+ * redrawn once the keys read so far have been handled, with a single
+ * write(): carriage return, prompt, text, clear to the end of the line and
+ * the cursor moved back into place. A paste is therefore one redraw.
+ *
+ * History is a ring of the last HIST_SIZE lines. It is loaded by mapping
+ * $HISTFILE, by default ~/.sh_history, and each accepted line is appended
+ * to it with one O_APPEND write, so concurrent shells interleave whole
+ * lines. The file is compacted when it holds twice as many.
+ */
+#define HIST_SIZE	1000
+
+/* keys that arrive as escape sequences */
+#define EDIT_UP		0x101
+#define EDIT_DOWN	0x102
+#define EDIT_RIGHT	0x103
+#define EDIT_LEFT	0x104
+#define EDIT_HOME	0x105
+#define EDIT_END	0x106
+#define EDIT_DEL	0x107
+
+#ifndef CTRL
+#define CTRL(c)		((c) & 0x1f)
+#endif
+
+static struct {
+	char	*lines[HIST_SIZE];
+	int		 first;			/* the oldest line */
+	int		 cnt;
+	int		 fd;			/* open for appending */
+	bool	 loaded;
+} hist = { .fd = -1 };
+
+typedef struct {
+	strbuf_t		 line;
+	size_t			 pos;		/* the cursor, as an offset into line */
+	const char		*prompt;
+	strbuf_t		 out;		/* the next redraw */
+} edit_t;
+
+static unsigned char edit_in[256];
+static int edit_in_len = 0, edit_in_pos = 0;
+
+/* 0 is the oldest line */
+static const char *hist_get(const int i)
+{
+	return hist.lines[(hist.first + i) % HIST_SIZE];
+}
+
+static void hist_push(const char *line, const size_t len)
+{
+	char *copy;
+
+	if ((copy = strndup(line, len)) == NULL)
+		return;
+
+	if (hist.cnt == HIST_SIZE) {
+		free(hist.lines[hist.first]);
+		hist.lines[hist.first] = copy;
+		hist.first = (hist.first + 1) % HIST_SIZE;
+	} else
+		hist.lines[(hist.first + hist.cnt++) % HIST_SIZE] = copy;
+}
+
+/* rewrite the history file as just the lines from start, via a private file */
+static void hist_compact(const char *file, const char *start, const size_t len)
+{
+	char tmp[PATH_MAX];
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid()) >= (int)sizeof(tmp) ||
+			(fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0600)) == -1)
+		return;
+
+	if (!write_all(fd, start, len) || close(fd) == -1 || rename(tmp, file) == -1) {
+		unlink(tmp);
+		return;
+	}
+
+	close(hist.fd);
+	hist.fd = open(file, O_WRONLY|O_APPEND|O_CLOEXEC);
+}
+
+static void hist_load(void)
+{
+	char path[PATH_MAX];
+	const char *file, *home;
+	struct stat sb;
+	char *map;
+
+	hist.loaded = true;
+
+	if ((file = getenv("HISTFILE")) == NULL) {
+		if ((home = getenv("HOME")) == NULL ||
+				snprintf(path, sizeof(path), "%s/.sh_history", home) >= (int)sizeof(path))
+			return;
+		file = path;
+	}
+
+	if ((hist.fd = open(file, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0600)) == -1)
+		return;
+	if (fstat(hist.fd, &sb) == -1 || sb.st_size == 0 ||
+			(map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, hist.fd, 0)) == MAP_FAILED)
+		return;
+
+	/* walk back over the lines that will be kept, and as many again */
+	const char *end = map + sb.st_size, *start = end, *keep = NULL, *nl;
+	int lines = 0;
+
+	if (start > map && start[-1] == '\n')
+		start--;
+	while (start > map && lines < HIST_SIZE * 2)
+	{
+		if ((nl = memrchr(map, '\n', start - map)) == NULL) {
+			start = map;
+			lines++;
+			break;
+		}
+		start = nl;
+		if (++lines == HIST_SIZE)
+			keep = nl + 1;
+	}
+	if (keep == NULL)
+		keep = start == map ? map : start + 1;
+
+	for (const char *line = keep; line < end; line = nl + 1)
+	{
+		if ((nl = memchr(line, '\n', end - line)) == NULL)
+			nl = end;
+		if (nl > line)
+			hist_push(line, nl - line);
+	}
+
+	if (lines == HIST_SIZE * 2)
+		hist_compact(file, keep, end - keep);
+
+	munmap(map, sb.st_size);
+}
+
+static void hist_add(const char *line)
+{
+	const size_t len = strlen(line);
+
+	if (len == 0 || strchr(line, '\n') || strspn(line, " \t") == len ||
+			(hist.cnt && !strcmp(hist_get(hist.cnt - 1), line)))
+		return;
+
+	hist_push(line, len);
+
+	if (hist.fd != -1) {
+		strbuf_t sb = {0};
+
+		if (strbuf_append(&sb, line, len) && strbuf_append(&sb, "\n", 1) &&
+				write(hist.fd, sb.buf, sb.len) == -1)
+			warn("history");
+		free(sb.buf);
+	}
+}
+
+/* the terminal in raw mode while a line is edited, and only then */
+static bool edit_raw(const bool on)
+{
+	static struct termios save;
+	static bool saved = false;
+	struct termios term;
+
+	if (!on) {
+		if (saved)
+			tcsetattr(STDIN_FILENO, TCSADRAIN, &save);
+		saved = false;
+		return true;
+	}
+
+	if (tcgetattr(STDIN_FILENO, &save) == -1)
+		return false;
+
+	term = save;
+	term.c_lflag &= ~(ICANON|ECHO|ECHONL|ISIG|IEXTEN);
+	term.c_iflag &= ~(IXON|ICRNL);
+	term.c_cc[VMIN] = 1;
+	term.c_cc[VTIME] = 0;
+
+	return (saved = tcsetattr(STDIN_FILENO, TCSADRAIN, &term) == 0);
+}
+
+static int edit_byte(void)
+{
+	ssize_t rc;
+
+	if (edit_in_pos == edit_in_len) {
+		while ((rc = read(STDIN_FILENO, edit_in, sizeof(edit_in))) == -1 && errno == EINTR) ;
+		if (rc <= 0)
+			return -1;
+		edit_in_len = rc;
+		edit_in_pos = 0;
+	}
+
+	return edit_in[edit_in_pos++];
+}
+
+/* the next key, with escape sequences turned into EDIT_ codes; -1 at end of file */
+static int edit_key(void)
+{
+	int c, arg = 0;
+
+	if ((c = edit_byte()) != 033)
+		return c;
+
+	if ((c = edit_byte()) != '[' && c != 'O')
+		return c == -1 ? -1 : 0;
+
+	while ((c = edit_byte()) != -1 && isdigit(c))
+		arg = arg * 10 + c - '0';
+
+	switch (c)
+	{
+		case 'A': return EDIT_UP;
+		case 'B': return EDIT_DOWN;
+		case 'C': return EDIT_RIGHT;
+		case 'D': return EDIT_LEFT;
+		case 'H': return EDIT_HOME;
+		case 'F': return EDIT_END;
+		case '~':
+			switch (arg)
+			{
+				case 1: case 7: return EDIT_HOME;
+				case 4: case 8: return EDIT_END;
+				case 3: return EDIT_DEL;
+			}
+			break;
+	}
 
-			while (*tmp)
-				if (!isalpha(*tmp)) break;
-				else tmp++;
+	return c == -1 ? -1 : 0;
+}
 
-			if (tmp - (src+2) < 1)
-				errx(EXIT_FAILURE, "No delimiter for heredoc");
-			
-			here_doc_delim = strndup(src+2, tmp - (src+2));
-			if (here_doc_remaining)
-				free(here_doc_remaining);
-			here_doc_remaining = strdup(src + (tmp - src));
-			
-			if (next) *next = NULL;
-			return NULL;
-		} else if (*src == '$' || *src == '`') {
-			if (*src == '$') {
-				if (*(src+1) == '{') {
-					while (*src != '}')
-						*dst++ = *src++;
-				} else if (*(src+1) == '(' && *(src+2) == '(') {
-					char *end = strstr(src+3, "))");
-					if (!end) errx(EXIT_FAILURE, "Unterminated $((");
-					len = (end + 2) - src;
-					strncpy(dst, src, len);
-					dst += len;
-					src += len;
-				} else if (*(src+1) == '(') {
-					int depth = 1;
-					char *end = src+2;
-					while(*end && depth) {
-						if (*end == ')' && *(end-1) != '\\') depth--;
-						else if (*end == '$' && *(end+1) == '(') depth++;
-						else
-							end++;
-					}
-					if (depth) errx(EXIT_FAILURE, "Unterminated $(");
-					len = (end + 1) - src;
-					strncpy(dst, src, len);
-					dst += len;
-					src += len;
-				} else
-					*dst++ = *src++;
-			} else
-				*dst++ = *src++;
-		} else if ((len = isoperator(src)) != 0) {
-			if ( (*src == '<' || *src == '>') && dst > buf) {
-				for (tmp = src; tmp > str;) {
-					if (!isdigit(*(tmp-1))) break;
-					tmp--;
+static void edit_flush(edit_t *ed)
+{
+	if (ed->out.len && !write_all(STDOUT_FILENO, ed->out.buf, ed->out.len))
+		exit(EXIT_FAILURE);
+	ed->out.len = 0;
+}
+
+/* redraw the line, with text before the line itself when it is not NULL */
+static void edit_redraw(edit_t *ed, const char *before, const size_t cursor)
+{
+	char tmp[32];
+
+	strbuf_append(&ed->out, "\r", 1);
+	strbuf_append(&ed->out, ed->prompt, strlen(ed->prompt));
+	if (before)
+		strbuf_append(&ed->out, before, strlen(before));
+	strbuf_append(&ed->out, ed->line.buf, ed->line.len);
+	strbuf_append(&ed->out, "\033[K", 3);
+	if (cursor < ed->line.len)
+		strbuf_append(&ed->out, tmp, snprintf(tmp, sizeof(tmp), "\033[%zuD", ed->line.len - cursor));
+	edit_flush(ed);
+}
+
+static void edit_set(edit_t *ed, const char *str)
+{
+	ed->line.len = 0;
+	strbuf_append(&ed->line, str, strlen(str));
+	ed->pos = ed->line.len;
+}
+
+static void edit_delete(edit_t *ed, const size_t from, const size_t to)
+{
+	memmove(ed->line.buf + from, ed->line.buf + to, ed->line.len - to + 1);
+	ed->line.len -= to - from;
+	ed->pos = from;
+}
+
+/* the newest line at or before from containing query, or -1 */
+static int hist_find(const char *query, int from)
+{
+	for (; from >= 0; from--)
+		if (strstr(hist_get(from), query))
+			return from;
+	return -1;
+}
+
+/*
+ * ^R: search back through history as the query is typed, ^R again for an
+ * older match. Any other key takes the match into the line and is then
+ * handled as usual; ^G restores the line as it was.
+ */
+static int edit_search(edit_t *ed)
+{
+	strbuf_t query = {0}, label = {0};
+	char *orig = strdup(ed->line.buf);
+	int match = -1, key, i;
+
+	strbuf_append(&query, "", 0);
+
+	while (1)
+	{
+		const char *found = match == -1 ? NULL : strstr(hist_get(match), query.buf);
+
+		label.len = 0;
+		strbuf_append(&label, "(reverse-i-search)`", 19);
+		strbuf_append(&label, query.buf, query.len);
+		strbuf_append(&label, "': ", 3);
+		edit_redraw(ed, label.buf, found ? (size_t)(found - hist_get(match)) : ed->line.len);
+
+		if ((key = edit_key()) == CTRL('R')) {
+			if (match > 0 && (i = hist_find(query.buf, match - 1)) != -1)
+				match = i;
+		} else if (key == 0x7f || key == CTRL('H')) {
+			if (query.len)
+				query.buf[--query.len] = '\0';
+			match = query.len ? hist_find(query.buf, hist.cnt - 1) : -1;
+		} else if (key >= ' ' && key < 0x7f) {
+			const char c = key;
+
+			strbuf_append(&query, &c, 1);
+			if ((i = hist_find(query.buf, match == -1 ? hist.cnt - 1 : match)) != -1)
+				match = i;
+		} else
+			break;
+
+		if (match != -1)
+			edit_set(ed, hist_get(match));
+	}
+
+	if (key == CTRL('G')) {
+		edit_set(ed, orig ? orig : "");
+		key = 0;
+	}
+
+	free(orig);
+	free(query.buf);
+	free(label.buf);
+	return key;
+}
+
+static bool get_next_parser_string(int prompt)
+{
+	static edit_t ed;
+	char *saved = NULL;		/* the new line, while history is shown */
+	int key, hidx;
+	bool eof = false, keep = !prompt;
+
+	if (!hist.loaded)
+		hist_load();
+
+	ed.line.len = 0;
+	if (!strbuf_grow(&ed.line, 0))
+		exit(EXIT_FAILURE);
+	ed.line.buf[0] = '\0';
+	ed.pos = 0;
+	ed.prompt = prompt ? "> " : "# ";
+	hidx = hist.cnt;
+
+	edit_raw(true);
+	edit_redraw(&ed, NULL, 0);
+
+	while ((key = edit_key()) != -1)
+	{
+		if (key == CTRL('R'))
+			key = edit_search(&ed);
+		if (key == '\r' || key == '\n')
+			break;
+
+		switch (key)
+		{
+			case CTRL('D'):
+				if (ed.line.len == 0) {
+					edit_set(&ed, "exit");
+					keep = false;
+					goto done;
 				}
+				/* FALLTHROUGH */
+			case EDIT_DEL:
+				if (ed.pos < ed.line.len)
+					edit_delete(&ed, ed.pos, ed.pos + 1);
+				break;
+			case 0x7f:
+			case CTRL('H'):
+				if (ed.pos)
+					edit_delete(&ed, ed.pos - 1, ed.pos);
+				break;
+			case CTRL('A'):
+			case EDIT_HOME:
+				ed.pos = 0;
+				break;
+			case CTRL('E'):
+			case EDIT_END:
+				ed.pos = ed.line.len;
+				break;
+			case CTRL('B'):
+			case EDIT_LEFT:
+				if (ed.pos)
+					ed.pos--;
+				break;
+			case CTRL('F'):
+			case EDIT_RIGHT:
+				if (ed.pos < ed.line.len)
+					ed.pos++;
+				break;
+			case CTRL('K'):
+				edit_delete(&ed, ed.pos, ed.line.len);
+				break;
+			case CTRL('U'):
+				edit_delete(&ed, 0, ed.pos);
+				break;
+			case CTRL('W'):
+				{
+					size_t from = ed.pos;
 
-				if (tmp >= str) {
-					//dst -= (src - tmp);
-					//*dst = '\0';
-					//src -= (src - tmp);
-					
-					/* the operator is not part of IO_NUMBER, but if we remove it, 
-					 * the categoriser has doesn't work */
-					strncat(buf, src, len);
+					while (from && isspace((unsigned char)ed.line.buf[from - 1]))
+						from--;
+					while (from && !isspace((unsigned char)ed.line.buf[from - 1]))
+						from--;
+					edit_delete(&ed, from, ed.pos);
+				}
+				break;
+			case CTRL('L'):
+				strbuf_append(&ed.out, "\033[H\033[2J", 7);
+				break;
+			case CTRL('C'):
+				strbuf_append(&ed.out, "^C\r\n", 4);
+				edit_set(&ed, "");
+				hidx = hist.cnt;
+				break;
+			case CTRL('P'):
+			case EDIT_UP:
+				if (hidx == 0)
 					break;
-				} else {
-					while(len--) *dst++ = *src++;
+				if (hidx == hist.cnt) {
+					free(saved);
+					saved = strdup(ed.line.buf);
+				}
+				edit_set(&ed, hist_get(--hidx));
+				break;
+			case CTRL('N'):
+			case EDIT_DOWN:
+				if (hidx == hist.cnt)
 					break;
+				edit_set(&ed, ++hidx == hist.cnt ? (saved ? saved : "") : hist_get(hidx));
+				break;
+			default:
+				if ((key >= ' ' && key < 0x100 && key != 0x7f) || key == '\t') {
+					const char c = key;
+
+					if (!strbuf_grow(&ed.line, 1))
+						break;
+					memmove(ed.line.buf + ed.pos + 1, ed.line.buf + ed.pos, ed.line.len - ed.pos + 1);
+					ed.line.buf[ed.pos++] = c;
+					ed.line.len++;
 				}
-			}
-			if (dst > buf) break;
-			while(len--) *dst++ = *src++;
-			break;
-		} else if (isblank(*src)) {
-			while(*src && isblank(*src)) src++;
-			if (dst > buf) 
 				break;
-		} else if (*src == '#') {
-			while(*src && *src != '\n') src++;
-		} else
-			*dst++ = *src++;
+		}
+
+		/* the rest of a paste is handled before the line is shown again */
+		if (edit_in_pos == edit_in_len)
+			edit_redraw(&ed, NULL, ed.pos);
+	}
+
+	if (key == -1 && ed.line.len == 0)
+		eof = true;
+
+done:
+	ed.pos = ed.line.len;
+	edit_redraw(&ed, NULL, ed.pos);
+	strbuf_append(&ed.out, "\r\n", 2);
+	edit_flush(&ed);
+	edit_raw(false);
+	free(saved);
+
+	if (keep && !eof)
+		hist_add(ed.line.buf);
+
+	parser_string = ed.line.buf;
+	return eof;
+}
+
+
+/* 
+ * The compiled form of a script is the parse tree, written out pre-order.
+ * Entries are keyed by the canonical path of the script and validated
+ * against its mtime and size, so an edited script is simply re-parsed.
+ */
+
+static bool cache_put(FILE *fp, const void *ptr, const size_t len)
+{
+	return fwrite(ptr, 1, len, fp) == len;
+}
+
+static bool cache_get(FILE *fp, void *ptr, const size_t len)
+{
+	return fread(ptr, 1, len, fp) == len;
+}
+
+static bool cache_put_str(FILE *fp, const char *str)
+{
+	const uint32_t len = str ? strlen(str) : CACHE_NULL;
+
+	if (!cache_put(fp, &len, sizeof(len)))
+		return false;
+
+	return str ? cache_put(fp, str, len) : true;
+}
+
+static bool cache_get_str(FILE *fp, char **str)
+{
+	uint32_t len;
+
+	*str = NULL;
+
+	if (!cache_get(fp, &len, sizeof(len)))
+		return false;
+	if (len == CACHE_NULL)
+		return true;
+	if ((*str = malloc(len + 1)) == NULL)
+		return false;
+	if (!cache_get(fp, *str, len)) {
+		free(*str);
+		*str = NULL;
+		return false;
+	}
+
+	(*str)[len] = '\0';
+	return true;
+}
+
+/* a node's arguments are written after it, then the rest of its list */
+static bool cache_put_node(FILE *fp, const node *n)
+{
+	for (; n; n = n->next)
+	{
+		const int32_t hdr[3] = { n->token, n->num, n->sep };
+		const uint8_t type = n->type;
+		const uint8_t mask = 
+			(n->arg0 ? 1<<0 : 0) |
+			(n->arg1 ? 1<<1 : 0) |
+			(n->arg2 ? 1<<2 : 0) |
+			(n->arg3 ? 1<<3 : 0) |
+			(n->next ? 1<<4 : 0);
+
+		if (!cache_put(fp, &type, sizeof(type)) || !cache_put(fp, &mask, sizeof(mask)) ||
+				!cache_put(fp, hdr, sizeof(hdr)) || !cache_put_str(fp, n->value))
+			return false;
+
+		if (n->arg0 && !cache_put_node(fp, n->arg0)) return false;
+		if (n->arg1 && !cache_put_node(fp, n->arg1)) return false;
+		if (n->arg2 && !cache_put_node(fp, n->arg2)) return false;
+		if (n->arg3 && !cache_put_node(fp, n->arg3)) return false;
 	}
 
-	if (next) {
-		if (*src) {
-			*next = src;
-		} else
-			*next = NULL;
+	return true;
+}
+
+static node *cache_get_node(FILE *fp)
+{
+	node *head = NULL, **link = &head;
+	int32_t hdr[3];
+	uint8_t type, mask = 1<<4;
+
+	while (mask & (1<<4))
+	{
+		if (!cache_get(fp, &type, sizeof(type)) || !cache_get(fp, &mask, sizeof(mask)) ||
+				!cache_get(fp, hdr, sizeof(hdr)))
+			goto fail;
+		if (type == N_NONE || type > N_PATTERN)
+			goto fail;
+
+		node *ret = newNode(type);
+		ret->token = hdr[0];
+		ret->num   = hdr[1];
+		ret->sep   = hdr[2];
+		*link = ret;
+		link = &ret->next;
+
+		if (!cache_get_str(fp, &ret->value))
+			goto fail;
+
+		if ((mask & (1<<0)) && (ret->arg0 = cache_get_node(fp)) == NULL) goto fail;
+		if ((mask & (1<<1)) && (ret->arg1 = cache_get_node(fp)) == NULL) goto fail;
+		if ((mask & (1<<2)) && (ret->arg2 = cache_get_node(fp)) == NULL) goto fail;
+		if ((mask & (1<<3)) && (ret->arg3 = cache_get_node(fp)) == NULL) goto fail;
 	}
 
-	len = strlen(buf) - 1;
-	for(int i = len; i >= 0 && isblank(buf[i]); i--)
-		buf[i] = '\0';
+	return head;
+fail:
+	freeNode(head, true);
+	return NULL;
+}
 
-	return strlen(buf) ? buf : NULL;
+static bool cache_put_header(FILE *fp, const cache_t *c)
+{
+	const uint32_t version = CACHE_VERSION;
+	const int64_t key[3] = { c->mtime.tv_sec, c->mtime.tv_nsec, c->size };
+
+	return cache_put(fp, CACHE_MAGIC, 4) && cache_put(fp, &version, sizeof(version)) &&
+		cache_put(fp, key, sizeof(key)) && cache_put_str(fp, c->source);
 }
-#endif
 
-static void parser_init()
+static bool cache_check_header(FILE *fp, const cache_t *c)
 {
-	/*
-	if (regcomp(&reg_assignment, reg_assignment_str, REG_EXTENDED))
-		errx(EXIT_FAILURE, "regcomp");
-	if (regcomp(&reg_name, reg_name_str, REG_EXTENDED))
-		errx(EXIT_FAILURE, "regcomp");
-	*/
-	if ((cur_sh_env = calloc(1, sizeof(shenv_t))) == NULL)
-		err(EXIT_FAILURE, "calloc: cur_sh_env");
-	if ((cur_sh_env->private_envs = calloc(1, sizeof(env_t *))) == NULL)
-		err(EXIT_FAILURE, "calloc: cur_sh_env[0]");
+	char magic[4];
+	uint32_t version;
+	int64_t key[3];
+	char *source = NULL;
+	bool ret;
 
-	char buf[BUFSIZ] = {0};
+	if (!cache_get(fp, magic, sizeof(magic)) || memcmp(magic, CACHE_MAGIC, 4) ||
+			!cache_get(fp, &version, sizeof(version)) || version != CACHE_VERSION ||
+			!cache_get(fp, key, sizeof(key)) || !cache_get_str(fp, &source))
+		return false;
 
-	for (size_t i = 0; environ && environ[i]; i++) {
-		char *tok = strchr(environ[i], '=');
-		char *env = strndup(environ[i], environ[i] - tok);
-		setshenv(cur_sh_env, env, getenv(env));
-		free(env);
-	}
+	ret = key[0] == c->mtime.tv_sec && key[1] == c->mtime.tv_nsec &&
+		key[2] == c->size && source && !strcmp(source, c->source);
 
-	char *shlvl_str = getenv("SHLVL");
-	int shlvl = 1;
-	if (shlvl_str)
-		shlvl = atoi(shlvl_str) + 1;
-	snprintf(buf, 10, "%u", shlvl);
+	free(source);
+	return ret;
+}
 
-	env_t *env = NULL;
-	if ((env = setshenv(cur_sh_env, "SHLVL", buf)) == NULL) {
-		if (errno)
-			err(EXIT_FAILURE, NULL);
-		else
-			err(EXIT_FAILURE, "Unable to set SHLVL");
+static void cache_free(cache_t *c)
+{
+	if (c->file) { free(c->file); c->file = NULL; }
+	if (c->source) { free(c->source); c->source = NULL; }
+}
+
+static bool cache_init(cache_t *restrict c, const char *restrict dir, 
+		const char *restrict path, const struct stat *restrict sb)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	char buf[PATH_MAX];
+
+	memset(c, 0, sizeof(cache_t));
+
+	if ((c->source = realpath(path, NULL)) == NULL)
+		return false;
+
+	/* FNV-1a of the canonical path names the entry */
+	for (const char *ptr = c->source; *ptr; ptr++) {
+		hash ^= (unsigned char)*ptr;
+		hash *= 0x100000001b3ULL;
 	}
 
-	exportenv(env);
+	if (snprintf(buf, sizeof(buf), "%s/%016llx.shc", dir, (unsigned long long)hash) >= (int)sizeof(buf) ||
+			(c->file = strdup(buf)) == NULL) {
+		cache_free(c);
+		return false;
+	}
 
-	atexit(cleanup);
-}
+	c->mtime = sb->st_mtim;
+	c->size  = sb->st_size;
 
-/* global function defintions */
+	return true;
+}
 
-#if 0
-int my_yylex()
+static node *cache_load(const cache_t *c)
 {
-	char *old = NULL;
+	FILE *fp;
+	node *ret = NULL;
 
-	if (left == NULL)
-	{
-		left = parser_string;
-		parser_string = NULL;
-	}
+	if ((fp = fopen(c->file, "r")) == NULL)
+		return NULL;
 
-	if (!left) return 0;
+	if (cache_check_header(fp, c))
+		ret = cache_get_node(fp);
 
-	yyline++; yyrow=0;
+	fclose(fp);
+	return ret;
+}
 
-again:
-	while(*left && isblank(*left)) left++;
-	if (!*left) return 0;
-	/*
-	static char buf[BUFSIZ] = {0};
-	if (feof(stdin) || ferror(stdin)) return 0;
-	if (left == NULL || !*left) {
-		if ((left = fgets(buf, BUFSIZ, stdin)) == NULL)
-			return 0;
+static void cache_save(const cache_t *c, const node *n)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
 
-		while(*left && isblank(*left)) left++;
-		if(!*left) goto again;
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", c->file, getpid()) >= (int)sizeof(tmp))
+		return;
 
-		yyline++;
-		yyrow = 0;
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		warn("%s", tmp);
+		return;
 	}
-	*/
 
-	old = left;
-	if (here_doc)
-	{
-		char *tmp = NULL;
+	/* write a private file and rename it, so concurrent shells never see a partial entry */
+	const bool ok = cache_put_header(fp, c) && cache_put_node(fp, n);
 
-		if (!strncmp(left, here_doc_delim, strlen(here_doc_delim)))
-		{
-			yylval.string = here_doc_word;
-			free(here_doc_delim);
-			here_doc_delim = NULL;
-			here_doc = false;
-			//here_doc_word = NULL;
-			prev = &word;
-			free_left = true;
-			left = here_doc_remaining;
-			free_me = here_doc_remaining;
-			//here_doc_remaining = NULL;
-			return word.tok;
-		}
+	if (fclose(fp) == EOF || !ok || rename(tmp, c->file) == -1) {
+		warn("%s", c->file);
+		unlink(tmp);
+	}
+}
 
-		if (here_doc_word == NULL && (here_doc_word = strdup(left)) == NULL) {
-			err(EXIT_FAILURE, "yylex: strdup");
-		} else if (here_doc_word) {
-			int newlen = strlen(here_doc_word) + strlen(left) + 1;
-			if ((tmp = realloc(here_doc_word, newlen)) == NULL) {
-				err(EXIT_FAILURE, "yylex: realloc");
-			} else {
-				here_doc_word = tmp;
-			}
-			strcat(here_doc_word, left);
-		}
+/*
+ * The scanner's input for a script or stdin, see YY_INPUT in sh.l. A
+ * script file is the shell's own and is read in blocks. Stdin is shared
+ * with the commands the script runs, so only a line is taken from it at
+ * a time, and read or cat in the script see what follows the command.
+ * Only a terminal goes through the line editor in get_next_parser_string().
+ */
+size_t sh_input(shell_state_t *state, char *buf, const size_t size)
+{
+	ssize_t rc;
 
-		left = NULL;
-		goto again;
-	}
-	else
-	{
-		char *yytext = NULL;
-		while(*left && isblank(*left)) left++;
-		if(!*left) goto again;
-		
-		//printf("get_next_token([%s])\n", left);
-		if ((yytext = get_next_token(left, &left)) == NULL) {
-			if (here_doc) 
-				goto again;
-			warnx("no match/no data for [%s@%p] %x\n", old, old, old ? *old : '!');
+	if (state->input_shared)
+		return read_to_newline(state->input_fd, buf, size);
+
+	while ((rc = read(state->input_fd, buf, size)) == -1)
+		if (errno != EINTR) {
+			warn("read");
 			return 0;
 		}
 
-		int ret = 0;
+	return rc;
+}
 
-		if ((prev = category(yytext, left, prev)) != NULL) {
-			/*
-			printf("matched: %s: [%s] tok=%d\n", 
-					prev->tok != NEWLINE ? prev->str : "\\n", 
-					(yytext && *yytext && *yytext != '\n') ? yytext : "_" ,
-					prev->tok);
-					*/
-			if (prev->tok == NEWLINE) 
-				yylval.chr = '\n';
-			else
-				yylval.string = yytext;
-			ret = prev->tok;
-		} else {
-			warnx("failed to match [%s@%p] %x\n", yytext, yytext, yytext ? *yytext : '!');
-		}
+/* returns yyparse()'s result: non-zero when input stopped at a syntax error */
+static int parse_input(const int fd, const bool shared, shell_state_t *state)
+{
+	void *scanner;
+	int ret;
 
-		if (!left || !*left) {
-			if (in_case || in_case_in || in_do>0 || in_for_in || in_for>0 || in_brace>0 || in_func || in_if>0) {
-				// FIXME && || and EOL
-				//printf("need more\n");
-				// FIXME only needed if iteractive, need old method otherwise? or not?
-				get_next_parser_string(1);
-			}
-		}
+	state->input_fd = fd;
+	state->input_shared = shared;
 
-		return ret;
-	}
+	if (yylex_init_extra(state, &scanner))
+		exit(EXIT_FAILURE);
+
+	ret = yyparse(scanner);
+	yylex_destroy(scanner);
+
+	return ret;
 }
-#endif
-//int yylex_init(void *);
-//void *yy_scan_string (const char *yy_str, void *yyscanner );
 
-void yyerror(const char *s)
+/* a syntax error ends the input, with what came before it already run */
+static int run_input(const int fd, const bool shared, shell_state_t *state)
 {
-	warnx("\nsh: unable to parse: [%d:%d] %s", yyline, yyrow, s);
+	return parse_input(fd, shared, state) ? 2 : cur_sh_env->rc;
 }
 
-static bool get_next_parser_string(int prompt)
+/* read, parse and execute a whole script, or its cached parse tree */
+static int run_script(const char *path, shell_state_t *state)
 {
-	static char buf[BUFSIZ] = {0};
-	static const char *end = buf + sizeof(buf);
-	char tmp[64] = {0};
-	memset(buf, 0, sizeof(buf));
-
-	if (prompt)
-		printf("> ");
+	struct stat sb;
+	cache_t cache;
+	int fd, rc;
+
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1 || fstat(fd, &sb) == -1) {
+		warn("%s", path);
+		if (fd != -1)
+			close(fd);
+		return 127;
+	}
 
-	char *ptr = buf;
-	ssize_t rc;
-	bool eof = false, running = true;;
-    //bool insert = false;
+	if (opt_cache_dir && cache_init(&cache, opt_cache_dir, path, &sb)) {
+		node *prog = cache_load(&cache), **save = parse_into;
+
+		/* the cache holds the whole tree, so the script is read through before any of it runs */
+		if (prog == NULL) {
+			parse_into = &prog;
+			if (parse_input(fd, false, state) == 0 && prog)
+				cache_save(&cache, prog);
+			else {
+				freeNode(prog, true);
+				prog = NULL;
+			}
+			parse_into = save;
+		}
+		cache_free(&cache);
 
-	while(running)
-	{
-		unsigned char in;
-		if ((rc = read(STDIN_FILENO, &in, 1)) == -1)
-			exit(EXIT_FAILURE);
-		if (rc == 0) {
-			eof = true;
-			break;
+		if (prog) {
+			close(fd);
+			return execute_program(prog);
 		}
-		//printf("H:%02x\n", in);
 
-again:
-		switch (in)
-		{
-            case 0x01: /* ^a */
-                printf("\r\033[C\033[C");
-                ptr = buf;
-                break;
-            case 0x04: /* ^d */
-                if (ptr == buf) {
-                    printf("exit\n");
-                    strcpy(buf, "exit\n");
-                    goto doparse;
-                }
-                break;
-			case 0033:
-				if ((rc = read(STDIN_FILENO, &in, 1)) == -1)
-					exit(EXIT_FAILURE);
-				if (in != '[') goto again;
-				if ((rc = read(STDIN_FILENO, &in, 1)) == -1)
-					exit(EXIT_FAILURE);
-				switch(in)
-				{
-					case 'C':
-						if ((ptr<end) && *(ptr + 1)) {
-							ptr++;
-							snprintf(tmp, 64, "\033[C");
-							goto print_tmp;
-						}
-						break;
-					case 'D':
-						if (ptr<=buf) break;
-						ptr--;
-						snprintf(tmp, 64, "\033[D");
-						goto print_tmp;
-				}
-				break;
-			case 0x0b:
-				in = 0x7f;
-				while(ptr-- > buf)
-					write(STDOUT_FILENO, &in, 1);
-				memset(buf, 0, sizeof(buf));
-				ptr = buf;
-				break;
-			case 0x7f:
-				*ptr = '\0';
-				if(ptr>buf) ptr--;
-				goto force_print;
-				break;
-            case 0x17: /* ^w */
-                while (ptr >= buf && isspace(*ptr)) *(ptr--) = '\0';
-                while (ptr >= buf && !isspace(*ptr)) *(ptr--) = '\0';
-                while (ptr >= buf && isspace(*ptr)) *(ptr--) = '\0';
-                if (ptr != buf)
-                    ptr++;
-                /* TODO refresh line */
-                break;
-			case '\n':
-				running = false;
-				goto force_print;
-				break;
-			default:
-				*(ptr++) = in;
-				if (isprint(in)) {
-force_print:
-					if ((write(STDOUT_FILENO, &in, 1)) == -1)
-						exit(EXIT_FAILURE);
-                } else
-                    fprintf(stderr, "Unknown character <0x%x>\n", in);
-                    
-				break;
+		/* one that does not parse runs up to its error, as it would without -K */
+		if (lseek(fd, 0, SEEK_SET) == -1) {
+			warn("%s", path);
+			close(fd);
+			return 127;
 		}
-		continue;
-print_tmp:
-		if ((write(STDOUT_FILENO, tmp, strlen(tmp))) == -1)
-			exit(EXIT_FAILURE);
+		memset(state, 0, sizeof(shell_state_t));
 	}
 
-	*ptr = '\0';
-doparse:
-	parser_string = buf;
+	rc = run_input(fd, false, state);
+	close(fd);
 
-	//printf("read:\"%s\"\n", parser_string);
-
-	return eof;
+	return rc;
 }
 
-extern void yyparse(void *);
-extern int yydebug;
-static struct termios tios_save;
+/* sh -c: the string is parsed in place, there is nothing to map or cache */
+static int run_string(const char *str, shell_state_t *state)
+{
+	void *scanner;
+
+	if (yylex_init_extra(state, &scanner))
+		exit(EXIT_FAILURE);
+
+	yy_scan_string(str, scanner);
+	yyparse(scanner);
+	yylex_destroy(scanner);
+
+	return cur_sh_env->rc;
+}
 
 pid_t main_pid;
 
-void restore_term(void)
+static void show_usage()
+{
+	fprintf(stderr,
+			"Usage: sh [-P] [-K cachedir] [file [argument...]]\n"
+			"       sh [-P] -c command_string [command_name [argument...]]\n");
+	exit(EXIT_FAILURE);
+}
+
+static int prof_cmp(const void *a, const void *b)
+{
+	const func_t *fa = *(func_t * const *)a, *fb = *(func_t * const *)b;
+
+	return fa->prof_total < fb->prof_total ? 1 : fa->prof_total > fb->prof_total ? -1 : 0;
+}
+
+/* -P: calls, inclusive and exclusive time of each function, slowest first */
+static void profile_report(void)
 {
-    if (main_pid == getpid())
-        tcsetattr(STDOUT_FILENO, TCSANOW, &tios_save);
+	func_t **list;
+	int cnt = 0, size;
+
+	if (main_pid != getpid() || !cur_sh_env || !cur_sh_env->functions)
+		return;
+
+	for (size = 0; cur_sh_env->functions[size]; size++) ;
+	if ((list = malloc(sizeof(func_t *) * (size + 1))) == NULL)
+		return;
+
+	for (int i = 0; i < size; i++)
+		if (cur_sh_env->functions[i]->calls)
+			list[cnt++] = cur_sh_env->functions[i];
+
+	if (cnt == 0) {
+		free(list);
+		return;
+	}
+
+	qsort(list, cnt, sizeof(func_t *), prof_cmp);
+
+	fprintf(stderr, "%10s %12s %12s  %s\n", "calls", "total", "self", "function");
+	for (int i = 0; i < cnt; i++)
+		fprintf(stderr, "%10lu %12.6f %12.6f  %s\n", list[i]->calls,
+				list[i]->prof_total / 1e9, list[i]->prof_self / 1e9, list[i]->name);
+
+	free(list);
 }
 
-int main(void)
+int main(int argc, char *argv[])
 {
-	setvbuf(stdout, NULL, _IONBF, 0);
+	{
+		int opt;
+
+		/* options end at the first operand, the rest belongs to the script */
+		while ((opt = getopt(argc, argv, "+cK:P")) != -1)
+		{
+			switch (opt)
+			{
+				case 'c':
+					opt_command = 1;
+					break;
+				case 'K':
+					opt_cache_dir = optarg;
+					break;
+				case 'P':
+					opt_profile = 1;
+					break;
+				default:
+					show_usage();
+			}
+		}
+	}
+
+	if (opt_command && optind >= argc)
+		show_usage();
+
+	interactive = !opt_command && optind >= argc && isatty(STDIN_FILENO);
+
+	/* stdin stays unbuffered so read(1) never consumes input meant for children */
 	setvbuf(stdin, NULL, _IONBF, 0);
-	setvbuf(stderr, NULL, _IONBF, 0);
+	if (interactive) {
+		setvbuf(stdout, NULL, _IONBF, 0);
+		setvbuf(stderr, NULL, _IONBF, 0);
+	}
 	parser_init();
 	void *scanner;
 
+	shell_start = now_ns();
+	if (opt_profile)
+		atexit(profile_report);
+
 	shell_state_t state;
 	memset(&state, 0, sizeof(state));
 
     main_pid = getpid();
 
-	struct termios term;
+	/* job control is on by default in an interactive shell */
+	if (interactive)
+		opt_monitor = 1;
+	jobs_init();
+
+	if (opt_command) {
+		const char *str = argv[optind++];
+
+		/* $0 is command_name when given, else the shell's own name */
+		if (optind < argc) {
+			cur_sh_env->argv = &argv[optind];
+			cur_sh_env->argc = argc - optind;
+		} else {
+			cur_sh_env->argv = argv;
+			cur_sh_env->argc = 1;
+		}
+		exit(run_string(str, &state));
+	}
 
-	if (tcgetattr(STDIN_FILENO, &term) == 0) {
-        memcpy(&tios_save, &term, sizeof(struct termios));
-		term.c_lflag &= ~(ICANON|ECHO|ECHOE|ECHOK|ECHONL);
-		if (tcsetattr(STDIN_FILENO, TCSANOW, &term) == 0)
-            atexit(restore_term);
+	if (optind < argc) {
+		cur_sh_env->argv = &argv[optind];
+		cur_sh_env->argc = argc - optind;
+		exit(run_script(argv[optind], &state));
 	}
 
+	if (!interactive)
+		exit(run_input(STDIN_FILENO, true, &state));
+
 	while(1)
 	{
         state.once = 0;
 
-		if (printf("# ") < 0)
-			exit(EXIT_FAILURE);
+		jobs_notify();
 
 		if (get_next_parser_string(0))
 			break;
 
-		printf("parsing '%s'\n", parser_string);
-		yydebug = 1;
 		if(yylex_init_extra(&state, &scanner))
 			exit(EXIT_FAILURE);
-		yyset_debug(1,scanner);
 		yy_scan_string(parser_string, scanner);
 		yyparse(scanner);
 		yylex_destroy(scanner);
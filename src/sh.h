@@ -37,6 +37,7 @@ struct _node {
 	node *arg1;
 	node *arg2;
 	node *arg3;
+	node *last;			// end of the list this node heads, see nodeAppend()
 	char *value;
 	char *evaluated;
 	int num;
@@ -49,6 +50,8 @@ struct _node {
 typedef struct {
 	int skip;
     int once;
+	int input_fd;			// read through sh_input() when not scanning a string
+	bool input_shared;		// input_fd is stdin, and read a line at a time
 } shell_state_t;
 
 typedef struct {
@@ -66,10 +69,36 @@ typedef struct {
 	int			 freed;
 } env_t;
 
+typedef struct {
+	char		*name;
+	node		*body;			/* private copy of the N_FUNC body, parsed once */
+	node		*retired;		/* bodies replaced while the function was running */
+	int			 active;
+	unsigned long		calls;		/* for sh -P */
+	unsigned long long	prof_total;	/* nanoseconds, including functions it called */
+	unsigned long long	prof_self;
+} func_t;
+
+/* for job_t */
+#define JOB_RUNNING	0
+#define JOB_STOPPED	1
+#define JOB_DONE	2
+
+typedef struct {
+	int			 id;			/* %n, 0 until the job is in the table */
+	int			 state;
+	pid_t		 pgid;
+	pid_t		*pids;			/* one per command in a pipeline */
+	int			*status;		/* from waitpid(), -1 while running */
+	int			 npids;
+	char		*cmd;
+} job_t;
+
 /* for shenv_t */
 #define	MAX_TRAP	15
 #define	MAX_OPTS	10
 #define NUM_FDS		10
+#define FD_CLOSED	(-2)	/* in fds[]: closed by n>&- */
 
 /* for list_t */
 #define LIST_AND	0
@@ -84,8 +113,9 @@ typedef struct sh_exec_env {
 	mode_t	  umask;
 	void	 *traps		[MAX_TRAP + 1];
 	int		  options	[MAX_OPTS + 1];
-	void	 *functions;
-	pid_t	**last_cmds;
+	func_t	**functions;
+	job_t	**jobs;
+	pid_t	  last_async;				/* $! */
 	void	 *aliases;
 	env_t	**private_envs;
 	list_t	**sh_list;
@@ -97,13 +127,14 @@ typedef struct sh_exec_env {
 
 
 extern node *nodeAppend(node*, node*);
+extern node *nodeSep(node *, int);
 extern node *nIf(node*, node*, node*);			// arg3 = redirect_list
 extern node *nSimple(node *, node *, node *);
 extern node *nIoRedirect(int, char *);
 extern node *nCase(char *, node *);
 extern node *nCaseItem(node *, node *);
 extern node *nWhile(node *, node *);
-extern node *nFor(char *, char *, node *);
+extern node *nFor(char *, node *, node *);
 extern node *nUntil(node *, node *);
 extern node *nString(char *);
 extern node *nPattern(char *);
@@ -114,7 +145,12 @@ extern node *nSubshell(node *);
 extern node *nFunc(char *, node *);
 extern void print_node(const node *, int, int);
 extern int evaluate(node *, int, int);
+extern int execute_program(node *);
 extern void freeNode(node *, const bool);
+extern size_t sh_input(shell_state_t *, char *, const size_t);
+extern bool here_doc_pending(void);
+extern bool here_doc_line(const char *, size_t);
+extern void here_doc_eof(void);
 
 extern shenv_t *cur_sh_env;
 
@@ -74,6 +74,10 @@ void yyerror(void *, const char *s);
 /*      '{'       '}'       '!'   */
 
 
+%token  Time
+/*      'time'   */
+
+
 %token  In
 /*      'in'   */
 
@@ -89,7 +93,8 @@ void yyerror(void *, const char *s);
 /*%type<node> expansion*/
 
 %type<string> name 
-%type<string> wordlist in fname filename
+%type<node> wordlist
+%type<string> in fname filename
 %type<string> here_end 
 /*%type<string> variable_expansion*/
 
@@ -102,30 +107,30 @@ void yyerror(void *, const char *s);
 %%
 program          : linebreak complete_commands linebreak			{ 
 																	debug_printf("program.1 [%0x,%0x]\n",$1,$3); 
-																	//print_node($2,0,1);
-																	//evaluate($2,0,1);
-																	freeNode($2,true);
 																	$$=NULL;
 																	}
                  | linebreak										{ debug_printf("program.2 [%0x]\n", $1); }
                  ;
 
+	/* each command runs as soon as it has been read, as a later syntax error must not stop it */
 complete_commands: complete_commands newline_list complete_command	{ 
 																	debug_printf("complete_commands.1 [%02x]\n", $2);
-																	$$=nodeAppend($3,$1);
+																	execute_program($3);
+																	$$=NULL;
 																	}
-                 |                                complete_command	{ debug_printf("complete_commands.2\n"); 
-																	cur_sh_env->rc = evaluate($1,0,1);
+                 |                                complete_command	{
+																	debug_printf("complete_commands.2\n");
+																	execute_program($1);
+																	$$=NULL;
 																	}
                  ;
 
-complete_command : list separator_op					{ debug_printf("complete.1 [%02xc]\n", $2); $1->sep = $2; $$ = $1; }
+complete_command : list separator_op					{ debug_printf("complete.1 [%02xc]\n", $2); $$ = nodeSep($1, $2); }
                  | list									{ debug_printf("complete.2\n"); }
                  ;
 list             : list separator_op and_or				{
 														debug_printf("list.1 [%02xc]\n", $2);
-														$1->sep = $2;
-														$$ = nodeAppend($3, $1);
+														$$ = nodeAppend($3, nodeSep($1, $2));
 														}
                  |                   and_or				{ debug_printf("list.2\n"); }
                  ;
@@ -147,6 +152,14 @@ pipeline         :      pipe_sequence					{ debug_printf("pipeline.1\n"); }
 														  debug_printf("pipeline.2 [!]\n");
 														  $$ = nOp('!', NULL, $2);
 														}
+                 | Time pipe_sequence					{
+														  debug_printf("pipeline.3 [time]\n");
+														  $$ = nOp(Time, NULL, $2);
+														}
+                 | Time Bang pipe_sequence				{
+														  debug_printf("pipeline.4 [time !]\n");
+														  $$ = nOp(Time, NULL, nOp('!', NULL, $3));
+														}
                  ;
 pipe_sequence    :                             command	{ debug_printf("pipe_seq.1\n"); }
                  | pipe_sequence '|' linebreak command	{ 
@@ -180,14 +193,12 @@ compound_list    : linebreak term				{
 												}
                  | linebreak term separator		{
 												  debug_printf("compound_list.2 [%02x, %c]\n", $1, $3);
-												  $2->sep = $3;
-												  $$ = $2;
+												  $$ = nodeSep($2, $3);
 												}
                  ;
 term             : term separator and_or		{
 												  debug_printf("term.1 [%c]\n", $2);
-												  $1->sep = $2;
-												  $$ = nodeAppend($3, $1);
+												  $$ = nodeAppend($3, nodeSep($1, $2));
 												}
                  |                and_or		{ debug_printf("term.2\n"); }
                  ;
@@ -207,30 +218,25 @@ for_clause       : For name                                      do_group
                  | For name linebreak in          sequential_sep do_group	
 					{ 
 					debug_printf("for_clause.3\n");
-					$$ = nFor($2,NULL,$6);
+					/* an empty word expands to no fields, so the body never runs */
+					$$ = nFor($2,nString(""),$6);
 					free($2);
 					}
                  | For name linebreak in wordlist sequential_sep do_group	
 					{
 					debug_printf("for_clause.4\n");
 					$$ = nFor($2,$5,$7);
-					free($2); free($5);
+					free($2);
 					}
                  ;
 name             : NAME                     { debug_printf("name.1 [%s]\n", $1); $$=strdup($1); }
+                 | WORD                     { debug_printf("name.2 [%s]\n", $1); $$=strdup($1); }
 				 ;							/* Apply rule.5 */
 
 in               : In                       { debug_printf("in.1 [in]\n"); $$="in"; } /* Apply rule.6 */
                  ;
-wordlist         : wordlist WORD			{ 
-											debug_printf("wordlist.1 [%s %s]\n", $1, $2);
-											const int len = strlen($1) + 1 + strlen($2) + 1;
-											char *r = malloc(len);
-											snprintf(r, len, "%s %s", $1, $2);
-											$$ = r;
-											free($1);
-											}
-                 |          WORD			{ debug_printf("wordlist.2 [%s]\n", $1); $$=strdup($1); }
+wordlist         : wordlist WORD			{ debug_printf("wordlist.1 [+%s]\n", $2); $$ = nodeAppend(nString($2), $1); }
+                 |          WORD			{ debug_printf("wordlist.2 [%s]\n", $1); $$ = nString($1); }
                  ;
 
 case_clause      : Case WORD linebreak in linebreak case_list    Esac	{
@@ -333,6 +339,7 @@ function_body    : compound_command					{ debug_printf("function_body.1\n"); }
 													/* Apply rule.9 */
                  ;
 fname            : NAME								{ debug_printf("fname.1 [%s]\n", $1); $$=strdup($1); }
+                 | WORD								{ debug_printf("fname.2 [%s]\n", $1); $$=strdup($1); }
 				 ;									/* Apply rule.8 */
 brace_group      : Lbrace compound_list Rbrace		{
 													debug_printf("bracegroup.1\n");
@@ -1,11 +1,19 @@
-#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
 
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+# include <sys/inotify.h>
+#endif
 
 static void show_usage(const char *str)
 {
@@ -19,7 +27,339 @@ static void show_usage(const char *str)
 static int opt_follow = 0;
 static int opt_bytes = 0;
 static int opt_lines = 0;
-static int num_lines = -1;
+static bool opt_from_start = false;		/* +number */
+static long long opt_count = 10;
+
+#define	TAIL_BLOCK	(64 * 1024)
+
+static void write_all(const char *p, size_t len)
+{
+	ssize_t wr;
+
+	while (len)
+	{
+		if ((wr = write(STDOUT_FILENO, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "write");
+		}
+		p += wr;
+		len -= wr;
+	}
+}
+
+/* returns 0 at EOF */
+static size_t read_block(const int fd, char *buf, const size_t size, const char *name)
+{
+	ssize_t rd;
+
+	while ((rd = read(fd, buf, size)) == -1)
+		if (errno != EINTR)
+			err(EXIT_FAILURE, "%s", name);
+
+	return rd;
+}
+
+/* copies fd from where it is to EOF */
+static void copy_rest(const int fd, const char *name)
+{
+	static char buf[TAIL_BLOCK];
+	size_t len;
+
+	while ((len = read_block(fd, buf, sizeof(buf), name)) != 0)
+		write_all(buf, len);
+}
+
+static size_t count_lines(const char *p, const size_t len)
+{
+	const char *const end = p + len;
+	size_t n = 0;
+
+	while ((p = memchr(p, '\n', end - p)) != NULL) {
+		n++;
+		p++;
+	}
+
+	return n;
+}
+
+/* +number: skip count - 1 lines or bytes, then copy the rest */
+static void tail_from_start(const int fd, const char *name)
+{
+	static char buf[TAIL_BLOCK];
+	long long skip = opt_count > 0 ? opt_count - 1 : 0;
+	size_t len;
+
+	if (opt_bytes && lseek(fd, skip, SEEK_CUR) != -1) {
+		copy_rest(fd, name);
+		return;
+	}
+
+	while (skip && (len = read_block(fd, buf, sizeof(buf), name)) != 0)
+	{
+		const char *p = buf, *const end = buf + len;
+
+		if (opt_bytes) {
+			if ((long long)len <= skip) {
+				skip -= len;
+				continue;
+			}
+			p += skip;
+			skip = 0;
+		} else {
+			while (skip && (p = memchr(p, '\n', end - p)) != NULL) {
+				p++;
+				skip--;
+			}
+			if (skip)
+				continue;
+		}
+
+		write_all(p, end - p);
+	}
+
+	copy_rest(fd, name);
+}
+
+/*
+ * The last count lines or bytes of a seekable file: found by reading
+ * backwards from EOF a block at a time, so the cost is in what is
+ * printed, not in the size of the file.
+ */
+static bool tail_seekable(const int fd, const char *name)
+{
+	static char buf[TAIL_BLOCK];
+	struct stat sb;
+	off_t end, pos, start;
+
+	if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode) ||
+			(pos = lseek(fd, 0, SEEK_CUR)) == -1 || (end = lseek(fd, 0, SEEK_END)) == -1)
+		return false;
+
+	if (opt_bytes) {
+		start = end - pos > opt_count ? end - opt_count : pos;
+	} else {
+		long long need = opt_count;
+		off_t at = end;
+		bool last = true;
+
+		start = need > 0 ? pos : end;
+		while (need > 0 && at > pos)
+		{
+			const size_t len = at - pos < (off_t)sizeof(buf) ? (size_t)(at - pos) : sizeof(buf);
+			ssize_t rd;
+
+			at -= len;
+			while ((rd = pread(fd, buf, len, at)) == -1 && errno == EINTR)
+				;
+			if (rd != (ssize_t)len)
+				err(EXIT_FAILURE, "%s", name);
+
+			size_t n = len;
+
+			/* the newline ending the last line is not a line of its own */
+			if (last && buf[n - 1] == '\n')
+				n--;
+			last = false;
+
+			const char *nl;
+			while ((nl = memrchr(buf, '\n', n)) != NULL)
+			{
+				if (--need == 0) {
+					start = at + (nl - buf) + 1;
+					break;
+				}
+				n = nl - buf;
+			}
+		}
+	}
+
+	if (lseek(fd, start, SEEK_SET) == -1)
+		err(EXIT_FAILURE, "%s", name);
+	copy_rest(fd, name);
+
+	return true;
+}
+
+/*
+ * The last count lines or bytes of a pipe: blocks are queued as they
+ * are read, and the oldest dropped once the rest hold enough, so memory
+ * goes with the count asked for rather than the input.
+ */
+typedef struct block {
+	struct block	*next;
+	size_t			 len;
+	size_t			 lines;
+	char			 data[TAIL_BLOCK];
+} block_t;
+
+static void tail_stream(const int fd, const char *name)
+{
+	block_t *head = NULL, *tail = NULL, *spare = NULL;
+	unsigned long long total = 0;		/* bytes or newlines queued */
+	size_t len;
+
+	while (1)
+	{
+		if (tail == NULL || tail->len == TAIL_BLOCK) {
+			block_t *b = spare;
+
+			if (b)
+				spare = NULL;
+			else if ((b = malloc(sizeof(block_t))) == NULL)
+				err(EXIT_FAILURE, "malloc");
+
+			b->next = NULL;
+			b->len = 0;
+			b->lines = 0;
+			if (tail)
+				tail->next = b;
+			else
+				head = b;
+			tail = b;
+		}
+
+		if ((len = read_block(fd, tail->data + tail->len, TAIL_BLOCK - tail->len, name)) == 0)
+			break;
+
+		const size_t lines = count_lines(tail->data + tail->len, len);
+
+		tail->len += len;
+		tail->lines += lines;
+		total += opt_bytes ? len : lines;
+
+		/* a line count needs one newline more, to know where the first line starts */
+		while (head != tail)
+		{
+			const size_t have = opt_bytes ? head->len : head->lines;
+
+			if (total - have < (unsigned long long)opt_count + !opt_bytes)
+				break;
+
+			block_t *b = head;
+			head = head->next;
+			total -= have;
+			free(spare);
+			spare = b;
+		}
+	}
+
+	/* walk back from the end to where the output starts */
+	block_t **blocks = NULL;
+	size_t nblocks = 0, first = 0, offset = 0;
+
+	for (block_t *b = head; b; b = b->next)
+		if ((blocks = realloc(blocks, sizeof(block_t *) * ++nblocks)) == NULL)
+			err(EXIT_FAILURE, "realloc");
+		else
+			blocks[nblocks - 1] = b;
+
+	long long need = opt_count;
+	bool last = true, found = false;
+
+	for (size_t i = nblocks; i-- > 0 && need > 0 && !found; )
+	{
+		block_t *b = blocks[i];
+		size_t n = b->len;
+
+		if (n == 0)
+			continue;
+
+		if (opt_bytes) {
+			if ((long long)n >= need) {
+				first = i;
+				offset = n - need;
+				found = true;
+			} else
+				need -= n;
+			continue;
+		}
+
+		if (last && b->data[n - 1] == '\n')
+			n--;
+		last = false;
+
+		const char *nl;
+		while ((nl = memrchr(b->data, '\n', n)) != NULL)
+		{
+			if (--need == 0) {
+				first = i;
+				offset = nl - b->data + 1;
+				found = true;
+				break;
+			}
+			n = nl - b->data;
+		}
+	}
+
+	if (opt_count > 0)
+		for (size_t i = first; i < nblocks; i++)
+			write_all(blocks[i]->data + (i == first ? offset : 0),
+					blocks[i]->len - (i == first ? offset : 0));
+
+	for (size_t i = 0; i < nblocks; i++)
+		free(blocks[i]);
+	free(blocks);
+	free(spare);
+}
+
+/*
+ * -f: wait for the file to change with inotify, and copy what was added.
+ * A file that shrinks has been truncated, and is followed from its start.
+ */
+static void tail_follow(const int fd, const char *name, const char *path)
+{
+	struct stat sb;
+	int ifd = -1;
+
+	if (fstat(fd, &sb) == -1 || !(S_ISREG(sb.st_mode) || S_ISFIFO(sb.st_mode)))
+		return;
+	/* a pipe has nothing more to give once it is at EOF */
+	if (S_ISFIFO(sb.st_mode) && path == NULL)
+		return;
+
+#ifdef __linux__
+	char proc[64];
+
+	if (path == NULL) {
+		snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+		path = proc;
+	}
+	if ((ifd = inotify_init1(IN_CLOEXEC)) != -1 &&
+			inotify_add_watch(ifd, path, IN_MODIFY|IN_ATTRIB|IN_DELETE_SELF|IN_MOVE_SELF) == -1) {
+		close(ifd);
+		ifd = -1;
+	}
+#endif
+
+	while (1)
+	{
+		copy_rest(fd, name);
+
+		off_t pos;
+
+		if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) &&
+				(pos = lseek(fd, 0, SEEK_CUR)) != -1 && sb.st_size < pos) {
+			warnx("%s: file truncated", name);
+			if (lseek(fd, 0, SEEK_SET) == -1)
+				err(EXIT_FAILURE, "%s", name);
+			continue;
+		}
+
+#ifdef __linux__
+		if (ifd != -1) {
+			_Alignas(struct inotify_event) char events[4096];
+
+			/* which event it was matters less than that there was one */
+			while (read(ifd, events, sizeof(events)) == -1)
+				if (errno != EINTR)
+					err(EXIT_FAILURE, "inotify");
+			continue;
+		}
+#endif
+		sleep(1);
+	}
+}
 
 int main(int argc, char *argv[])
 {
@@ -35,14 +375,14 @@ int main(int argc, char *argv[])
 					opt_follow = 1;
 					break;
 				case 'c':
-					if (opt_bytes) show_usage("only one -n");
+					if (opt_bytes) show_usage("only one -c");
 					opt_bytes = 1;
-					cnt_str = strdup(optarg);
+					cnt_str = optarg;
 					break;
 				case 'n':
 					if (opt_lines) show_usage("only one -n");
 					opt_lines = 1;
-					cnt_str = strdup(optarg);
+					cnt_str = optarg;
 					break;
 				default:
 					show_usage(NULL);
@@ -52,28 +392,38 @@ int main(int argc, char *argv[])
 		if (opt_lines + opt_bytes > 1)
 			show_usage("-c or -n only");
 
-		if (opt_lines + opt_bytes == 0) {
-			num_lines = 1;
-		}
+		if (argc - optind > 1)
+			show_usage(NULL);
 
 		if (cnt_str) {
 			char *err;
-			int flip = 0;
-			if (*cnt_str == '+') 
+
+			if (*cnt_str == '+') {
+				opt_from_start = true;
+				cnt_str++;
+			} else if (*cnt_str == '-')
 				cnt_str++;
-			else if (isdigit(*cnt_str))
-				flip = 1;
 
-			num_lines = strtol(cnt_str, &err, 10);
-			if (!(*cnt_str != '\0' && *err == '\0'))
+			opt_count = strtoll(cnt_str, &err, 10);
+			if (!(isdigit(*cnt_str) && *err == '\0'))
 				errx(EXIT_FAILURE, "%s: not a valid number", cnt_str);
-			
-			if (flip)
-				num_lines = -num_lines;
-		} else
-			num_lines = -10;
+		}
 	}
 
-	printf("num_lines = %d\n", num_lines);
-}
+	const char *path = optind < argc ? argv[optind] : NULL;
+	const char *name = path ? path : "<stdin>";
+	int fd = STDIN_FILENO;
+
+	if (path && (fd = open(path, O_RDONLY)) == -1)
+		err(EXIT_FAILURE, "%s", path);
 
+	if (opt_from_start)
+		tail_from_start(fd, name);
+	else if (!tail_seekable(fd, name))
+		tail_stream(fd, name);
+
+	if (opt_follow)
+		tail_follow(fd, name, path);
+
+	exit(EXIT_SUCCESS);
+}
@@ -1,80 +1,209 @@
 #define _XOPEN_SOURCE 700
 
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <err.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
 
+#ifdef SH_BUILTIN
+# include "builtin.h"
+#endif
+
 #undef	EXIT_FAILURE
 #define EXIT_FAILURE	2
 
-static struct stat sb;
+/*
+ * The arguments are parsed into an expression tree first, then evaluated
+ * with short-circuiting -a and -o. File operands are interned while
+ * parsing, so `test -f x -a -s x -a ! -h x` looks x up once for stat and
+ * once for lstat, however many primaries name it.
+ */
+
+/* for file_t */
+#define	ST_UNKNOWN	(-1)
+#define	ST_FAILED	0
+#define	ST_OK		1
+
+typedef struct {
+	const char	*path;
+	int			 st_state;		/* ST_UNKNOWN until stat() has run */
+	int			 lst_state;		/* ditto, lstat() */
+	struct stat	 st;
+	struct stat	 lst;
+} file_t;
+
+/* for expr_t */
+#define	E_STRING	0
+#define	E_UNARY		1
+#define	E_BINARY	2
+#define	E_NOT		3
+#define	E_AND		4
+#define	E_OR		5
+
+typedef struct expr {
+	int			 type;
+	const char	*op;
+	const char	*lhs_str;
+	const char	*rhs_str;
+	struct expr	*lhs;
+	struct expr	*rhs;
+	file_t		*file;			/* E_UNARY on a path */
+} expr_t;
+
+typedef struct {
+	char	**argv;
+	int		  pos;
+	int		  end;
+	expr_t	 *nodes;				/* every node consumes an argument, argc is enough */
+	int		  nnodes;
+	file_t	 *files;
+	int		  nfiles;
+} test_t;
+
+/* set instead of exiting, so test can also run inside the shell */
+static int test_error = 0;
+
+static const struct stat *file_stat(file_t *f)
+{
+	if (f->st_state == ST_UNKNOWN) {
+		/* what lstat() found is all stat() would, unless it was a link */
+		if (f->lst_state == ST_OK && !S_ISLNK(f->lst.st_mode)) {
+			f->st = f->lst;
+			f->st_state = ST_OK;
+		} else
+			f->st_state = stat(f->path, &f->st) == -1 ? ST_FAILED : ST_OK;
+	}
 
-static int is_block(const char *f) {
-	if (stat(f, &sb) == -1) return 1; else return !(S_ISBLK(sb.st_mode));
+	return f->st_state == ST_OK ? &f->st : NULL;
 }
 
-static int is_char(const char *f) {
-	if (stat(f, &sb) == -1) return 1; else return !(S_ISCHR(sb.st_mode));
-}
+static const struct stat *file_lstat(file_t *f)
+{
+	if (f->lst_state == ST_UNKNOWN)
+		f->lst_state = lstat(f->path, &f->lst) == -1 ? ST_FAILED : ST_OK;
 
-static int is_dir(const char *f) {
-	if (stat(f, &sb) == -1) return 1; else return !(S_ISDIR(sb.st_mode));
+	return f->lst_state == ST_OK ? &f->lst : NULL;
 }
 
-static int is_existing(const char *f) {
-	if (stat(f, &sb) == -1) return 1; else return 0;
-}
+static file_t *file_intern(test_t *t, const char *path)
+{
+	for (int i = 0; i < t->nfiles; i++)
+		if (!strcmp(t->files[i].path, path))
+			return &t->files[i];
 
-static int is_file(const char *f) {
-	if (stat(f, &sb) == -1) return 1; else return !(S_ISREG(sb.st_mode));
-}
+	file_t *f = &t->files[t->nfiles++];
 
-static int is_setgid(const char *f) {
-	if (stat(f, &sb) == -1) return 1; else return !((sb.st_mode & S_ISGID) == S_ISGID);
-}
+	f->path = path;
+	f->st_state = ST_UNKNOWN;
+	f->lst_state = ST_UNKNOWN;
 
-static int is_link(const char *f) {
-	if (stat(f, &sb) == -1) return 1; else return !(S_ISLNK(sb.st_mode));
+	return f;
 }
 
-static int is_fifo(const char *f) {
-	if (stat(f, &sb) == -1) return 1; else return !(S_ISFIFO(sb.st_mode));
-}
+static bool is_file_desc(const char *f)
+{
+	char *endptr = NULL;
 
-static int is_socket(const char *f) {
-	if (stat(f, &sb) == -1) return 1; else return !(S_ISSOCK(sb.st_mode));
-}
+	errno = 0;
+	long fd = strtol(f, &endptr, 10);
 
-static int is_setuid(const char *f) {
-	if (stat(f, &sb) == -1) return 1; else return !((sb.st_mode & S_ISUID) == S_ISUID);
-}
+	if (errno || endptr == f || *endptr != '\0' || fd < 0 || fd > 0x7fffffff) {
+		warnx("invalid file descriptor: %s", f);
+		test_error = 1;
+		return false;
+	}
 
-static int is_not_empty(const char *f) {
-	if (stat(f, &sb) == -1) return 1; else return !(sb.st_size > 0);
+	return isatty(fd);
 }
 
-static int is_readable(const char *f) {
-	if (access(f, R_OK)) return 1; else return 0;
+static bool is_unary(const char *op)
+{
+	return op[0] == '-' && op[1] && !op[2] && strchr("bcdefghLnprSstuwxz", op[1]);
 }
 
-static int is_writeable(const char *f) {
-	if (access(f, W_OK)) return 1; else return 0;
+static bool is_binary(const char *op)
+{
+	static const char *const ops[] = {
+		"=", "!=", "-eq", "-ne", "-gt", "-ge", "-lt", "-le", NULL
+	};
+
+	for (int i = 0; ops[i]; i++)
+		if (!strcmp(op, ops[i]))
+			return true;
+
+	return false;
 }
 
-static int is_exec(const char *f) {
-	if (access(f, X_OK)) return 1; else return 0;
+static bool unaryop(expr_t *e)
+{
+	const struct stat *sb;
+
+	switch (e->op[1])
+	{
+		case 'n': return *e->lhs_str != '\0';
+		case 'z': return *e->lhs_str == '\0';
+		case 't': return is_file_desc(e->lhs_str);
+		case 'r': return !access(e->lhs_str, R_OK);
+		case 'w': return !access(e->lhs_str, W_OK);
+		case 'x': return !access(e->lhs_str, X_OK);
+		case 'h':
+		case 'L':
+			return (sb = file_lstat(e->file)) && S_ISLNK(sb->st_mode);
+	}
+
+	if ((sb = file_stat(e->file)) == NULL)
+		return false;
+
+	switch (e->op[1])
+	{
+		case 'b': return S_ISBLK(sb->st_mode);
+		case 'c': return S_ISCHR(sb->st_mode);
+		case 'd': return S_ISDIR(sb->st_mode);
+		case 'e': return true;
+		case 'f': return S_ISREG(sb->st_mode);
+		case 'g': return (sb->st_mode & S_ISGID) == S_ISGID;
+		case 'p': return S_ISFIFO(sb->st_mode);
+		case 'S': return S_ISSOCK(sb->st_mode);
+		case 's': return sb->st_size > 0;
+		case 'u': return (sb->st_mode & S_ISUID) == S_ISUID;
+	}
+
+	warnx("unknown test '%s'", e->op);
+	test_error = 1;
+	return false;
 }
 
-static int is_file_desc(const char *f) {
-	warnx("is_file_desc not implemented");
-	return 0;
+static bool get_integer(const char *str, long *val)
+{
+	char *endptr = NULL;
+
+	errno = 0;
+	*val = strtol(str, &endptr, 10);
+
+	if (errno || endptr == str || *endptr != '\0') {
+		warnx("invalid integer: %s", str);
+		test_error = 1;
+		return false;
+	}
+
+	return true;
 }
 
-static int binaryintop(const char *op, long n1, long n2)
+static bool binaryop(const char *op, const char *arg0, const char *arg1)
 {
+	long n1, n2;
+
+	if (!strcmp(op, "="))
+		return !strcmp(arg0, arg1);
+	if (!strcmp(op, "!="))
+		return strcmp(arg0, arg1);
+
+	if (!get_integer(arg0, &n1) || !get_integer(arg1, &n2))
+		return false;
+
 	op++;
 
 	if (!strcmp(op, "eq"))      { return n1 == n2; }
@@ -83,170 +212,274 @@ static int binaryintop(const char *op, long n1, long n2)
 	else if (!strcmp(op, "ge")) { return n1 >= n2; }
 	else if (!strcmp(op, "lt")) { return n1 <  n2; }
 	else if (!strcmp(op, "le")) { return n1 <= n2; }
-	else {
-		errx(EXIT_FAILURE, "unknown operator %s", op);
+
+	warnx("unknown operator -%s", op);
+	test_error = 1;
+	return false;
+}
+
+static bool eval(expr_t *e)
+{
+	switch (e->type)
+	{
+		case E_STRING:	return *e->lhs_str != '\0';
+		case E_UNARY:	return unaryop(e);
+		case E_BINARY:	return binaryop(e->op, e->lhs_str, e->rhs_str);
+		case E_NOT:		return !eval(e->lhs);
+		case E_AND:		return eval(e->lhs) && eval(e->rhs);
+		case E_OR:		return eval(e->lhs) || eval(e->rhs);
 	}
-	return 0;
+
+	return false;
 }
 
-static int binaryop(const char *op, const char *arg0, const char *arg1)
+/*
+ * oexpr   := aexpr [ -o oexpr ]
+ * aexpr   := nexpr [ -a aexpr ]
+ * nexpr   := ! nexpr | primary
+ * primary := ( oexpr ) | unary-op arg | arg binary-op arg | arg
+ *
+ * A binary operator in second place wins over everything else, as POSIX
+ * requires for three arguments: `test ! = x` compares "!" with "x".
+ */
+
+static expr_t *parse_or(test_t *);
+
+static expr_t *new_expr(test_t *t, const int type)
 {
-	if (*op == '-' ) {
-		char *endptr = NULL;
+	expr_t *e = &t->nodes[t->nnodes++];
 
-		errno = 0;
-		long n1 = strtol(arg0, &endptr, 10);
+	memset(e, 0, sizeof(expr_t));
+	e->type = type;
 
-		if (errno)
-			err(EXIT_FAILURE, "invalid integer: %s", arg0);
-		if (endptr != NULL)
-			errx(EXIT_FAILURE, "invalid integer: %s", arg0);
-			
-		errno = 0;
-		endptr = NULL;
-		long n2 = strtol(arg1, &endptr, 10);
+	return e;
+}
 
-		if (errno)
-			err(EXIT_FAILURE, "invalid integer: %s", arg0);
-		if (endptr != NULL)
-			errx(EXIT_FAILURE, "invalid integer: %s", arg0);
+static expr_t *parse_primary(test_t *t)
+{
+	char **argv = t->argv;
+	expr_t *e;
 
-		return binaryintop(op, n1, n2);
-	} else if (!strcmp(op, "=")) {
-		return strcmp(arg0, arg1) ? 1 : 0;
-	} else if (!strcmp(op, "!=")) {
-		return strcmp(arg0, arg1) ? 0 : 1;
-	} else {
-		errx(EXIT_FAILURE, "unknown operator %s", op);
+	if (t->pos >= t->end) {
+		warnx("argument expected");
+		return NULL;
+	}
+
+	if (t->pos + 2 < t->end && is_binary(argv[t->pos + 1])) {
+		e = new_expr(t, E_BINARY);
+		e->lhs_str = argv[t->pos];
+		e->op = argv[t->pos + 1];
+		e->rhs_str = argv[t->pos + 2];
+		t->pos += 3;
+		return e;
+	}
+
+	if (t->pos + 1 < t->end && is_unary(argv[t->pos])) {
+		e = new_expr(t, E_UNARY);
+		e->op = argv[t->pos];
+		e->lhs_str = argv[t->pos + 1];
+		if (!strchr("nzrwxt", e->op[1]))
+			e->file = file_intern(t, e->lhs_str);
+		t->pos += 2;
+		return e;
+	}
+
+	if (t->pos + 1 < t->end && !strcmp(argv[t->pos], "(")) {
+		t->pos++;
+		if ((e = parse_or(t)) == NULL)
+			return NULL;
+		if (t->pos >= t->end || strcmp(argv[t->pos], ")")) {
+			warnx("')' expected");
+			return NULL;
+		}
+		t->pos++;
+		return e;
 	}
 
-	return 0;
+	e = new_expr(t, E_STRING);
+	e->lhs_str = argv[t->pos++];
+	return e;
+}
+
+static expr_t *parse_not(test_t *t)
+{
+	expr_t *e;
+
+	/* a lone ! is a string, and so is ! in front of a binary operator or ) */
+	if (t->pos + 1 < t->end && !strcmp(t->argv[t->pos], "!") &&
+			strcmp(t->argv[t->pos + 1], ")") &&
+			!(t->pos + 2 < t->end && is_binary(t->argv[t->pos + 1]))) {
+		t->pos++;
+		e = new_expr(t, E_NOT);
+		if ((e->lhs = parse_not(t)) == NULL)
+			return NULL;
+		return e;
+	}
+
+	return parse_primary(t);
+}
+
+static expr_t *parse_and(test_t *t)
+{
+	expr_t *lhs, *e;
+
+	if ((lhs = parse_not(t)) == NULL)
+		return NULL;
+
+	if (t->pos >= t->end || strcmp(t->argv[t->pos], "-a"))
+		return lhs;
+
+	t->pos++;
+	e = new_expr(t, E_AND);
+	e->lhs = lhs;
+	if ((e->rhs = parse_and(t)) == NULL)
+		return NULL;
+
+	return e;
 }
 
-static int unaryop(const char *op, const char *arg)
+static expr_t *parse_or(test_t *t)
 {
-	int rc = 0;
+	expr_t *lhs, *e;
+
+	if ((lhs = parse_and(t)) == NULL)
+		return NULL;
 
-	switch(*(op+1))
+	if (t->pos >= t->end || strcmp(t->argv[t->pos], "-o"))
+		return lhs;
+
+	t->pos++;
+	e = new_expr(t, E_OR);
+	e->lhs = lhs;
+	if ((e->rhs = parse_or(t)) == NULL)
+		return NULL;
+
+	return e;
+}
+
+/*
+ * POSIX settles one to four arguments by their count alone, and only
+ * longer expressions go to the grammar above: `test ( ! )` is a one
+ * argument test of "!" in parentheses, not a negation missing its operand.
+ */
+static expr_t *parse_count(test_t *t, const int n)
+{
+	char **argv = t->argv + t->pos;
+	expr_t *e;
+
+	switch (n)
 	{
-		case 'b':
-			rc = is_block(arg);
-			break;
-		case 'c':
-			rc = is_char(arg);
-			break;
-		case 'd':
-			rc = is_dir(arg);
-			break;
-		case 'e':
-			rc = is_existing(arg);
-			break;
-		case 'f':
-			rc = is_file(arg);
-			break;
-		case 'g':
-			rc = is_setgid(arg);
-			break;
-		case 'h':
-		case 'L':
-			rc = is_link(arg);
-			break;
-		case 'n':
-			rc = !strlen(arg);
-			break;
-		case 'p':
-			rc = is_fifo(arg);
-			break;
-		case 'r':
-			rc = is_readable(arg);
-			break;
-		case 'S':
-			rc = is_socket(arg);
-			break;
-		case 's':
-			rc = is_not_empty(arg);
-			break;
-		case 't':
-			rc = is_file_desc(arg);
-			break;
-		case 'u':
-			rc = is_setuid(arg);
-			break;
-		case 'w':
-			rc = is_writeable(arg);
-			break;
-		case 'x':
-			rc = is_exec(arg);
-			break;
-		case 'z':
-			rc = strlen(arg);
-			break;
+		case 1:
+			e = new_expr(t, E_STRING);
+			e->lhs_str = argv[0];
+			t->pos++;
+			return e;
+		case 2:
+			if (!strcmp(argv[0], "!"))
+				break;
+			if (is_unary(argv[0]))
+				return parse_primary(t);
+			return parse_or(t);
+		case 3:
+			if (is_binary(argv[1]))
+				return parse_primary(t);
+			if (!strcmp(argv[1], "-a") || !strcmp(argv[1], "-o")) {
+				e = new_expr(t, argv[1][1] == 'a' ? E_AND : E_OR);
+				e->lhs = parse_count(t, 1);
+				t->pos++;
+				e->rhs = parse_count(t, 1);
+				return e;
+			}
+			if (!strcmp(argv[0], "!"))
+				break;
+			if (!strcmp(argv[0], "(") && !strcmp(argv[2], ")")) {
+				t->pos++;
+				e = parse_count(t, 1);
+				t->pos++;
+				return e;
+			}
+			return parse_or(t);
+		case 4:
+			if (!strcmp(argv[0], "!"))
+				break;
+			if (!strcmp(argv[0], "(") && !strcmp(argv[3], ")")) {
+				t->pos++;
+				if ((e = parse_count(t, 2)) == NULL)
+					return NULL;
+				if (t->pos != t->end - 1) {
+					warnx("%s: unexpected argument", t->argv[t->pos]);
+					return NULL;
+				}
+				t->pos++;
+				return e;
+			}
+			return parse_or(t);
 		default:
-			errx(EXIT_FAILURE, "unknown test '%s'", op);
+			return parse_or(t);
 	}
 
-	return rc;
+	/* a leading ! negates whatever the remaining arguments decide */
+	t->pos++;
+	e = new_expr(t, E_NOT);
+	if ((e->lhs = parse_count(t, n - 1)) == NULL)
+		return NULL;
+	return e;
 }
 
-int main(int argc, char *argv[])
+/* returns the exit status rather than exiting, see builtin.h */
+int test_main(int argc, char *argv[])
 {
-	int rc = -1;
+	test_t t;
+	expr_t *root;
+	int rc;
+
+	test_error = 0;
 
 	if (!strcmp(argv[0], "[")) {
 		if(!strcmp(argv[argc-1], "]")) {
 			argc--;
 		} else {
-			errx(EXIT_FAILURE, "']' required as last argument");
+			warnx("']' required as last argument");
+			return EXIT_FAILURE;
 		}
 	}
 
-	switch (argc) {
-		/* test */
-		case 1:
-			rc = 1;
-			break;
-		
-		/* test arg */
-		case 2:
-			rc = strlen(argv[1]) ? 1 : 0;
-			break;
-
-		/* test ?? ?? */
-		case 3:			
-			if (!strcmp(argv[1], "!")) {
-				/* ! arg */
-				rc = strlen(argv[1]) ? 0 : 1;
-			} else {
-				/* op arg */
-				rc = unaryop(argv[1], argv[2]);
-			}
-			break;
-
-		/* test ?? op arg */
-		case 4:
-			if (!strcmp(argv[1], "!")) {
-				/* test ! op arg */
-				rc = !unaryop(argv[2], argv[3]);
-			} else {
-				/* test arg op arg */
-				rc = binaryop(argv[2], argv[1], argv[3]);
-			}
-			break;
+	/* test */
+	if (argc == 1)
+		return 1;
 
-		case 5:
-			if (strcmp(argv[1], "!"))
-				break;
-			rc = !binaryop(argv[3], argv[2], argv[4]);
-			break;
+	memset(&t, 0, sizeof(t));
+	t.argv = argv;
+	t.pos = 1;
+	t.end = argc;
 
-		default:
-			break;
+	if ((t.nodes = malloc(sizeof(expr_t) * argc)) == NULL ||
+			(t.files = malloc(sizeof(file_t) * argc)) == NULL) {
+		warn("test");
+		free(t.nodes);
+		return EXIT_FAILURE;
+	}
 
+	if ((root = parse_count(&t, t.end - t.pos)) == NULL) {
+		rc = EXIT_FAILURE;
+	} else if (t.pos < t.end) {
+		warnx("%s: unexpected argument", argv[t.pos]);
+		rc = EXIT_FAILURE;
+	} else {
+		rc = eval(root) ? 0 : 1;
+		if (test_error)
+			rc = EXIT_FAILURE;
 	}
 
+	free(t.nodes);
+	free(t.files);
 
-	if (rc == -1)
-		err(EXIT_FAILURE, "Unsupported test");
+	return rc;
+}
 
-	exit(rc ? 1 : 0);
+#ifndef SH_BUILTIN
+int main(int argc, char *argv[])
+{
+	exit(test_main(argc, argv));
 }
+#endif
@@ -6,6 +6,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 
 static void show_usage(const char *message)
 {
@@ -62,7 +63,7 @@ static int opt_delete = 0;
 static int opt_replace = 0;
 static int string_class[2] = {0,0};
 
-static const char *parse_list(char string[], int strnum)
+static char *parse_list(char string[], int strnum)
 {
 	if (strlen(string) >= BUFSIZ-2)
 		errx(EXIT_FAILURE, "string too long");
@@ -208,162 +209,249 @@ static const char *parse_list(char string[], int strnum)
 	return ret;
 }
 
-inline static int min(const int a, const int b)
+/*
+ * The operands are compiled once into three tables indexed by byte: what
+ * each byte becomes, whether it is deleted, and whether runs of it are
+ * squeezed. Input is then handled a block at a time with no per-line or
+ * per-operand work, so it does not need to be text.
+ */
+static unsigned char tr_xlat[256];
+static unsigned char tr_delete[256];
+static unsigned char tr_squeeze[256];
+
+#define	TR_BLOCK	(128 * 1024)
+
+/* for tr_kind */
+#define	TR_COPY		0
+#define	TR_XLAT		1		/* translate only */
+#define	TR_DELETE	2		/* delete only */
+#define	TR_DELETE1	3		/* delete a single byte */
+#define	TR_SQUEEZE	4		/* squeeze only */
+#define	TR_FULL		5		/* -s with -d or translation */
+
+static int tr_kind = TR_COPY;
+static int tr_delete_byte = 0;
+
+/*
+ * Marks the bytes of a parsed string and of its classes in set, and lists
+ * them in order: the string first, then the classes' bytes in byte order.
+ * Returns how many were listed.
+ */
+static size_t tr_set(const char *string, const int cls, unsigned char set[256], unsigned char list[])
 {
-	return a < b ? a : b;
+	size_t n = 0;
+
+	memset(set, 0, 256);
+
+	for (const unsigned char *s = (const unsigned char *)string; *s; s++) {
+		set[*s] = 1;
+		list[n++] = *s;
+	}
+
+	for (int c = 0; cls && c < 256; c++)
+		for (int j = 0; class_mapping[j].name; j++)
+			if ((cls & class_mapping[j].bit) && class_mapping[j].test(c)) {
+				if (!set[c])
+					list[n++] = c;
+				set[c] = 1;
+				break;
+			}
+
+	return n;
 }
 
-__attribute__((nonnull))
-static void perform_tr(const char *string1, const int str1cls, const char *string2, const int str2cls)
+static void tr_compile(const char *string1, const int str1cls, const char *string2, const int str2cls)
 {
-	//const int str2len = string2 ? strlen(string2)-1 : 0;
-	const int str2len = strlen(string2)-1;
+	static unsigned char list1[BUFSIZ + 256], list2[BUFSIZ + 256];
+	unsigned char set1[256], set2[256];
+	size_t n1, n2 = 0;
+
+	for (int c = 0; c < 256; c++)
+		tr_xlat[c] = c;
 
-	while (1)
+	n1 = tr_set(string1, str1cls, set1, list1);
+
+	/* the complement, in byte order */
+	if (opt_complement_values || opt_complement_chars) {
+		n1 = 0;
+		for (int c = 0; c < 256; c++)
+			if ((set1[c] = !set1[c]))
+				list1[n1++] = c;
+	}
+
+	if (string2)
+		n2 = tr_set(string2, str2cls, set2, list2);
+
+	if (opt_delete)
+		memcpy(tr_delete, set1, 256);
+
+	if (opt_replace)
+		memcpy(tr_squeeze, string2 ? set2 : set1, 256);
+
+	if (!opt_delete && string2)
 	{
-		if (feof(stdin) || feof(stdout))
-			exit(EXIT_SUCCESS);
-		if (ferror(stdin) || ferror(stdout))
-			exit(EXIT_FAILURE);
+		/* [:lower:] [:upper:] and the like convert case, the rest map in order */
+		if (str1cls && str2cls) {
+			const size_t len1 = strlen(string1), len2 = strlen(string2);
+
+			for (int c = 0; c < 256; c++)
+				if (((str2cls & UPPER) && islower(c)) || ((str2cls & LOWER) && isupper(c)))
+					tr_xlat[c] = (str2cls & UPPER) ? toupper(c) : tolower(c);
+
+			for (size_t i = 0; i < len1 && len2; i++)
+				tr_xlat[(unsigned char)string1[i]] = string2[i < len2 ? i : len2 - 1];
+		} else if (n1) {
+			if (n2 == 0)
+				errx(EXIT_FAILURE, "string2 must not be empty");
+
+			/* string2 is padded out with its last byte */
+			for (size_t i = 0; i < n1; i++)
+				tr_xlat[list1[i]] = list2[i < n2 ? i : n2 - 1];
+		}
+	}
 
-		char buf[BUFSIZ];
-		char *line = fgets(buf, BUFSIZ, stdin);
+	int deletes = 0, translates = 0;
 
-		if (!line) 
-			continue;
-		if (strlen(line) == BUFSIZ)
-			errx(EXIT_FAILURE, "buffer overflow");
+	for (int c = 0; c < 256; c++) {
+		if (tr_delete[c]) {
+			tr_delete_byte = c;
+			deletes++;
+		}
+		if (tr_xlat[c] != c)
+			translates++;
+	}
 
-		/* remove \n */
-		line[strlen(line)-1] = '\0';
+	if (opt_replace)
+		tr_kind = deletes || translates ? TR_FULL : TR_SQUEEZE;
+	else if (deletes == 1)
+		tr_kind = TR_DELETE1;
+	else if (deletes)
+		tr_kind = TR_DELETE;
+	else if (translates)
+		tr_kind = TR_XLAT;
+}
 
-		char c;
-		int op = 0;
+static void tr_write(const unsigned char *buf, size_t len)
+{
+	ssize_t wr;
 
-		/* loop over every character in the line */
-		while ((c = *line++) != '\0')
-		{
-			int mod = 0;
+	while (len)
+	{
+		if ((wr = write(STDOUT_FILENO, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "write");
+		}
+		buf += wr;
+		len -= wr;
+	}
+}
 
-			/* first we check for non-character class based actions */
-			for (int i = 0; string1[i]; i++)
+/*
+ * Filters len bytes of in into out, returning how many there are. The
+ * output is kept apart from the input so that no store can alias the
+ * next load.
+ */
+static size_t tr_block(const unsigned char *restrict in, const size_t len,
+		unsigned char *restrict out, int *last)
+{
+	const unsigned char *const end = in + len;
+	size_t j = 0;
+
+	switch (tr_kind)
+	{
+		case TR_XLAT:
+			for (size_t i = 0; i < len; i++)
+				out[i] = tr_xlat[in[i]];
+			return len;
+
+		case TR_DELETE1:
+			/* memchr() finds the few bytes to drop far faster than a byte loop */
+			for (const unsigned char *p = in, *q; p < end; p = q + 1)
 			{
-				/* NOT: a, a-a, [a*n] */
-				if (c != string1[i]) 
-					continue;
+				if ((q = memchr(p, tr_delete_byte, end - p)) == NULL)
+					q = end;
+				memcpy(out + j, p, q - p);
+				j += q - p;
+			}
+			return j;
+
+		case TR_DELETE:
+			/* no branch on the data: store every byte, keep the ones wanted */
+			for (size_t i = 0; i < len; i++) {
+				const unsigned char c = in[i];
+				out[j] = c;
+				j += !tr_delete[c];
+			}
+			return j;
 
-				mod = 1;
-				op++;
+		case TR_SQUEEZE: {
+			int prev = *last;
 
-				/* -d */
-				if (opt_delete && !opt_replace) {
-					continue;
-				} 
-				/* -s */
-				else if (!opt_delete && opt_replace) 
-				{
-					while (*line && *line == c) line++;
-					goto redo;
-				}
-				/* -sd */
-				else if (opt_delete && opt_replace)
-				{
-					// TODO the 'c != string1[i]' only covers the first arg
-					// not the second
-					// should we create a second loop outside of this?
-					errx(EXIT_FAILURE, "-s -d a not supported");
-				}
-				/* */
-				else
-				{
-redo:
-					putchar(string2[min(i, str2len)]);
+			for (size_t i = 0; i < len; )
+			{
+				/* spans of bytes that are never squeezed go across whole */
+				const size_t start = i;
+
+				while (i < len && !tr_squeeze[in[i]])
+					i++;
+				if (i > start) {
+					memcpy(out + j, in + start, i - start);
+					j += i - start;
+					prev = in[i - 1];
 				}
+				if (i == len)
+					break;
+
+				if (in[i] != prev)
+					out[j++] = in[i];
+				prev = in[i++];
 			}
 
-			/* if nothing has happened, we then process character classes */
-			if (!mod) {
-				/* [::] */
-				if (str1cls && !str2cls) 
-				{
-					int skip = 0;
-					for (int j = 0; class_mapping[j].name; j++)
-					{
-						if (!(str1cls & class_mapping[j].bit)) continue;
-						if (!class_mapping[j].test(c)) continue;
-
-						mod = 1;
-						op++;
-
-						/* -d */
-						if (opt_delete) {
-							skip = 1;
-							break;
-						} 
-						/* -s */
-						else if (opt_replace) 
-						{
-							putchar(c);
-							while (*line && *line == c) line++;
-						}
-						/* */
-						else
-						{
-							putchar(string2[min(str2len, 0)]); // FIXME record posistion of [::] in argv instead of 1
-						}
-					}
-					if (skip)
-						continue;
-				} 
-				/* [::] [::] */
-				else if (str1cls && str2cls && (opt_delete + opt_replace == 0)) 
-				{
-					for (int j = 0; class_mapping[j].name; j++)
-					{
-						if (!(str1cls & class_mapping[j].bit)) continue;
-						if (!class_mapping[j].test(c)) continue;
-						/* */
-						mod = 1;
-						op++;
-						putchar(class_mapping[j].conv(c));
-					}
-				}
-				/* -sd [::] [::] */
-				else if (str1cls && str2cls && (opt_delete + opt_replace == 2)) 
-				{
-					int skip = 0;
-					for (int j = 0; class_mapping[j].name; j++)
-					{
-						/* -d */
-						if ((str1cls & class_mapping[j].bit) && class_mapping[j].test(c)) {
-							mod = 1;
-							skip = 1;
-							break;
-						}
-						/* -s */
-						if ((str2cls & class_mapping[j].bit) && class_mapping[j].test(c)) {
-							mod = 1;
-							op++;
-							putchar(c);
-							while (*line && *line++ != c) ;
-						}
-					}
-					if (skip)
-						continue;
-				}
-			} /* if (!mod) */
+			*last = prev;
+			return j;
+		}
+
+		case TR_FULL: {
+			int prev = *last;
 
-			/* finally, if nothing has happened, dump the original character */
-			if (!mod) {
-				putchar(c);
-				op++;
+			for (size_t i = 0; i < len; i++)
+			{
+				unsigned char c = in[i];
+
+				if (tr_delete[c])
+					continue;
+				/* a squeezed byte equals prev, so prev can always move on */
+				c = tr_xlat[c];
+				out[j] = c;
+				j += c != prev || !tr_squeeze[c];
+				prev = c;
 			}
+
+			*last = prev;
+			return j;
 		}
+	}
 
-		/* if we output anything, put a trailing newline */
-		if (op)
-			putchar('\n');
+	memcpy(out, in, len);
+	return len;
+}
+
+static void perform_tr(void)
+{
+	static unsigned char in[TR_BLOCK], out[TR_BLOCK];
+	int last = -1;			/* squeezing carries across blocks */
+	ssize_t rd;
 
+	while ((rd = read(STDIN_FILENO, in, sizeof(in))) != 0)
+	{
+		if (rd == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "read");
+		}
+
+		tr_write(out, tr_block(in, rd, out, &last));
 	}
 }
 
@@ -403,8 +491,8 @@ int main(int argc, char *argv[])
 	}
 
 
-	const char *string1 = parse_list(argv[optind++], 0);
-	const char *string2;
+	char *string1 = parse_list(argv[optind++], 0);
+	char *string2;
 
 	if (optind < argc) {
 		string2 = parse_list(argv[optind], 1);
@@ -421,5 +509,11 @@ int main(int argc, char *argv[])
 		))
 		show_usage("character class in string2 missing from string 1");
 
-	perform_tr(string1, string_class[0], string2, string_class[1]);
+	tr_compile(string1, string_class[0], string2, string_class[1]);
+	free(string1);
+	free(string2);
+
+	perform_tr();
+
+	exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,521 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "walk.h"
+
+/*
+ * Directories are opened with openat() from their parent and their
+ * entries stat'ed with fstatat(), so nothing is resolved from the top
+ * and paths can be any length; the path is kept only for messages and
+ * for visit().
+ */
+/* append /name, returning the length to go back to */
+size_t path_push(path_t *p, const char *name)
+{
+	const size_t mark = p->len, len = strlen(name);
+
+	if (p->len + len + 2 > p->size) {
+		size_t size = p->size ? p->size : 256;
+		while (size < p->len + len + 2)
+			size *= 2;
+		char *tmp = realloc(p->buf, size);
+		if (tmp == NULL)
+			err(EXIT_FAILURE, "realloc");
+		p->buf = tmp;
+		p->size = size;
+	}
+
+	if (p->len && p->buf[p->len - 1] != '/')
+		p->buf[p->len++] = '/';
+	memcpy(p->buf + p->len, name, len + 1);
+	p->len += len;
+
+	return mark;
+}
+
+void path_pop(path_t *p, const size_t mark)
+{
+	p->len = mark;
+	p->buf[mark] = '\0';
+}
+
+/*
+ * The budget is a quarter of the fds; the task queues of the parallel
+ * walks keep up to half.
+ */
+static atomic_int wdir_held;
+static int wdir_budget = 256;
+static pthread_once_t wdir_once = PTHREAD_ONCE_INIT;
+
+static void wdir_init(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+		wdir_budget = rl.rlim_cur < INT_MAX ? rl.rlim_cur / 4 : INT_MAX / 4;
+}
+
+bool wdir_fdopen(wdir_t *d, const int fd)
+{
+	struct stat sb;
+
+	pthread_once(&wdir_once, wdir_init);
+	memset(d, 0, sizeof(wdir_t));
+	d->fd = -1;
+
+	if (fstat(fd, &sb) == -1) {
+		const int saved = errno;
+		close(fd);
+		errno = saved;
+		return false;
+	}
+
+	d->fd = fd;
+	d->dev = sb.st_dev;
+	d->ino = sb.st_ino;
+	wdir_held++;
+
+	return true;
+}
+
+bool wdir_open(wdir_t *d, const int dfd, const char *name, const bool follow)
+{
+	int fd;
+
+	if ((fd = openat(dfd, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC|(follow ? 0 : O_NOFOLLOW))) == -1) {
+		memset(d, 0, sizeof(wdir_t));
+		d->fd = -1;
+		return false;
+	}
+
+	return wdir_fdopen(d, fd);
+}
+
+const char *wdir_read(wdir_t *d, unsigned char *type)
+{
+	struct dirent *ent;
+
+	if (d->listed) {
+		if (d->off == d->len) {
+			errno = d->error;
+			return NULL;
+		}
+
+		const char *name = d->ents + d->off + 1;
+
+		*type = d->ents[d->off];
+		d->off += strlen(name) + 2;
+		return name;
+	}
+
+	if (d->dir == NULL && (d->dir = fdopendir(d->fd)) == NULL)
+		return NULL;
+
+	while ((errno = 0, ent = readdir(d->dir)) != NULL)
+	{
+		if (!strcmp(".", ent->d_name) || !strcmp("..", ent->d_name))
+			continue;
+
+		const size_t len = strlen(ent->d_name);
+
+		if (len + 1 > d->name_size) {
+			size_t size = d->name_size ? d->name_size : 256;
+			while (size < len + 1)
+				size *= 2;
+			char *tmp = realloc(d->name, size);
+			if (tmp == NULL)
+				err(EXIT_FAILURE, "realloc");
+			d->name = tmp;
+			d->name_size = size;
+		}
+
+		memcpy(d->name, ent->d_name, len + 1);
+		*type = ent->d_type;
+		return d->name;
+	}
+
+	return NULL;
+}
+
+void wdir_leave(wdir_t *d, const int fd)
+{
+	struct stat sb;
+
+	if (d->keep || d->fd == -1 || wdir_held <= wdir_budget)
+		return;
+
+	/* only if the way back up leads here, which a followed link may not */
+	if (fstatat(fd, "..", &sb, 0) == -1 || sb.st_dev != d->dev || sb.st_ino != d->ino)
+		return;
+
+	/* one never read is just closed: its caller has its entries elsewhere */
+	if (d->dir && !d->listed) {
+		struct dirent *ent;
+
+		while ((errno = 0, ent = readdir(d->dir)) != NULL)
+		{
+			if (!strcmp(".", ent->d_name) || !strcmp("..", ent->d_name))
+				continue;
+
+			const size_t len = strlen(ent->d_name);
+
+			if (d->len + len + 2 > d->size) {
+				size_t size = d->size ? d->size : 256;
+				while (size < d->len + len + 2)
+					size *= 2;
+				char *tmp = realloc(d->ents, size);
+				if (tmp == NULL)
+					err(EXIT_FAILURE, "realloc");
+				d->ents = tmp;
+				d->size = size;
+			}
+
+			d->ents[d->len] = ent->d_type;
+			memcpy(d->ents + d->len + 1, ent->d_name, len + 1);
+			d->len += len + 2;
+		}
+
+		d->error = errno;
+		d->listed = true;
+	}
+
+	if (d->dir)
+		closedir(d->dir);
+	else
+		close(d->fd);
+	d->dir = NULL;
+	d->fd = -1;
+	wdir_held--;
+}
+
+bool wdir_back(wdir_t *d, const int fd)
+{
+	struct stat sb;
+	int pfd;
+
+	if (d->fd != -1)
+		return true;
+
+	if ((pfd = openat(fd, "..", O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1)
+		return false;
+
+	/* moved away while the walk was below it */
+	if (fstat(pfd, &sb) == -1 || sb.st_dev != d->dev || sb.st_ino != d->ino) {
+		close(pfd);
+		errno = ENOENT;
+		return false;
+	}
+
+	d->fd = pfd;
+	wdir_held++;
+
+	return true;
+}
+
+void wdir_close(wdir_t *d)
+{
+	if (d->dir)
+		closedir(d->dir);
+	else if (d->fd != -1)
+		close(d->fd);
+	if (d->dir || d->fd != -1)
+		wdir_held--;
+
+	free(d->ents);
+	free(d->name);
+	d->dir = NULL;
+	d->fd = -1;
+	d->ents = NULL;
+	d->name = NULL;
+}
+
+/*
+ * Under -L a directory can be reached more than once, or from inside
+ * itself; each is only entered the first time.
+ */
+typedef struct {
+	dev_t	dev;
+	ino_t	ino;
+} seen_t;
+
+static pthread_mutex_t seen_lock = PTHREAD_MUTEX_INITIALIZER;
+static seen_t *seen = NULL;
+static size_t seen_cnt = 0;
+static size_t seen_size = 0;
+
+static size_t seen_hash(const dev_t dev, const ino_t ino, const size_t size)
+{
+	return ((uint64_t)ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t)dev) & (size - 1);
+}
+
+/* true the first time dev/ino is seen */
+static bool seen_first(const struct stat *sb)
+{
+	size_t i;
+
+	pthread_mutex_lock(&seen_lock);
+
+	if ((seen_cnt + 1) * 2 > seen_size) {
+		const size_t size = seen_size ? seen_size * 2 : 1024;
+		seen_t *tmp = calloc(size, sizeof(seen_t));
+
+		if (tmp == NULL)
+			err(EXIT_FAILURE, "calloc");
+		for (size_t j = 0; j < seen_size; j++)
+			if (seen[j].ino) {
+				for (i = seen_hash(seen[j].dev, seen[j].ino, size); tmp[i].ino; i = (i + 1) & (size - 1))
+					;
+				tmp[i] = seen[j];
+			}
+		free(seen);
+		seen = tmp;
+		seen_size = size;
+	}
+
+	for (i = seen_hash(sb->st_dev, sb->st_ino, seen_size); seen[i].ino; i = (i + 1) & (seen_size - 1))
+		if (seen[i].ino == sb->st_ino && seen[i].dev == sb->st_dev) {
+			pthread_mutex_unlock(&seen_lock);
+			return false;
+		}
+
+	seen[i].dev = sb->st_dev;
+	seen[i].ino = sb->st_ino;
+	seen_cnt++;
+
+	pthread_mutex_unlock(&seen_lock);
+	return true;
+}
+
+/*
+ * With jobs > 1, each directory that is opened becomes a task on a
+ * stack shared by the threads, carrying its own fd so it needs nothing
+ * from its parent. Once too many fds are queued, directories are walked
+ * in place instead.
+ */
+typedef struct {
+	int		 fd;
+	char	*path;
+} task_t;
+
+static pthread_mutex_t task_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t task_cond = PTHREAD_COND_INITIALIZER;
+static task_t *tasks = NULL;
+static size_t task_cnt = 0;
+static size_t task_size = 0;
+static size_t task_pending = 0;		/* queued or running */
+static atomic_int task_failures;
+static atomic_int fds_held;
+static int fds_budget = 512;
+
+static bool task_push(const int fd, const char *path)
+{
+	char *copy;
+
+	if (fds_held >= fds_budget || (copy = strdup(path)) == NULL)
+		return false;
+
+	pthread_mutex_lock(&task_lock);
+	if (task_cnt == task_size) {
+		const size_t size = task_size ? task_size * 2 : 64;
+		task_t *tmp = realloc(tasks, sizeof(task_t) * size);
+		if (tmp == NULL) {
+			pthread_mutex_unlock(&task_lock);
+			free(copy);
+			return false;
+		}
+		tasks = tmp;
+		task_size = size;
+	}
+
+	tasks[task_cnt].fd = fd;
+	tasks[task_cnt].path = copy;
+	task_cnt++;
+	task_pending++;
+	fds_held++;
+	pthread_cond_signal(&task_cond);
+	pthread_mutex_unlock(&task_lock);
+
+	return true;
+}
+
+static int walk_dir(const walk_t *, wdir_t *, path_t *, const bool);
+
+static int walk_entry(const walk_t *w, wdir_t *up, const char *name, path_t *path,
+		const bool cmdline, const bool pool)
+{
+	const bool follow = w->follow == WALK_LOGICAL || (cmdline && w->follow == WALK_CMDLINE);
+	struct stat sb;
+	wdir_t d;
+	int failures, fd;
+
+	if (fstatat(up->fd, name, &sb, follow ? 0 : AT_SYMLINK_NOFOLLOW) == -1 &&
+			/* a dangling link is still a link */
+			(!follow || errno != ENOENT || fstatat(up->fd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1)) {
+		warn("%s", path->buf);
+		return 1;
+	}
+
+	failures = w->visit(up->fd, name, path->buf, &sb);
+
+	if (!w->recurse || !S_ISDIR(sb.st_mode))
+		return failures;
+	if (w->follow == WALK_LOGICAL && !seen_first(&sb))
+		return failures;
+
+	if ((fd = openat(up->fd, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC|(follow ? 0 : O_NOFOLLOW))) == -1) {
+		warn("%s", path->buf);
+		return failures + 1;
+	}
+
+	if (pool && task_push(fd, path->buf))
+		return failures;
+
+	if (!wdir_fdopen(&d, fd)) {
+		warn("%s", path->buf);
+		return failures + 1;
+	}
+
+	wdir_leave(up, d.fd);
+	failures += walk_dir(w, &d, path, pool);
+	if (!wdir_back(up, d.fd)) {
+		warn("%s/..", path->buf);
+		failures++;
+	}
+	wdir_close(&d);
+
+	return failures;
+}
+
+/* walks the directory in d, which stays open */
+static int walk_dir(const walk_t *w, wdir_t *d, path_t *path, const bool pool)
+{
+	unsigned char type;
+	const char *name;
+	int failures = 0;
+
+	while ((name = wdir_read(d, &type)) != NULL)
+	{
+		const size_t mark = path_push(path, name);
+		failures += walk_entry(w, d, name, path, false, pool);
+		path_pop(path, mark);
+
+		/* lost on the way back up */
+		if (d->fd == -1)
+			return failures;
+	}
+
+	if (errno) {
+		warn("%s", path->buf);
+		failures++;
+	}
+
+	return failures;
+}
+
+static void *walk_worker(void *arg)
+{
+	const walk_t *w = arg;
+	path_t path;
+	wdir_t d;
+	task_t t;
+
+	memset(&path, 0, sizeof(path));
+
+	pthread_mutex_lock(&task_lock);
+	while (1)
+	{
+		while (task_cnt == 0 && task_pending)
+			pthread_cond_wait(&task_cond, &task_lock);
+		if (task_cnt == 0)
+			break;
+
+		t = tasks[--task_cnt];
+		pthread_mutex_unlock(&task_lock);
+
+		path.len = 0;
+		path_push(&path, t.path);
+		free(t.path);
+		if (wdir_fdopen(&d, t.fd)) {
+			task_failures += walk_dir(w, &d, &path, true);
+			wdir_close(&d);
+		} else {
+			warn("%s", path.buf);
+			task_failures++;
+		}
+		fds_held--;
+
+		pthread_mutex_lock(&task_lock);
+		if (--task_pending == 0)
+			pthread_cond_broadcast(&task_cond);
+	}
+	pthread_mutex_unlock(&task_lock);
+
+	free(path.buf);
+	return NULL;
+}
+
+int walk(const walk_t *w, const char *operand)
+{
+	const bool pool = w->recurse && w->jobs > 1;
+	wdir_t top = { .fd = AT_FDCWD, .keep = true };
+	path_t path;
+	int failures;
+
+	memset(&path, 0, sizeof(path));
+	path_push(&path, operand);
+
+	if (pool) {
+		struct rlimit rl;
+
+		/* keep half the fds free for the walk in place */
+		if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+			fds_budget = rl.rlim_cur < INT_MAX ? rl.rlim_cur / 2 : INT_MAX / 2;
+		task_failures = 0;
+	}
+
+	failures = walk_entry(w, &top, operand, &path, true, pool);
+	free(path.buf);
+
+	if (!pool || task_pending == 0)
+		return failures;
+
+	pthread_t *threads;
+	int nthreads = 0;
+
+	if ((threads = calloc(w->jobs, sizeof(pthread_t))) == NULL)
+		err(EXIT_FAILURE, "calloc");
+
+	for (int i = 0; i < w->jobs; i++)
+	{
+		if ((errno = pthread_create(&threads[i], NULL, walk_worker, (void *)w))) {
+			warn("pthread_create");
+			break;
+		}
+		nthreads++;
+	}
+
+	/* without threads the tasks still need doing */
+	if (nthreads == 0)
+		walk_worker((void *)w);
+
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	return failures + task_failures;
+}
@@ -0,0 +1,86 @@
+#ifndef _WALK_H
+#define _WALK_H 1
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * The tree walk shared by chmod, chgrp and chown -R. Every file is
+ * stat'ed once, relative to its directory's fd, and handed to visit()
+ * before any of its children; visit() acts on it with the *at() calls.
+ * sb describes the link itself when a symbolic link is not followed.
+ */
+
+/* which symbolic links are followed: -P, -H and -L */
+#define	WALK_PHYSICAL	0
+#define	WALK_CMDLINE	1
+#define	WALK_LOGICAL	2
+
+typedef int (*walk_fn)(const int dfd, const char *name, const char *path, const struct stat *sb);
+
+typedef struct {
+	walk_fn	 visit;
+	int		 follow;
+	bool	 recurse;
+	int		 jobs;				/* > 1 walks subtrees on that many threads */
+} walk_t;
+
+/*
+ * A path built up one name at a time as a walk goes down, for messages
+ * only; the walks themselves go by directory fd.
+ */
+typedef struct {
+	char	*buf;
+	size_t	 len;
+	size_t	 size;
+} path_t;
+
+/* append /name, returning the length to go back to */
+extern size_t path_push(path_t *, const char *);
+extern void path_pop(path_t *, const size_t);
+
+/*
+ * A directory being read in a walk. Each one open holds an fd, so past a
+ * budget of them wdir_leave() lets a directory go while the walk is in
+ * one of its subdirectories, keeping the entries it has left to read, and
+ * wdir_back() opens it again through "..", checked by dev and inode. A
+ * walk of any depth so holds a bounded number of fds. A directory fd the
+ * caller shares, or AT_FDCWD, goes in as { .fd = fd, .keep = true }.
+ */
+typedef struct {
+	DIR		*dir;
+	int		 fd;			/* -1 while let go */
+	bool	 keep;			/* never let go */
+	dev_t	 dev;
+	ino_t	 ino;
+	bool	 listed;		/* what is left to read is in ents */
+	char	*ents;			/* a d_type byte and a name for each */
+	size_t	 len;
+	size_t	 off;
+	size_t	 size;
+	int		 error;			/* from reading the directory into ents */
+	char	*name;			/* the last entry read, which outlives the DIR */
+	size_t	 name_size;
+} wdir_t;
+
+/* false with errno set; d needs no wdir_close() then */
+extern bool wdir_open(wdir_t *, const int, const char *, const bool);
+/* takes over fd */
+extern bool wdir_fdopen(wdir_t *, const int);
+/*
+ * the next entry but . and .., or NULL at the end or, with errno set, on
+ * an error; the name stays good until the next call, wdir_leave() or not
+ */
+extern const char *wdir_read(wdir_t *, unsigned char *);
+/* before and after walking the subdirectory open on the fd */
+extern void wdir_leave(wdir_t *, const int);
+extern bool wdir_back(wdir_t *, const int);
+extern void wdir_close(wdir_t *);
+
+/* returns the number of failures */
+extern int walk(const walk_t *, const char *);
+
+#endif /* _WALK_H */